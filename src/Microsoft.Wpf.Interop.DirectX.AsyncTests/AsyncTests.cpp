@@ -0,0 +1,271 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+//
+// Coroutine tests of the async wrappers.
+//
+// The awaitables of SurfaceQueueAsync.h need C++20, which the main test
+// project isn't built with, so they get an executable of their own built with
+// the latest language standard.  The queues run on software devices.
+//
+
+#include "Tests.h"
+
+#include <stdlib.h>
+#include <new>
+#include "SurfaceQueueAsync.h"
+#include "SurfaceQueueSoftware.h"
+
+#ifndef SURFACE_QUEUE_COROUTINES
+#error This project must be compiled with coroutine support
+#endif
+
+UINT g_nFailures = 0;
+
+static const UINT   ASYNC_SURFACES      = 3;
+static const UINT   ASYNC_FRAMES        = 20;
+static const DWORD  ASYNC_TIMEOUT       = 5000;
+
+// How long a suspended coroutine is given to resume when it shouldn't
+static const DWORD  ASYNC_SETTLE_TIME   = 50;
+
+//
+// A coroutine that starts right away and frees itself when it returns.  The
+// tests wait for the event the coroutine sets before returning.
+//
+class CAsyncTestTask
+{
+    public:
+        struct promise_type
+        {
+            CAsyncTestTask          get_return_object()         { return CAsyncTestTask(); }
+            std::suspend_never      initial_suspend()           { return {}; }
+            std::suspend_never      final_suspend() noexcept    { return {}; }
+            void                    return_void()               {}
+            void                    unhandled_exception()       { abort(); }
+        };
+};
+
+struct ASYNC_TEST_QUEUE
+{
+    ISoftwareSurfaceDevice*     pDevice;
+    ISurfaceQueue*              pQueue;
+    ISurfaceProducer*           pProducer;
+    ISurfaceConsumer*           pConsumer;
+    CSurfaceProducerAsync*      pProducerAsync;
+    CSurfaceConsumerAsync*      pConsumerAsync;
+};
+
+//-----------------------------------------------------------------------------
+static void ReleaseTestQueue(ASYNC_TEST_QUEUE* pQueue)
+{
+    // Completes the coroutines still waiting on them with E_ABORT
+    delete pQueue->pConsumerAsync;
+    delete pQueue->pProducerAsync;
+    pQueue->pConsumerAsync = NULL;
+    pQueue->pProducerAsync = NULL;
+    ReleaseInterface(pQueue->pConsumer);
+    ReleaseInterface(pQueue->pProducer);
+    ReleaseInterface(pQueue->pQueue);
+    ReleaseInterface(pQueue->pDevice);
+}
+
+//-----------------------------------------------------------------------------
+// A multithreaded queue with both ends on one software device, wrapped.
+//-----------------------------------------------------------------------------
+static HRESULT CreateTestQueue(ASYNC_TEST_QUEUE* pQueue)
+{
+    HRESULT             hr;
+    SURFACE_QUEUE_DESC  desc;
+
+    ZeroMemory(pQueue, sizeof(*pQueue));
+
+    ZeroMemory(&desc, sizeof(desc));
+    desc.Width          = 64;
+    desc.Height         = 64;
+    desc.Format         = DXGI_FORMAT_B8G8R8A8_UNORM;
+    desc.NumSurfaces    = ASYNC_SURFACES;
+    desc.MetaDataSize   = sizeof(UINT);
+    desc.Flags          = 0;
+
+    pQueue->pProducerAsync = new QUEUE_NOTHROW_SPECIFIER CSurfaceProducerAsync();
+    pQueue->pConsumerAsync = new QUEUE_NOTHROW_SPECIFIER CSurfaceConsumerAsync();
+    if (!pQueue->pProducerAsync || !pQueue->pConsumerAsync)
+    {
+        hr = E_OUTOFMEMORY;
+        goto end;
+    }
+
+    if (FAILED(hr = CreateSoftwareSurfaceDevice(&pQueue->pDevice)) ||
+        FAILED(hr = CreateSurfaceQueue(&desc, pQueue->pDevice, &pQueue->pQueue)) ||
+        FAILED(hr = pQueue->pQueue->OpenProducer(pQueue->pDevice, &pQueue->pProducer)) ||
+        FAILED(hr = pQueue->pQueue->OpenConsumer(pQueue->pDevice, &pQueue->pConsumer)) ||
+        FAILED(hr = pQueue->pProducerAsync->Initialize(pQueue->pProducer)) ||
+        FAILED(hr = pQueue->pConsumerAsync->Initialize(pQueue->pConsumer)))
+    {
+        goto end;
+    }
+
+end:
+    if (FAILED(hr))
+    {
+        ReleaseTestQueue(pQueue);
+    }
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+// Sends the surfaces round the queue ASYNC_FRAMES times, numbering each frame
+// in its meta data.
+//-----------------------------------------------------------------------------
+static CAsyncTestTask RunFrames(ASYNC_TEST_QUEUE* pQueue, HRESULT* pResult, HANDLE hDone)
+{
+    HRESULT     hr          = S_OK;
+    IUnknown*   pSurface    = NULL;
+    UINT        MetaData;
+    UINT        Size;
+
+    for (UINT i = 0; i < ASYNC_FRAMES && SUCCEEDED(hr); i++)
+    {
+        Size = sizeof(MetaData);
+        hr = co_await pQueue->pConsumerAsync->DequeueAsync(__uuidof(ISoftwareSurface), &pSurface, &MetaData, &Size);
+        if (FAILED(hr))
+        {
+            break;
+        }
+
+        // The first round dequeues the surfaces the queue starts out with
+        if (i >= ASYNC_SURFACES && (Size != sizeof(MetaData) || MetaData != i - ASYNC_SURFACES))
+        {
+            hr = E_FAIL;
+        }
+        if (SUCCEEDED(hr))
+        {
+            hr = co_await pQueue->pProducerAsync->EnqueueAsync(pSurface, &i, sizeof(i));
+        }
+        ReleaseInterface(pSurface);
+    }
+
+    *pResult = hr;
+    SetEvent(hDone);
+}
+
+//-----------------------------------------------------------------------------
+static CAsyncTestTask DequeueOne(ASYNC_TEST_QUEUE* pQueue, IUnknown** ppSurface, HRESULT* pResult, HANDLE hDone)
+{
+    *pResult = co_await pQueue->pConsumerAsync->DequeueAsync(__uuidof(ISoftwareSurface), ppSurface);
+    SetEvent(hDone);
+}
+
+//-----------------------------------------------------------------------------
+static CAsyncTestTask EnqueueOne(ASYNC_TEST_QUEUE* pQueue, IUnknown* pSurface, HRESULT* pResult, HANDLE hDone)
+{
+    *pResult = co_await pQueue->pProducerAsync->EnqueueAsync(pSurface);
+    SetEvent(hDone);
+}
+
+//-----------------------------------------------------------------------------
+// Frames go round a queue through co_await alone.
+//-----------------------------------------------------------------------------
+static void TestAwaitRoundTrip()
+{
+    ASYNC_TEST_QUEUE    queue       = {};
+    HANDLE              hDone       = NULL;
+    HRESULT             hrFrames    = E_PENDING;
+
+    printf("TestAwaitRoundTrip\n");
+
+    hDone = CreateEventW(NULL, TRUE, FALSE, NULL);
+    CHECK(hDone);
+    CHECK_HR(CreateTestQueue(&queue));
+
+    RunFrames(&queue, &hrFrames, hDone);
+
+    CHECK(WAIT_OBJECT_0 == WaitForSingleObject(hDone, ASYNC_TIMEOUT));
+    CHECK_HR(hrFrames);
+
+Cleanup:
+    ReleaseTestQueue(&queue);
+    if (hDone)
+    {
+        WaitForSingleObject(hDone, ASYNC_TIMEOUT);
+        CloseHandle(hDone);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// A dequeue from an empty queue suspends the coroutine until a surface is
+// enqueued, and resumes it with that surface.
+//-----------------------------------------------------------------------------
+static void TestAwaitSuspendsUntilEnqueue()
+{
+    ASYNC_TEST_QUEUE    queue                       = {};
+    IUnknown*           ppSurfaces[ASYNC_SURFACES]  = {};
+    IUnknown*           pDequeued                   = NULL;
+    HANDLE              hDequeued                   = NULL;
+    HANDLE              hEnqueued                   = NULL;
+    HRESULT             hrDequeue                   = E_PENDING;
+    HRESULT             hrEnqueue                   = E_PENDING;
+    UINT                i;
+
+    printf("TestAwaitSuspendsUntilEnqueue\n");
+
+    hDequeued = CreateEventW(NULL, TRUE, FALSE, NULL);
+    hEnqueued = CreateEventW(NULL, TRUE, FALSE, NULL);
+    CHECK(hDequeued && hEnqueued);
+    CHECK_HR(CreateTestQueue(&queue));
+
+    // Empty the queue
+    for (i = 0; i < ASYNC_SURFACES; i++)
+    {
+        CHECK_HR(queue.pConsumerAsync->TryDequeue(__uuidof(ISoftwareSurface), &ppSurfaces[i], NULL, NULL));
+    }
+
+    DequeueOne(&queue, &pDequeued, &hrDequeue, hDequeued);
+    CHECK(WAIT_TIMEOUT == WaitForSingleObject(hDequeued, ASYNC_SETTLE_TIME));
+
+    EnqueueOne(&queue, ppSurfaces[1], &hrEnqueue, hEnqueued);
+    CHECK(WAIT_OBJECT_0 == WaitForSingleObject(hEnqueued, ASYNC_TIMEOUT));
+    CHECK_HR(hrEnqueue);
+
+    CHECK(WAIT_OBJECT_0 == WaitForSingleObject(hDequeued, ASYNC_TIMEOUT));
+    CHECK_HR(hrDequeue);
+    CHECK(pDequeued == ppSurfaces[1]);
+
+Cleanup:
+    ReleaseInterface(pDequeued);
+    for (i = 0; i < ASYNC_SURFACES; i++)
+    {
+        ReleaseInterface(ppSurfaces[i]);
+    }
+    ReleaseTestQueue(&queue);
+    if (hEnqueued)
+    {
+        WaitForSingleObject(hEnqueued, ASYNC_TIMEOUT);
+        CloseHandle(hEnqueued);
+    }
+    if (hDequeued)
+    {
+        WaitForSingleObject(hDequeued, ASYNC_TIMEOUT);
+        CloseHandle(hDequeued);
+    }
+}
+
+//-----------------------------------------------------------------------------
+int main()
+{
+    TestAwaitRoundTrip();
+    TestAwaitSuspendsUntilEnqueue();
+
+    if (g_nFailures)
+    {
+        printf("%u failed\n", g_nFailures);
+        return 1;
+    }
+    printf("passed\n");
+    return 0;
+}
@@ -0,0 +1,110 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+//
+// Replays surface queue traces, see SurfaceQueueTrace.h.
+//
+//      Microsoft.Wpf.Interop.DirectX.Replay [-realtime] trace [trace ...]
+//
+// For each trace, prints how often each call was made and its average time
+// when traced and when replayed.  With -realtime the calls are issued with
+// the gaps they had when they were traced.  The exit code is 1 if a trace
+// could not be replayed or a call mismatched, so the tool can gate a build
+// that changes the queue.
+//
+
+#include <windows.h>
+#include <stdio.h>
+#include <wchar.h>
+
+#include "SurfaceQueueTrace.h"
+
+static const char* g_CallNames[SURFACE_QUEUE_TRACE_NUM_CALLS] =
+{
+    "Create",
+    "Clone",
+    "OpenProducer",
+    "OpenConsumer",
+    "Enqueue",
+    "Dequeue",
+    "Flush",
+    "Destroy",
+};
+
+//-----------------------------------------------------------------------------
+static double TicksToMicroseconds(LONGLONG Ticks, UINT Count, LONGLONG Frequency)
+{
+    if (Count == 0 || Frequency == 0)
+    {
+        return 0.0;
+    }
+    return (double)Ticks * 1e6 / (double)Frequency / Count;
+}
+
+//-----------------------------------------------------------------------------
+static void PrintStats(const SURFACE_QUEUE_REPLAY_STATS* pStats)
+{
+    printf("  %-14s %10s %14s %14s\n", "call", "count", "traced (us)", "replayed (us)");
+    for (UINT i = 0; i < SURFACE_QUEUE_TRACE_NUM_CALLS; i++)
+    {
+        if (pStats->CallCount[i] == 0)
+        {
+            continue;
+        }
+        printf("  %-14s %10u %14.2f %14.2f\n",
+               g_CallNames[i],
+               pStats->CallCount[i],
+               TicksToMicroseconds(pStats->TracedTicks[i], pStats->CallCount[i], pStats->TimestampFrequency),
+               TicksToMicroseconds(pStats->ReplayedTicks[i], pStats->CallCount[i], pStats->TimestampFrequency));
+    }
+    printf("  %u calls, %u mismatched, %u skipped\n", pStats->NumCalls, pStats->NumMismatches, pStats->NumSkipped);
+}
+
+//-----------------------------------------------------------------------------
+int wmain(int argc, wchar_t** argv)
+{
+    DWORD   Flags       = 0;
+    UINT    nTraces     = 0;
+    UINT    nFailures   = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (0 == wcscmp(argv[i], L"-realtime"))
+        {
+            Flags |= SURFACE_QUEUE_REPLAY_FLAG_REALTIME;
+            continue;
+        }
+
+        SURFACE_QUEUE_REPLAY_STATS  Stats;
+        HRESULT                     hr;
+
+        ZeroMemory(&Stats, sizeof(Stats));
+        nTraces++;
+
+        printf("%ls\n", argv[i]);
+        if (FAILED(hr = ReplaySurfaceQueueTrace(argv[i], Flags, &Stats)))
+        {
+            printf("  replay failed with 0x%08X\n", hr);
+            nFailures++;
+            continue;
+        }
+
+        PrintStats(&Stats);
+        if (Stats.NumMismatches)
+        {
+            nFailures++;
+        }
+    }
+
+    if (nTraces == 0)
+    {
+        printf("usage: Microsoft.Wpf.Interop.DirectX.Replay [-realtime] trace [trace ...]\n");
+        return 2;
+    }
+
+    return nFailures ? 1 : 0;
+}
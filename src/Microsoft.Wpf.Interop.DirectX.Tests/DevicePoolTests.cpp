@@ -0,0 +1,583 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+//
+// Device pool tests.
+//
+// The pool is driven through SetSurfaceDevicePoolFactory with fake devices.
+// With the factory and both loss checks replaced, the pool only counts
+// references on the devices and compares them, so an object implementing
+// IUnknown stands in for each of them.
+//
+// The render lock test runs two images on one set the way the interop helper
+// does, one rendered on the test thread and one on a render thread.  Their
+// pipelines run on software devices.
+//
+
+#include "Tests.h"
+
+#include "SurfaceQueueDevicePool.h"
+#include "SurfaceQueueSoftware.h"
+#include "SurfaceQueueInteropPipeline.h"
+
+//
+// A device that only counts its references.  The loss checks of the fake
+// factory read Lost.
+//
+class CFakeDevice : public IUnknown
+{
+public:
+    CFakeDevice() : m_RefCount(1), Lost(FALSE)
+    {
+        InterlockedIncrement(&s_nLive);
+    }
+
+    STDMETHOD(QueryInterface)(REFIID iid, void** ppv)
+    {
+        if (!ppv)
+        {
+            return E_INVALIDARG;
+        }
+        *ppv = NULL;
+        if (iid != __uuidof(IUnknown))
+        {
+            return E_NOINTERFACE;
+        }
+        AddRef();
+        *ppv = this;
+        return S_OK;
+    }
+
+    STDMETHOD_(ULONG, AddRef)()
+    {
+        return InterlockedIncrement(&m_RefCount);
+    }
+
+    STDMETHOD_(ULONG, Release)()
+    {
+        ULONG ulRef = InterlockedDecrement(&m_RefCount);
+        if (0 == ulRef)
+        {
+            InterlockedDecrement(&s_nLive);
+            delete this;
+        }
+        return ulRef;
+    }
+
+    BOOL                Lost;
+
+    // Fake devices not yet destroyed
+    static LONG         s_nLive;
+
+private:
+    LONG                m_RefCount;
+};
+
+LONG CFakeDevice::s_nLive = 0;
+
+struct FAKE_DEVICE_FACTORY
+{
+    UINT                nSetsCreated;
+    UINT                nRenderDevicesCreated;
+};
+
+//-----------------------------------------------------------------------------
+static CFakeDevice* FakeDevice(IUnknown* pDevice)
+{
+    return static_cast<CFakeDevice*>(pDevice);
+}
+
+//-----------------------------------------------------------------------------
+static HRESULT CALLBACK CreateFakeDeviceSet(UINT Adapter, HWND hwnd, SURFACE_DEVICE_SET* pSet, void* pContext)
+{
+    UNREFERENCED_PARAMETER(Adapter);
+    UNREFERENCED_PARAMETER(hwnd);
+
+    FAKE_DEVICE_FACTORY* pFactory = (FAKE_DEVICE_FACTORY*)pContext;
+
+    // Only the render device is replaced
+    if (!pSet->pD3D9Device)
+    {
+        pSet->pD3D9         = reinterpret_cast<IDirect3D9Ex*>(static_cast<IUnknown*>(new CFakeDevice));
+        pSet->pD3D9Device   = reinterpret_cast<IDirect3DDevice9Ex*>(static_cast<IUnknown*>(new CFakeDevice));
+        pFactory->nSetsCreated++;
+    }
+    pSet->pD3D10Device = reinterpret_cast<ID3D10Device1*>(static_cast<IUnknown*>(new CFakeDevice));
+    pFactory->nRenderDevicesCreated++;
+
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+static BOOL CALLBACK IsFakeDeviceSetLost(const SURFACE_DEVICE_SET* pSet, void* pContext)
+{
+    UNREFERENCED_PARAMETER(pContext);
+
+    return FakeDevice(pSet->pD3D9Device)->Lost;
+}
+
+//-----------------------------------------------------------------------------
+static BOOL CALLBACK IsFakeRenderDeviceLost(const SURFACE_DEVICE_SET* pSet, void* pContext)
+{
+    UNREFERENCED_PARAMETER(pContext);
+
+    return FakeDevice(pSet->pD3D10Device)->Lost;
+}
+
+//-----------------------------------------------------------------------------
+static HRESULT UseFakeDevices(FAKE_DEVICE_FACTORY* pFactory)
+{
+    ZeroMemory(pFactory, sizeof(*pFactory));
+
+    return SetSurfaceDevicePoolFactory(&CreateFakeDeviceSet,
+                                       &IsFakeDeviceSetLost,
+                                       &IsFakeRenderDeviceLost,
+                                       pFactory);
+}
+
+//-----------------------------------------------------------------------------
+// Callers on the same adapter share one set; another adapter gets its own.
+//-----------------------------------------------------------------------------
+static void TestPoolSharesSetPerAdapter()
+{
+    FAKE_DEVICE_FACTORY     factory;
+    SURFACE_DEVICE_SET      setA    = { 0 };
+    SURFACE_DEVICE_SET      setB    = { 0 };
+    SURFACE_DEVICE_SET      setC    = { 0 };
+
+    printf("TestPoolSharesSetPerAdapter\n");
+
+    CHECK_HR(UseFakeDevices(&factory));
+
+    CHECK_HR(AcquireSharedSurfaceDevices(0, NULL, &setA));
+    CHECK_HR(AcquireSharedSurfaceDevices(0, NULL, &setB));
+    CHECK(setA.pD3D9 == setB.pD3D9);
+    CHECK(setA.pD3D9Device == setB.pD3D9Device);
+    CHECK(setA.pD3D10Device == setB.pD3D10Device);
+    CHECK(factory.nSetsCreated == 1);
+    CHECK(GetSurfaceDevicePoolSize() == 1);
+
+    CHECK_HR(AcquireSharedSurfaceDevices(1, NULL, &setC));
+    CHECK(setC.pD3D9Device != setA.pD3D9Device);
+    CHECK(factory.nSetsCreated == 2);
+    CHECK(GetSurfaceDevicePoolSize() == 2);
+
+    // The factory can't change under the sets it made
+    CHECK(SetSurfaceDevicePoolFactory(NULL, NULL, NULL, NULL) == HRESULT_FROM_WIN32(ERROR_BUSY));
+
+    CHECK_HR(ReleaseSharedSurfaceDevices(&setC));
+    CHECK(GetSurfaceDevicePoolSize() == 1);
+
+Cleanup:
+    ReleaseSharedSurfaceDevices(&setC);
+    ReleaseSharedSurfaceDevices(&setB);
+    ReleaseSharedSurfaceDevices(&setA);
+    SetSurfaceDevicePoolFactory(NULL, NULL, NULL, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// The devices stay until the last holder releases the set.
+//-----------------------------------------------------------------------------
+static void TestPoolLastHolderReleasesSet()
+{
+    FAKE_DEVICE_FACTORY     factory;
+    SURFACE_DEVICE_SET      setA    = { 0 };
+    SURFACE_DEVICE_SET      setB    = { 0 };
+    SURFACE_DEVICE_SET      setGone = { 0 };
+    LONG                    nLive   = CFakeDevice::s_nLive;
+
+    printf("TestPoolLastHolderReleasesSet\n");
+
+    CHECK_HR(UseFakeDevices(&factory));
+
+    CHECK_HR(AcquireSharedSurfaceDevices(0, NULL, &setA));
+    CHECK_HR(AcquireSharedSurfaceDevices(0, NULL, &setB));
+    CHECK(CFakeDevice::s_nLive == nLive + 3);
+
+    CHECK_HR(ReleaseSharedSurfaceDevices(&setA));
+    CHECK(setA.pD3D9Device == NULL);
+    CHECK(GetSurfaceDevicePoolSize() == 1);
+    CHECK(CFakeDevice::s_nLive == nLive + 3);
+
+    setGone = setB;
+    CHECK_HR(ReleaseSharedSurfaceDevices(&setB));
+    CHECK(GetSurfaceDevicePoolSize() == 0);
+    CHECK(CFakeDevice::s_nLive == nLive);
+
+    // A set that is gone isn't found; its devices aren't touched
+    CHECK(ReleaseSharedSurfaceDevices(&setGone) == E_INVALIDARG);
+
+    // The next caller gets a new set
+    CHECK_HR(AcquireSharedSurfaceDevices(0, NULL, &setA));
+    CHECK(factory.nSetsCreated == 2);
+
+Cleanup:
+    ReleaseSharedSurfaceDevices(&setB);
+    ReleaseSharedSurfaceDevices(&setA);
+    SetSurfaceDevicePoolFactory(NULL, NULL, NULL, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// A lost D3D9 device takes the set out of the pool.  Its holders keep it until
+// they release it; the next caller gets a new set.
+//-----------------------------------------------------------------------------
+static void TestPoolD3D9DeviceLost()
+{
+    FAKE_DEVICE_FACTORY     factory;
+    SURFACE_DEVICE_SET      setA    = { 0 };
+    SURFACE_DEVICE_SET      setB    = { 0 };
+    SURFACE_DEVICE_SET      setC    = { 0 };
+    LONG                    nLive   = CFakeDevice::s_nLive;
+
+    printf("TestPoolD3D9DeviceLost\n");
+
+    CHECK_HR(UseFakeDevices(&factory));
+
+    CHECK_HR(AcquireSharedSurfaceDevices(0, NULL, &setA));
+    FakeDevice(setA.pD3D9Device)->Lost = TRUE;
+
+    CHECK_HR(AcquireSharedSurfaceDevices(0, NULL, &setB));
+    CHECK(setB.pD3D9Device != setA.pD3D9Device);
+    CHECK(setB.pD3D10Device != setA.pD3D10Device);
+    CHECK(factory.nSetsCreated == 2);
+    CHECK(GetSurfaceDevicePoolSize() == 2);
+
+    // Reported lost by a holder, without the check noticing
+    CHECK_HR(ReportSharedSurfaceDevicesLost(&setB));
+    CHECK_HR(AcquireSharedSurfaceDevices(0, NULL, &setC));
+    CHECK(setC.pD3D9Device != setB.pD3D9Device);
+    CHECK(factory.nSetsCreated == 3);
+
+    CHECK_HR(ReleaseSharedSurfaceDevices(&setA));
+    CHECK_HR(ReleaseSharedSurfaceDevices(&setB));
+    CHECK(GetSurfaceDevicePoolSize() == 1);
+    CHECK(CFakeDevice::s_nLive == nLive + 3);
+
+Cleanup:
+    ReleaseSharedSurfaceDevices(&setC);
+    ReleaseSharedSurfaceDevices(&setB);
+    ReleaseSharedSurfaceDevices(&setA);
+    SetSurfaceDevicePoolFactory(NULL, NULL, NULL, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// A removed render device alone keeps the set.  The next acquire puts a new
+// render device in it, and the holders of the old one move to the same one.
+//-----------------------------------------------------------------------------
+static void TestPoolRenderDeviceLost()
+{
+    FAKE_DEVICE_FACTORY     factory;
+    SURFACE_DEVICE_SET      setA        = { 0 };
+    SURFACE_DEVICE_SET      setB        = { 0 };
+    ID3D10Device1*          pOldDevice  = NULL;
+    LONG                    nLive       = CFakeDevice::s_nLive;
+
+    printf("TestPoolRenderDeviceLost\n");
+
+    CHECK_HR(UseFakeDevices(&factory));
+
+    CHECK_HR(AcquireSharedSurfaceDevices(0, NULL, &setA));
+    pOldDevice = setA.pD3D10Device;
+    FakeDevice(pOldDevice)->Lost = TRUE;
+
+    CHECK_HR(AcquireSharedSurfaceDevices(0, NULL, &setB));
+    CHECK(setB.pD3D9Device == setA.pD3D9Device);
+    CHECK(setB.pD3D10Device != pOldDevice);
+    CHECK(factory.nSetsCreated == 1);
+    CHECK(factory.nRenderDevicesCreated == 2);
+    CHECK(GetSurfaceDevicePoolSize() == 1);
+
+    // The old holder still has the removed device, and still finds its set
+    CHECK(setA.pD3D10Device == pOldDevice);
+    CHECK(CFakeDevice::s_nLive == nLive + 4);
+
+    CHECK_HR(ReplaceSharedRenderDevice(&setA));
+    CHECK(setA.pD3D10Device == setB.pD3D10Device);
+    CHECK(factory.nRenderDevicesCreated == 2);
+    CHECK(CFakeDevice::s_nLive == nLive + 3);
+
+    CHECK_HR(ReleaseSharedSurfaceDevices(&setA));
+    CHECK_HR(ReleaseSharedSurfaceDevices(&setB));
+    CHECK(GetSurfaceDevicePoolSize() == 0);
+    CHECK(CFakeDevice::s_nLive == nLive);
+
+Cleanup:
+    ReleaseSharedSurfaceDevices(&setB);
+    ReleaseSharedSurfaceDevices(&setA);
+    SetSurfaceDevicePoolFactory(NULL, NULL, NULL, NULL);
+}
+
+//
+// Two images on one set.  The UI image renders on the thread that also shows
+// the frames of the thread image, which the render thread can't get back
+// before they were shown.
+//
+struct RENDER_LOCK_TEST
+{
+    SURFACE_DEVICE_SET      UISet;
+    SURFACE_DEVICE_SET      ThreadSet;
+    CInteropPipeline*       pUIPipeline;
+    CInteropPipeline*       pThreadPipeline;
+    UINT                    NumFrames;
+    DWORD                   StartTime;
+
+    // Images rendering right now, and how often that was more than one
+    volatile LONG           nRendering;
+    volatile LONG           nOverlaps;
+
+    volatile LONG           nThreadFramesShown;
+    UINT                    nUIFrames;
+    HRESULT                 hrUI;
+    HRESULT                 hrThread;
+};
+
+// Long enough for every frame, short of hanging on a deadlock
+static const DWORD RENDER_LOCK_TEST_TIMEOUT = 10000;
+
+//-----------------------------------------------------------------------------
+static BOOL IsRenderLockTestOver(const RENDER_LOCK_TEST* pTest)
+{
+    return GetTickCount() - pTest->StartTime > RENDER_LOCK_TEST_TIMEOUT;
+}
+
+//-----------------------------------------------------------------------------
+// Stands in for the render callback, which must run alone on the device
+//-----------------------------------------------------------------------------
+static void RenderOnSharedDevice(RENDER_LOCK_TEST* pTest)
+{
+    if (InterlockedIncrement(&pTest->nRendering) > 1)
+    {
+        InterlockedIncrement(&pTest->nOverlaps);
+    }
+    Sleep(1);
+    InterlockedDecrement(&pTest->nRendering);
+}
+
+//-----------------------------------------------------------------------------
+// The render thread takes the lock only once it has a surface, as the helper
+// does, so its wait for the UI thread never holds it.
+//-----------------------------------------------------------------------------
+static DWORD WINAPI RenderLockThreadProc(void* pContext)
+{
+    RENDER_LOCK_TEST*   pTest       = (RENDER_LOCK_TEST*)pContext;
+    HRESULT             hr          = S_OK;
+    IUnknown*           pSurface    = NULL;
+
+    for (UINT i = 0; i < pTest->NumFrames; i++)
+    {
+        for (;;)
+        {
+            hr = pTest->pThreadPipeline->BeginFrame(__uuidof(ISoftwareSurface), &pSurface, 16);
+            if (HRESULT_FROM_WIN32(WAIT_TIMEOUT) != hr || IsRenderLockTestOver(pTest))
+            {
+                break;
+            }
+        }
+        if (FAILED(hr))
+        {
+            goto end;
+        }
+
+        if (FAILED(hr = LockSharedRenderDevice(&pTest->ThreadSet)))
+        {
+            goto end;
+        }
+        RenderOnSharedDevice(pTest);
+        hr = pTest->pThreadPipeline->EndFrame(pSurface, NULL, FALSE);
+        UnlockSharedRenderDevice(&pTest->ThreadSet);
+
+        pSurface->Release();
+        pSurface = NULL;
+
+        if (FAILED(hr) || FAILED(hr = pTest->pThreadPipeline->FlushRendered(0)))
+        {
+            goto end;
+        }
+    }
+
+end:
+    if (pSurface)
+    {
+        pSurface->Release();
+    }
+    pTest->hrThread = hr;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// The UI thread renders its own image under the lock and shows the frames of
+// the render thread, as the helper does.
+//-----------------------------------------------------------------------------
+static DWORD WINAPI RenderLockUIThreadProc(void* pContext)
+{
+    RENDER_LOCK_TEST*   pTest       = (RENDER_LOCK_TEST*)pContext;
+    HRESULT             hr          = S_OK;
+    IUnknown*           pSurface    = NULL;
+
+    while ((pTest->nUIFrames < pTest->NumFrames || (UINT)pTest->nThreadFramesShown < pTest->NumFrames) &&
+           !IsRenderLockTestOver(pTest))
+    {
+        if (pTest->nUIFrames < pTest->NumFrames)
+        {
+            if (FAILED(hr = LockSharedRenderDevice(&pTest->UISet)))
+            {
+                goto end;
+            }
+            hr = pTest->pUIPipeline->BeginFrame(__uuidof(ISoftwareSurface), &pSurface, 0);
+            if (SUCCEEDED(hr))
+            {
+                RenderOnSharedDevice(pTest);
+                hr = pTest->pUIPipeline->EndFrame(pSurface, NULL, FALSE);
+
+                pSurface->Release();
+                pSurface = NULL;
+            }
+            UnlockSharedRenderDevice(&pTest->UISet);
+
+            if (SUCCEEDED(hr))
+            {
+                if (FAILED(hr = pTest->pUIPipeline->FlushRendered(0)) ||
+                    FAILED(hr = pTest->pUIPipeline->AcquireFrame(__uuidof(ISoftwareSurface), &pSurface, NULL, NULL, INFINITE)))
+                {
+                    goto end;
+                }
+                hr = pTest->pUIPipeline->ReleaseFrame(pSurface, NULL, 0);
+
+                pSurface->Release();
+                pSurface = NULL;
+
+                pTest->nUIFrames++;
+            }
+            else if (HRESULT_FROM_WIN32(WAIT_TIMEOUT) != hr)
+            {
+                goto end;
+            }
+        }
+
+        if (SUCCEEDED(pTest->pThreadPipeline->AcquireFrame(__uuidof(ISoftwareSurface), &pSurface, NULL, NULL, 0)))
+        {
+            hr = pTest->pThreadPipeline->ReleaseFrame(pSurface, NULL, 0);
+
+            pSurface->Release();
+            pSurface = NULL;
+
+            InterlockedIncrement(&pTest->nThreadFramesShown);
+        }
+        if (FAILED(hr) && HRESULT_FROM_WIN32(WAIT_TIMEOUT) != hr)
+        {
+            goto end;
+        }
+        hr = S_OK;
+    }
+
+end:
+    if (pSurface)
+    {
+        pSurface->Release();
+    }
+    pTest->hrUI = hr;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Two images on one set, one rendered on the UI thread and one on a render
+// thread, with a single surface each so every frame waits for the other side.
+// The render lock keeps them from rendering at once and can't deadlock.
+//-----------------------------------------------------------------------------
+static void TestRenderLockSerializesImages()
+{
+    FAKE_DEVICE_FACTORY         factory;
+    RENDER_LOCK_TEST            test;
+    ISoftwareSurfaceDevice*     pBridgeDevice   = NULL;
+    ISoftwareSurfaceDevice*     pRenderDevice   = NULL;
+    ISoftwareSurfaceDevice*     pDisplayDevice  = NULL;
+    HANDLE                      hThreads[2]     = { NULL, NULL };
+    INTEROP_PIPELINE_DESC       desc;
+    BOOL                        fDeadlocked     = FALSE;
+
+    printf("TestRenderLockSerializesImages\n");
+
+    ZeroMemory(&test, sizeof(test));
+    test.NumFrames = 50;
+
+    CHECK_HR(UseFakeDevices(&factory));
+    CHECK_HR(AcquireSharedSurfaceDevices(0, NULL, &test.UISet));
+    CHECK_HR(AcquireSharedSurfaceDevices(0, NULL, &test.ThreadSet));
+
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pBridgeDevice));
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pRenderDevice));
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pDisplayDevice));
+
+    ZeroMemory(&desc, sizeof(desc));
+    desc.Width          = 64;
+    desc.Height         = 64;
+    desc.Format         = DXGI_FORMAT_B8G8R8A8_UNORM;
+    desc.NumSurfaces    = 1;
+    desc.Flags          = 0;
+    desc.pBridgeDevice  = pBridgeDevice;
+    desc.pRenderDevice  = pRenderDevice;
+    desc.pDisplayDevice = pDisplayDevice;
+
+    CHECK_HR(CreateInteropPipeline(&desc, &test.pUIPipeline));
+    CHECK_HR(CreateInteropPipeline(&desc, &test.pThreadPipeline));
+
+    test.StartTime = GetTickCount();
+
+    hThreads[0] = CreateThread(NULL, 0, &RenderLockUIThreadProc, &test, 0, NULL);
+    CHECK(hThreads[0]);
+    hThreads[1] = CreateThread(NULL, 0, &RenderLockThreadProc, &test, 0, NULL);
+    CHECK(hThreads[1]);
+
+    // Both threads give up on their own once the time is up, unless they are
+    // stuck on each other
+    if (WAIT_TIMEOUT == WaitForMultipleObjects(2, hThreads, TRUE, 2 * RENDER_LOCK_TEST_TIMEOUT))
+    {
+        fDeadlocked = TRUE;
+    }
+    CHECK(!fDeadlocked);
+
+    CHECK_HR(test.hrUI);
+    CHECK_HR(test.hrThread);
+    CHECK(test.nOverlaps == 0);
+    CHECK(test.nUIFrames == test.NumFrames);
+    CHECK((UINT)test.nThreadFramesShown == test.NumFrames);
+
+Cleanup:
+    if (fDeadlocked)
+    {
+        // The threads still use everything; leave it to the process exit
+        return;
+    }
+    if (hThreads[0])
+    {
+        WaitForSingleObject(hThreads[0], INFINITE);
+        CloseHandle(hThreads[0]);
+    }
+    if (hThreads[1])
+    {
+        WaitForSingleObject(hThreads[1], INFINITE);
+        CloseHandle(hThreads[1]);
+    }
+    ReleaseInterface(test.pThreadPipeline);
+    ReleaseInterface(test.pUIPipeline);
+    ReleaseInterface(pDisplayDevice);
+    ReleaseInterface(pRenderDevice);
+    ReleaseInterface(pBridgeDevice);
+    ReleaseSharedSurfaceDevices(&test.ThreadSet);
+    ReleaseSharedSurfaceDevices(&test.UISet);
+    SetSurfaceDevicePoolFactory(NULL, NULL, NULL, NULL);
+}
+
+//-----------------------------------------------------------------------------
+void RunDevicePoolTests()
+{
+    TestPoolSharesSetPerAdapter();
+    TestPoolLastHolderReleasesSet();
+    TestPoolD3D9DeviceLost();
+    TestPoolRenderDeviceLost();
+    TestRenderLockSerializesImages();
+}
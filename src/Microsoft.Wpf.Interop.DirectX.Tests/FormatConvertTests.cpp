@@ -0,0 +1,277 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+//
+// Pixel format conversion tests and benchmarks.
+//
+// Every pair of formats is converted once with the kernels the CPU supports
+// and once with SetSurfaceConvertInstructionSets(0), which picks the scalar
+// kernels, and the results are compared.  The F16C kernels round to nearest
+// even where the scalar code rounds half up, so FP16 results may differ by
+// one unit; everything else must match exactly.  FP16 sources hold values
+// converted from 8 bits, which both kernels read back the same way, so the
+// difference never grows through the alpha steps.
+//
+
+#include "Tests.h"
+
+#include <stdlib.h>
+#include "SurfaceFormatConvert.h"
+
+struct CONVERT_FORMAT
+{
+    DXGI_FORMAT     Format;
+    const char*     pName;
+    UINT            Size;
+};
+
+static const CONVERT_FORMAT g_Formats[] =
+{
+    { DXGI_FORMAT_B8G8R8A8_UNORM,       "B8G8R8A8",     4 },
+    { DXGI_FORMAT_B8G8R8X8_UNORM,       "B8G8R8X8",     4 },
+    { DXGI_FORMAT_R8G8B8A8_UNORM,       "R8G8B8A8",     4 },
+    { DXGI_FORMAT_R10G10B10A2_UNORM,    "R10G10B10A2",  4 },
+    { DXGI_FORMAT_R16G16B16A16_FLOAT,   "R16G16B16A16F", 8 },
+};
+
+static const UINT FORMAT_COUNT = sizeof(g_Formats) / sizeof(g_Formats[0]);
+
+struct CONVERT_FLAGS
+{
+    DWORD           Flags;
+    const char*     pName;
+};
+
+static const CONVERT_FLAGS g_Flags[] =
+{
+    { 0,                                    "" },
+    { SURFACE_CONVERT_FLAG_PREMULTIPLY,     " premultiply" },
+    { SURFACE_CONVERT_FLAG_UNPREMULTIPLY,   " unpremultiply" },
+};
+
+static const UINT FLAGS_COUNT = sizeof(g_Flags) / sizeof(g_Flags[0]);
+
+// Odd, so that every SIMD kernel leaves a tail to the scalar code
+static const UINT TEST_WIDTH        = 67;
+static const UINT TEST_HEIGHT       = 5;
+
+static const UINT BENCH_WIDTH       = 1920;
+static const UINT BENCH_HEIGHT      = 1080;
+static const UINT BENCH_ITERATIONS  = 50;
+
+//-----------------------------------------------------------------------------
+static void FillRandom(BYTE* pData, SIZE_T Size, UINT* pSeed)
+{
+    for (SIZE_T i = 0; i < Size; i++)
+    {
+        *pSeed = *pSeed * 1664525 + 1013904223;
+        pData[i] = (BYTE)(*pSeed >> 24);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Compares Width x Height pixels of Format, allowing Tolerance units per
+// channel.  FP16 channels are compared as 16 bit values, which for the
+// positive values the conversions produce orders them like the floats.
+//-----------------------------------------------------------------------------
+static BOOL AreImagesEqual(const BYTE* pA, const BYTE* pB, UINT Pitch, const CONVERT_FORMAT* pFormat, UINT Width, UINT Height, UINT Tolerance)
+{
+    for (UINT y = 0; y < Height; y++)
+    {
+        const BYTE* pRowA = pA + (SIZE_T)y * Pitch;
+        const BYTE* pRowB = pB + (SIZE_T)y * Pitch;
+
+        for (UINT i = 0; i < Width * 4; i++)
+        {
+            int a, b;
+            if (pFormat->Size == 8)
+            {
+                a = ((const USHORT*)pRowA)[i];
+                b = ((const USHORT*)pRowB)[i];
+            }
+            else
+            {
+                a = pRowA[i];
+                b = pRowB[i];
+            }
+            if (abs(a - b) > (int)Tolerance)
+            {
+                printf("pixel (%u, %u) channel %u: %d and %d\n", i / 4, y, i % 4, a, b);
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+// The SIMD kernels give the results of the scalar ones, for every pair of
+// formats, with and without the alpha steps, on unaligned rows.
+//-----------------------------------------------------------------------------
+static void TestConvertKernelsMatchScalar()
+{
+    // One byte in, so neither image nor pitch is aligned
+    const UINT  Pitch       = TEST_WIDTH * 8 + 3;
+    const SIZE_T Size       = (SIZE_T)Pitch * TEST_HEIGHT + 1;
+    BYTE*       pSrc        = (BYTE*)malloc(Size);
+    BYTE*       pScalar     = (BYTE*)malloc(Size);
+    BYTE*       pSIMD       = (BYTE*)malloc(Size);
+    UINT        Seed        = 1;
+    DWORD       Sets        = 0;
+    UINT        s, d, f;
+
+    printf("TestConvertKernelsMatchScalar\n");
+
+    CHECK(pSrc && pScalar && pSIMD);
+
+    Sets = SetSurfaceConvertInstructionSets(SURFACE_CONVERT_ISA_ALL);
+    printf("  kernels:%s%s%s%s\n",
+           (Sets & SURFACE_CONVERT_ISA_SSE2) ? " SSE2" : "",
+           (Sets & SURFACE_CONVERT_ISA_SSSE3) ? " SSSE3" : "",
+           (Sets & SURFACE_CONVERT_ISA_F16C) ? " F16C" : "",
+           (Sets & SURFACE_CONVERT_ISA_AVX2) ? " AVX2" : "");
+
+    for (s = 0; s < FORMAT_COUNT; s++)
+    {
+        for (d = 0; d < FORMAT_COUNT; d++)
+        {
+            for (f = 0; f < FLAGS_COUNT; f++)
+            {
+                const CONVERT_FORMAT*   pSrcFormat  = &g_Formats[s];
+                const CONVERT_FORMAT*   pDstFormat  = &g_Formats[d];
+                UINT                    Tolerance   = (pDstFormat->Size == 8) ? 1 : 0;
+
+                if (pSrcFormat->Size == 8)
+                {
+                    FillRandom(pScalar, Size, &Seed);
+                    SetSurfaceConvertInstructionSets(0);
+                    CHECK_HR(ConvertSurfaceFormat(pSrc + 1, Pitch, pSrcFormat->Format,
+                                                  pScalar + 1, Pitch, DXGI_FORMAT_R8G8B8A8_UNORM,
+                                                  TEST_WIDTH, TEST_HEIGHT, 0));
+                }
+                else
+                {
+                    FillRandom(pSrc, Size, &Seed);
+                }
+                memset(pScalar, 0, Size);
+                memset(pSIMD, 0, Size);
+
+                SetSurfaceConvertInstructionSets(0);
+                CHECK_HR(ConvertSurfaceFormat(pScalar + 1, Pitch, pDstFormat->Format,
+                                              pSrc + 1, Pitch, pSrcFormat->Format,
+                                              TEST_WIDTH, TEST_HEIGHT, g_Flags[f].Flags));
+
+                SetSurfaceConvertInstructionSets(SURFACE_CONVERT_ISA_ALL);
+                CHECK_HR(ConvertSurfaceFormat(pSIMD + 1, Pitch, pDstFormat->Format,
+                                              pSrc + 1, Pitch, pSrcFormat->Format,
+                                              TEST_WIDTH, TEST_HEIGHT, g_Flags[f].Flags));
+
+                if (!AreImagesEqual(pScalar + 1, pSIMD + 1, Pitch, pDstFormat, TEST_WIDTH, TEST_HEIGHT, Tolerance))
+                {
+                    printf("%s -> %s%s differs from the scalar kernels\n", pSrcFormat->pName, pDstFormat->pName, g_Flags[f].pName);
+                    g_nFailures++;
+                }
+            }
+        }
+    }
+
+Cleanup:
+    SetSurfaceConvertInstructionSets(SURFACE_CONVERT_ISA_ALL);
+    free(pSIMD);
+    free(pScalar);
+    free(pSrc);
+}
+
+//-----------------------------------------------------------------------------
+// Returns the bytes read and written per second, in GB/s.
+//-----------------------------------------------------------------------------
+static double MeasureConversion(BYTE* pDst, const CONVERT_FORMAT* pDstFormat, const BYTE* pSrc, const CONVERT_FORMAT* pSrcFormat, DWORD Flags)
+{
+    double  Start;
+    double  Seconds;
+    UINT    i;
+
+    // Warm up the caches and the kernel selection
+    ConvertSurfaceFormat(pDst, BENCH_WIDTH * pDstFormat->Size, pDstFormat->Format,
+                         pSrc, BENCH_WIDTH * pSrcFormat->Size, pSrcFormat->Format,
+                         BENCH_WIDTH, BENCH_HEIGHT, Flags);
+
+    Start = GetBenchmarkTime();
+    for (i = 0; i < BENCH_ITERATIONS; i++)
+    {
+        ConvertSurfaceFormat(pDst, BENCH_WIDTH * pDstFormat->Size, pDstFormat->Format,
+                             pSrc, BENCH_WIDTH * pSrcFormat->Size, pSrcFormat->Format,
+                             BENCH_WIDTH, BENCH_HEIGHT, Flags);
+    }
+    Seconds = GetBenchmarkTime() - Start;
+
+    return (double)BENCH_WIDTH * BENCH_HEIGHT * (pSrcFormat->Size + pDstFormat->Size) * BENCH_ITERATIONS / Seconds / 1e9;
+}
+
+//-----------------------------------------------------------------------------
+// Throughput of every conversion on a 1080p image, with the scalar kernels
+// and with the ones the CPU supports.
+//-----------------------------------------------------------------------------
+static void BenchmarkConvertKernels()
+{
+    const SIZE_T    Size    = (SIZE_T)BENCH_WIDTH * BENCH_HEIGHT * 8;
+    BYTE*           pSrc    = (BYTE*)malloc(Size);
+    BYTE*           pDst    = (BYTE*)malloc(Size);
+    UINT            Seed    = 1;
+    double          Scalar;
+    double          SIMD;
+    UINT            s, d, f;
+
+    printf("BenchmarkConvertKernels (%ux%u, GB/s read and written)\n", BENCH_WIDTH, BENCH_HEIGHT);
+
+    CHECK(pSrc && pDst);
+    FillRandom(pSrc, Size, &Seed);
+
+    printf("  %-44s %8s %8s\n", "", "scalar", "simd");
+    for (s = 0; s < FORMAT_COUNT; s++)
+    {
+        for (d = 0; d < FORMAT_COUNT; d++)
+        {
+            for (f = 0; f < FLAGS_COUNT; f++)
+            {
+                char Name[64];
+
+                // Same format without an alpha step is a plain copy
+                if (s == d && g_Flags[f].Flags == 0)
+                {
+                    continue;
+                }
+
+                SetSurfaceConvertInstructionSets(0);
+                Scalar = MeasureConversion(pDst, &g_Formats[d], pSrc, &g_Formats[s], g_Flags[f].Flags);
+
+                SetSurfaceConvertInstructionSets(SURFACE_CONVERT_ISA_ALL);
+                SIMD = MeasureConversion(pDst, &g_Formats[d], pSrc, &g_Formats[s], g_Flags[f].Flags);
+
+                sprintf_s(Name, sizeof(Name), "%s -> %s%s", g_Formats[s].pName, g_Formats[d].pName, g_Flags[f].pName);
+                printf("  %-44s %8.2f %8.2f\n", Name, Scalar, SIMD);
+            }
+        }
+    }
+
+Cleanup:
+    SetSurfaceConvertInstructionSets(SURFACE_CONVERT_ISA_ALL);
+    free(pDst);
+    free(pSrc);
+}
+
+//-----------------------------------------------------------------------------
+void RunFormatConvertTests()
+{
+    TestConvertKernelsMatchScalar();
+}
+
+//-----------------------------------------------------------------------------
+void RunFormatConvertBenchmarks()
+{
+    BenchmarkConvertKernels();
+}
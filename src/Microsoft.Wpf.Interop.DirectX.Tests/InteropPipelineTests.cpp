@@ -0,0 +1,271 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+//
+// Interop pipeline tests.
+//
+// The pipeline runs on software devices, so the tests need no GPU.  Removing
+// a render device is simulated by dropping it and handing the pipeline a new
+// one, which is what the interop helper does once the pool replaced it.
+//
+
+#include "Tests.h"
+
+#include "SurfaceQueueImpl.h"
+#include "SurfaceQueueSoftware.h"
+#include "SurfaceQueueInteropPipeline.h"
+
+// Long enough for a surface that is flushed, short enough for one that is not
+static const DWORD FRAME_TIMEOUT = 100;
+
+// Counts the surfaces a queue reports
+class CNotifyCounter : public ISurfaceQueueNotify
+{
+    public:
+        CNotifyCounter() : nFlushed(0), nReclaimed(0) {}
+
+        void OnSurfaceEnqueued(CSurfaceQueue*) {}
+        void OnSurfacesFlushed(CSurfaceQueue*, UINT NumSurfaces) { nFlushed += NumSurfaces; }
+        void OnSurfacesReclaimed(CSurfaceQueue*, UINT NumSurfaces) { nReclaimed += NumSurfaces; }
+
+        UINT    nFlushed;
+        UINT    nReclaimed;
+};
+
+//-----------------------------------------------------------------------------
+// The render device is removed between BeginFrame and EndFrame.  Every surface
+// is dequeued by the render side at that point, so nothing can be rendered
+// after the recovery unless the dequeued ones come back.
+//-----------------------------------------------------------------------------
+static void TestRenderDeviceRemovedMidFrame(UINT NumSurfaces)
+{
+    ISoftwareSurfaceDevice*     pBridgeDevice   = NULL;
+    ISoftwareSurfaceDevice*     pDisplayDevice  = NULL;
+    ISoftwareSurfaceDevice*     pRenderDevice   = NULL;
+    CInteropPipeline*           pPipeline       = NULL;
+    IUnknown*                   pSurface        = NULL;
+    INTEROP_PIPELINE_DESC       desc;
+    UINT                        nReclaimed      = 0;
+    UINT                        i;
+
+    printf("TestRenderDeviceRemovedMidFrame(%u)\n", NumSurfaces);
+
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pBridgeDevice));
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pDisplayDevice));
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pRenderDevice));
+
+    ZeroMemory(&desc, sizeof(desc));
+    desc.Width          = 64;
+    desc.Height         = 64;
+    desc.Format         = DXGI_FORMAT_B8G8R8A8_UNORM;
+    desc.NumSurfaces    = NumSurfaces;
+    desc.Flags          = 0;
+    desc.pBridgeDevice  = pBridgeDevice;
+    desc.pRenderDevice  = pRenderDevice;
+    desc.pDisplayDevice = pDisplayDevice;
+
+    CHECK_HR(CreateInteropPipeline(&desc, &pPipeline));
+
+    // The render side takes every surface, the last one mid-frame
+    for (i = 0; i < NumSurfaces; i++)
+    {
+        CHECK_HR(pPipeline->BeginFrame(__uuidof(ISoftwareSurface), &pSurface, FRAME_TIMEOUT));
+        ReleaseInterface(pSurface);
+    }
+    CHECK(pPipeline->BeginFrame(__uuidof(ISoftwareSurface), &pSurface, 0) == HRESULT_FROM_WIN32(WAIT_TIMEOUT));
+
+    // The device is removed and the frame is never ended
+    ReleaseInterface(pRenderDevice);
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pRenderDevice));
+
+    CHECK_HR(pPipeline->ReplaceRenderDevice(pRenderDevice, &nReclaimed));
+    CHECK(nReclaimed == NumSurfaces);
+
+    // Every surface renders again and gets to the display side
+    for (i = 0; i < NumSurfaces; i++)
+    {
+        CHECK_HR(pPipeline->BeginFrame(__uuidof(ISoftwareSurface), &pSurface, FRAME_TIMEOUT));
+        CHECK_HR(pPipeline->EndFrame(pSurface, NULL, TRUE));
+        ReleaseInterface(pSurface);
+    }
+    for (i = 0; i < NumSurfaces; i++)
+    {
+        CHECK_HR(pPipeline->AcquireFrame(__uuidof(ISoftwareSurface), &pSurface, NULL, NULL, FRAME_TIMEOUT));
+        CHECK_HR(pPipeline->ReleaseFrame(pSurface, NULL, 0));
+        ReleaseInterface(pSurface);
+    }
+
+    // And goes round again
+    CHECK_HR(pPipeline->BeginFrame(__uuidof(ISoftwareSurface), &pSurface, FRAME_TIMEOUT));
+    CHECK_HR(pPipeline->EndFrame(pSurface, NULL, TRUE));
+    ReleaseInterface(pSurface);
+
+Cleanup:
+    ReleaseInterface(pSurface);
+    ReleaseInterface(pPipeline);
+    ReleaseInterface(pRenderDevice);
+    ReleaseInterface(pDisplayDevice);
+    ReleaseInterface(pBridgeDevice);
+}
+
+//-----------------------------------------------------------------------------
+// The render device is removed after EndFrame enqueued a surface without
+// waiting, while the render side still holds another one.
+//-----------------------------------------------------------------------------
+static void TestRenderDeviceRemovedWithFramePending()
+{
+    ISoftwareSurfaceDevice*     pBridgeDevice   = NULL;
+    ISoftwareSurfaceDevice*     pDisplayDevice  = NULL;
+    ISoftwareSurfaceDevice*     pRenderDevice   = NULL;
+    CInteropPipeline*           pPipeline       = NULL;
+    IUnknown*                   pSurface        = NULL;
+    INTEROP_PIPELINE_DESC       desc;
+    UINT                        nFrames         = 0;
+    UINT                        i;
+
+    printf("TestRenderDeviceRemovedWithFramePending\n");
+
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pBridgeDevice));
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pDisplayDevice));
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pRenderDevice));
+
+    ZeroMemory(&desc, sizeof(desc));
+    desc.Width          = 64;
+    desc.Height         = 64;
+    desc.Format         = DXGI_FORMAT_B8G8R8A8_UNORM;
+    desc.NumSurfaces    = 2;
+    desc.Flags          = 0;
+    desc.pBridgeDevice  = pBridgeDevice;
+    desc.pRenderDevice  = pRenderDevice;
+    desc.pDisplayDevice = pDisplayDevice;
+
+    CHECK_HR(CreateInteropPipeline(&desc, &pPipeline));
+
+    CHECK_HR(pPipeline->BeginFrame(__uuidof(ISoftwareSurface), &pSurface, FRAME_TIMEOUT));
+    CHECK_HR(pPipeline->EndFrame(pSurface, NULL, FALSE));
+    ReleaseInterface(pSurface);
+    CHECK_HR(pPipeline->BeginFrame(__uuidof(ISoftwareSurface), &pSurface, FRAME_TIMEOUT));
+    ReleaseInterface(pSurface);
+
+    ReleaseInterface(pRenderDevice);
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pRenderDevice));
+
+    CHECK_HR(pPipeline->ReplaceRenderDevice(pRenderDevice, NULL));
+
+    // The display side gets what was flushed before the removal, the render
+    // side the rest; no surface is lost either way
+    while (SUCCEEDED(pPipeline->AcquireFrame(__uuidof(ISoftwareSurface), &pSurface, NULL, NULL, 0)))
+    {
+        CHECK_HR(pPipeline->ReleaseFrame(pSurface, NULL, 0));
+        ReleaseInterface(pSurface);
+    }
+    for (i = 0; i < desc.NumSurfaces; i++)
+    {
+        CHECK_HR(pPipeline->BeginFrame(__uuidof(ISoftwareSurface), &pSurface, FRAME_TIMEOUT));
+        CHECK_HR(pPipeline->EndFrame(pSurface, NULL, TRUE));
+        ReleaseInterface(pSurface);
+        nFrames++;
+    }
+    CHECK(nFrames == desc.NumSurfaces);
+
+Cleanup:
+    ReleaseInterface(pSurface);
+    ReleaseInterface(pPipeline);
+    ReleaseInterface(pRenderDevice);
+    ReleaseInterface(pDisplayDevice);
+    ReleaseInterface(pBridgeDevice);
+}
+
+//-----------------------------------------------------------------------------
+// Surfaces reclaimed from a lost consumer are reported as reclaimed.  Nothing
+// enqueued them, so a producer counting its flushes must not see them.
+//-----------------------------------------------------------------------------
+static void TestReclaimedSurfacesAreNotFlushes()
+{
+    ISoftwareSurfaceDevice*     pBridgeDevice   = NULL;
+    ISoftwareSurfaceDevice*     pDisplayDevice  = NULL;
+    ISoftwareSurfaceDevice*     pRenderDevice   = NULL;
+    ISurfaceQueue*              pABQueue        = NULL;
+    ISurfaceQueue*              pBAQueue        = NULL;
+    ISurfaceProducer*           pABProducer     = NULL;
+    ISurfaceConsumer*           pABConsumer     = NULL;
+    ISurfaceProducer*           pBAProducer     = NULL;
+    ISurfaceConsumer*           pBAConsumer     = NULL;
+    IUnknown*                   pSurface        = NULL;
+    ISurfaceQueueDevice*        pLostDevice     = NULL;
+    SURFACE_QUEUE_DESC          desc;
+    SURFACE_QUEUE_CLONE_DESC    cloneDesc;
+    CNotifyCounter              counter;
+    BOOL                        fNotifySet      = FALSE;
+    UINT                        nReclaimed      = 0;
+
+    printf("TestReclaimedSurfacesAreNotFlushes\n");
+
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pBridgeDevice));
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pDisplayDevice));
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pRenderDevice));
+
+    ZeroMemory(&desc, sizeof(desc));
+    desc.Width          = 64;
+    desc.Height         = 64;
+    desc.Format         = DXGI_FORMAT_B8G8R8A8_UNORM;
+    desc.NumSurfaces    = 2;
+    desc.MetaDataSize   = 0;
+    desc.Flags          = 0;
+
+    ZeroMemory(&cloneDesc, sizeof(cloneDesc));
+
+    // Set up the way the pipeline sets up its queues
+    CHECK_HR(CreateSurfaceQueue(&desc, pBridgeDevice, &pABQueue));
+    CHECK_HR(pABQueue->Clone(&cloneDesc, &pBAQueue));
+    CHECK_HR(pBAQueue->OpenProducer(pRenderDevice, &pBAProducer));
+    CHECK_HR(pABQueue->OpenConsumer(pRenderDevice, &pABConsumer));
+    CHECK_HR(pABQueue->OpenProducer(pDisplayDevice, &pABProducer));
+    CHECK_HR(pBAQueue->OpenConsumer(pDisplayDevice, &pBAConsumer));
+
+    CHECK_HR(static_cast<CSurfaceQueue*>(pABQueue)->SetNotify(QUEUE_EPOCH_PRODUCER, &counter));
+    fNotifySet = TRUE;
+
+    // The render side holds a surface when its device is lost
+    CHECK_HR(pABConsumer->Dequeue(__uuidof(ISoftwareSurface), &pSurface, NULL, NULL, FRAME_TIMEOUT));
+    ReleaseInterface(pSurface);
+
+    pLostDevice = static_cast<CSurfaceConsumer*>(pABConsumer)->GetDevice();
+    ReleaseInterface(pBAProducer);
+    ReleaseInterface(pABConsumer);
+
+    CHECK_HR(static_cast<CSurfaceQueue*>(pABQueue)->ReclaimConsumerSurfaces(
+                                        static_cast<CSurfaceQueue*>(pBAQueue), pLostDevice, &nReclaimed));
+    CHECK(nReclaimed == 1);
+    CHECK(counter.nReclaimed == 1);
+    CHECK(counter.nFlushed == 0);
+
+Cleanup:
+    if (fNotifySet)
+    {
+        static_cast<CSurfaceQueue*>(pABQueue)->SetNotify(QUEUE_EPOCH_PRODUCER, NULL);
+    }
+    ReleaseInterface(pSurface);
+    ReleaseInterface(pBAConsumer);
+    ReleaseInterface(pBAProducer);
+    ReleaseInterface(pABConsumer);
+    ReleaseInterface(pABProducer);
+    ReleaseInterface(pBAQueue);
+    ReleaseInterface(pABQueue);
+    ReleaseInterface(pRenderDevice);
+    ReleaseInterface(pDisplayDevice);
+    ReleaseInterface(pBridgeDevice);
+}
+
+//-----------------------------------------------------------------------------
+void RunInteropPipelineTests()
+{
+    TestRenderDeviceRemovedMidFrame(1);
+    TestRenderDeviceRemovedMidFrame(3);
+    TestRenderDeviceRemovedWithFramePending();
+    TestReclaimedSurfacesAreNotFlushes();
+}
@@ -0,0 +1,258 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+//
+// Interop pipeline benchmark.
+//
+// Frames go round a pipeline on software devices the way the interop helper
+// sends them: a render thread begins a frame, writes into its dirty rect and
+// ends it without waiting, and the display side, on the benchmark thread,
+// acquires it, reads the changed part and releases it.  The benchmark reports
+// the frame rate and the time from EndFrame to AcquireFrame of each frame.
+//
+
+#include "Tests.h"
+
+#include <new>
+#include <string.h>
+#include "SurfaceQueueImpl.h"
+#include "SurfaceQueueSoftware.h"
+#include "SurfaceQueueInteropPipeline.h"
+
+static const UINT   PIPELINE_WIDTH      = 1920;
+static const UINT   PIPELINE_HEIGHT     = 1080;
+static const UINT   PIPELINE_FRAMES     = 600;
+
+// Long enough for any frame; a frame that takes longer fails the benchmark
+static const DWORD  PIPELINE_TIMEOUT    = 5000;
+
+struct PIPELINE_BENCHMARK
+{
+    CInteropPipeline*   pPipeline;
+    // NULL for whole frames
+    const RECT*         pDirtyRect;
+    HRESULT             hrRender;
+
+    // When each frame was ended and acquired
+    double              EndTimes[PIPELINE_FRAMES];
+    double              AcquireTimes[PIPELINE_FRAMES];
+};
+
+//-----------------------------------------------------------------------------
+// Writes Value into the rect, as rendering would
+//-----------------------------------------------------------------------------
+static void FillRect(ISoftwareSurface* pSurface, const RECT* pRect, BYTE Value)
+{
+    UINT    Pitch;
+    BYTE*   pBits = (BYTE*)pSurface->GetBits(&Pitch);
+
+    for (LONG y = pRect->top; y < pRect->bottom; y++)
+    {
+        memset(pBits + (SIZE_T)y * Pitch + pRect->left * 4, Value, (pRect->right - pRect->left) * 4);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Reads the rect, as showing the frame would
+//-----------------------------------------------------------------------------
+static UINT ReadRect(ISoftwareSurface* pSurface, const RECT* pRect)
+{
+    UINT    Pitch;
+    BYTE*   pBits   = (BYTE*)pSurface->GetBits(&Pitch);
+    UINT    Sum     = 0;
+
+    for (LONG y = pRect->top; y < pRect->bottom; y++)
+    {
+        const DWORD* pRow = (const DWORD*)(pBits + (SIZE_T)y * Pitch);
+        for (LONG x = pRect->left; x < pRect->right; x++)
+        {
+            Sum += pRow[x];
+        }
+    }
+    return Sum;
+}
+
+//-----------------------------------------------------------------------------
+static DWORD WINAPI PipelineRenderThreadProc(void* pContext)
+{
+    PIPELINE_BENCHMARK* pBenchmark  = (PIPELINE_BENCHMARK*)pContext;
+    RECT                Full        = { 0, 0, (LONG)PIPELINE_WIDTH, (LONG)PIPELINE_HEIGHT };
+    const RECT*         pRect       = pBenchmark->pDirtyRect ? pBenchmark->pDirtyRect : &Full;
+    HRESULT             hr          = S_OK;
+    IUnknown*           pSurface    = NULL;
+    ISoftwareSurface*   pSoftware   = NULL;
+
+    for (UINT i = 0; i < PIPELINE_FRAMES; i++)
+    {
+        if (FAILED(hr = pBenchmark->pPipeline->BeginFrame(__uuidof(ISoftwareSurface), &pSurface, PIPELINE_TIMEOUT)) ||
+            FAILED(hr = pSurface->QueryInterface(__uuidof(ISoftwareSurface), (void**)&pSoftware)))
+        {
+            goto end;
+        }
+
+        FillRect(pSoftware, pRect, (BYTE)i);
+
+        if (FAILED(hr = pBenchmark->pPipeline->EndFrame(pSurface, pBenchmark->pDirtyRect, FALSE)))
+        {
+            goto end;
+        }
+        pBenchmark->EndTimes[i] = GetBenchmarkTime();
+
+        pSoftware->Release();
+        pSoftware = NULL;
+        pSurface->Release();
+        pSurface = NULL;
+
+        if (FAILED(hr = pBenchmark->pPipeline->FlushRendered(0)))
+        {
+            goto end;
+        }
+    }
+
+end:
+    if (pSoftware)
+    {
+        pSoftware->Release();
+    }
+    if (pSurface)
+    {
+        pSurface->Release();
+    }
+    pBenchmark->hrRender = hr;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Sends PIPELINE_FRAMES frames through a pipeline of NumSurfaces surfaces.
+//-----------------------------------------------------------------------------
+static void MeasurePipeline(UINT NumSurfaces, const RECT* pDirtyRect)
+{
+    ISoftwareSurfaceDevice*     pBridgeDevice   = NULL;
+    ISoftwareSurfaceDevice*     pDisplayDevice  = NULL;
+    ISoftwareSurfaceDevice*     pRenderDevice   = NULL;
+    IUnknown*                   pSurface        = NULL;
+    ISoftwareSurface*           pSoftware       = NULL;
+    HANDLE                      hThread         = NULL;
+    PIPELINE_BENCHMARK*         pBenchmark      = new QUEUE_NOTHROW_SPECIFIER PIPELINE_BENCHMARK;
+    INTEROP_PIPELINE_DESC       desc;
+    RECT                        Shown;
+    UINT                        nShown          = 0;
+    UINT                        Sum             = 0;
+    double                      Start;
+    double                      Seconds;
+    double                      Latency         = 0.0;
+    double                      MaxLatency      = 0.0;
+    UINT                        i;
+
+    CHECK(pBenchmark);
+    ZeroMemory(pBenchmark, sizeof(*pBenchmark));
+    pBenchmark->pDirtyRect = pDirtyRect;
+
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pBridgeDevice));
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pDisplayDevice));
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pRenderDevice));
+
+    ZeroMemory(&desc, sizeof(desc));
+    desc.Width          = PIPELINE_WIDTH;
+    desc.Height         = PIPELINE_HEIGHT;
+    desc.Format         = DXGI_FORMAT_B8G8R8A8_UNORM;
+    desc.NumSurfaces    = NumSurfaces;
+    desc.Flags          = 0;
+    desc.pBridgeDevice  = pBridgeDevice;
+    desc.pRenderDevice  = pRenderDevice;
+    desc.pDisplayDevice = pDisplayDevice;
+
+    CHECK_HR(CreateInteropPipeline(&desc, &pBenchmark->pPipeline));
+
+    Start = GetBenchmarkTime();
+    hThread = CreateThread(NULL, 0, &PipelineRenderThreadProc, pBenchmark, 0, NULL);
+    CHECK(hThread);
+
+    for (i = 0; i < PIPELINE_FRAMES; i++)
+    {
+        nShown = 1;
+        CHECK_HR(pBenchmark->pPipeline->AcquireFrame(__uuidof(ISoftwareSurface), &pSurface, &Shown, &nShown, PIPELINE_TIMEOUT));
+        pBenchmark->AcquireTimes[i] = GetBenchmarkTime();
+
+        CHECK_HR(pSurface->QueryInterface(__uuidof(ISoftwareSurface), (void**)&pSoftware));
+        if (nShown)
+        {
+            Sum += ReadRect(pSoftware, &Shown);
+        }
+
+        CHECK_HR(pBenchmark->pPipeline->ReleaseFrame(pSurface, nShown ? &Shown : NULL, nShown));
+        ReleaseInterface(pSoftware);
+        ReleaseInterface(pSurface);
+    }
+    Seconds = GetBenchmarkTime() - Start;
+
+    CHECK(WAIT_OBJECT_0 == WaitForSingleObject(hThread, PIPELINE_TIMEOUT));
+    CHECK_HR(pBenchmark->hrRender);
+
+    for (i = 0; i < PIPELINE_FRAMES; i++)
+    {
+        double FrameLatency = pBenchmark->AcquireTimes[i] - pBenchmark->EndTimes[i];
+        Latency    += FrameLatency;
+        MaxLatency  = max(MaxLatency, FrameLatency);
+    }
+
+    printf("  %-10u %-12s %10.1f %14.3f %14.3f\n",
+           NumSurfaces,
+           pDirtyRect ? "dirty rect" : "full frame",
+           PIPELINE_FRAMES / Seconds,
+           Latency * 1000.0 / PIPELINE_FRAMES,
+           MaxLatency * 1000.0);
+
+Cleanup:
+    ReleaseInterface(pSoftware);
+    ReleaseInterface(pSurface);
+    if (hThread)
+    {
+        // A failed display side leaves the render thread to time out
+        WaitForSingleObject(hThread, INFINITE);
+        CloseHandle(hThread);
+    }
+    if (pBenchmark)
+    {
+        ReleaseInterface(pBenchmark->pPipeline);
+        delete pBenchmark;
+    }
+    ReleaseInterface(pRenderDevice);
+    ReleaseInterface(pDisplayDevice);
+    ReleaseInterface(pBridgeDevice);
+
+    // Keeps the reads from being optimized away
+    if (Sum == 0xFFFFFFFF)
+    {
+        printf("\n");
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Frame rate and latency of 1080p frames, whole and with a 400x300 dirty rect.
+//-----------------------------------------------------------------------------
+static void BenchmarkInteropPipeline()
+{
+    static const UINT   SurfaceCounts[] = { 2, 3 };
+    RECT                Dirty           = { 760, 390, 1160, 690 };
+    UINT                i;
+
+    printf("BenchmarkInteropPipeline (%ux%u, %u frames)\n", PIPELINE_WIDTH, PIPELINE_HEIGHT, PIPELINE_FRAMES);
+    printf("  %-10s %-12s %10s %14s %14s\n", "surfaces", "frames", "fps", "latency (ms)", "max (ms)");
+
+    for (i = 0; i < sizeof(SurfaceCounts) / sizeof(SurfaceCounts[0]); i++)
+    {
+        MeasurePipeline(SurfaceCounts[i], NULL);
+        MeasurePipeline(SurfaceCounts[i], &Dirty);
+    }
+}
+
+//-----------------------------------------------------------------------------
+void RunPipelineBenchmarks()
+{
+    BenchmarkInteropPipeline();
+}
@@ -0,0 +1,245 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+//
+// Same device queue tests and benchmark.
+//
+// Surfaces go round a pair of queues, built the way the interop pipeline
+// builds its AB and BA queues, once with both ends on one device and once
+// with two devices.  Every Enqueue on two devices copies part of the surface
+// to a staging resource and maps it; on one device it doesn't, which
+// SameDeviceEnqueues counts.  Software devices copy and map in system memory,
+// so the benchmark shows the calls that are saved rather than the stall of a
+// GPU map, which is the larger part of the saving on hardware.
+//
+
+#include "Tests.h"
+
+#include "SurfaceQueueSoftware.h"
+#include "SurfaceQueueStats.h"
+
+static const UINT   SAME_DEVICE_SURFACES    = 2;
+static const UINT   SAME_DEVICE_FRAMES      = 20000;
+static const DWORD  SAME_DEVICE_TIMEOUT     = 1000;
+
+struct SAME_DEVICE_NETWORK
+{
+    ISurfaceQueue*          pABQueue;
+    ISurfaceQueue*          pBAQueue;
+    ISurfaceProducer*       pABProducer;
+    ISurfaceConsumer*       pABConsumer;
+    ISurfaceProducer*       pBAProducer;
+    ISurfaceConsumer*       pBAConsumer;
+};
+
+//-----------------------------------------------------------------------------
+static void ReleaseNetwork(SAME_DEVICE_NETWORK* pNetwork)
+{
+    ReleaseInterface(pNetwork->pBAConsumer);
+    ReleaseInterface(pNetwork->pBAProducer);
+    ReleaseInterface(pNetwork->pABConsumer);
+    ReleaseInterface(pNetwork->pABProducer);
+    ReleaseInterface(pNetwork->pBAQueue);
+    ReleaseInterface(pNetwork->pABQueue);
+}
+
+//-----------------------------------------------------------------------------
+// The display device creates the surfaces and displays them, the render
+// device renders them.  Passing the same device for both puts every end of
+// both queues on it.
+//-----------------------------------------------------------------------------
+static HRESULT CreateNetwork(IUnknown* pDisplayDevice, IUnknown* pRenderDevice, SAME_DEVICE_NETWORK* pNetwork)
+{
+    HRESULT                     hr;
+    SURFACE_QUEUE_DESC          desc;
+    SURFACE_QUEUE_CLONE_DESC    cloneDesc;
+
+    ZeroMemory(pNetwork, sizeof(*pNetwork));
+
+    ZeroMemory(&desc, sizeof(desc));
+    desc.Width          = 256;
+    desc.Height         = 256;
+    desc.Format         = DXGI_FORMAT_B8G8R8A8_UNORM;
+    desc.NumSurfaces    = SAME_DEVICE_SURFACES;
+    desc.MetaDataSize   = 0;
+    desc.Flags          = 0;
+
+    ZeroMemory(&cloneDesc, sizeof(cloneDesc));
+
+    if (FAILED(hr = CreateSurfaceQueue(&desc, pDisplayDevice, &pNetwork->pABQueue)) ||
+        FAILED(hr = pNetwork->pABQueue->Clone(&cloneDesc, &pNetwork->pBAQueue)) ||
+        FAILED(hr = pNetwork->pABQueue->OpenProducer(pDisplayDevice, &pNetwork->pABProducer)) ||
+        FAILED(hr = pNetwork->pABQueue->OpenConsumer(pRenderDevice, &pNetwork->pABConsumer)) ||
+        FAILED(hr = pNetwork->pBAQueue->OpenProducer(pRenderDevice, &pNetwork->pBAProducer)) ||
+        FAILED(hr = pNetwork->pBAQueue->OpenConsumer(pDisplayDevice, &pNetwork->pBAConsumer)))
+    {
+        ReleaseNetwork(pNetwork);
+    }
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+// Sends one surface to the render side and back.
+//-----------------------------------------------------------------------------
+static HRESULT RunFrame(SAME_DEVICE_NETWORK* pNetwork)
+{
+    HRESULT     hr;
+    IUnknown*   pSurface = NULL;
+
+    if (SUCCEEDED(hr = pNetwork->pABConsumer->Dequeue(__uuidof(ISoftwareSurface), &pSurface, NULL, NULL, SAME_DEVICE_TIMEOUT)))
+    {
+        hr = pNetwork->pBAProducer->Enqueue(pSurface, NULL, 0, 0);
+        pSurface->Release();
+        pSurface = NULL;
+    }
+    if (SUCCEEDED(hr) &&
+        SUCCEEDED(hr = pNetwork->pBAConsumer->Dequeue(__uuidof(ISoftwareSurface), &pSurface, NULL, NULL, SAME_DEVICE_TIMEOUT)))
+    {
+        hr = pNetwork->pABProducer->Enqueue(pSurface, NULL, 0, 0);
+        pSurface->Release();
+    }
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+// Returns the enqueues of both queues that skipped the copy and the map.
+//-----------------------------------------------------------------------------
+static HRESULT GetSameDeviceEnqueues(SAME_DEVICE_NETWORK* pNetwork, ULONGLONG* pCount)
+{
+    HRESULT             hr;
+    ISurfaceQueue1*     pQueue1 = NULL;
+    SURFACE_QUEUE_STATS stats;
+
+    *pCount = 0;
+
+    if (FAILED(hr = pNetwork->pABQueue->QueryInterface(__uuidof(ISurfaceQueue1), (void**)&pQueue1)) ||
+        FAILED(hr = pQueue1->GetStats(&stats)))
+    {
+        goto end;
+    }
+    *pCount += stats.SameDeviceEnqueues;
+    ReleaseInterface(pQueue1);
+
+    if (FAILED(hr = pNetwork->pBAQueue->QueryInterface(__uuidof(ISurfaceQueue1), (void**)&pQueue1)) ||
+        FAILED(hr = pQueue1->GetStats(&stats)))
+    {
+        goto end;
+    }
+    *pCount += stats.SameDeviceEnqueues;
+
+end:
+    ReleaseInterface(pQueue1);
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+// Only queues with both ends on one device skip the copy and the map.
+//-----------------------------------------------------------------------------
+static void TestSameDeviceEnqueueSkipsCopy()
+{
+    ISoftwareSurfaceDevice*     pDisplayDevice  = NULL;
+    ISoftwareSurfaceDevice*     pRenderDevice   = NULL;
+    SAME_DEVICE_NETWORK         same            = {};
+    SAME_DEVICE_NETWORK         split           = {};
+    ULONGLONG                   nSkipped;
+    UINT                        i;
+
+    printf("TestSameDeviceEnqueueSkipsCopy\n");
+
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pDisplayDevice));
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pRenderDevice));
+
+    CHECK_HR(CreateNetwork(pDisplayDevice, pDisplayDevice, &same));
+    CHECK_HR(CreateNetwork(pDisplayDevice, pRenderDevice, &split));
+
+    for (i = 0; i < 2 * SAME_DEVICE_SURFACES; i++)
+    {
+        CHECK_HR(RunFrame(&same));
+        CHECK_HR(RunFrame(&split));
+    }
+
+    // Two enqueues per frame
+    CHECK_HR(GetSameDeviceEnqueues(&same, &nSkipped));
+    CHECK(nSkipped == 4 * SAME_DEVICE_SURFACES);
+    CHECK_HR(GetSameDeviceEnqueues(&split, &nSkipped));
+    CHECK(nSkipped == 0);
+
+Cleanup:
+    ReleaseNetwork(&split);
+    ReleaseNetwork(&same);
+    ReleaseInterface(pRenderDevice);
+    ReleaseInterface(pDisplayDevice);
+}
+
+//-----------------------------------------------------------------------------
+// Returns the microseconds per frame, or a negative value on failure.
+//-----------------------------------------------------------------------------
+static double MeasureFrames(IUnknown* pDisplayDevice, IUnknown* pRenderDevice, ULONGLONG* pSkipped)
+{
+    SAME_DEVICE_NETWORK     network     = {};
+    double                  Start;
+    double                  Time        = -1.0;
+    UINT                    i;
+
+    CHECK_HR(CreateNetwork(pDisplayDevice, pRenderDevice, &network));
+
+    Start = GetBenchmarkTime();
+    for (i = 0; i < SAME_DEVICE_FRAMES; i++)
+    {
+        CHECK_HR(RunFrame(&network));
+    }
+    Time = (GetBenchmarkTime() - Start) * 1e6 / SAME_DEVICE_FRAMES;
+
+    CHECK_HR(GetSameDeviceEnqueues(&network, pSkipped));
+
+Cleanup:
+    ReleaseNetwork(&network);
+    return Time;
+}
+
+//-----------------------------------------------------------------------------
+// Round trips on one device and on two, with the enqueues that copied and
+// mapped a staging resource.
+//-----------------------------------------------------------------------------
+static void BenchmarkSameDeviceEnqueue()
+{
+    ISoftwareSurfaceDevice*     pDisplayDevice  = NULL;
+    ISoftwareSurfaceDevice*     pRenderDevice   = NULL;
+    ULONGLONG                   nSkipped        = 0;
+    double                      Time;
+
+    printf("BenchmarkSameDeviceEnqueue (%u frames, 2 enqueues each)\n", SAME_DEVICE_FRAMES);
+
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pDisplayDevice));
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pRenderDevice));
+
+    printf("  %-12s %14s %14s\n", "devices", "us per frame", "copy and map");
+
+    Time = MeasureFrames(pDisplayDevice, pRenderDevice, &nSkipped);
+    CHECK(Time >= 0.0);
+    printf("  %-12s %14.2f %14llu\n", "two", Time, 2ULL * SAME_DEVICE_FRAMES - nSkipped);
+
+    Time = MeasureFrames(pDisplayDevice, pDisplayDevice, &nSkipped);
+    CHECK(Time >= 0.0);
+    printf("  %-12s %14.2f %14llu\n", "one", Time, 2ULL * SAME_DEVICE_FRAMES - nSkipped);
+
+Cleanup:
+    ReleaseInterface(pRenderDevice);
+    ReleaseInterface(pDisplayDevice);
+}
+
+//-----------------------------------------------------------------------------
+void RunSameDeviceQueueTests()
+{
+    TestSameDeviceEnqueueSkipsCopy();
+}
+
+//-----------------------------------------------------------------------------
+void RunSameDeviceQueueBenchmarks()
+{
+    BenchmarkSameDeviceEnqueue();
+}
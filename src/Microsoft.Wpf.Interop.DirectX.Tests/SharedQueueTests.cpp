@@ -0,0 +1,314 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+//
+// Shared queue tests.
+//
+// The handles of software surfaces are only valid in the process that created
+// them, so the "other process" here is the same process opening the segment
+// again by name with a device of its own.  That goes through the named
+// mapping, the named semaphores and the ring exactly like another process
+// would; only the surfaces themselves are shared in memory.  The segment is
+// mapped once more to fake a process that exited while it owned a ring.
+//
+
+#include "Tests.h"
+
+#include <new>
+#include "SurfaceQueueImpl.h"
+#include "SurfaceQueueShared.h"
+#include "SurfaceQueueSoftware.h"
+
+static const UINT   SHARED_WIDTH        = 64;
+static const UINT   SHARED_HEIGHT       = 48;
+static const UINT   SHARED_SURFACES     = 3;
+static const UINT   SHARED_FRAMES       = 10;
+static const DWORD  SHARED_TIMEOUT      = 1000;
+
+// No process has this id; process ids are multiples of 4
+static const LONG   SHARED_EXITED_PROCESS_ID    = 0x7FFFFFF1;
+
+// The System process, which runs as long as Windows does
+static const LONG   SHARED_SYSTEM_PROCESS_ID    = 4;
+
+//-----------------------------------------------------------------------------
+// Makes a name no other run of the tests uses at the same time.
+//-----------------------------------------------------------------------------
+static void GetQueueName(LPCWSTR pTest, WCHAR* pName)
+{
+    swprintf_s(pName, SHARED_SURFACE_QUEUE_MAX_NAME, L"SharedQueueTests.%s.%u", pTest, GetCurrentProcessId());
+}
+
+//-----------------------------------------------------------------------------
+static HRESULT CreateQueue(IUnknown* pDevice, LPCWSTR pName, ISurfaceQueue** ppQueue)
+{
+    SURFACE_QUEUE_DESC desc;
+
+    ZeroMemory(&desc, sizeof(desc));
+    desc.Width          = SHARED_WIDTH;
+    desc.Height         = SHARED_HEIGHT;
+    desc.Format         = DXGI_FORMAT_B8G8R8A8_UNORM;
+    desc.NumSurfaces    = SHARED_SURFACES;
+    desc.MetaDataSize   = sizeof(UINT);
+    desc.Flags          = 0;
+
+    return CreateSharedSurfaceQueue(&desc, pDevice, pName, ppQueue);
+}
+
+//-----------------------------------------------------------------------------
+static void WritePixel(IUnknown* pSurface, UINT x, UINT y, DWORD Value)
+{
+    ISoftwareSurface*   pSoftware;
+    UINT                Pitch;
+
+    if (SUCCEEDED(pSurface->QueryInterface(__uuidof(ISoftwareSurface), (void**)&pSoftware)))
+    {
+        ((DWORD*)((BYTE*)pSoftware->GetBits(&Pitch) + (SIZE_T)y * Pitch))[x] = Value;
+        pSoftware->Release();
+    }
+}
+
+//-----------------------------------------------------------------------------
+static DWORD ReadPixel(IUnknown* pSurface, UINT x, UINT y)
+{
+    ISoftwareSurface*   pSoftware;
+    UINT                Pitch;
+    DWORD               Value = 0;
+
+    if (SUCCEEDED(pSurface->QueryInterface(__uuidof(ISoftwareSurface), (void**)&pSoftware)))
+    {
+        Value = ((DWORD*)((BYTE*)pSoftware->GetBits(&Pitch) + (SIZE_T)y * Pitch))[x];
+        pSoftware->Release();
+    }
+    return Value;
+}
+
+//-----------------------------------------------------------------------------
+// The host creates ring 0 (renderer to host) and clones ring 1 (host to
+// renderer); the renderer opens both by name.  Frames go round with their
+// meta data, their dirty rects and what was written into them.
+//-----------------------------------------------------------------------------
+static void TestSharedQueueRoundTrip()
+{
+    ISoftwareSurfaceDevice*     pHostDevice         = NULL;
+    ISoftwareSurfaceDevice*     pRendererDevice     = NULL;
+    ISurfaceQueue*              pHostQueue0         = NULL;
+    ISurfaceQueue*              pHostQueue1         = NULL;
+    ISurfaceQueue*              pRendererQueue0     = NULL;
+    ISurfaceQueue*              pRendererQueue1     = NULL;
+    ISurfaceConsumer*           pHostConsumer       = NULL;
+    ISurfaceProducer*           pHostProducer       = NULL;
+    ISurfaceConsumer*           pRendererConsumer   = NULL;
+    ISurfaceProducer*           pRendererProducer   = NULL;
+    ISurfaceConsumer1*          pHostConsumer1      = NULL;
+    ISurfaceProducer1*          pRendererProducer1  = NULL;
+    ISurfaceProducer*           pSecondProducer     = NULL;
+    IUnknown*                   pSurface            = NULL;
+    SURFACE_QUEUE_CLONE_DESC    cloneDesc;
+    WCHAR                       Name[SHARED_SURFACE_QUEUE_MAX_NAME];
+    RECT                        Dirty               = { 8, 4, 24, 20 };
+    RECT                        Rects[SURFACE_QUEUE_MAX_DIRTY_RECTS];
+    UINT                        nRects;
+    UINT                        Frame;
+    UINT                        MetaData;
+    UINT                        Size;
+    UINT                        i;
+
+    printf("TestSharedQueueRoundTrip\n");
+
+    GetQueueName(L"RoundTrip", Name);
+    ZeroMemory(&cloneDesc, sizeof(cloneDesc));
+    cloneDesc.MetaDataSize = sizeof(UINT);
+
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pHostDevice));
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pRendererDevice));
+
+    CHECK_HR(CreateQueue(pHostDevice, Name, &pHostQueue0));
+    CHECK_HR(pHostQueue0->Clone(&cloneDesc, &pHostQueue1));
+    CHECK_HR(OpenSharedSurfaceQueue(Name, 0, &pRendererQueue0));
+    CHECK_HR(OpenSharedSurfaceQueue(Name, 1, &pRendererQueue1));
+
+    CHECK_HR(pHostQueue0->OpenConsumer(pHostDevice, &pHostConsumer));
+    CHECK_HR(pHostQueue1->OpenProducer(pHostDevice, &pHostProducer));
+    CHECK_HR(pRendererQueue0->OpenProducer(pRendererDevice, &pRendererProducer));
+    CHECK_HR(pRendererQueue1->OpenConsumer(pRendererDevice, &pRendererConsumer));
+
+    CHECK_HR(pHostConsumer->QueryInterface(__uuidof(ISurfaceConsumer1), (void**)&pHostConsumer1));
+    CHECK_HR(pRendererProducer->QueryInterface(__uuidof(ISurfaceProducer1), (void**)&pRendererProducer1));
+
+    // One producer per ring, wherever it is opened
+    CHECK(FAILED(pHostQueue0->OpenProducer(pHostDevice, &pSecondProducer)));
+
+    // Ring 0 starts out full, and every surface is dirty as a whole
+    for (i = 0; i < SHARED_SURFACES; i++)
+    {
+        nRects = SURFACE_QUEUE_MAX_DIRTY_RECTS;
+        CHECK_HR(pHostConsumer1->DequeueDirty(__uuidof(ISoftwareSurface), &pSurface, NULL, NULL, Rects, &nRects, SHARED_TIMEOUT));
+        CHECK(nRects == 1);
+        CHECK(Rects[0].left == 0 && Rects[0].top == 0 &&
+              Rects[0].right == (LONG)SHARED_WIDTH && Rects[0].bottom == (LONG)SHARED_HEIGHT);
+
+        CHECK_HR(pHostProducer->Enqueue(pSurface, NULL, 0, 0));
+        ReleaseInterface(pSurface);
+    }
+
+    for (Frame = 0; Frame < SHARED_FRAMES; Frame++)
+    {
+        // The renderer draws the frame and sends it to the host
+        Size = sizeof(MetaData);
+        CHECK_HR(pRendererConsumer->Dequeue(__uuidof(ISoftwareSurface), &pSurface, &MetaData, &Size, SHARED_TIMEOUT));
+        CHECK(Size == 0);
+        WritePixel(pSurface, Dirty.left, Dirty.top, 0xFF000000 | Frame);
+        CHECK_HR(pRendererProducer1->EnqueueDirty(pSurface, &Frame, sizeof(Frame), &Dirty, 1, 0));
+        ReleaseInterface(pSurface);
+
+        // The host shows it and hands it back
+        Size    = sizeof(MetaData);
+        nRects  = SURFACE_QUEUE_MAX_DIRTY_RECTS;
+        CHECK_HR(pHostConsumer1->DequeueDirty(__uuidof(ISoftwareSurface), &pSurface, &MetaData, &Size, Rects, &nRects, SHARED_TIMEOUT));
+        CHECK(Size == sizeof(Frame) && MetaData == Frame);
+        CHECK(nRects == 1 && EqualRect(&Rects[0], &Dirty));
+        CHECK(ReadPixel(pSurface, Dirty.left, Dirty.top) == (0xFF000000 | Frame));
+
+        CHECK_HR(pHostProducer->Enqueue(pSurface, NULL, 0, 0));
+        ReleaseInterface(pSurface);
+    }
+
+    // The producer of ring 0 can be opened again once it is closed
+    ReleaseInterface(pRendererProducer1);
+    ReleaseInterface(pRendererProducer);
+    CHECK_HR(pHostQueue0->OpenProducer(pHostDevice, &pSecondProducer));
+
+Cleanup:
+    ReleaseInterface(pSurface);
+    ReleaseInterface(pSecondProducer);
+    ReleaseInterface(pRendererProducer1);
+    ReleaseInterface(pHostConsumer1);
+    ReleaseInterface(pRendererProducer);
+    ReleaseInterface(pRendererConsumer);
+    ReleaseInterface(pHostProducer);
+    ReleaseInterface(pHostConsumer);
+    ReleaseInterface(pRendererQueue1);
+    ReleaseInterface(pRendererQueue0);
+    ReleaseInterface(pHostQueue1);
+    ReleaseInterface(pHostQueue0);
+    ReleaseInterface(pRendererDevice);
+    ReleaseInterface(pHostDevice);
+}
+
+//-----------------------------------------------------------------------------
+// A Clone that fails gives its ring back to the next Clone.
+//-----------------------------------------------------------------------------
+static void TestSharedQueueCloneFailure()
+{
+    ISoftwareSurfaceDevice*     pDevice         = NULL;
+    ISurfaceQueue*              pQueue          = NULL;
+    ISurfaceQueue*              pClone          = NULL;
+    ISurfaceQueue*              pOpened         = NULL;
+    HANDLE                      hSemaphore      = NULL;
+    SURFACE_QUEUE_CLONE_DESC    cloneDesc;
+    WCHAR                       Name[SHARED_SURFACE_QUEUE_MAX_NAME];
+    WCHAR                       SemaphoreName[SHARED_SURFACE_QUEUE_MAX_NAME + 16];
+
+    printf("TestSharedQueueCloneFailure\n");
+
+    GetQueueName(L"CloneFailure", Name);
+    ZeroMemory(&cloneDesc, sizeof(cloneDesc));
+
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pDevice));
+    CHECK_HR(CreateQueue(pDevice, Name, &pQueue));
+
+    // A semaphore left over under the name of ring 1 makes the Clone fail
+    swprintf_s(SemaphoreName, SHARED_SURFACE_QUEUE_MAX_NAME + 16, L"%s.Ring1", Name);
+    hSemaphore = CreateSemaphoreW(NULL, 0, 1, SemaphoreName);
+    CHECK(hSemaphore);
+    CHECK(pQueue->Clone(&cloneDesc, &pClone) == HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS));
+    CHECK(pClone == NULL);
+    CloseHandle(hSemaphore);
+    hSemaphore = NULL;
+
+    // Ring 1 was given back, so the next Clone sets it up
+    CHECK_HR(pQueue->Clone(&cloneDesc, &pClone));
+    CHECK_HR(OpenSharedSurfaceQueue(Name, 1, &pOpened));
+    ReleaseInterface(pOpened);
+    CHECK(FAILED(OpenSharedSurfaceQueue(Name, 2, &pOpened)));
+
+Cleanup:
+    if (hSemaphore)
+    {
+        CloseHandle(hSemaphore);
+    }
+    ReleaseInterface(pOpened);
+    ReleaseInterface(pClone);
+    ReleaseInterface(pQueue);
+    ReleaseInterface(pDevice);
+}
+
+//-----------------------------------------------------------------------------
+// The endpoints of a process that exited without closing them are taken
+// over; those of a running process are not.
+//-----------------------------------------------------------------------------
+static void TestSharedQueueExitedOwner()
+{
+    ISoftwareSurfaceDevice*     pDevice         = NULL;
+    ISurfaceQueue*              pQueue          = NULL;
+    ISurfaceProducer*           pProducer       = NULL;
+    ISurfaceConsumer*           pConsumer       = NULL;
+    HANDLE                      hMapping        = NULL;
+    SharedQueueHeader*          pHeader         = NULL;
+    WCHAR                       Name[SHARED_SURFACE_QUEUE_MAX_NAME];
+
+    printf("TestSharedQueueExitedOwner\n");
+
+    GetQueueName(L"ExitedOwner", Name);
+
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pDevice));
+    CHECK_HR(CreateQueue(pDevice, Name, &pQueue));
+
+    hMapping = OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, Name);
+    CHECK(hMapping);
+    pHeader = (SharedQueueHeader*)MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    CHECK(pHeader);
+
+    // The producer was left open by a process that is gone
+    pHeader->Rings[0].ProducerProcessId = SHARED_EXITED_PROCESS_ID;
+    CHECK_HR(pQueue->OpenProducer(pDevice, &pProducer));
+    CHECK(pHeader->Rings[0].ProducerProcessId == (LONG)GetCurrentProcessId());
+
+    // Closing it frees the ring for the next process
+    ReleaseInterface(pProducer);
+    CHECK(pHeader->Rings[0].ProducerProcessId == 0);
+
+    // The consumer is open in a process that is running
+    pHeader->Rings[0].ConsumerProcessId = SHARED_SYSTEM_PROCESS_ID;
+    CHECK(FAILED(pQueue->OpenConsumer(pDevice, &pConsumer)));
+    CHECK(pHeader->Rings[0].ConsumerProcessId == SHARED_SYSTEM_PROCESS_ID);
+    pHeader->Rings[0].ConsumerProcessId = 0;
+    CHECK_HR(pQueue->OpenConsumer(pDevice, &pConsumer));
+
+Cleanup:
+    ReleaseInterface(pConsumer);
+    ReleaseInterface(pProducer);
+    if (pHeader)
+    {
+        UnmapViewOfFile(pHeader);
+    }
+    if (hMapping)
+    {
+        CloseHandle(hMapping);
+    }
+    ReleaseInterface(pQueue);
+    ReleaseInterface(pDevice);
+}
+
+//-----------------------------------------------------------------------------
+void RunSharedQueueTests()
+{
+    TestSharedQueueRoundTrip();
+    TestSharedQueueCloneFailure();
+    TestSharedQueueExitedOwner();
+}
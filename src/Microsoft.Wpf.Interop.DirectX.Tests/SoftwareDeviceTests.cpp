@@ -0,0 +1,327 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+//
+// Software device tests.
+//
+// The surfaces are created and opened through the queue device wrapper, the
+// same way the queue does, so the handle table, the copies and the mapping are
+// tested as the queue uses them.
+//
+
+#include "Tests.h"
+
+#include <new>
+#include "SurfaceQueueImpl.h"
+#include "SurfaceQueueSoftware.h"
+#include "SurfaceFormatConvert.h"
+
+static const UINT SURFACE_WIDTH     = 37;
+static const UINT SURFACE_HEIGHT    = 23;
+
+// More than the table holds before it grows for the first time
+static const UINT TABLE_SURFACES    = 40;
+
+// The value written to pixel (x, y) of a pattern
+static DWORD PatternPixel(UINT x, UINT y)
+{
+    return 0xFF000000 | (y << 16) | (x << 8) | ((x * 7 + y * 13) & 0xFF);
+}
+
+static void FillSurface(ISoftwareSurface* pSurface, BOOL Pattern)
+{
+    UINT    Width, Height, Pitch;
+    DXGI_FORMAT Format;
+    BYTE*   pBits = (BYTE*)pSurface->GetBits(&Pitch);
+
+    pSurface->GetDesc(&Width, &Height, &Format);
+    for (UINT y = 0; y < Height; y++)
+    {
+        DWORD* pRow = (DWORD*)(pBits + (SIZE_T)y * Pitch);
+        for (UINT x = 0; x < Width; x++)
+        {
+            pRow[x] = Pattern ? PatternPixel(x, y) : 0;
+        }
+    }
+}
+
+static DWORD ReadPixel(ISoftwareSurface* pSurface, UINT x, UINT y)
+{
+    UINT    Pitch;
+    BYTE*   pBits = (BYTE*)pSurface->GetBits(&Pitch);
+
+    return ((DWORD*)(pBits + (SIZE_T)y * Pitch))[x];
+}
+
+// Returns TRUE if the pixels inside the rect hold the pattern and the others
+// are still 0.
+static BOOL IsRectCopied(ISoftwareSurface* pSurface, const RECT* pRect)
+{
+    UINT    Width, Height;
+    DXGI_FORMAT Format;
+
+    pSurface->GetDesc(&Width, &Height, &Format);
+    for (UINT y = 0; y < Height; y++)
+    {
+        for (UINT x = 0; x < Width; x++)
+        {
+            BOOL    Inside  = (LONG)x >= pRect->left && (LONG)x < pRect->right &&
+                              (LONG)y >= pRect->top && (LONG)y < pRect->bottom;
+            DWORD   Pixel   = ReadPixel(pSurface, x, y);
+
+            if (Pixel != (Inside ? PatternPixel(x, y) : 0))
+            {
+                printf("pixel (%u, %u) is 0x%08X\n", x, y, Pixel);
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+// Shared handles open the surface they were created for, as long as it lives.
+//-----------------------------------------------------------------------------
+static void TestSoftwareHandleTable()
+{
+    ISoftwareSurfaceDevice*         pDevice     = NULL;
+    CSurfaceQueueDeviceSoftware*    pWrapper    = NULL;
+    IUnknown*                       pSurfaces[TABLE_SURFACES] = {};
+    HANDLE                          hSurfaces[TABLE_SURFACES] = {};
+    ISoftwareSurface*               pOpened     = NULL;
+    ISoftwareSurface*               pPrivate    = NULL;
+    ISoftwareSurface*               pExpected   = NULL;
+    HANDLE                          hShared     = NULL;
+    HANDLE                          hReleased   = NULL;
+    UINT                            i, j;
+
+    printf("TestSoftwareHandleTable\n");
+
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pDevice));
+    pWrapper = new QUEUE_NOTHROW_SPECIFIER CSurfaceQueueDeviceSoftware(pDevice);
+    CHECK(pWrapper);
+
+    for (i = 0; i < TABLE_SURFACES; i++)
+    {
+        CHECK_HR(pWrapper->CreateSharedSurface(SURFACE_WIDTH, SURFACE_HEIGHT, DXGI_FORMAT_B8G8R8A8_UNORM, &pSurfaces[i], &hSurfaces[i]));
+        CHECK(hSurfaces[i]);
+        for (j = 0; j < i; j++)
+        {
+            CHECK(hSurfaces[j] != hSurfaces[i]);
+        }
+    }
+
+    // Every handle still opens its own surface after the table grew
+    for (i = 0; i < TABLE_SURFACES; i++)
+    {
+        CHECK_HR(pWrapper->OpenSurface(hSurfaces[i], (void**)&pOpened, SURFACE_WIDTH, SURFACE_HEIGHT, DXGI_FORMAT_B8G8R8A8_UNORM));
+        CHECK_HR(pSurfaces[i]->QueryInterface(__uuidof(ISoftwareSurface), (void**)&pExpected));
+        CHECK(pOpened == pExpected);
+        CHECK_HR(pWrapper->GetSharedHandle(pOpened, &hShared));
+        CHECK(hShared == hSurfaces[i]);
+        ReleaseInterface(pExpected);
+        ReleaseInterface(pOpened);
+    }
+
+    // Opening with a different description fails
+    CHECK(pWrapper->OpenSurface(hSurfaces[0], (void**)&pOpened, SURFACE_WIDTH + 1, SURFACE_HEIGHT, DXGI_FORMAT_B8G8R8A8_UNORM) == E_INVALIDARG);
+    CHECK(!pOpened);
+    CHECK(pWrapper->OpenSurface(hSurfaces[0], (void**)&pOpened, SURFACE_WIDTH, SURFACE_HEIGHT, DXGI_FORMAT_R8G8B8A8_UNORM) == E_INVALIDARG);
+    CHECK(!pOpened);
+
+    // Handles that were not made by a software surface are rejected
+    CHECK(FAILED(pWrapper->OpenSurface(NULL, (void**)&pOpened, SURFACE_WIDTH, SURFACE_HEIGHT, DXGI_FORMAT_B8G8R8A8_UNORM)));
+    CHECK(FAILED(pWrapper->OpenSurface((HANDLE)(ULONG_PTR)0x40000002, (void**)&pOpened, SURFACE_WIDTH, SURFACE_HEIGHT, DXGI_FORMAT_B8G8R8A8_UNORM)));
+    CHECK(!pOpened);
+
+    // The handle of a released surface no longer opens anything.  The slot
+    // is reused by the next shared surface, so nothing is created in between.
+    hReleased = hSurfaces[TABLE_SURFACES / 2];
+    ReleaseInterface(pSurfaces[TABLE_SURFACES / 2]);
+    CHECK(FAILED(pWrapper->OpenSurface(hReleased, (void**)&pOpened, SURFACE_WIDTH, SURFACE_HEIGHT, DXGI_FORMAT_B8G8R8A8_UNORM)));
+    CHECK(!pOpened);
+
+    // Private surfaces have no handle
+    CHECK_HR(pDevice->CreateSurface(SURFACE_WIDTH, SURFACE_HEIGHT, DXGI_FORMAT_B8G8R8A8_UNORM, &pPrivate));
+    CHECK(FAILED(pWrapper->GetSharedHandle(pPrivate, &hShared)));
+
+    // Nor does the device
+    CHECK(FAILED(pWrapper->GetSharedHandle(pDevice, &hShared)));
+
+Cleanup:
+    ReleaseInterface(pExpected);
+    ReleaseInterface(pOpened);
+    ReleaseInterface(pPrivate);
+    for (i = 0; i < TABLE_SURFACES; i++)
+    {
+        ReleaseInterface(pSurfaces[i]);
+    }
+    delete pWrapper;
+    ReleaseInterface(pDevice);
+}
+
+//-----------------------------------------------------------------------------
+// CopySurfaceRect copies the rect clipped to both surfaces and nothing else.
+//-----------------------------------------------------------------------------
+static void TestSoftwareCopySurfaceRect()
+{
+    ISoftwareSurfaceDevice*         pDevice     = NULL;
+    CSurfaceQueueDeviceSoftware*    pWrapper    = NULL;
+    ISoftwareSurface*               pSrc        = NULL;
+    ISoftwareSurface*               pDst        = NULL;
+    ISoftwareSurface*               pSmall      = NULL;
+    ISoftwareSurface*               pSwizzled   = NULL;
+    ISoftwareSurface*               pAlpha      = NULL;
+    RECT                            rect;
+    RECT                            clipped;
+    RECT                            empty       = {};
+    DWORD                           Expected;
+
+    printf("TestSoftwareCopySurfaceRect\n");
+
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pDevice));
+    pWrapper = new QUEUE_NOTHROW_SPECIFIER CSurfaceQueueDeviceSoftware(pDevice);
+    CHECK(pWrapper);
+
+    CHECK_HR(pDevice->CreateSurface(SURFACE_WIDTH, SURFACE_HEIGHT, DXGI_FORMAT_B8G8R8A8_UNORM, &pSrc));
+    CHECK_HR(pDevice->CreateSurface(SURFACE_WIDTH, SURFACE_HEIGHT, DXGI_FORMAT_B8G8R8A8_UNORM, &pDst));
+    CHECK_HR(pDevice->CreateSurface(SURFACE_WIDTH / 2, SURFACE_HEIGHT / 2, DXGI_FORMAT_B8G8R8A8_UNORM, &pSmall));
+    FillSurface(pSrc, TRUE);
+
+    // A rect starting at an odd pixel, away from every edge
+    FillSurface(pDst, FALSE);
+    SetRect(&rect, 3, 5, 30, 17);
+    CHECK_HR(pWrapper->CopySurfaceRect(pDst, pSrc, &rect));
+    CHECK(IsRectCopied(pDst, &rect));
+
+    // Single pixel
+    FillSurface(pDst, FALSE);
+    SetRect(&rect, SURFACE_WIDTH - 1, SURFACE_HEIGHT - 1, SURFACE_WIDTH, SURFACE_HEIGHT);
+    CHECK_HR(pWrapper->CopySurfaceRect(pDst, pSrc, &rect));
+    CHECK(IsRectCopied(pDst, &rect));
+
+    // Rects reaching outside the surfaces are clipped to both of them
+    FillSurface(pSmall, FALSE);
+    SetRect(&rect, -4, -4, SURFACE_WIDTH + 4, SURFACE_HEIGHT + 4);
+    SetRect(&clipped, 0, 0, SURFACE_WIDTH / 2, SURFACE_HEIGHT / 2);
+    CHECK_HR(pWrapper->CopySurfaceRect(pSmall, pSrc, &rect));
+    CHECK(IsRectCopied(pSmall, &clipped));
+
+    FillSurface(pDst, FALSE);
+    SetRect(&rect, 2, 2, SURFACE_WIDTH, SURFACE_HEIGHT);
+    SetRect(&clipped, 2, 2, SURFACE_WIDTH / 2, SURFACE_HEIGHT / 2);
+    CHECK_HR(pWrapper->CopySurfaceRect(pDst, pSmall, &rect));
+    CHECK(IsRectCopied(pDst, &clipped));
+
+    // Empty, inverted and fully clipped rects copy nothing
+    FillSurface(pDst, FALSE);
+    CHECK_HR(pWrapper->CopySurfaceRect(pDst, pSrc, &empty));
+    SetRect(&rect, 10, 10, 5, 20);
+    CHECK_HR(pWrapper->CopySurfaceRect(pDst, pSrc, &rect));
+    SetRect(&rect, -10, -10, -1, -1);
+    CHECK_HR(pWrapper->CopySurfaceRect(pDst, pSrc, &rect));
+    SetRect(&rect, SURFACE_WIDTH, 0, SURFACE_WIDTH + 10, SURFACE_HEIGHT);
+    CHECK_HR(pWrapper->CopySurfaceRect(pDst, pSrc, &rect));
+    CHECK(IsRectCopied(pDst, &empty));
+
+    // Whole surface through CopySurface
+    FillSurface(pDst, FALSE);
+    SetRect(&rect, 0, 0, SURFACE_WIDTH, SURFACE_HEIGHT);
+    CHECK_HR(pWrapper->CopySurface(pDst, pSrc, SURFACE_WIDTH, SURFACE_HEIGHT));
+    CHECK(IsRectCopied(pDst, &rect));
+
+    // Copies between formats that convert swap the channels
+    CHECK(IsSurfaceFormatConvertible(DXGI_FORMAT_R8G8B8A8_UNORM, DXGI_FORMAT_B8G8R8A8_UNORM));
+    CHECK_HR(pDevice->CreateSurface(SURFACE_WIDTH, SURFACE_HEIGHT, DXGI_FORMAT_R8G8B8A8_UNORM, &pSwizzled));
+    FillSurface(pSwizzled, FALSE);
+    SetRect(&rect, 1, 1, 9, 4);
+    CHECK_HR(pWrapper->CopySurfaceRect(pSwizzled, pSrc, &rect));
+    Expected = PatternPixel(4, 2);
+    Expected = (Expected & 0xFF00FF00) | ((Expected >> 16) & 0xFF) | ((Expected & 0xFF) << 16);
+    CHECK(ReadPixel(pSwizzled, 4, 2) == Expected);
+    CHECK(ReadPixel(pSwizzled, 9, 2) == 0);
+    CHECK(ReadPixel(pSwizzled, 4, 0) == 0);
+
+    // Formats software surfaces support but can't convert between are refused
+    CHECK(!IsSurfaceFormatConvertible(DXGI_FORMAT_A8_UNORM, DXGI_FORMAT_B8G8R8A8_UNORM));
+    CHECK_HR(pDevice->CreateSurface(SURFACE_WIDTH, SURFACE_HEIGHT, DXGI_FORMAT_A8_UNORM, &pAlpha));
+    CHECK(pWrapper->CopySurfaceRect(pAlpha, pSrc, &rect) == E_INVALIDARG);
+
+    // Objects that are not software surfaces are refused
+    CHECK(FAILED(pWrapper->CopySurfaceRect(pDevice, pSrc, &rect)));
+    CHECK(FAILED(pWrapper->CopySurfaceRect(pDst, pDevice, &rect)));
+
+Cleanup:
+    ReleaseInterface(pAlpha);
+    ReleaseInterface(pSwizzled);
+    ReleaseInterface(pSmall);
+    ReleaseInterface(pDst);
+    ReleaseInterface(pSrc);
+    delete pWrapper;
+    ReleaseInterface(pDevice);
+}
+
+//-----------------------------------------------------------------------------
+// MapSurface hands out the bits of the surface, aligned the way the header
+// promises.
+//-----------------------------------------------------------------------------
+static void TestSoftwareMapSurface()
+{
+    ISoftwareSurfaceDevice*         pDevice     = NULL;
+    CSurfaceQueueDeviceSoftware*    pWrapper    = NULL;
+    IUnknown*                       pShared     = NULL;
+    ISoftwareSurface*               pSurface    = NULL;
+    HANDLE                          hShared     = NULL;
+    void*                           pData       = NULL;
+    void*                           pBits;
+    UINT                            Pitch       = 0;
+    UINT                            BitsPitch;
+
+    printf("TestSoftwareMapSurface\n");
+
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pDevice));
+    pWrapper = new QUEUE_NOTHROW_SPECIFIER CSurfaceQueueDeviceSoftware(pDevice);
+    CHECK(pWrapper);
+
+    CHECK_HR(pWrapper->CreateSharedSurface(SURFACE_WIDTH, SURFACE_HEIGHT, DXGI_FORMAT_B8G8R8A8_UNORM, &pShared, &hShared));
+    CHECK_HR(pShared->QueryInterface(__uuidof(ISoftwareSurface), (void**)&pSurface));
+    pBits = pSurface->GetBits(&BitsPitch);
+
+    CHECK_HR(pWrapper->MapSurface(pShared, 0, &pData, &Pitch));
+    CHECK(pData == pBits);
+    CHECK(Pitch == BitsPitch);
+    CHECK(Pitch >= SURFACE_WIDTH * GetSoftwareSurfaceFormatSize(DXGI_FORMAT_B8G8R8A8_UNORM));
+    CHECK(Pitch % SOFTWARE_SURFACE_ALIGNMENT == 0);
+    CHECK((ULONG_PTR)pData % SOFTWARE_SURFACE_ALIGNMENT == 0);
+    CHECK_HR(pWrapper->UnlockSurface(pShared));
+
+    // Writes through the mapping land in the surface
+    ((DWORD*)((BYTE*)pData + Pitch))[1] = 0x12345678;
+    CHECK(ReadPixel(pSurface, 1, 1) == 0x12345678);
+
+    // The outputs are optional, which is how LockSurface maps
+    CHECK_HR(pWrapper->MapSurface(pShared, 0, NULL, NULL));
+    CHECK_HR(pWrapper->UnlockSurface(pShared));
+    CHECK_HR(pWrapper->LockSurface(pShared, 0));
+    CHECK_HR(pWrapper->UnlockSurface(pShared));
+
+    CHECK(FAILED(pWrapper->MapSurface(pDevice, 0, &pData, &Pitch)));
+
+Cleanup:
+    ReleaseInterface(pSurface);
+    ReleaseInterface(pShared);
+    delete pWrapper;
+    ReleaseInterface(pDevice);
+}
+
+//-----------------------------------------------------------------------------
+void RunSoftwareDeviceTests()
+{
+    TestSoftwareHandleTable();
+    TestSoftwareCopySurfaceRect();
+    TestSoftwareMapSurface();
+}
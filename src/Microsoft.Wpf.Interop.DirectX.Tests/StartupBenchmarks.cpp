@@ -0,0 +1,183 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+//
+// Queue startup benchmark.
+//
+// Creating the surfaces of a queue and the staging resources of its producer
+// goes through CreateResources, which spreads the calls over the thread pool
+// when the device is thread-safe.  Software surfaces are created too quickly
+// for that to show, so the device here keeps the CPU busy for a configurable
+// time in every create call, the way a driver allocating a large texture
+// does.  Each network is created once as if the device were single-threaded
+// and once as a thread-safe device.
+//
+
+#include "Tests.h"
+
+#include <new>
+#include "SurfaceQueueImpl.h"
+#include "SurfaceQueueSoftware.h"
+
+static const UINT STARTUP_WIDTH     = 1920;
+static const UINT STARTUP_HEIGHT    = 1080;
+
+//
+// Forwards to a software device and spins for CreateCost seconds in each
+// create call.
+//
+class CSlowCreateDevice : public ISurfaceQueueDevice
+{
+    public:
+        CSlowCreateDevice(ISurfaceQueueDevice* pDevice, double CreateCost, BOOL ThreadSafe) :
+            m_pDevice(pDevice), m_CreateCost(CreateCost), m_ThreadSafe(ThreadSafe) {}
+
+        HRESULT CreateSharedSurface(UINT Width, UINT Height, DXGI_FORMAT Format, IUnknown** ppSurface, HANDLE* pHandle)
+        {
+            Spin();
+            return m_pDevice->CreateSharedSurface(Width, Height, Format, ppSurface, pHandle);
+        }
+
+        HRESULT CreateCopyResource(DXGI_FORMAT Format, UINT Width, UINT Height, IUnknown** ppResource)
+        {
+            Spin();
+            return m_pDevice->CreateCopyResource(Format, Width, Height, ppResource);
+        }
+
+        BOOL ValidateREFIID(REFIID id) { return m_pDevice->ValidateREFIID(id); }
+        BOOL IsThreadSafe() { return m_ThreadSafe; }
+        HRESULT OpenSurface(HANDLE hSurface, void** ppSurface, UINT w, UINT h, DXGI_FORMAT f) { return m_pDevice->OpenSurface(hSurface, ppSurface, w, h, f); }
+        HRESULT GetSharedHandle(IUnknown* p, HANDLE* ph) { return m_pDevice->GetSharedHandle(p, ph); }
+        HRESULT CopySurface(IUnknown* pDst, IUnknown* pSrc, UINT w, UINT h) { return m_pDevice->CopySurface(pDst, pSrc, w, h); }
+        HRESULT CopySurfaceRect(IUnknown* pDst, IUnknown* pSrc, const RECT* pRect) { return m_pDevice->CopySurfaceRect(pDst, pSrc, pRect); }
+        HRESULT LockSurface(IUnknown* p, DWORD Flags) { return m_pDevice->LockSurface(p, Flags); }
+        HRESULT MapSurface(IUnknown* p, DWORD Flags, void** ppData, UINT* pPitch) { return m_pDevice->MapSurface(p, Flags, ppData, pPitch); }
+        HRESULT UnlockSurface(IUnknown* p) { return m_pDevice->UnlockSurface(p); }
+
+    private:
+        void Spin()
+        {
+            double End = GetBenchmarkTime() + m_CreateCost;
+            while (GetBenchmarkTime() < End)
+            {
+                YieldProcessor();
+            }
+        }
+
+        ISurfaceQueueDevice*    m_pDevice;
+        double                  m_CreateCost;
+        BOOL                    m_ThreadSafe;
+};
+
+// What the queue and its producer create, one entry per index
+struct STARTUP_RESOURCES
+{
+    CSlowCreateDevice*      pDevice;
+    IUnknown**              ppSurfaces;
+    IUnknown**              ppStaging;
+};
+
+//-----------------------------------------------------------------------------
+static HRESULT CreateStartupSurface(UINT Index, void* pContext)
+{
+    STARTUP_RESOURCES*  pResources = (STARTUP_RESOURCES*)pContext;
+    HANDLE              hSurface;
+
+    return pResources->pDevice->CreateSharedSurface(STARTUP_WIDTH, STARTUP_HEIGHT, DXGI_FORMAT_B8G8R8A8_UNORM,
+                                                    &pResources->ppSurfaces[Index], &hSurface);
+}
+
+//-----------------------------------------------------------------------------
+static HRESULT CreateStartupStaging(UINT Index, void* pContext)
+{
+    STARTUP_RESOURCES* pResources = (STARTUP_RESOURCES*)pContext;
+
+    return pResources->pDevice->CreateCopyResource(DXGI_FORMAT_B8G8R8A8_UNORM, 1, 1, &pResources->ppStaging[Index]);
+}
+
+//-----------------------------------------------------------------------------
+// Creates the surfaces and the staging resources of a queue the way
+// CSurfaceQueue::Initialize and CSurfaceProducer::Initialize do, and returns
+// the time it took in milliseconds, or a negative value on failure.
+//-----------------------------------------------------------------------------
+static double MeasureStartup(ISurfaceQueueDevice* pSoftware, UINT NumSurfaces, double CreateCost, BOOL ThreadSafe)
+{
+    CSlowCreateDevice   device(pSoftware, CreateCost, ThreadSafe);
+    STARTUP_RESOURCES   resources;
+    double              Start;
+    double              Time        = -1.0;
+    UINT                i;
+
+    resources.pDevice       = &device;
+    resources.ppSurfaces    = new QUEUE_NOTHROW_SPECIFIER IUnknown*[NumSurfaces];
+    resources.ppStaging     = new QUEUE_NOTHROW_SPECIFIER IUnknown*[NumSurfaces];
+
+    CHECK(resources.ppSurfaces && resources.ppStaging);
+    ZeroMemory(resources.ppSurfaces, sizeof(IUnknown*) * NumSurfaces);
+    ZeroMemory(resources.ppStaging, sizeof(IUnknown*) * NumSurfaces);
+
+    Start = GetBenchmarkTime();
+    CHECK_HR(CreateResources(&device, NumSurfaces, &CreateStartupSurface, &resources));
+    CHECK_HR(CreateResources(&device, NumSurfaces, &CreateStartupStaging, &resources));
+    Time = (GetBenchmarkTime() - Start) * 1000.0;
+
+Cleanup:
+    for (i = 0; i < NumSurfaces; i++)
+    {
+        if (resources.ppSurfaces)
+        {
+            ReleaseInterface(resources.ppSurfaces[i]);
+        }
+        if (resources.ppStaging)
+        {
+            ReleaseInterface(resources.ppStaging[i]);
+        }
+    }
+    delete[] resources.ppStaging;
+    delete[] resources.ppSurfaces;
+    return Time;
+}
+
+//-----------------------------------------------------------------------------
+// Time to create queues of 1 to 8 surfaces with CreateCost milliseconds per
+// create call, on a single-threaded and on a thread-safe device.
+//-----------------------------------------------------------------------------
+static void BenchmarkQueueStartup(DWORD CreateCost)
+{
+    static const UINT           SurfaceCounts[] = { 1, 2, 3, 4, 8 };
+    ISoftwareSurfaceDevice*     pDevice         = NULL;
+    CSurfaceQueueDeviceSoftware* pSoftware      = NULL;
+    double                      Serial;
+    double                      Parallel;
+    UINT                        i;
+
+    printf("BenchmarkQueueStartup (%u ms per create call)\n", CreateCost);
+
+    CHECK_HR(CreateSoftwareSurfaceDevice(&pDevice));
+    pSoftware = new QUEUE_NOTHROW_SPECIFIER CSurfaceQueueDeviceSoftware(pDevice);
+    CHECK(pSoftware);
+
+    printf("  %-10s %12s %12s %8s\n", "surfaces", "serial (ms)", "pool (ms)", "speedup");
+    for (i = 0; i < sizeof(SurfaceCounts) / sizeof(SurfaceCounts[0]); i++)
+    {
+        Serial      = MeasureStartup(pSoftware, SurfaceCounts[i], CreateCost / 1000.0, FALSE);
+        Parallel    = MeasureStartup(pSoftware, SurfaceCounts[i], CreateCost / 1000.0, TRUE);
+        CHECK(Serial >= 0.0 && Parallel >= 0.0);
+
+        printf("  %-10u %12.1f %12.1f %7.2fx\n", SurfaceCounts[i], Serial, Parallel, Parallel > 0.0 ? Serial / Parallel : 0.0);
+    }
+
+Cleanup:
+    delete pSoftware;
+    ReleaseInterface(pDevice);
+}
+
+//-----------------------------------------------------------------------------
+void RunStartupBenchmarks(DWORD CreateCost)
+{
+    BenchmarkQueueStartup(CreateCost);
+}
@@ -0,0 +1,55 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#include <stdlib.h>
+#include <string.h>
+#include "Tests.h"
+
+UINT g_nFailures = 0;
+
+// Milliseconds each create call takes in the startup benchmark by default
+static const DWORD DEFAULT_CREATE_COST = 10;
+
+//-----------------------------------------------------------------------------
+double GetBenchmarkTime()
+{
+    LARGE_INTEGER Frequency;
+    LARGE_INTEGER Counter;
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Counter);
+    return (double)Counter.QuadPart / (double)Frequency.QuadPart;
+}
+
+//-----------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    if (argc > 1 && 0 == strcmp(argv[1], "bench"))
+    {
+        RunFormatConvertBenchmarks();
+        RunStartupBenchmarks(argc > 2 ? (DWORD)atoi(argv[2]) : DEFAULT_CREATE_COST);
+        RunPipelineBenchmarks();
+        RunSameDeviceQueueBenchmarks();
+    }
+    else
+    {
+        RunInteropPipelineTests();
+        RunDevicePoolTests();
+        RunSoftwareDeviceTests();
+        RunFormatConvertTests();
+        RunSameDeviceQueueTests();
+        RunSharedQueueTests();
+    }
+
+    if (g_nFailures)
+    {
+        printf("%u failed\n", g_nFailures);
+        return 1;
+    }
+    printf("passed\n");
+    return 0;
+}
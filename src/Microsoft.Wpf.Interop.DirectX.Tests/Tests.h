@@ -0,0 +1,42 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#pragma once
+
+//
+// Shared by the test files.  A failed check counts the failure and jumps to
+// the Cleanup label of the test.
+//
+// Started with "bench", the executable runs the benchmarks instead of the
+// tests.  They print their results and only fail when a step fails.  A
+// number after "bench" sets the milliseconds each create call takes in the
+// startup benchmark.
+//
+
+#include <windows.h>
+#include <stdio.h>
+
+extern UINT g_nFailures;
+
+#define CHECK(x) { if (!(x)) { printf("%s(%d): CHECK(%s) failed\n", __FILE__, __LINE__, #x); g_nFailures++; goto Cleanup; }}
+#define CHECK_HR(x) { HRESULT hrCheck = (x); if (FAILED(hrCheck)) { printf("%s(%d): %s failed with 0x%08X\n", __FILE__, __LINE__, #x, hrCheck); g_nFailures++; goto Cleanup; }}
+#define ReleaseInterface(x) { if (NULL != x) { x->Release(); x = NULL; }}
+
+void RunInteropPipelineTests();
+void RunDevicePoolTests();
+void RunSoftwareDeviceTests();
+void RunFormatConvertTests();
+void RunSameDeviceQueueTests();
+void RunSharedQueueTests();
+
+void RunFormatConvertBenchmarks();
+void RunStartupBenchmarks(DWORD CreateCost);
+void RunPipelineBenchmarks();
+void RunSameDeviceQueueBenchmarks();
+
+// Seconds on the performance counter, for the benchmarks
+double GetBenchmarkTime();
@@ -73,6 +73,17 @@ namespace Microsoft {
                     }
                 }
 
+                bool D3D11Image::RenderOnWorkerThread::get()
+                {
+                    return (this->Helper != nullptr) && this->Helper->RenderOnWorkerThread;
+                }
+
+                void D3D11Image::RenderOnWorkerThread::set(bool value)
+                {
+                    this->EnsureHelper();
+                    this->Helper->RenderOnWorkerThread = value;
+                }
+
                 void D3D11Image::RequestRender()
                 {
                     this->EnsureHelper();
@@ -89,6 +100,54 @@ namespace Microsoft {
                     this->EnsureHelper();
                     this->Helper->SetPixelSize(static_cast<UInt32>(pixelWidth), static_cast<UInt32>(pixelHeight));
                 }
+
+                void D3D11Image::SetRenderScaleRange(double minScale, double maxScale)
+                {
+                    this->EnsureHelper();
+                    this->Helper->SetRenderScaleRange(minScale, maxScale);
+                }
+
+                double D3D11Image::FrameTimeBudget::get()
+                {
+                    this->EnsureHelper();
+                    return this->Helper->FrameTimeBudget;
+                }
+
+                void D3D11Image::FrameTimeBudget::set(double value)
+                {
+                    this->EnsureHelper();
+                    this->Helper->FrameTimeBudget = value;
+                }
+
+                unsigned int D3D11Image::SurfaceCount::get()
+                {
+                    this->EnsureHelper();
+                    return this->Helper->SurfaceCount;
+                }
+
+                void D3D11Image::SurfaceCount::set(unsigned int value)
+                {
+                    this->EnsureHelper();
+                    this->Helper->SurfaceCount = value;
+                }
+
+                InteropSurfaceFormat D3D11Image::SurfaceFormat::get()
+                {
+                    this->EnsureHelper();
+                    return this->Helper->SurfaceFormat;
+                }
+
+                void D3D11Image::SurfaceFormat::set(InteropSurfaceFormat value)
+                {
+                    this->EnsureHelper();
+                    this->Helper->SurfaceFormat = value;
+                }
+
+                void D3D11Image::AddRenderDirtyRect(Int32Rect rect)
+                {
+                    this->EnsureHelper();
+                    this->Helper->AddDirtyRect(rect);
+                }
             }
         }
     }
@@ -67,6 +67,75 @@ namespace Microsoft {
                         }
                     }
 
+                    /// When true, OnRender is called on a dedicated render thread and RequestRender returns without waiting for
+                    /// the GPU; the UI thread only shows finished frames.  OnRender must then not touch UI objects.
+                    property bool RenderOnWorkerThread
+                    {
+                        bool get();
+                        void set(bool value);
+                    }
+
+                    /// The number of frames skipped because the previous frame was still on the GPU, and of render requests coalesced
+                    /// into another render.  An application whose dropped count keeps growing is GPU bound.
+                    property unsigned int DroppedFrameCount
+                    {
+                        unsigned int get() { return (this->Helper != nullptr) ? this->Helper->DroppedFrameCount : 0; }
+                    }
+
+                    property unsigned int CoalescedRenderCount
+                    {
+                        unsigned int get() { return (this->Helper != nullptr) ? this->Helper->CoalescedRenderCount : 0; }
+                    }
+
+                    /// The number of device losses recovered from, of those the ones that only replaced the render device and
+                    /// kept the surfaces, and the milliseconds the last one took.  OnRender sees the surfaces as new after one.
+                    property unsigned int DeviceRecoveryCount
+                    {
+                        unsigned int get() { return (this->Helper != nullptr) ? this->Helper->DeviceRecoveryCount : 0; }
+                    }
+
+                    property unsigned int RenderDeviceRecoveryCount
+                    {
+                        unsigned int get() { return (this->Helper != nullptr) ? this->Helper->RenderDeviceRecoveryCount : 0; }
+                    }
+
+                    property double LastDeviceRecoveryTime
+                    {
+                        double get() { return (this->Helper != nullptr) ? this->Helper->LastDeviceRecoveryTime : 0.0; }
+                    }
+
+                    /// Lets the render resolution drop to as little as minScale of the pixel size, and back up to maxScale, to keep
+                    /// frames within FrameTimeBudget milliseconds.  The image still displays at its layout size.
+                    void SetRenderScaleRange(double minScale, double maxScale);
+
+                    property double FrameTimeBudget
+                    {
+                        double get();
+                        void set(double value);
+                    }
+
+                    /// The fraction of the pixel size currently rendered.
+                    property double RenderScale
+                    {
+                        double get() { return (this->Helper != nullptr) ? this->Helper->RenderScale : 1.0; }
+                    }
+
+                    /// The number of surfaces the image renders through, 1 to 4.  More than one lets the GPU render the next frame
+                    /// while the current one is composed, at the cost of a frame of latency; OnRender should then redraw the
+                    /// whole surface.
+                    property unsigned int SurfaceCount
+                    {
+                        unsigned int get();
+                        void set(unsigned int value);
+                    }
+
+                    /// The format of the surface passed to OnRender.
+                    property InteropSurfaceFormat SurfaceFormat
+                    {
+                        InteropSurfaceFormat get();
+                        void set(InteropSurfaceFormat value);
+                    }
+
                     /// The RequestRender method signals that the D3D11Image should get the DirectX rendering code to render a new frame to the provided surface.
                     /// Typically the user of the D3D11Image calls this every time the CompositionTarget.Rendering event fires.
                     void RequestRender();
@@ -74,6 +143,10 @@ namespace Microsoft {
                     /// The application hosting the D3D11Image should ensure that the PixelSize is the number of pixels that the D3D11Image is
                     /// being displayed in.
                     void SetPixelSize(int pixelWidth, int pixelHeight);
+
+                    /// Called from the OnRender delegate to report the part of the surface the frame changed, so that only that part
+                    /// is composed again.  The calls accumulate; without a call the whole surface is invalidated.
+                    void AddRenderDirtyRect(Int32Rect rect);
                 };
             }
         }
@@ -12,6 +12,10 @@
 #include <stdio.h>
 
 #include "SurfaceQueue.h"
+#include "SurfaceQueueDirtyRects.h"
+#include "SurfaceQueueSurfaceData.h"
+#include "SurfaceQueueDevicePool.h"
+#include "SurfaceQueueInteropPipeline.h"
 
 #if DIRECTX_SDK
 #include <d3dx9.h>
@@ -136,10 +136,17 @@ HRESULT CSurfaceQueueDeviceD3D10::CreateCopyResource(DXGI_FORMAT format, UINT wi
 }
 
 HRESULT CSurfaceQueueDeviceD3D10::CopySurface(IUnknown* pDst, IUnknown* pSrc, UINT width, UINT height)
+{
+    RECT rect = {(long)0, (long)0, (long)width, (long)height };
+
+    return CopySurfaceRect(pDst, pSrc, &rect);
+}
+
+HRESULT CSurfaceQueueDeviceD3D10::CopySurfaceRect(IUnknown* pDst, IUnknown* pSrc, const RECT* pRect)
 {
     HRESULT hr;
     
-    D3D10_BOX UnitBox = {0, 0, 0, width, height, 1};
+    D3D10_BOX Box = {(UINT)pRect->left, (UINT)pRect->top, 0, (UINT)pRect->right, (UINT)pRect->bottom, 1};
     
     ID3D10Resource* pSrcRes = NULL;
     ID3D10Resource* pDstRes = NULL;
@@ -157,10 +164,10 @@ HRESULT CSurfaceQueueDeviceD3D10::CopySurface(IUnknown* pDst, IUnknown* pSrc, UI
     m_pDevice->CopySubresourceRegion(
             pDstRes, 
             0, 
-            0, 0, 0, //(x, y, z)
+            pRect->left, pRect->top, 0, //(x, y, z)
             pSrcRes,
             0, 
-            &UnitBox);
+            &Box);
 end:
     if (pSrcRes)
     {
@@ -175,6 +182,11 @@ end:
 }
 
 HRESULT CSurfaceQueueDeviceD3D10::LockSurface(IUnknown* pSurface, DWORD flags)
+{
+    return MapSurface(pSurface, flags, NULL, NULL);
+}
+
+HRESULT CSurfaceQueueDeviceD3D10::MapSurface(IUnknown* pSurface, DWORD flags, void** ppData, UINT* pPitch)
 {
     ASSERT(pSurface);
 
@@ -190,7 +202,7 @@ HRESULT CSurfaceQueueDeviceD3D10::LockSurface(IUnknown* pSurface, DWORD flags)
 
     if (flags & SURFACE_QUEUE_FLAG_DO_NOT_WAIT)
     {
-        flags |= D3D10_MAP_FLAG_DO_NOT_WAIT;
+        d3d10flags |= D3D10_MAP_FLAG_DO_NOT_WAIT;
     }
     
     if (FAILED(hr = pSurface->QueryInterface(__uuidof(ID3D10Texture2D), (void**)&pTex2D)))
@@ -199,6 +211,17 @@ HRESULT CSurfaceQueueDeviceD3D10::LockSurface(IUnknown* pSurface, DWORD flags)
     }
     
     hr = pTex2D->Map(0, D3D10_MAP_READ, d3d10flags, &region);
+    if (SUCCEEDED(hr))
+    {
+        if (ppData)
+        {
+            *ppData = region.pData;
+        }
+        if (pPitch)
+        {
+            *pPitch = region.RowPitch;
+        }
+    }
 
 end:
     if (pTex2D)
@@ -237,3 +260,8 @@ BOOL CSurfaceQueueDeviceD3D10::ValidateREFIID(REFIID id)
 		   (id == __uuidof(IDXGISurface));
 }
 
+BOOL CSurfaceQueueDeviceD3D10::IsThreadSafe()
+{
+    return (m_pDevice->GetCreationFlags() & D3D10_CREATE_DEVICE_SINGLETHREADED) == 0;
+}
+
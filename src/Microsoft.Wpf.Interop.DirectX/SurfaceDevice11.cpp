@@ -136,10 +136,17 @@ HRESULT CSurfaceQueueDeviceD3D11::CreateCopyResource(DXGI_FORMAT format, UINT wi
 }
 
 HRESULT CSurfaceQueueDeviceD3D11::CopySurface(IUnknown* pDst, IUnknown* pSrc, UINT width, UINT height)
+{
+    RECT rect = {(long)0, (long)0, (long)width, (long)height };
+
+    return CopySurfaceRect(pDst, pSrc, &rect);
+}
+
+HRESULT CSurfaceQueueDeviceD3D11::CopySurfaceRect(IUnknown* pDst, IUnknown* pSrc, const RECT* pRect)
 {
     HRESULT hr;
     
-    D3D11_BOX UnitBox = {0, 0, 0, width, height, 1};
+    D3D11_BOX Box = {(UINT)pRect->left, (UINT)pRect->top, 0, (UINT)pRect->right, (UINT)pRect->bottom, 1};
     
     ID3D11DeviceContext*    pContext = NULL;
     ID3D11Resource*         pSrcRes = NULL;
@@ -161,10 +168,10 @@ HRESULT CSurfaceQueueDeviceD3D11::CopySurface(IUnknown* pDst, IUnknown* pSrc, UI
     pContext->CopySubresourceRegion(
             pDstRes, 
             0, 
-            0, 0, 0, //(x, y, z)
+            pRect->left, pRect->top, 0, //(x, y, z)
             pSrcRes,
             0, 
-            &UnitBox);
+            &Box);
 end:
     if (pSrcRes)
     {
@@ -183,6 +190,11 @@ end:
 }
 
 HRESULT CSurfaceQueueDeviceD3D11::LockSurface(IUnknown* pSurface, DWORD flags)
+{
+    return MapSurface(pSurface, flags, NULL, NULL);
+}
+
+HRESULT CSurfaceQueueDeviceD3D11::MapSurface(IUnknown* pSurface, DWORD flags, void** ppData, UINT* pPitch)
 {
     ASSERT(pSurface);
 
@@ -212,6 +224,17 @@ HRESULT CSurfaceQueueDeviceD3D11::LockSurface(IUnknown* pSurface, DWORD flags)
     }
 
     hr = pContext->Map(pResource, 0, D3D11_MAP_READ, d3d11flags, &region); 
+    if (SUCCEEDED(hr))
+    {
+        if (ppData)
+        {
+            *ppData = region.pData;
+        }
+        if (pPitch)
+        {
+            *pPitch = region.RowPitch;
+        }
+    }
 
 end:
     if (pResource)
@@ -267,4 +290,9 @@ BOOL CSurfaceQueueDeviceD3D11::ValidateREFIID(REFIID id)
 		   (id == __uuidof(IDXGISurface));
 }
 
+BOOL CSurfaceQueueDeviceD3D11::IsThreadSafe()
+{
+    return (m_pDevice->GetCreationFlags() & D3D11_CREATE_DEVICE_SINGLETHREADED) == 0;
+}
+
 
@@ -187,12 +187,19 @@ HRESULT CSurfaceQueueDeviceD3D9::CreateCopyResource(DXGI_FORMAT Format, UINT wid
 }
 
 HRESULT CSurfaceQueueDeviceD3D9::CopySurface(IUnknown* pDst, IUnknown* pSrc, UINT width, UINT height)
+{
+    RECT rect = {(long)0, (long)0, (long)width, (long)height };
+
+    return CopySurfaceRect(pDst, pSrc, &rect);
+}
+
+HRESULT CSurfaceQueueDeviceD3D9::CopySurfaceRect(IUnknown* pDst, IUnknown* pSrc, const RECT* pRect)
 {
     ASSERT(pDst);
     ASSERT(pSrc);
     ASSERT(m_pDevice);
 
-	if(NULL == pDst || NULL == pSrc || NULL == m_pDevice)
+	if(NULL == pDst || NULL == pSrc || NULL == pRect || NULL == m_pDevice)
 	{
 		return E_FAIL;
 	}
@@ -201,7 +208,6 @@ HRESULT CSurfaceQueueDeviceD3D9::CopySurface(IUnknown* pDst, IUnknown* pSrc, UIN
     IDirect3DSurface9*  pSrcSurf    = NULL;
     IDirect3DSurface9*  pDstSurf    = NULL;
     IDirect3DTexture9*  pSrcTex     = NULL;
-    RECT                rect        = {(long)0, (long)0, (long)width, (long)height };
    
     // The source should be a IDirect3DTexture9.  We need to QI for it and then get the
     // top most surface from it.
@@ -219,7 +225,7 @@ HRESULT CSurfaceQueueDeviceD3D9::CopySurface(IUnknown* pDst, IUnknown* pSrc, UIN
         goto end;
     }
 
-    hr = m_pDevice->StretchRect(pSrcSurf, &rect, pDstSurf, &rect, D3DTEXF_NONE);
+    hr = m_pDevice->StretchRect(pSrcSurf, pRect, pDstSurf, pRect, D3DTEXF_NONE);
 
 end:
     if (pSrcTex)
@@ -238,6 +244,11 @@ end:
 }
 
 HRESULT CSurfaceQueueDeviceD3D9::LockSurface(IUnknown* pSurface, DWORD flags)
+{
+    return MapSurface(pSurface, flags, NULL, NULL);
+}
+
+HRESULT CSurfaceQueueDeviceD3D9::MapSurface(IUnknown* pSurface, DWORD flags, void** ppData, UINT* pPitch)
 {
     ASSERT(pSurface);
 
@@ -263,6 +274,17 @@ HRESULT CSurfaceQueueDeviceD3D9::LockSurface(IUnknown* pSurface, DWORD flags)
     }
    
     hr = pSurf->LockRect(&region, NULL, d3d9flags);
+    if (SUCCEEDED(hr))
+    {
+        if (ppData)
+        {
+            *ppData = region.pBits;
+        }
+        if (pPitch)
+        {
+            *pPitch = (UINT)region.Pitch;
+        }
+    }
 
 end:
     if (pSurf)
@@ -308,3 +330,14 @@ BOOL CSurfaceQueueDeviceD3D9::ValidateREFIID(REFIID id)
     return id == __uuidof(IDirect3DTexture9);
 }
 
+BOOL CSurfaceQueueDeviceD3D9::IsThreadSafe()
+{
+    D3DDEVICE_CREATION_PARAMETERS Params;
+
+    if (FAILED(m_pDevice->GetCreationParameters(&Params)))
+    {
+        return FALSE;
+    }
+    return (Params.BehaviorFlags & D3DCREATE_MULTITHREADED) != 0;
+}
+
@@ -0,0 +1,835 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#include <new>
+#include <string.h>
+#include <limits.h>
+#include <malloc.h>
+#include <emmintrin.h>
+#include "SurfaceQueueImpl.h"
+#include "SurfaceFormatConvert.h"
+
+//
+// Notes about shared handles:
+//
+// A shared software surface is entered in a process wide table and its handle
+// encodes its index in the table.  Opening a handle looks the surface up and
+// adds a reference.  The surface removes itself from the table in its
+// destructor, under the table lock, so a lookup that raced with the final
+// Release finds a reference count of zero and fails instead of reviving the
+// object.
+//
+
+// Tags the handles so that D3D handles passed by mistake are rejected
+#define SOFTWARE_HANDLE_TAG             (0x53000000)
+#define SOFTWARE_HANDLE_INDEX_MASK      (0x00FFFFFF)
+
+// Copies larger than this bypass the cache; the consumer reads the surface
+// much later, so pulling it into the cache only evicts the working set.
+#define SOFTWARE_STREAMING_COPY_SIZE    (1024 * 1024)
+
+class CSoftwareSurface;
+
+static SRWLOCK              g_SoftwareSurfaceLock   = SRWLOCK_INIT;
+static CSoftwareSurface**   g_ppSoftwareSurfaces    = NULL;
+static UINT                 g_nSoftwareSurfaces     = 0;
+
+//-----------------------------------------------------------------------------
+// CSoftwareSurface
+//-----------------------------------------------------------------------------
+class CSoftwareSurface : public ISoftwareSurface
+{
+    // Com Interfaces
+    public:
+        STDMETHOD(  QueryInterface) (REFIID ID, void** ppInterface);
+        STDMETHOD_( ULONG, AddRef)();
+        STDMETHOD_( ULONG, Release)();
+
+    // Public Interfaces
+    public:
+        STDMETHOD_( void, GetDesc) (UINT* pWidth, UINT* pHeight, DXGI_FORMAT* pFormat);
+        STDMETHOD_( void*, GetBits) (UINT* pPitch);
+        STDMETHOD ( GetSharedHandle) (HANDLE* pHandle);
+
+    // Implementation
+    public:
+        CSoftwareSurface();
+        ~CSoftwareSurface();
+
+        HRESULT Initialize(UINT Width, UINT Height, DXGI_FORMAT Format, BOOL Shared);
+
+        // Adds a reference unless the surface is already being destroyed
+        BOOL TryAddRef();
+
+        static HRESULT Lookup(HANDLE Handle, CSoftwareSurface** ppSurface);
+
+    private:
+        HRESULT Register();
+        void    Unregister();
+
+    private:
+        LONG                                m_RefCount;
+        UINT                                m_Width;
+        UINT                                m_Height;
+        DXGI_FORMAT                         m_Format;
+        UINT                                m_Pitch;
+        BYTE*                               m_pBits;
+
+        // Index in the handle table, or UINT_MAX if the surface is not shared
+        UINT                                m_Index;
+};
+
+//-----------------------------------------------------------------------------
+CSoftwareSurface::CSoftwareSurface() :
+    m_RefCount(0),
+    m_Width(0),
+    m_Height(0),
+    m_Format(DXGI_FORMAT_UNKNOWN),
+    m_Pitch(0),
+    m_pBits(NULL),
+    m_Index(UINT_MAX)
+{
+}
+
+//-----------------------------------------------------------------------------
+CSoftwareSurface::~CSoftwareSurface()
+{
+    Unregister();
+
+    if (m_pBits)
+    {
+        _aligned_free(m_pBits);
+    }
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSoftwareSurface::Initialize(UINT Width, UINT Height, DXGI_FORMAT Format, BOOL Shared)
+{
+    ASSERT(m_pBits == NULL);
+
+    UINT        PixelSize = GetSoftwareSurfaceFormatSize(Format);
+    ULONGLONG   Pitch;
+    ULONGLONG   Size;
+
+    if (PixelSize == 0 || Width == 0 || Height == 0)
+    {
+        return E_INVALIDARG;
+    }
+
+    Pitch = ((ULONGLONG)Width * PixelSize + SOFTWARE_SURFACE_ALIGNMENT - 1) & ~(ULONGLONG)(SOFTWARE_SURFACE_ALIGNMENT - 1);
+    Size  = Pitch * Height;
+
+    if (Pitch > UINT_MAX || Size > (SIZE_T)-1)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    m_pBits = (BYTE*)_aligned_malloc((SIZE_T)Size, SOFTWARE_SURFACE_ALIGNMENT);
+    if (!m_pBits)
+    {
+        return E_OUTOFMEMORY;
+    }
+    ZeroMemory(m_pBits, (SIZE_T)Size);
+
+    m_Width     = Width;
+    m_Height    = Height;
+    m_Format    = Format;
+    m_Pitch     = (UINT)Pitch;
+
+    return Shared ? Register() : S_OK;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSoftwareSurface::Register()
+{
+    HRESULT hr = S_OK;
+
+    AcquireSRWLockExclusive(&g_SoftwareSurfaceLock);
+
+    UINT i;
+    for (i = 0; i < g_nSoftwareSurfaces; i++)
+    {
+        if (g_ppSoftwareSurfaces[i] == NULL)
+        {
+            break;
+        }
+    }
+
+    if (i == g_nSoftwareSurfaces)
+    {
+        UINT NewCount = g_nSoftwareSurfaces ? g_nSoftwareSurfaces * 2 : 16;
+
+        if (NewCount > SOFTWARE_HANDLE_INDEX_MASK + 1)
+        {
+            hr = E_OUTOFMEMORY;
+            goto end;
+        }
+
+        CSoftwareSurface** ppTable = new QUEUE_NOTHROW_SPECIFIER CSoftwareSurface*[NewCount];
+        if (!ppTable)
+        {
+            hr = E_OUTOFMEMORY;
+            goto end;
+        }
+        ZeroMemory(ppTable, sizeof(CSoftwareSurface*) * NewCount);
+
+        if (g_ppSoftwareSurfaces)
+        {
+            memcpy(ppTable, g_ppSoftwareSurfaces, sizeof(CSoftwareSurface*) * g_nSoftwareSurfaces);
+            delete[] g_ppSoftwareSurfaces;
+        }
+        g_ppSoftwareSurfaces    = ppTable;
+        g_nSoftwareSurfaces     = NewCount;
+    }
+
+    g_ppSoftwareSurfaces[i] = this;
+    m_Index                 = i;
+
+end:
+    ReleaseSRWLockExclusive(&g_SoftwareSurfaceLock);
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+void CSoftwareSurface::Unregister()
+{
+    if (m_Index == UINT_MAX)
+    {
+        return;
+    }
+
+    AcquireSRWLockExclusive(&g_SoftwareSurfaceLock);
+
+    ASSERT(g_ppSoftwareSurfaces[m_Index] == this);
+    g_ppSoftwareSurfaces[m_Index] = NULL;
+    m_Index = UINT_MAX;
+
+    ReleaseSRWLockExclusive(&g_SoftwareSurfaceLock);
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSoftwareSurface::Lookup(HANDLE Handle, CSoftwareSurface** ppSurface)
+{
+    ULONG_PTR   Value   = (ULONG_PTR)Handle;
+    UINT        Index   = (UINT)(Value & SOFTWARE_HANDLE_INDEX_MASK);
+    HRESULT     hr      = E_INVALIDARG;
+
+    *ppSurface = NULL;
+
+    if ((Value & ~(ULONG_PTR)SOFTWARE_HANDLE_INDEX_MASK) != SOFTWARE_HANDLE_TAG)
+    {
+        return E_INVALIDARG;
+    }
+
+    AcquireSRWLockShared(&g_SoftwareSurfaceLock);
+
+    if (Index < g_nSoftwareSurfaces &&
+        g_ppSoftwareSurfaces[Index] &&
+        g_ppSoftwareSurfaces[Index]->TryAddRef())
+    {
+        *ppSurface  = g_ppSoftwareSurfaces[Index];
+        hr          = S_OK;
+    }
+
+    ReleaseSRWLockShared(&g_SoftwareSurfaceLock);
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+BOOL CSoftwareSurface::TryAddRef()
+{
+    for (;;)
+    {
+        LONG RefCount = m_RefCount;
+        if (RefCount == 0)
+        {
+            return FALSE;
+        }
+        if (InterlockedCompareExchange(&m_RefCount, RefCount + 1, RefCount) == RefCount)
+        {
+            return TRUE;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSoftwareSurface::QueryInterface(REFIID id, void** ppInterface)
+{
+    *ppInterface = NULL;
+    if (id == __uuidof(ISoftwareSurface))
+    {
+        *reinterpret_cast<ISoftwareSurface**>(ppInterface) = this;
+        AddRef();
+        return S_OK;
+    }
+    else if (id == __uuidof(IUnknown))
+    {
+        *reinterpret_cast<ISoftwareSurface**>(ppInterface) = this;
+        AddRef();
+        return S_OK;
+    }
+    return E_NOINTERFACE;
+}
+
+ULONG CSoftwareSurface::AddRef()
+{
+    return InterlockedIncrement(&m_RefCount);
+}
+
+ULONG CSoftwareSurface::Release()
+{
+    ULONG RefCount = InterlockedDecrement(&m_RefCount);
+    if (RefCount == 0)
+    {
+        delete this;
+    }
+    return RefCount;
+}
+
+//-----------------------------------------------------------------------------
+void CSoftwareSurface::GetDesc(UINT* pWidth, UINT* pHeight, DXGI_FORMAT* pFormat)
+{
+    if (pWidth)
+    {
+        *pWidth = m_Width;
+    }
+    if (pHeight)
+    {
+        *pHeight = m_Height;
+    }
+    if (pFormat)
+    {
+        *pFormat = m_Format;
+    }
+}
+
+//-----------------------------------------------------------------------------
+void* CSoftwareSurface::GetBits(UINT* pPitch)
+{
+    if (pPitch)
+    {
+        *pPitch = m_Pitch;
+    }
+    return m_pBits;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSoftwareSurface::GetSharedHandle(HANDLE* pHandle)
+{
+    ASSERT(pHandle);
+
+    if (NULL == pHandle)
+    {
+        return E_INVALIDARG;
+    }
+
+    if (m_Index == UINT_MAX)
+    {
+        *pHandle = NULL;
+        return E_FAIL;
+    }
+
+    *pHandle = (HANDLE)(ULONG_PTR)(SOFTWARE_HANDLE_TAG | m_Index);
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+// CSoftwareSurfaceDevice
+//-----------------------------------------------------------------------------
+class CSoftwareSurfaceDevice : public ISoftwareSurfaceDevice
+{
+    // Com Interfaces
+    public:
+        STDMETHOD(  QueryInterface) (REFIID ID, void** ppInterface);
+        STDMETHOD_( ULONG, AddRef)();
+        STDMETHOD_( ULONG, Release)();
+
+    // Public Interfaces
+    public:
+        STDMETHOD ( CreateSurface) (UINT Width, UINT Height, DXGI_FORMAT Format, ISoftwareSurface** ppSurface);
+
+    // Implementation
+    public:
+        CSoftwareSurfaceDevice();
+
+    private:
+        LONG                                m_RefCount;
+};
+
+//-----------------------------------------------------------------------------
+CSoftwareSurfaceDevice::CSoftwareSurfaceDevice() :
+    m_RefCount(0)
+{
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSoftwareSurfaceDevice::QueryInterface(REFIID id, void** ppInterface)
+{
+    *ppInterface = NULL;
+    if (id == __uuidof(ISoftwareSurfaceDevice))
+    {
+        *reinterpret_cast<ISoftwareSurfaceDevice**>(ppInterface) = this;
+        AddRef();
+        return S_OK;
+    }
+    else if (id == __uuidof(IUnknown))
+    {
+        *reinterpret_cast<ISoftwareSurfaceDevice**>(ppInterface) = this;
+        AddRef();
+        return S_OK;
+    }
+    return E_NOINTERFACE;
+}
+
+ULONG CSoftwareSurfaceDevice::AddRef()
+{
+    return InterlockedIncrement(&m_RefCount);
+}
+
+ULONG CSoftwareSurfaceDevice::Release()
+{
+    ULONG RefCount = InterlockedDecrement(&m_RefCount);
+    if (RefCount == 0)
+    {
+        delete this;
+    }
+    return RefCount;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSoftwareSurfaceDevice::CreateSurface(
+                                UINT Width, UINT Height,
+                                DXGI_FORMAT Format,
+                                ISoftwareSurface** ppSurface)
+{
+    if (ppSurface == NULL)
+    {
+        return E_INVALIDARG;
+    }
+    *ppSurface = NULL;
+
+    HRESULT             hr;
+    CSoftwareSurface*   pSurface = new QUEUE_NOTHROW_SPECIFIER CSoftwareSurface();
+
+    if (!pSurface)
+    {
+        return E_OUTOFMEMORY;
+    }
+    pSurface->AddRef();
+
+    if (FAILED(hr = pSurface->Initialize(Width, Height, Format, FALSE)))
+    {
+        pSurface->Release();
+        return hr;
+    }
+
+    *ppSurface = pSurface;
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+// Helper Functions
+//-----------------------------------------------------------------------------
+HRESULT WINAPI CreateSoftwareSurfaceDevice(ISoftwareSurfaceDevice** ppDevice)
+{
+    if (ppDevice == NULL)
+    {
+        return E_INVALIDARG;
+    }
+
+    *ppDevice = new QUEUE_NOTHROW_SPECIFIER CSoftwareSurfaceDevice();
+    if (!*ppDevice)
+    {
+        return E_OUTOFMEMORY;
+    }
+    (*ppDevice)->AddRef();
+
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+UINT GetSoftwareSurfaceFormatSize(DXGI_FORMAT Format)
+{
+    switch (Format)
+    {
+        case DXGI_FORMAT_B8G8R8A8_UNORM:
+        case DXGI_FORMAT_B8G8R8A8_UNORM_SRGB:
+        case DXGI_FORMAT_B8G8R8X8_UNORM:
+        case DXGI_FORMAT_B8G8R8X8_UNORM_SRGB:
+        case DXGI_FORMAT_R8G8B8A8_UNORM:
+        case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB:
+        case DXGI_FORMAT_R10G10B10A2_UNORM:
+            return 4;
+        case DXGI_FORMAT_R16G16B16A16_FLOAT:
+            return 8;
+        case DXGI_FORMAT_R32G32B32A32_FLOAT:
+            return 16;
+        case DXGI_FORMAT_R8_UNORM:
+        case DXGI_FORMAT_A8_UNORM:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Copies Rows rows of RowSize bytes.  The SIMD loop needs both images and
+// their pitches aligned to 16 bytes, which they are unless the copy starts
+// inside a row (e.g. for a dirty rectangle).
+//-----------------------------------------------------------------------------
+static void CopySoftwareRows(
+                BYTE* pDst, UINT DstPitch,
+                const BYTE* pSrc, UINT SrcPitch,
+                UINT RowSize, UINT Rows)
+{
+    BOOL Stream  = ((ULONGLONG)RowSize * Rows) >= SOFTWARE_STREAMING_COPY_SIZE;
+    UINT Blocks  = RowSize & ~63u;
+    UINT Chunks  = RowSize & ~15u;
+
+    if ((((ULONG_PTR)pDst | (ULONG_PTR)pSrc | DstPitch | SrcPitch) & 15) != 0)
+    {
+        for (UINT y = 0; y < Rows; y++, pDst += DstPitch, pSrc += SrcPitch)
+        {
+            memcpy(pDst, pSrc, RowSize);
+        }
+        return;
+    }
+
+    for (UINT y = 0; y < Rows; y++)
+    {
+        UINT x = 0;
+
+        if (Stream)
+        {
+            for (; x < Blocks; x += 64)
+            {
+                __m128i a = _mm_load_si128((const __m128i*)(pSrc + x));
+                __m128i b = _mm_load_si128((const __m128i*)(pSrc + x + 16));
+                __m128i c = _mm_load_si128((const __m128i*)(pSrc + x + 32));
+                __m128i d = _mm_load_si128((const __m128i*)(pSrc + x + 48));
+                _mm_stream_si128((__m128i*)(pDst + x),      a);
+                _mm_stream_si128((__m128i*)(pDst + x + 16), b);
+                _mm_stream_si128((__m128i*)(pDst + x + 32), c);
+                _mm_stream_si128((__m128i*)(pDst + x + 48), d);
+            }
+            for (; x < Chunks; x += 16)
+            {
+                _mm_stream_si128((__m128i*)(pDst + x), _mm_load_si128((const __m128i*)(pSrc + x)));
+            }
+        }
+        else
+        {
+            for (; x < Blocks; x += 64)
+            {
+                __m128i a = _mm_load_si128((const __m128i*)(pSrc + x));
+                __m128i b = _mm_load_si128((const __m128i*)(pSrc + x + 16));
+                __m128i c = _mm_load_si128((const __m128i*)(pSrc + x + 32));
+                __m128i d = _mm_load_si128((const __m128i*)(pSrc + x + 48));
+                _mm_store_si128((__m128i*)(pDst + x),      a);
+                _mm_store_si128((__m128i*)(pDst + x + 16), b);
+                _mm_store_si128((__m128i*)(pDst + x + 32), c);
+                _mm_store_si128((__m128i*)(pDst + x + 48), d);
+            }
+            for (; x < Chunks; x += 16)
+            {
+                _mm_store_si128((__m128i*)(pDst + x), _mm_load_si128((const __m128i*)(pSrc + x)));
+            }
+        }
+
+        if (x < RowSize)
+        {
+            memcpy(pDst + x, pSrc + x, RowSize - x);
+        }
+
+        pDst += DstPitch;
+        pSrc += SrcPitch;
+    }
+
+    if (Stream)
+    {
+        // Streaming stores are weakly ordered; make them visible before the
+        // surface is handed to the other side.
+        _mm_sfence();
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Implementation of the software Device Wrapper.  Surfaces are images in
+// system memory and copies complete before CopySurface returns, so locking
+// never has to wait.  See the comments in SharedSurfaceQueue.h to descriptions
+// of these functions.
+//-----------------------------------------------------------------------------
+CSurfaceQueueDeviceSoftware::CSurfaceQueueDeviceSoftware(ISoftwareSurfaceDevice* pDevice) :
+    m_pDevice(pDevice)
+{
+    ASSERT(m_pDevice);
+    if (NULL != m_pDevice)
+    {
+        m_pDevice->AddRef();
+    }
+}
+
+CSurfaceQueueDeviceSoftware::~CSurfaceQueueDeviceSoftware()
+{
+    m_pDevice->Release();
+}
+
+HRESULT CSurfaceQueueDeviceSoftware::CreateSharedSurface(
+                                UINT Width, UINT Height,
+                                DXGI_FORMAT format,
+                                IUnknown** ppUnknown,
+                                HANDLE* pHandle)
+{
+    ASSERT(ppUnknown);
+    ASSERT(pHandle);
+
+    if (NULL == ppUnknown || NULL == pHandle)
+    {
+        return E_FAIL;
+    }
+
+    HRESULT             hr;
+    CSoftwareSurface*   pSurface = new QUEUE_NOTHROW_SPECIFIER CSoftwareSurface();
+
+    *ppUnknown = NULL;
+
+    if (!pSurface)
+    {
+        return E_OUTOFMEMORY;
+    }
+    pSurface->AddRef();
+
+    if (FAILED(hr = pSurface->Initialize(Width, Height, format, TRUE)) ||
+        FAILED(hr = pSurface->GetSharedHandle(pHandle)))
+    {
+        pSurface->Release();
+        return hr;
+    }
+
+    *ppUnknown = pSurface;
+    return S_OK;
+}
+
+HRESULT CSurfaceQueueDeviceSoftware::OpenSurface(
+                                    HANDLE hSharedHandle,
+                                    void** ppSurface,
+                                    UINT Width,
+                                    UINT Height,
+                                    DXGI_FORMAT format)
+{
+    ASSERT(ppSurface);
+
+    if (NULL == ppSurface)
+    {
+        return E_FAIL;
+    }
+
+    HRESULT             hr;
+    CSoftwareSurface*   pSurface;
+    UINT                SurfaceWidth;
+    UINT                SurfaceHeight;
+    DXGI_FORMAT         SurfaceFormat;
+
+    *ppSurface = NULL;
+
+    if (FAILED(hr = CSoftwareSurface::Lookup(hSharedHandle, &pSurface)))
+    {
+        return hr;
+    }
+
+    pSurface->GetDesc(&SurfaceWidth, &SurfaceHeight, &SurfaceFormat);
+    if (SurfaceWidth != Width || SurfaceHeight != Height || SurfaceFormat != format)
+    {
+        pSurface->Release();
+        return E_INVALIDARG;
+    }
+
+    *ppSurface = static_cast<ISoftwareSurface*>(pSurface);
+    return S_OK;
+}
+
+HRESULT CSurfaceQueueDeviceSoftware::GetSharedHandle(IUnknown* pUnknown, HANDLE* pHandle)
+{
+    ASSERT(pUnknown);
+    ASSERT(pHandle);
+
+    if (NULL == pUnknown || NULL == pHandle)
+    {
+        return E_FAIL;
+    }
+
+    HRESULT hr = S_OK;
+
+    *pHandle = NULL;
+    ISoftwareSurface* pSurface;
+
+    if (FAILED(hr = pUnknown->QueryInterface(__uuidof(ISoftwareSurface), (void**)&pSurface)))
+    {
+        return hr;
+    }
+
+    hr = pSurface->GetSharedHandle(pHandle);
+    pSurface->Release();
+
+    return hr;
+}
+
+HRESULT CSurfaceQueueDeviceSoftware::CreateCopyResource(DXGI_FORMAT format, UINT width, UINT height, IUnknown** ppRes)
+{
+    ASSERT(ppRes);
+    ASSERT(m_pDevice);
+
+    if (NULL == ppRes || NULL == m_pDevice)
+    {
+        return E_FAIL;
+    }
+
+    return m_pDevice->CreateSurface(width, height, format, reinterpret_cast<ISoftwareSurface**>(ppRes));
+}
+
+HRESULT CSurfaceQueueDeviceSoftware::CopySurface(IUnknown* pDst, IUnknown* pSrc, UINT width, UINT height)
+{
+    RECT rect = {(long)0, (long)0, (long)width, (long)height };
+
+    return CopySurfaceRect(pDst, pSrc, &rect);
+}
+
+HRESULT CSurfaceQueueDeviceSoftware::CopySurfaceRect(IUnknown* pDst, IUnknown* pSrc, const RECT* pRect)
+{
+    HRESULT hr;
+
+    ISoftwareSurface*   pSrcSurface = NULL;
+    ISoftwareSurface*   pDstSurface = NULL;
+    UINT                SrcWidth, SrcHeight, DstWidth, DstHeight;
+    DXGI_FORMAT         SrcFormat, DstFormat;
+    UINT                SrcPitch, DstPitch;
+    BYTE*               pSrcBits;
+    BYTE*               pDstBits;
+    UINT                left, top, right, bottom;
+
+    if (FAILED(hr = pDst->QueryInterface(__uuidof(ISoftwareSurface), (void**)&pDstSurface)))
+    {
+        goto end;
+    }
+
+    if (FAILED(hr = pSrc->QueryInterface(__uuidof(ISoftwareSurface), (void**)&pSrcSurface)))
+    {
+        goto end;
+    }
+
+    pSrcSurface->GetDesc(&SrcWidth, &SrcHeight, &SrcFormat);
+    pDstSurface->GetDesc(&DstWidth, &DstHeight, &DstFormat);
+
+    if (SrcFormat != DstFormat && !IsSurfaceFormatConvertible(DstFormat, SrcFormat))
+    {
+        hr = E_INVALIDARG;
+        goto end;
+    }
+
+    // Same as the box of the D3D copies, clipped to both surfaces
+    left    = (UINT)max(pRect->left, 0L);
+    top     = (UINT)max(pRect->top,  0L);
+    right   = min((UINT)max(pRect->right,  0L), min(SrcWidth,  DstWidth));
+    bottom  = min((UINT)max(pRect->bottom, 0L), min(SrcHeight, DstHeight));
+
+    if (left >= right || top >= bottom)
+    {
+        goto end;
+    }
+
+    pSrcBits = (BYTE*)pSrcSurface->GetBits(&SrcPitch) + (SIZE_T)top * SrcPitch + left * GetSoftwareSurfaceFormatSize(SrcFormat);
+    pDstBits = (BYTE*)pDstSurface->GetBits(&DstPitch) + (SIZE_T)top * DstPitch + left * GetSoftwareSurfaceFormatSize(DstFormat);
+
+    if (SrcFormat != DstFormat)
+    {
+        // Software surfaces of different formats can be copied between, for
+        // example to read a queue back in the layout the caller wants
+        hr = ConvertSurfaceFormat(pDstBits, DstPitch, DstFormat,
+                                  pSrcBits, SrcPitch, SrcFormat,
+                                  right - left, bottom - top, 0);
+    }
+    else
+    {
+        CopySoftwareRows(pDstBits, DstPitch,
+                         pSrcBits, SrcPitch,
+                         (right - left) * GetSoftwareSurfaceFormatSize(SrcFormat), bottom - top);
+    }
+
+end:
+    if (pSrcSurface)
+    {
+        pSrcSurface->Release();
+    }
+    if (pDstSurface)
+    {
+        pDstSurface->Release();
+    }
+
+    return hr;
+}
+
+HRESULT CSurfaceQueueDeviceSoftware::LockSurface(IUnknown* pSurface, DWORD flags)
+{
+    return MapSurface(pSurface, flags, NULL, NULL);
+}
+
+HRESULT CSurfaceQueueDeviceSoftware::MapSurface(IUnknown* pSurface, DWORD, void** ppData, UINT* pPitch)
+{
+    ASSERT(pSurface);
+
+    if (NULL == pSurface)
+    {
+        return E_FAIL;
+    }
+
+    HRESULT             hr;
+    ISoftwareSurface*   pSoftwareSurface;
+
+    if (FAILED(hr = pSurface->QueryInterface(__uuidof(ISoftwareSurface), (void**)&pSoftwareSurface)))
+    {
+        return hr;
+    }
+
+    // Copies are synchronous, so the surface is always idle
+    UINT  Pitch;
+    void* pData = pSoftwareSurface->GetBits(&Pitch);
+
+    if (ppData)
+    {
+        *ppData = pData;
+    }
+    if (pPitch)
+    {
+        *pPitch = Pitch;
+    }
+
+    pSoftwareSurface->Release();
+    return S_OK;
+}
+
+HRESULT CSurfaceQueueDeviceSoftware::UnlockSurface(IUnknown* pSurface)
+{
+    ASSERT(pSurface);
+
+    if (NULL == pSurface)
+    {
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+BOOL CSurfaceQueueDeviceSoftware::ValidateREFIID(REFIID id)
+{
+    return (id == __uuidof(ISoftwareSurface));
+}
+
+BOOL CSurfaceQueueDeviceSoftware::IsThreadSafe()
+{
+    // Surfaces are plain allocations; the handle table has its own lock
+    return TRUE;
+}
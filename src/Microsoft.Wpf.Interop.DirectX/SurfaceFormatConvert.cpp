@@ -0,0 +1,700 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#include <new>
+#include <string.h>
+#include <malloc.h>
+#include <intrin.h>
+#include <immintrin.h>
+#include "SurfaceQueueImpl.h"
+#include "SurfaceFormatConvert.h"
+
+//
+// Notes about the kernels:
+//
+// A conversion decodes each source row into 8 bit RGBA, optionally
+// premultiplies or unpremultiplies it, and encodes it into the destination.
+// When neither end is RGBA8 the intermediate row lives in a small buffer that
+// stays in the cache.  Each step is a row kernel; the SIMD kernels handle
+// whole groups of pixels with unaligned loads and stores and leave the rest of
+// the row to the scalar kernel.
+//
+// Unpremultiply has no SIMD kernel: it needs a divide per channel, and the
+// reciprocal table it uses instead is a gather, which doesn't vectorize well
+// before AVX-512.
+//
+
+typedef void (*PFN_CONVERT_ROW)(BYTE* pDst, const BYTE* pSrc, UINT Count);
+
+enum SurfaceConvertLayout
+{
+    SURFACE_LAYOUT_UNKNOWN = 0,
+    SURFACE_LAYOUT_RGBA8,
+    SURFACE_LAYOUT_BGRA8,
+    SURFACE_LAYOUT_BGRX8,
+    SURFACE_LAYOUT_R10G10B10A2,
+    SURFACE_LAYOUT_RGBA16F,
+};
+
+struct SurfaceConvertKernels
+{
+    PFN_CONVERT_ROW     pfnSwizzle;
+    PFN_CONVERT_ROW     pfnSetAlpha;
+    PFN_CONVERT_ROW     pfnR10G10B10A2ToRGBA8;
+    PFN_CONVERT_ROW     pfnRGBA8ToR10G10B10A2;
+    PFN_CONVERT_ROW     pfnRGBA16FToRGBA8;
+    PFN_CONVERT_ROW     pfnRGBA8ToRGBA16F;
+    PFN_CONVERT_ROW     pfnPremultiply;
+    PFN_CONVERT_ROW     pfnUnpremultiply;
+};
+
+static SurfaceConvertKernels    g_Kernels;
+static volatile LONG            g_KernelsSelected = 0;
+
+// (255 << 16) / a, rounded, for unpremultiplying
+static UINT                     g_UnpremultiplyTable[256];
+
+//-----------------------------------------------------------------------------
+// Helper Functions
+//-----------------------------------------------------------------------------
+static SurfaceConvertLayout GetConvertLayout(DXGI_FORMAT Format)
+{
+    switch (Format)
+    {
+        case DXGI_FORMAT_R8G8B8A8_UNORM:
+        case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB:
+            return SURFACE_LAYOUT_RGBA8;
+        case DXGI_FORMAT_B8G8R8A8_UNORM:
+        case DXGI_FORMAT_B8G8R8A8_UNORM_SRGB:
+            return SURFACE_LAYOUT_BGRA8;
+        case DXGI_FORMAT_B8G8R8X8_UNORM:
+        case DXGI_FORMAT_B8G8R8X8_UNORM_SRGB:
+            return SURFACE_LAYOUT_BGRX8;
+        case DXGI_FORMAT_R10G10B10A2_UNORM:
+            return SURFACE_LAYOUT_R10G10B10A2;
+        case DXGI_FORMAT_R16G16B16A16_FLOAT:
+            return SURFACE_LAYOUT_RGBA16F;
+        default:
+            return SURFACE_LAYOUT_UNKNOWN;
+    }
+}
+
+static UINT GetConvertLayoutSize(SurfaceConvertLayout Layout)
+{
+    return Layout == SURFACE_LAYOUT_RGBA16F ? 8 : 4;
+}
+
+static float HalfToFloat(USHORT h)
+{
+    UINT Sign       = (UINT)(h & 0x8000) << 16;
+    UINT Exponent   = (h >> 10) & 0x1F;
+    UINT Mantissa   = h & 0x3FF;
+    UINT Bits;
+
+    if (Exponent == 0)
+    {
+        if (Mantissa == 0)
+        {
+            Bits = Sign;
+        }
+        else
+        {
+            // Denormal; normalize it
+            Exponent = 127 - 15 + 1;
+            while ((Mantissa & 0x400) == 0)
+            {
+                Mantissa <<= 1;
+                Exponent--;
+            }
+            Bits = Sign | (Exponent << 23) | ((Mantissa & 0x3FF) << 13);
+        }
+    }
+    else if (Exponent == 31)
+    {
+        Bits = Sign | 0x7F800000 | (Mantissa << 13);
+    }
+    else
+    {
+        Bits = Sign | ((Exponent + 127 - 15) << 23) | (Mantissa << 13);
+    }
+
+    float f;
+    memcpy(&f, &Bits, sizeof(f));
+    return f;
+}
+
+static USHORT FloatToHalf(float f)
+{
+    UINT Bits;
+    memcpy(&Bits, &f, sizeof(Bits));
+
+    USHORT  Sign        = (USHORT)((Bits >> 16) & 0x8000);
+    INT     Exponent    = (INT)((Bits >> 23) & 0xFF) - 127 + 15;
+    UINT    Mantissa    = Bits & 0x7FFFFF;
+
+    if (Exponent <= 0)
+    {
+        // Values converted from 8 bits are never small enough to need denormals
+        return Sign;
+    }
+    if (Exponent >= 31)
+    {
+        return (USHORT)(Sign | 0x7C00);
+    }
+
+    // Round to nearest; a carry into the exponent is still correct
+    return (USHORT)((Sign | (Exponent << 10) | (Mantissa >> 13)) + ((Mantissa >> 12) & 1));
+}
+
+static BYTE UnitToByte(float f)
+{
+    if (!(f > 0.0f))
+    {
+        return 0;
+    }
+    if (f >= 1.0f)
+    {
+        return 255;
+    }
+    return (BYTE)(f * 255.0f + 0.5f);
+}
+
+//-----------------------------------------------------------------------------
+// Scalar kernels
+//-----------------------------------------------------------------------------
+static void SwizzleScalar(BYTE* pDst, const BYTE* pSrc, UINT Count)
+{
+    for (UINT i = 0; i < Count; i++, pDst += 4, pSrc += 4)
+    {
+        BYTE r = pSrc[0];
+        BYTE b = pSrc[2];
+        pDst[0] = b;
+        pDst[1] = pSrc[1];
+        pDst[2] = r;
+        pDst[3] = pSrc[3];
+    }
+}
+
+static void SetAlphaScalar(BYTE* pDst, const BYTE*, UINT Count)
+{
+    for (UINT i = 0; i < Count; i++)
+    {
+        pDst[i * 4 + 3] = 0xFF;
+    }
+}
+
+static void R10G10B10A2ToRGBA8Scalar(BYTE* pDst, const BYTE* pSrc, UINT Count)
+{
+    for (UINT i = 0; i < Count; i++, pDst += 4, pSrc += 4)
+    {
+        UINT v;
+        memcpy(&v, pSrc, sizeof(v));
+        pDst[0] = (BYTE)((v >> 2) & 0xFF);
+        pDst[1] = (BYTE)((v >> 12) & 0xFF);
+        pDst[2] = (BYTE)((v >> 22) & 0xFF);
+        pDst[3] = (BYTE)((v >> 30) * 0x55);
+    }
+}
+
+static void RGBA8ToR10G10B10A2Scalar(BYTE* pDst, const BYTE* pSrc, UINT Count)
+{
+    for (UINT i = 0; i < Count; i++, pDst += 4, pSrc += 4)
+    {
+        UINT r = ((UINT)pSrc[0] << 2) | (pSrc[0] >> 6);
+        UINT g = ((UINT)pSrc[1] << 2) | (pSrc[1] >> 6);
+        UINT b = ((UINT)pSrc[2] << 2) | (pSrc[2] >> 6);
+        UINT a = pSrc[3] >> 6;
+        UINT v = r | (g << 10) | (b << 20) | (a << 30);
+        memcpy(pDst, &v, sizeof(v));
+    }
+}
+
+static void RGBA16FToRGBA8Scalar(BYTE* pDst, const BYTE* pSrc, UINT Count)
+{
+    for (UINT i = 0; i < Count * 4; i++, pSrc += 2)
+    {
+        USHORT h;
+        memcpy(&h, pSrc, sizeof(h));
+        pDst[i] = UnitToByte(HalfToFloat(h));
+    }
+}
+
+static void RGBA8ToRGBA16FScalar(BYTE* pDst, const BYTE* pSrc, UINT Count)
+{
+    for (UINT i = 0; i < Count * 4; i++, pDst += 2)
+    {
+        USHORT h = FloatToHalf(pSrc[i] * (1.0f / 255.0f));
+        memcpy(pDst, &h, sizeof(h));
+    }
+}
+
+static void PremultiplyScalar(BYTE* pDst, const BYTE* pSrc, UINT Count)
+{
+    for (UINT i = 0; i < Count; i++, pDst += 4, pSrc += 4)
+    {
+        UINT a = pSrc[3];
+        for (UINT c = 0; c < 3; c++)
+        {
+            // x / 255, rounded, without a divide
+            UINT x = pSrc[c] * a + 128;
+            pDst[c] = (BYTE)((x + (x >> 8)) >> 8);
+        }
+        pDst[3] = (BYTE)a;
+    }
+}
+
+static void UnpremultiplyScalar(BYTE* pDst, const BYTE* pSrc, UINT Count)
+{
+    for (UINT i = 0; i < Count; i++, pDst += 4, pSrc += 4)
+    {
+        UINT a          = pSrc[3];
+        UINT Reciprocal = g_UnpremultiplyTable[a];
+        for (UINT c = 0; c < 3; c++)
+        {
+            UINT x = (pSrc[c] * Reciprocal + 0x8000) >> 16;
+            pDst[c] = (BYTE)(x > 255 ? 255 : x);
+        }
+        pDst[3] = (BYTE)a;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// SSE2 kernels
+//-----------------------------------------------------------------------------
+static void SetAlphaSSE2(BYTE* pDst, const BYTE* pSrc, UINT Count)
+{
+    const __m128i   Alpha   = _mm_set1_epi32((int)0xFF000000);
+    UINT            i       = 0;
+
+    for (; i + 4 <= Count; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(pDst + i * 4));
+        _mm_storeu_si128((__m128i*)(pDst + i * 4), _mm_or_si128(v, Alpha));
+    }
+    SetAlphaScalar(pDst + i * 4, pSrc, Count - i);
+}
+
+static void R10G10B10A2ToRGBA8SSE2(BYTE* pDst, const BYTE* pSrc, UINT Count)
+{
+    const __m128i   Mask    = _mm_set1_epi32(0xFF);
+    UINT            i       = 0;
+
+    for (; i + 4 <= Count; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(pSrc + i * 4));
+        __m128i r = _mm_and_si128(_mm_srli_epi32(v, 2), Mask);
+        __m128i g = _mm_and_si128(_mm_srli_epi32(v, 12), Mask);
+        __m128i b = _mm_and_si128(_mm_srli_epi32(v, 22), Mask);
+        __m128i a = _mm_srli_epi32(v, 30);
+
+        // a * 0x55 spreads the 2 bits over the byte
+        a = _mm_or_si128(_mm_or_si128(a, _mm_slli_epi32(a, 2)),
+                         _mm_or_si128(_mm_slli_epi32(a, 4), _mm_slli_epi32(a, 6)));
+
+        __m128i p = _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 8)),
+                                 _mm_or_si128(_mm_slli_epi32(b, 16), _mm_slli_epi32(a, 24)));
+        _mm_storeu_si128((__m128i*)(pDst + i * 4), p);
+    }
+    R10G10B10A2ToRGBA8Scalar(pDst + i * 4, pSrc + i * 4, Count - i);
+}
+
+static void RGBA8ToR10G10B10A2SSE2(BYTE* pDst, const BYTE* pSrc, UINT Count)
+{
+    const __m128i   Mask    = _mm_set1_epi32(0xFF);
+    UINT            i       = 0;
+
+    for (; i + 4 <= Count; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(pSrc + i * 4));
+        __m128i r = _mm_and_si128(v, Mask);
+        __m128i g = _mm_and_si128(_mm_srli_epi32(v, 8), Mask);
+        __m128i b = _mm_and_si128(_mm_srli_epi32(v, 16), Mask);
+        __m128i a = _mm_srli_epi32(v, 30);
+
+        // Replicate the top bits so 0xFF becomes 0x3FF
+        r = _mm_or_si128(_mm_slli_epi32(r, 2), _mm_srli_epi32(r, 6));
+        g = _mm_or_si128(_mm_slli_epi32(g, 2), _mm_srli_epi32(g, 6));
+        b = _mm_or_si128(_mm_slli_epi32(b, 2), _mm_srli_epi32(b, 6));
+
+        __m128i p = _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 10)),
+                                 _mm_or_si128(_mm_slli_epi32(b, 20), _mm_slli_epi32(a, 30)));
+        _mm_storeu_si128((__m128i*)(pDst + i * 4), p);
+    }
+    RGBA8ToR10G10B10A2Scalar(pDst + i * 4, pSrc + i * 4, Count - i);
+}
+
+static __m128i PremultiplyPixelsSSE2(__m128i v, __m128i AlphaLane, __m128i Round)
+{
+    // v holds 2 pixels as 16 bit channels
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+
+    // Multiply alpha by 255 so it comes out unchanged
+    a = _mm_or_si128(_mm_andnot_si128(AlphaLane, a), _mm_and_si128(AlphaLane, _mm_set1_epi16(255)));
+
+    __m128i x = _mm_add_epi16(_mm_mullo_epi16(v, a), Round);
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+static void PremultiplySSE2(BYTE* pDst, const BYTE* pSrc, UINT Count)
+{
+    const __m128i   Zero        = _mm_setzero_si128();
+    const __m128i   Round       = _mm_set1_epi16(128);
+    const __m128i   AlphaLane   = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    UINT            i           = 0;
+
+    for (; i + 4 <= Count; i += 4)
+    {
+        __m128i v  = _mm_loadu_si128((const __m128i*)(pSrc + i * 4));
+        __m128i lo = PremultiplyPixelsSSE2(_mm_unpacklo_epi8(v, Zero), AlphaLane, Round);
+        __m128i hi = PremultiplyPixelsSSE2(_mm_unpackhi_epi8(v, Zero), AlphaLane, Round);
+        _mm_storeu_si128((__m128i*)(pDst + i * 4), _mm_packus_epi16(lo, hi));
+    }
+    PremultiplyScalar(pDst + i * 4, pSrc + i * 4, Count - i);
+}
+
+//-----------------------------------------------------------------------------
+// SSSE3 kernels
+//-----------------------------------------------------------------------------
+static void SwizzleSSSE3(BYTE* pDst, const BYTE* pSrc, UINT Count)
+{
+    const __m128i   Shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    UINT            i       = 0;
+
+    for (; i + 4 <= Count; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(pSrc + i * 4));
+        _mm_storeu_si128((__m128i*)(pDst + i * 4), _mm_shuffle_epi8(v, Shuffle));
+    }
+    SwizzleScalar(pDst + i * 4, pSrc + i * 4, Count - i);
+}
+
+//-----------------------------------------------------------------------------
+// F16C kernels (F16C implies AVX and SSE4.1)
+//-----------------------------------------------------------------------------
+static void RGBA16FToRGBA8F16C(BYTE* pDst, const BYTE* pSrc, UINT Count)
+{
+    const __m128    Scale   = _mm_set1_ps(255.0f);
+    const __m128    Zero    = _mm_setzero_ps();
+    const __m128    One     = _mm_set1_ps(1.0f);
+    UINT            i       = 0;
+
+    for (; i + 4 <= Count; i += 4)
+    {
+        __m128i p[4];
+        for (UINT j = 0; j < 4; j++)
+        {
+            __m128 f = _mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)(pSrc + (i + j) * 8)));
+
+            // max/min also turn NaN into 0
+            f    = _mm_min_ps(_mm_max_ps(f, Zero), One);
+            p[j] = _mm_cvtps_epi32(_mm_mul_ps(f, Scale));
+        }
+        __m128i lo = _mm_packs_epi32(p[0], p[1]);
+        __m128i hi = _mm_packs_epi32(p[2], p[3]);
+        _mm_storeu_si128((__m128i*)(pDst + i * 4), _mm_packus_epi16(lo, hi));
+    }
+    RGBA16FToRGBA8Scalar(pDst + i * 4, pSrc + i * 8, Count - i);
+}
+
+static void RGBA8ToRGBA16FF16C(BYTE* pDst, const BYTE* pSrc, UINT Count)
+{
+    const __m256    Scale   = _mm256_set1_ps(1.0f / 255.0f);
+    UINT            i       = 0;
+
+    for (; i + 2 <= Count; i += 2)
+    {
+        __m128i v = _mm_loadl_epi64((const __m128i*)(pSrc + i * 4));
+        __m128i lo = _mm_cvtepu8_epi32(v);
+        __m128i hi = _mm_cvtepu8_epi32(_mm_srli_si128(v, 4));
+        __m256  f  = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_insertf128_si256(_mm256_castsi128_si256(lo), hi, 1)), Scale);
+        _mm_storeu_si128((__m128i*)(pDst + i * 8), _mm256_cvtps_ph(f, 0));
+    }
+    RGBA8ToRGBA16FScalar(pDst + i * 8, pSrc + i * 4, Count - i);
+}
+
+//-----------------------------------------------------------------------------
+// AVX2 kernels
+//-----------------------------------------------------------------------------
+static void SwizzleAVX2(BYTE* pDst, const BYTE* pSrc, UINT Count)
+{
+    const __m256i   Shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                               2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    UINT            i       = 0;
+
+    for (; i + 8 <= Count; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(pSrc + i * 4));
+        _mm256_storeu_si256((__m256i*)(pDst + i * 4), _mm256_shuffle_epi8(v, Shuffle));
+    }
+    SwizzleSSSE3(pDst + i * 4, pSrc + i * 4, Count - i);
+}
+
+static void PremultiplyAVX2(BYTE* pDst, const BYTE* pSrc, UINT Count)
+{
+    // Alpha of each pixel into all 4 of its 16 bit channels
+    const __m256i   AlphaShuffle    = _mm256_setr_epi8(6, -1, 6, -1, 6, -1, 6, -1, 14, -1, 14, -1, 14, -1, 14, -1,
+                                                       6, -1, 6, -1, 6, -1, 6, -1, 14, -1, 14, -1, 14, -1, 14, -1);
+    const __m256i   AlphaLane       = _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0);
+    const __m256i   Round           = _mm256_set1_epi16(128);
+    const __m256i   Zero            = _mm256_setzero_si256();
+    UINT            i               = 0;
+
+    for (; i + 8 <= Count; i += 8)
+    {
+        __m256i v  = _mm256_loadu_si256((const __m256i*)(pSrc + i * 4));
+        __m256i lo = _mm256_unpacklo_epi8(v, Zero);
+        __m256i hi = _mm256_unpackhi_epi8(v, Zero);
+
+        // The alpha lane multiplies by 255 so alpha comes out unchanged
+        __m256i alo = _mm256_max_epu16(_mm256_shuffle_epi8(lo, AlphaShuffle), AlphaLane);
+        __m256i ahi = _mm256_max_epu16(_mm256_shuffle_epi8(hi, AlphaShuffle), AlphaLane);
+
+        __m256i xlo = _mm256_add_epi16(_mm256_mullo_epi16(lo, alo), Round);
+        __m256i xhi = _mm256_add_epi16(_mm256_mullo_epi16(hi, ahi), Round);
+        xlo = _mm256_srli_epi16(_mm256_add_epi16(xlo, _mm256_srli_epi16(xlo, 8)), 8);
+        xhi = _mm256_srli_epi16(_mm256_add_epi16(xhi, _mm256_srli_epi16(xhi, 8)), 8);
+
+        // unpack and pack work within 128 bit lanes, so the order is preserved
+        _mm256_storeu_si256((__m256i*)(pDst + i * 4), _mm256_packus_epi16(xlo, xhi));
+    }
+    PremultiplySSE2(pDst + i * 4, pSrc + i * 4, Count - i);
+}
+
+//-----------------------------------------------------------------------------
+// Kernel selection
+//-----------------------------------------------------------------------------
+// Returns the SURFACE_CONVERT_ISA flags of the instruction sets the CPU and
+// the OS support.
+static DWORD GetSupportedInstructionSets()
+{
+    int     Info[4]     = { 0 };
+    DWORD   Sets        = SURFACE_CONVERT_ISA_SSE2;
+
+    __cpuid(Info, 0);
+    int MaxLeaf = Info[0];
+
+    __cpuid(Info, 1);
+    if (Info[2] & (1 << 9))
+    {
+        Sets |= SURFACE_CONVERT_ISA_SSSE3;
+    }
+
+    // AVX state has to be enabled by the OS, not just supported by the CPU
+    BOOL AVX = (Info[2] & (1 << 27)) && (Info[2] & (1 << 28)) && ((_xgetbv(0) & 6) == 6);
+
+    if (AVX && (Info[2] & (1 << 29)) && (Info[2] & (1 << 19)))
+    {
+        Sets |= SURFACE_CONVERT_ISA_F16C;
+    }
+
+    if (AVX && MaxLeaf >= 7)
+    {
+        __cpuidex(Info, 7, 0);
+        if (Info[1] & (1 << 5))
+        {
+            Sets |= SURFACE_CONVERT_ISA_AVX2;
+        }
+    }
+
+    return Sets;
+}
+
+//-----------------------------------------------------------------------------
+static void SetConvertKernels(DWORD Sets)
+{
+    BOOL    SSE2    = (Sets & SURFACE_CONVERT_ISA_SSE2) != 0;
+    BOOL    SSSE3   = (Sets & SURFACE_CONVERT_ISA_SSSE3) != 0;
+    BOOL    F16C    = (Sets & SURFACE_CONVERT_ISA_F16C) != 0;
+    BOOL    AVX2    = (Sets & SURFACE_CONVERT_ISA_AVX2) != 0;
+
+    SurfaceConvertKernels Kernels;
+    Kernels.pfnSwizzle              = AVX2 ? SwizzleAVX2 : SSSE3 ? SwizzleSSSE3 : SwizzleScalar;
+    Kernels.pfnSetAlpha             = SSE2 ? SetAlphaSSE2 : SetAlphaScalar;
+    Kernels.pfnR10G10B10A2ToRGBA8   = SSE2 ? R10G10B10A2ToRGBA8SSE2 : R10G10B10A2ToRGBA8Scalar;
+    Kernels.pfnRGBA8ToR10G10B10A2   = SSE2 ? RGBA8ToR10G10B10A2SSE2 : RGBA8ToR10G10B10A2Scalar;
+    Kernels.pfnRGBA16FToRGBA8       = F16C ? RGBA16FToRGBA8F16C : RGBA16FToRGBA8Scalar;
+    Kernels.pfnRGBA8ToRGBA16F       = F16C ? RGBA8ToRGBA16FF16C : RGBA8ToRGBA16FScalar;
+    Kernels.pfnPremultiply          = AVX2 ? PremultiplyAVX2 : SSE2 ? PremultiplySSE2 : PremultiplyScalar;
+    Kernels.pfnUnpremultiply        = UnpremultiplyScalar;
+
+    g_Kernels = Kernels;
+}
+
+//-----------------------------------------------------------------------------
+static void SelectConvertKernels()
+{
+    if (g_KernelsSelected)
+    {
+        return;
+    }
+
+    g_UnpremultiplyTable[0] = 0;
+    for (UINT a = 1; a < 256; a++)
+    {
+        g_UnpremultiplyTable[a] = ((255 << 16) + a / 2) / a;
+    }
+
+    // Every thread that races here computes the same values
+    SetConvertKernels(GetSupportedInstructionSets());
+    MemoryBarrier();
+    g_KernelsSelected = 1;
+}
+
+//-----------------------------------------------------------------------------
+DWORD SetSurfaceConvertInstructionSets(DWORD Sets)
+{
+    SelectConvertKernels();
+
+    Sets &= GetSupportedInstructionSets();
+    SetConvertKernels(Sets);
+    return Sets;
+}
+
+//-----------------------------------------------------------------------------
+// ConvertSurfaceFormat
+//-----------------------------------------------------------------------------
+BOOL IsSurfaceFormatConvertible(DXGI_FORMAT DstFormat, DXGI_FORMAT SrcFormat)
+{
+    return GetConvertLayout(DstFormat) != SURFACE_LAYOUT_UNKNOWN &&
+           GetConvertLayout(SrcFormat) != SURFACE_LAYOUT_UNKNOWN;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT ConvertSurfaceFormat(
+                void*           pDst,
+                UINT            DstPitch,
+                DXGI_FORMAT     DstFormat,
+                const void*     pSrc,
+                UINT            SrcPitch,
+                DXGI_FORMAT     SrcFormat,
+                UINT            Width,
+                UINT            Height,
+                DWORD           Flags)
+{
+    SurfaceConvertLayout    DstLayout   = GetConvertLayout(DstFormat);
+    SurfaceConvertLayout    SrcLayout   = GetConvertLayout(SrcFormat);
+    BYTE*                   pRow        = NULL;
+    BYTE*                   pDstRow     = (BYTE*)pDst;
+    const BYTE*             pSrcRow     = (const BYTE*)pSrc;
+    HRESULT                 hr          = S_OK;
+
+    if (pDst == NULL || pSrc == NULL || DstLayout == SURFACE_LAYOUT_UNKNOWN || SrcLayout == SURFACE_LAYOUT_UNKNOWN)
+    {
+        return E_INVALIDARG;
+    }
+    if ((Flags & ~(SURFACE_CONVERT_FLAG_PREMULTIPLY | SURFACE_CONVERT_FLAG_UNPREMULTIPLY)) ||
+        (Flags == (SURFACE_CONVERT_FLAG_PREMULTIPLY | SURFACE_CONVERT_FLAG_UNPREMULTIPLY)))
+    {
+        return E_INVALIDARG;
+    }
+
+    SelectConvertKernels();
+
+    // Without alpha there is nothing to multiply by
+    if (SrcLayout == SURFACE_LAYOUT_BGRX8)
+    {
+        Flags = 0;
+    }
+
+    // Same layout: only the alpha step can change the pixels
+    if (DstLayout == SrcLayout && Flags == 0)
+    {
+        UINT RowSize = Width * GetConvertLayoutSize(SrcLayout);
+        for (UINT y = 0; y < Height; y++, pDstRow += DstPitch, pSrcRow += SrcPitch)
+        {
+            memcpy(pDstRow, pSrcRow, RowSize);
+        }
+        return S_OK;
+    }
+
+    // The intermediate row is only needed when neither end is RGBA8 or the
+    // alpha step has to modify it
+    if ((DstLayout != SURFACE_LAYOUT_RGBA8 && SrcLayout != SURFACE_LAYOUT_RGBA8) || Flags)
+    {
+        pRow = (BYTE*)_aligned_malloc((SIZE_T)Width * 4, 32);
+        if (!pRow)
+        {
+            return E_OUTOFMEMORY;
+        }
+    }
+
+    for (UINT y = 0; y < Height; y++, pDstRow += DstPitch, pSrcRow += SrcPitch)
+    {
+        // Decode into RGBA8, straight into the destination if it is RGBA8
+        BYTE*       pRGBA   = pRow ? pRow : pDstRow;
+        const BYTE* pIn     = pRGBA;
+
+        switch (SrcLayout)
+        {
+            case SURFACE_LAYOUT_RGBA8:
+                if (pRow)
+                {
+                    memcpy(pRGBA, pSrcRow, Width * 4);
+                }
+                else
+                {
+                    // Encode straight from the source
+                    pIn = pSrcRow;
+                }
+                break;
+            case SURFACE_LAYOUT_BGRA8:
+                g_Kernels.pfnSwizzle(pRGBA, pSrcRow, Width);
+                break;
+            case SURFACE_LAYOUT_BGRX8:
+                g_Kernels.pfnSwizzle(pRGBA, pSrcRow, Width);
+                g_Kernels.pfnSetAlpha(pRGBA, pRGBA, Width);
+                break;
+            case SURFACE_LAYOUT_R10G10B10A2:
+                g_Kernels.pfnR10G10B10A2ToRGBA8(pRGBA, pSrcRow, Width);
+                break;
+            case SURFACE_LAYOUT_RGBA16F:
+                g_Kernels.pfnRGBA16FToRGBA8(pRGBA, pSrcRow, Width);
+                break;
+            default:
+                ASSERT(FALSE);
+                break;
+        }
+
+        if (Flags & SURFACE_CONVERT_FLAG_PREMULTIPLY)
+        {
+            g_Kernels.pfnPremultiply(pRGBA, pRGBA, Width);
+        }
+        else if (Flags & SURFACE_CONVERT_FLAG_UNPREMULTIPLY)
+        {
+            g_Kernels.pfnUnpremultiply(pRGBA, pRGBA, Width);
+        }
+
+        switch (DstLayout)
+        {
+            case SURFACE_LAYOUT_RGBA8:
+                if (pRow)
+                {
+                    memcpy(pDstRow, pRGBA, Width * 4);
+                }
+                break;
+            case SURFACE_LAYOUT_BGRA8:
+            case SURFACE_LAYOUT_BGRX8:
+                g_Kernels.pfnSwizzle(pDstRow, pIn, Width);
+                break;
+            case SURFACE_LAYOUT_R10G10B10A2:
+                g_Kernels.pfnRGBA8ToR10G10B10A2(pDstRow, pIn, Width);
+                break;
+            case SURFACE_LAYOUT_RGBA16F:
+                g_Kernels.pfnRGBA8ToRGBA16F(pDstRow, pIn, Width);
+                break;
+            default:
+                ASSERT(FALSE);
+                break;
+        }
+    }
+
+    if (pRow)
+    {
+        _aligned_free(pRow);
+    }
+    return hr;
+}
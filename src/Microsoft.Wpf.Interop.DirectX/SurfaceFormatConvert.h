@@ -0,0 +1,69 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#pragma once
+
+#include "surfacequeue.h"
+
+//
+// Pixel format conversion on the CPU.
+//
+// Converts between the formats software surfaces and readbacks use when the
+// two ends of a copy disagree on the layout:
+//
+//      DXGI_FORMAT_B8G8R8A8_UNORM(_SRGB), DXGI_FORMAT_B8G8R8X8_UNORM(_SRGB),
+//      DXGI_FORMAT_R8G8B8A8_UNORM(_SRGB), DXGI_FORMAT_R10G10B10A2_UNORM and
+//      DXGI_FORMAT_R16G16B16A16_FLOAT
+//
+// Every conversion goes through 8 bit RGBA, so 10 bit and FP16 sources lose
+// precision even when the destination could hold it.  Channels are converted
+// as they are: sRGB variants are treated like the UNORM formats and FP16 values
+// are clamped to [0, 1] without a gamma curve.
+//
+// The row kernels are picked once per process from the instruction sets the
+// CPU supports (AVX2, F16C, SSSE3, then SSE2 or scalar code).
+//
+
+// Multiplies the color channels by alpha after the conversion
+#define SURFACE_CONVERT_FLAG_PREMULTIPLY        (0x1)
+// Divides the color channels by alpha after the conversion
+#define SURFACE_CONVERT_FLAG_UNPREMULTIPLY      (0x2)
+
+// Instruction sets the row kernels can use
+#define SURFACE_CONVERT_ISA_SSE2                (0x1)
+#define SURFACE_CONVERT_ISA_SSSE3               (0x2)
+#define SURFACE_CONVERT_ISA_F16C                (0x4)
+#define SURFACE_CONVERT_ISA_AVX2                (0x8)
+#define SURFACE_CONVERT_ISA_ALL                 (0xF)
+
+//
+// Limits the row kernels to the instruction sets in Sets and returns the ones
+// the CPU supports among them, which are the ones used from then on.  0 picks
+// the scalar kernels everywhere and SURFACE_CONVERT_ISA_ALL restores the
+// default.  This is for tests and benchmarks that compare the kernels; it must
+// not be called while conversions are running.
+//
+DWORD SetSurfaceConvertInstructionSets(DWORD Sets);
+
+// Returns TRUE if ConvertSurfaceFormat supports the pair of formats.
+BOOL IsSurfaceFormatConvertible(DXGI_FORMAT DstFormat, DXGI_FORMAT SrcFormat);
+
+//
+// Converts Width x Height pixels from pSrc to pDst.  Rows are SrcPitch and
+// DstPitch bytes apart; neither the images nor the pitches have to be
+// aligned.  The images must not overlap.
+//
+HRESULT ConvertSurfaceFormat(
+                void*           pDst,
+                UINT            DstPitch,
+                DXGI_FORMAT     DstFormat,
+                const void*     pSrc,
+                UINT            SrcPitch,
+                DXGI_FORMAT     SrcFormat,
+                UINT            Width,
+                UINT            Height,
+                DWORD           Flags);
@@ -26,10 +26,12 @@
 //         ONLY between Enqueue and Flush and do not need to be protected in CSurfaceQueue.
 //      2) A Semaphore to control waiting when the Queue is empty.  The semaphore is
 //         released on Enqueue/Flush and is waited on in Dequeue.  
-//      3) A SlimReaderWriter lock protecting the CSurfaceQueue object.  All of the
-//         high frequency calls grab shared locks (Enqueue/Flush/Dequeue) to allow
-//         parallel access to the queue.  The low frequency state changes
-//         (i.e. OpenProducer) will grab an exclusive lock.
+//      3) An epoch protecting the CSurfaceQueue object.  All of the high frequency
+//         calls (Enqueue/Flush/Dequeue) only announce the current epoch in the
+//         reader slot for their side of the queue.  The low frequency state changes
+//         (i.e. OpenProducer) are serialized by a critical section; they publish
+//         the new state and wait for the readers of the old state to drain before
+//         releasing anything.
 //      4) A critical section protecting the underlying circular queue.  Both Enqueue
 //         and dequeue will contend for this lock but the duration the lock is held
 //         is kept to a minimum.
@@ -43,6 +45,7 @@ HRESULT CreateDeviceWrapper(IUnknown* pUnknown, ISurfaceQueueDevice** ppDevice)
     IDirect3DDevice9Ex* pD3D9Device;
     ID3D10Device*       pD3D10Device;
     ID3D11Device*       pD3D11Device;
+    ISoftwareSurfaceDevice* pSoftwareDevice;
 
     HRESULT hr = S_OK;
     *ppDevice  = NULL;
@@ -62,6 +65,11 @@ HRESULT CreateDeviceWrapper(IUnknown* pUnknown, ISurfaceQueueDevice** ppDevice)
         pD3D11Device->Release();
         *ppDevice = new QUEUE_NOTHROW_SPECIFIER CSurfaceQueueDeviceD3D11(pD3D11Device);
     }
+    else if (SUCCEEDED(pUnknown->QueryInterface(__uuidof(ISoftwareSurfaceDevice), (void**)&pSoftwareDevice)))
+    {
+        pSoftwareDevice->Release();
+        *ppDevice = new QUEUE_NOTHROW_SPECIFIER CSurfaceQueueDeviceSoftware(pSoftwareDevice);
+    }
     else
     {
         hr = E_INVALIDARG;    
@@ -75,6 +83,421 @@ HRESULT CreateDeviceWrapper(IUnknown* pUnknown, ISurfaceQueueDevice** ppDevice)
     return hr; 
 };
 
+//-----------------------------------------------------------------------------
+// Resource creation.  Creating big textures can take a while, so devices that
+// can be called from several threads create them on the thread pool as well as
+// on the calling thread.  Each thread takes the next index until all are done
+// or one fails.
+//-----------------------------------------------------------------------------
+struct CreateResourcesJob
+{
+    PFN_CREATE_RESOURCE     pfnCreate;
+    void*                   pContext;
+    UINT                    Count;
+    volatile LONG           NextIndex;
+    volatile LONG           Result;
+};
+
+static void RunCreateResourcesJob(CreateResourcesJob* pJob)
+{
+    for (;;)
+    {
+        // No new resources after the first failure
+        if (FAILED(pJob->Result))
+        {
+            return;
+        }
+
+        UINT Index = (UINT)InterlockedIncrement(&pJob->NextIndex) - 1;
+        if (Index >= pJob->Count)
+        {
+            return;
+        }
+
+        HRESULT hr = pJob->pfnCreate(Index, pJob->pContext);
+        if (FAILED(hr))
+        {
+            InterlockedCompareExchange(&pJob->Result, hr, S_OK);
+        }
+    }
+}
+
+static void CALLBACK CreateResourcesCallback(PTP_CALLBACK_INSTANCE, PVOID pContext, PTP_WORK)
+{
+    RunCreateResourcesJob((CreateResourcesJob*)pContext);
+}
+
+HRESULT CreateResources(ISurfaceQueueDevice* pDevice, UINT Count, PFN_CREATE_RESOURCE pfnCreate, void* pContext)
+{
+    ASSERT(pDevice && pfnCreate);
+
+    CreateResourcesJob  Job;
+    PTP_WORK            pWork = NULL;
+
+    Job.pfnCreate   = pfnCreate;
+    Job.pContext    = pContext;
+    Job.Count       = Count;
+    Job.NextIndex   = 0;
+    Job.Result      = S_OK;
+
+    if (Count > 1 && pDevice->IsThreadSafe())
+    {
+        SYSTEM_INFO Info;
+        GetSystemInfo(&Info);
+
+        // The calling thread is one of the workers
+        UINT nWorkers = min(Count, (UINT)Info.dwNumberOfProcessors) - 1;
+
+        // Without a work object everything is created on this thread
+        if (nWorkers)
+        {
+            pWork = CreateThreadpoolWork(&CreateResourcesCallback, &Job, NULL);
+        }
+        if (pWork)
+        {
+            for (UINT i = 0; i < nWorkers; i++)
+            {
+                SubmitThreadpoolWork(pWork);
+            }
+        }
+    }
+
+    RunCreateResourcesJob(&Job);
+
+    if (pWork)
+    {
+        WaitForThreadpoolWorkCallbacks(pWork, FALSE);
+        CloseThreadpoolWork(pWork);
+    }
+
+    return Job.Result;
+}
+
+//-----------------------------------------------------------------------------
+static LONGLONG DirtyRectArea(const RECT& Rect)
+{
+    return (LONGLONG)(Rect.right - Rect.left) * (Rect.bottom - Rect.top);
+}
+
+//-----------------------------------------------------------------------------
+static RECT DirtyRectUnion(const RECT& a, const RECT& b)
+{
+    RECT Union;
+    Union.left      = min(a.left,   b.left);
+    Union.top       = min(a.top,    b.top);
+    Union.right     = max(a.right,  b.right);
+    Union.bottom    = max(a.bottom, b.bottom);
+    return Union;
+}
+
+//-----------------------------------------------------------------------------
+// Adds a (clipped, non empty) rectangle to a dirty list of at most
+// SURFACE_QUEUE_MAX_DIRTY_RECTS rectangles.
+//-----------------------------------------------------------------------------
+static void AddDirtyRect(RECT* pRects, UINT* pNumRects, RECT Rect)
+{
+    // Absorb every rectangle the new one overlaps.  The union can overlap
+    // rectangles the original didn't, so start over after each merge.
+    for (UINT i = 0; i < *pNumRects; )
+    {
+        if (pRects[i].left < Rect.right && Rect.left < pRects[i].right &&
+            pRects[i].top < Rect.bottom && Rect.top < pRects[i].bottom)
+        {
+            Rect = DirtyRectUnion(pRects[i], Rect);
+            pRects[i] = pRects[--(*pNumRects)];
+            i = 0;
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    if (*pNumRects < SURFACE_QUEUE_MAX_DIRTY_RECTS)
+    {
+        pRects[(*pNumRects)++] = Rect;
+        return;
+    }
+
+    // The list is full; merge into the rectangle that grows the least
+    UINT        iBest       = 0;
+    LONGLONG    BestGrowth  = 0;
+    for (UINT i = 0; i < *pNumRects; i++)
+    {
+        LONGLONG Growth = DirtyRectArea(DirtyRectUnion(pRects[i], Rect)) - DirtyRectArea(pRects[i]);
+        if (i == 0 || Growth < BestGrowth)
+        {
+            iBest       = i;
+            BestGrowth  = Growth;
+        }
+    }
+
+    // The grown rectangle is added again since it may overlap others now.
+    // That can't recurse further, because removing it frees a slot.
+    Rect = DirtyRectUnion(pRects[iBest], Rect);
+    pRects[iBest] = pRects[--(*pNumRects)];
+    AddDirtyRect(pRects, pNumRects, Rect);
+}
+
+//-----------------------------------------------------------------------------
+void BuildDirtyRectList(const RECT* pDirtyRects, UINT NumDirtyRects, UINT Width, UINT Height,
+                        RECT* pRects, UINT* pNumRects)
+{
+    *pNumRects = 0;
+
+    if (NumDirtyRects == 0)
+    {
+        SetRect(&pRects[0], 0, 0, Width, Height);
+        *pNumRects = 1;
+    }
+    for (UINT i = 0; i < NumDirtyRects; i++)
+    {
+        RECT Rect;
+        Rect.left   = max(pDirtyRects[i].left,   0L);
+        Rect.top    = max(pDirtyRects[i].top,    0L);
+        Rect.right  = min(pDirtyRects[i].right,  (LONG)Width);
+        Rect.bottom = min(pDirtyRects[i].bottom, (LONG)Height);
+
+        if (Rect.left < Rect.right && Rect.top < Rect.bottom)
+        {
+            AddDirtyRect(pRects, pNumRects, Rect);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+void CopyDirtyRectList(const RECT* pRects, UINT NumRects, RECT* pDirtyRects, UINT* pNumDirtyRects)
+{
+    if (NumRects <= *pNumDirtyRects)
+    {
+        memcpy(pDirtyRects, pRects, sizeof(RECT) * NumRects);
+        *pNumDirtyRects = NumRects;
+    }
+    else
+    {
+        // Not enough room; hand out the union instead
+        pDirtyRects[0] = pRects[0];
+        for (UINT i = 1; i < NumRects; i++)
+        {
+            pDirtyRects[0] = DirtyRectUnion(pDirtyRects[0], pRects[i]);
+        }
+        *pNumDirtyRects = 1;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// CQueueEpoch Implementation
+//-----------------------------------------------------------------------------
+CQueueEpoch::CQueueEpoch() :
+    m_GlobalEpoch(1)
+{
+    // A reader epoch of 0 means the side is not inside the queue.
+    ZeroMemory(m_Readers, sizeof(m_Readers));
+}
+
+//-----------------------------------------------------------------------------
+void CQueueEpoch::Enter(QueueEpochSide side)
+{
+    //
+    // The interlocked exchange is a full barrier.  The announcement must be
+    // visible before any of the queue state is read; otherwise Synchronize 
+    // could miss a reader that still sees the old state.
+    //
+    InterlockedExchange(&m_Readers[side].Epoch, m_GlobalEpoch);
+}
+
+//-----------------------------------------------------------------------------
+void CQueueEpoch::Leave(QueueEpochSide side)
+{
+    // Volatile stores have release semantics, so all of the reads made inside
+    // the epoch complete before the slot is cleared.
+    m_Readers[side].Epoch = 0;
+}
+
+//-----------------------------------------------------------------------------
+BOOL CQueueEpoch::Synchronize()
+{
+    //
+    // Readers that enter after the increment will observe the state that was 
+    // published before this call.  Only readers that announced an older epoch 
+    // need to be waited on.  This should be very rare: the state changes happen 
+    // when the producer or consumer devices change.
+    //
+    LONG Target  = InterlockedIncrement(&m_GlobalEpoch);
+    BOOL Waited  = FALSE;
+
+    for (UINT i = 0; i < QUEUE_EPOCH_NUM_SIDES; i++)
+    {
+        UINT Spins = 0;
+        for (;;)
+        {
+            LONG Epoch = m_Readers[i].Epoch;
+            if (Epoch == 0 || Epoch >= Target)
+            {
+                break;
+            }
+
+            // Readers can be blocked in a Dequeue.  Spin briefly and then
+            // get out of the way.
+            Waited = TRUE;
+            if (++Spins < 64)
+            {
+                YieldProcessor();
+            }
+            else
+            {
+                Sleep(1);
+            }
+        }
+    }
+
+    return Waited;
+}
+
+//-----------------------------------------------------------------------------
+// CQueueLockProfile Implementation
+//-----------------------------------------------------------------------------
+CQueueLockProfile::CQueueLockProfile() :
+    m_Enabled(0)
+{
+    LARGE_INTEGER Frequency;
+    QueryPerformanceFrequency(&Frequency);
+    m_Frequency = Frequency.QuadPart;
+
+    ZeroMemory((void*)m_Locks, sizeof(m_Locks));
+}
+
+//-----------------------------------------------------------------------------
+void CQueueLockProfile::EnterProfiled(SURFACE_QUEUE_LOCK Lock, CRITICAL_SECTION* pLock)
+{
+    if (TryEnterCriticalSection(pLock))
+    {
+        Record(Lock, TRUE, FALSE, 0);
+        return;
+    }
+
+    LARGE_INTEGER Start;
+    LARGE_INTEGER End;
+
+    QueryPerformanceCounter(&Start);
+    EnterCriticalSection(pLock);
+    QueryPerformanceCounter(&End);
+
+    // Recorded while holding the lock, which doesn't matter for the counters
+    Record(Lock, TRUE, TRUE, End.QuadPart - Start.QuadPart);
+}
+
+//-----------------------------------------------------------------------------
+DWORD CQueueLockProfile::WaitProfiled(SURFACE_QUEUE_LOCK Lock, HANDLE hObject, DWORD dwTimeout)
+{
+    DWORD dwWait = WaitForSingleObject(hObject, 0);
+
+    // Polls that find the object empty did not wait for it
+    if (dwWait != WAIT_TIMEOUT || dwTimeout == 0)
+    {
+        Record(Lock, dwWait == WAIT_OBJECT_0, FALSE, 0);
+        return dwWait;
+    }
+
+    LARGE_INTEGER Start;
+    LARGE_INTEGER End;
+
+    QueryPerformanceCounter(&Start);
+    dwWait = WaitForSingleObject(hObject, dwTimeout);
+    QueryPerformanceCounter(&End);
+
+    Record(Lock, dwWait == WAIT_OBJECT_0, TRUE, End.QuadPart - Start.QuadPart);
+    return dwWait;
+}
+
+//-----------------------------------------------------------------------------
+LONGLONG CQueueLockProfile::BeginWait() const
+{
+    if (!m_Enabled)
+    {
+        return 0;
+    }
+
+    LARGE_INTEGER Start;
+    QueryPerformanceCounter(&Start);
+    return Start.QuadPart;
+}
+
+//-----------------------------------------------------------------------------
+void CQueueLockProfile::EndWait(SURFACE_QUEUE_LOCK Lock, LONGLONG Start, BOOL Contended)
+{
+    ASSERT(Start);
+
+    LARGE_INTEGER End;
+    QueryPerformanceCounter(&End);
+
+    Record(Lock, TRUE, Contended, Contended ? End.QuadPart - Start : 0);
+}
+
+//-----------------------------------------------------------------------------
+void CQueueLockProfile::Record(SURFACE_QUEUE_LOCK Lock, BOOL Acquired, BOOL Contended, LONGLONG WaitTicks)
+{
+    ASSERT(Lock < SURFACE_QUEUE_NUM_LOCKS);
+
+    LockCounters& Counters = m_Locks[Lock];
+
+    if (Acquired)
+    {
+        InterlockedIncrement64(&Counters.Acquisitions);
+    }
+    if (Contended)
+    {
+        LONGLONG    Microseconds    = WaitTicks * 1000000 / m_Frequency;
+        UINT        Bucket          = 0;
+
+        for (LONGLONG Remaining = Microseconds; Remaining && Bucket < SURFACE_QUEUE_WAIT_HISTOGRAM_BUCKETS - 1; Remaining >>= 1)
+        {
+            Bucket++;
+        }
+
+        InterlockedIncrement64(&Counters.Contentions);
+        InterlockedExchangeAdd64(&Counters.TotalWaitMicroseconds, Microseconds);
+        InterlockedIncrement64(&Counters.WaitHistogram[Bucket]);
+    }
+}
+
+//-----------------------------------------------------------------------------
+void CQueueLockProfile::GetStats(SURFACE_QUEUE_STATS* pStats) const
+{
+    pStats->LockProfiling = IsEnabled();
+
+    for (UINT i = 0; i < SURFACE_QUEUE_NUM_LOCKS; i++)
+    {
+        const LockCounters&         Counters    = m_Locks[i];
+        SURFACE_QUEUE_LOCK_STATS&   Stats       = pStats->Locks[i];
+
+        Stats.Acquisitions          = (ULONGLONG)Counters.Acquisitions;
+        Stats.Contentions           = (ULONGLONG)Counters.Contentions;
+        Stats.TotalWaitMicroseconds = (ULONGLONG)Counters.TotalWaitMicroseconds;
+        for (UINT j = 0; j < SURFACE_QUEUE_WAIT_HISTOGRAM_BUCKETS; j++)
+        {
+            Stats.WaitHistogram[j] = (ULONGLONG)Counters.WaitHistogram[j];
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+void CQueueLockProfile::Reset()
+{
+    for (UINT i = 0; i < SURFACE_QUEUE_NUM_LOCKS; i++)
+    {
+        LockCounters& Counters = m_Locks[i];
+
+        InterlockedExchange64(&Counters.Acquisitions, 0);
+        InterlockedExchange64(&Counters.Contentions, 0);
+        InterlockedExchange64(&Counters.TotalWaitMicroseconds, 0);
+        for (UINT j = 0; j < SURFACE_QUEUE_WAIT_HISTOGRAM_BUCKETS; j++)
+        {
+            InterlockedExchange64(&Counters.WaitHistogram[j], 0);
+        }
+    }
+}
+
 //-----------------------------------------------------------------------------
 // SharedSurfaceObject Implementation
 //-----------------------------------------------------------------------------
@@ -137,12 +560,13 @@ HRESULT WINAPI CreateSurfaceQueue(
         return E_INVALIDARG;
     }
 
-    if (pDesc->Flags != 0 && pDesc->Flags != SURFACE_QUEUE_FLAG_SINGLE_THREADED)
+    if (pDesc->Flags & ~SURFACE_QUEUE_VALID_CREATE_FLAGS)
     {
         return E_INVALIDARG;
     }
 
-    CSurfaceQueue* pSurfaceQueue = new QUEUE_NOTHROW_SPECIFIER CSurfaceQueue();
+    LONGLONG        TraceStart      = SurfaceQueueTraceBegin();
+    CSurfaceQueue*  pSurfaceQueue   = new QUEUE_NOTHROW_SPECIFIER CSurfaceQueue();
     if (!pSurfaceQueue)
     {
         hr = E_OUTOFMEMORY;
@@ -158,6 +582,13 @@ HRESULT WINAPI CreateSurfaceQueue(
     hr = pSurfaceQueue->QueryInterface(__uuidof(ISurfaceQueue), (void**)ppQueue);
 
 end:
+    if (TraceStart)
+    {
+        SurfaceQueueTraceCall(SURFACE_QUEUE_TRACE_CREATE, pSurfaceQueue ? pSurfaceQueue->GetTraceId() : 0,
+                              TraceStart, hr, pDesc->Flags, SURFACE_QUEUE_TRACE_NO_SURFACE, 0,
+                              pDesc, sizeof(*pDesc));
+    }
+
     if (FAILED(hr))
     {
         if (pSurfaceQueue)
@@ -259,7 +690,57 @@ HRESULT CSurfaceConsumer::Dequeue(
 
     if (m_IsMultithreaded)
     {
-        EnterCriticalSection(&m_lock);
+        m_pQueue->GetLockProfile()->Enter(SURFACE_QUEUE_LOCK_CONSUMER, &m_lock);
+    }
+
+    // Validate that REFIID is correct for a surface from this device
+    if (!m_pDevice->ValidateREFIID(id))
+    {
+        hr = E_INVALIDARG;
+        goto end;
+    }
+    if (ppSurface == NULL)
+    {
+        hr = E_INVALIDARG;
+        goto end;
+    }
+
+    *ppSurface = NULL;
+    
+    // Forward to queue
+    hr = m_pQueue->Dequeue(id, ppSurface, pBuffer, BufferSize, NULL, NULL, dwTimeout);
+
+end:
+    if (m_IsMultithreaded)
+    {
+        LeaveCriticalSection(&m_lock);
+    }
+    return hr;
+}
+
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceConsumer::DequeueDirty(
+                        REFIID id,
+                        IUnknown** ppSurface,
+                        void*  pBuffer,
+                        UINT*  BufferSize,
+                        RECT*  pDirtyRects,
+                        UINT*  pNumDirtyRects,
+                        DWORD  dwTimeout)
+{
+    ASSERT(m_pQueue);
+
+	if (NULL == m_pQueue)
+	{
+		return E_FAIL;
+	}
+
+    HRESULT hr = S_OK;
+
+    if (m_IsMultithreaded)
+    {
+        m_pQueue->GetLockProfile()->Enter(SURFACE_QUEUE_LOCK_CONSUMER, &m_lock);
     }
 
     // Validate that REFIID is correct for a surface from this device
@@ -273,11 +754,16 @@ HRESULT CSurfaceConsumer::Dequeue(
         hr = E_INVALIDARG;
         goto end;
     }
+    if (pDirtyRects == NULL || pNumDirtyRects == NULL || *pNumDirtyRects == 0)
+    {
+        hr = E_INVALIDARG;
+        goto end;
+    }
 
     *ppSurface = NULL;
     
     // Forward to queue
-    hr = m_pQueue->Dequeue(ppSurface, pBuffer, BufferSize, dwTimeout);
+    hr = m_pQueue->Dequeue(id, ppSurface, pBuffer, BufferSize, pDirtyRects, pNumDirtyRects, dwTimeout);
 
 end:
     if (m_IsMultithreaded)
@@ -287,6 +773,82 @@ end:
     return hr;
 }
 
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceConsumer::SetSurfaceData(
+                        IUnknown* pSurface,
+                        REFGUID Key,
+                        IUnknown* pData)
+{
+    ASSERT(m_pQueue);
+
+    if (NULL == m_pQueue)
+    {
+        return E_FAIL;
+    }
+    if (pSurface == NULL)
+    {
+        return E_INVALIDARG;
+    }
+
+    HRESULT hr;
+    HANDLE  hSharedHandle;
+
+    if (m_IsMultithreaded)
+    {
+        m_pQueue->GetLockProfile()->Enter(SURFACE_QUEUE_LOCK_CONSUMER, &m_lock);
+    }
+
+    if (SUCCEEDED(hr = m_pDevice->GetSharedHandle(pSurface, &hSharedHandle)))
+    {
+        hr = m_pQueue->SetSurfaceData(hSharedHandle, Key, pData);
+    }
+
+    if (m_IsMultithreaded)
+    {
+        LeaveCriticalSection(&m_lock);
+    }
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceConsumer::GetSurfaceData(
+                        IUnknown* pSurface,
+                        REFGUID Key,
+                        IUnknown** ppData)
+{
+    ASSERT(m_pQueue);
+
+    if (NULL == m_pQueue)
+    {
+        return E_FAIL;
+    }
+    if (pSurface == NULL || ppData == NULL)
+    {
+        return E_INVALIDARG;
+    }
+
+    *ppData = NULL;
+
+    HRESULT hr;
+    HANDLE  hSharedHandle;
+
+    if (m_IsMultithreaded)
+    {
+        m_pQueue->GetLockProfile()->Enter(SURFACE_QUEUE_LOCK_CONSUMER, &m_lock);
+    }
+
+    if (SUCCEEDED(hr = m_pDevice->GetSharedHandle(pSurface, &hSharedHandle)))
+    {
+        hr = m_pQueue->GetSurfaceData(hSharedHandle, Key, ppData);
+    }
+
+    if (m_IsMultithreaded)
+    {
+        LeaveCriticalSection(&m_lock);
+    }
+    return hr;
+}
+
 
 //-----------------------------------------------------------------------------
 // CSurfaceProducer implementation
@@ -298,10 +860,12 @@ CSurfaceProducer:: CSurfaceProducer(BOOL IsMultithreaded) :
     m_IsMultithreaded(IsMultithreaded),
     m_pQueue(NULL),
     m_pDevice(NULL),
+    m_pDeviceKey(NULL),
     m_nStagingResources(0),
     m_pStagingResources(NULL),
     m_uiStagingResourceHeight(0),
     m_uiStagingResourceWidth(0),
+    m_StagingFormat(DXGI_FORMAT_UNKNOWN),
     m_iCurrentResource(0)
 {
     if (m_IsMultithreaded)
@@ -369,6 +933,14 @@ HRESULT CSurfaceProducer::Initialize(IUnknown* pDevice, UINT uNumSurfaces, SURFA
         goto end;
     }
 
+    // The wrapper holds the device; the key is only compared
+    hr = pDevice->QueryInterface(__uuidof(IUnknown), (void**)&m_pDeviceKey);
+    if (FAILED(hr))
+    {
+        goto end;
+    }
+    m_pDeviceKey->Release();
+
     m_pStagingResources = new QUEUE_NOTHROW_SPECIFIER IUnknown*[uNumSurfaces];
     if (!m_pStagingResources)
     {
@@ -382,14 +954,18 @@ HRESULT CSurfaceProducer::Initialize(IUnknown* pDevice, UINT uNumSurfaces, SURFA
     m_uiStagingResourceWidth    = min(queueDesc->Width, SHARED_SURFACE_COPY_SIZE);
     m_uiStagingResourceHeight   = min(queueDesc->Height, SHARED_SURFACE_COPY_SIZE);
 
+    if (FAILED(hr = m_StagingCharge.Acquire(pDevice, SURFACE_QUEUE_BUDGET_STAGING, queueDesc->Format,
+                                            m_uiStagingResourceWidth, m_uiStagingResourceHeight,
+                                            m_nStagingResources)))
+    {
+        goto end;
+    }
+
     // Create the staging resources
-    for (UINT i = 0; i < m_nStagingResources; i++)
+    m_StagingFormat = queueDesc->Format;
+    if (FAILED(hr = CreateResources(m_pDevice, m_nStagingResources, &CreateStagingResource, this)))
     {
-        if (FAILED(hr = m_pDevice->CreateCopyResource(queueDesc->Format, m_uiStagingResourceWidth,
-                                                      m_uiStagingResourceHeight, &(m_pStagingResources[i]))))
-        {
-            goto end;
-        }
+        goto end;
     }
 
 end:
@@ -408,6 +984,7 @@ end:
             m_pStagingResources = NULL;
             m_nStagingResources = 0;
         }
+        m_StagingCharge.Release();
 
         if (m_pDevice)
         {
@@ -419,12 +996,36 @@ end:
     return hr;
 }
 
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceProducer::CreateStagingResource(UINT Index, void* pContext)
+{
+    CSurfaceProducer* pProducer = (CSurfaceProducer*)pContext;
+
+    return pProducer->m_pDevice->CreateCopyResource(pProducer->m_StagingFormat,
+                                                    pProducer->m_uiStagingResourceWidth,
+                                                    pProducer->m_uiStagingResourceHeight,
+                                                    &(pProducer->m_pStagingResources[Index]));
+}
+
 //-----------------------------------------------------------------------------
 HRESULT CSurfaceProducer::Enqueue(
                         IUnknown*   pSurface,
                         void*       pBuffer,
                         UINT        BufferSize,
                         DWORD       Flags )
+{
+    // The whole surface is dirty
+    return EnqueueDirty(pSurface, pBuffer, BufferSize, NULL, 0, Flags);
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceProducer::EnqueueDirty(
+                        IUnknown*   pSurface,
+                        void*       pBuffer,
+                        UINT        BufferSize,
+                        const RECT* pDirtyRects,
+                        UINT        NumDirtyRects,
+                        DWORD       Flags )
 {
     //
     // This function essentially does simple error checking and then
@@ -442,7 +1043,7 @@ HRESULT CSurfaceProducer::Enqueue(
 
     if (m_IsMultithreaded)
     {
-        EnterCriticalSection(&m_lock);
+        m_pQueue->GetLockProfile()->Enter(SURFACE_QUEUE_LOCK_PRODUCER, &m_lock);
     }
 
     HRESULT hr;
@@ -471,7 +1072,9 @@ HRESULT CSurfaceProducer::Enqueue(
                             Flags, 
                             m_pStagingResources[m_iCurrentResource],
                             m_uiStagingResourceWidth,
-                            m_uiStagingResourceHeight
+                            m_uiStagingResourceHeight,
+                            pDirtyRects,
+                            NumDirtyRects
                           );
     
     if (hr == DXGI_ERROR_WAS_STILL_DRAWING)
@@ -511,7 +1114,7 @@ HRESULT CSurfaceProducer::Flush(
 
     if (m_IsMultithreaded)
     {
-        EnterCriticalSection(&m_lock);
+        m_pQueue->GetLockProfile()->Enter(SURFACE_QUEUE_LOCK_PRODUCER, &m_lock);
     }
 
     HRESULT hr;
@@ -559,21 +1162,52 @@ CSurfaceQueue:: CSurfaceQueue()
         m_QueueHead(0),
         m_QueueSize(0),
         m_ConsumerSurfaces(NULL),
+        m_pConsumerDeviceKey(NULL),
         m_CreatedSurfaces(NULL),
         m_iEnqueuedHead(0),
-        m_nEnqueuedSurfaces(0)
+        m_nEnqueuedSurfaces(0),
+        m_TraceId(0),
+        m_StagingBytes(0),
+        m_SameDeviceEnqueues(0),
+        m_Registered(FALSE),
+        m_pNextRegistered(NULL),
+        m_pPrevRegistered(NULL)
 {
+    ZeroMemory((void*)m_pNotify, sizeof(m_pNotify));
+    ZeroMemory((void*)m_WaitStart, sizeof(m_WaitStart));
+    ZeroMemory((void*)m_WaitKind, sizeof(m_WaitKind));
+    ZeroMemory(m_StallReported, sizeof(m_StallReported));
 }
 
 //-----------------------------------------------------------------------------
 CSurfaceQueue::~CSurfaceQueue()
 {
+    LONGLONG TraceStart = SurfaceQueueTraceBegin();
+
     Destroy();
+
+    if (TraceStart)
+    {
+        SurfaceQueueTraceCall(SURFACE_QUEUE_TRACE_DESTROY, m_TraceId, TraceStart, S_OK, 0,
+                              SURFACE_QUEUE_TRACE_NO_SURFACE, 0, NULL, 0);
+    }
 }
 
 //-----------------------------------------------------------------------------
 void CSurfaceQueue::Destroy()
 {
+    // Once off the list, the watchdog can't be looking at the queue
+    UnregisterForWatchdog();
+
+    // Release all opened surfaces while the root queue, which keeps them, is
+    // still there
+    if (m_ConsumerSurfaces)
+    {
+        ReleaseConsumerSurfaces();
+        delete[] m_ConsumerSurfaces;
+        m_ConsumerSurfaces = NULL;
+    }
+
     RemoveQueueFromNetwork();
     
     // The ref counting should guarantee that the root queue object
@@ -594,20 +1228,6 @@ void CSurfaceQueue::Destroy()
         m_pCreator = NULL;
     }
 
-    // Release all opened surfaces
-    if (m_ConsumerSurfaces)
-    {
-        for (UINT i = 0; i < m_Desc.NumSurfaces; i++)
-        {
-            if (m_ConsumerSurfaces[i].pSurface)
-            {
-                m_ConsumerSurfaces[i].pSurface->Release();
-            }
-        }
-        delete[] m_ConsumerSurfaces;
-        m_ConsumerSurfaces = NULL;
-    }
-
     // Clean up the allocated meta data buffers
     if (m_SurfaceQueue)
     {
@@ -637,6 +1257,7 @@ void CSurfaceQueue::Destroy()
         delete[] m_CreatedSurfaces;
         m_CreatedSurfaces = NULL;
     }
+    m_SurfaceCharge.Release();
 
     m_pConsumer = NULL;
     m_pProducer = NULL;
@@ -649,6 +1270,7 @@ void CSurfaceQueue::Destroy()
             m_hSemaphore = NULL;
         }
         DeleteCriticalSection(&m_QueueLock);
+        DeleteCriticalSection(&m_StateLock);
     }
     else
     {
@@ -727,6 +1349,21 @@ SharedSurfaceObject* CSurfaceQueue::GetSurfaceObjectFromHandle(HANDLE handle)
     return NULL;
 }
 
+//-----------------------------------------------------------------------------
+// Index of the surface in the network, for the trace
+//-----------------------------------------------------------------------------
+UINT CSurfaceQueue::GetSurfaceIndex(const SharedSurfaceObject* pObject) const
+{
+    for (UINT i = 0; i < m_Desc.NumSurfaces; i++)
+    {
+        if (m_CreatedSurfaces[i] == pObject)
+        {
+            return i;
+        }
+    }
+    return SURFACE_QUEUE_TRACE_NO_SURFACE;
+}
+
 //-----------------------------------------------------------------------------
 IUnknown* CSurfaceQueue::GetOpenedSurface(const SharedSurfaceObject* pObject) const
 {
@@ -757,6 +1394,54 @@ IUnknown* CSurfaceQueue::GetOpenedSurface(const SharedSurfaceObject* pObject) co
     return NULL;
 }
 
+//-----------------------------------------------------------------------------
+// Returns the opened surface of a queue created with SURFACE_QUEUE_FLAG_LAZY_OPEN,
+// opening it on the consumer device the first time.  The caller is inside the
+// consumer epoch, so the consumer and the mapping stay in place.
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueue::OpenSurfaceLazily(const SharedSurfaceObject* pObject, IUnknown** ppSurface)
+{
+    ASSERT(pObject && ppSurface);
+    ASSERT(m_ConsumerSurfaces && m_pConsumer);
+
+    for (UINT i = 0; i < m_Desc.NumSurfaces; i++)
+    {
+        if (m_ConsumerSurfaces[i].pObject != pObject)
+        {
+            continue;
+        }
+
+        IUnknown*   pSurface    = m_ConsumerSurfaces[i].pSurface;
+        HRESULT     hr          = S_OK;
+
+        if (pSurface)
+        {
+            *ppSurface = pSurface;
+            return S_OK;
+        }
+
+        if (FAILED(hr = GetOpenedSurfaceCache()->Acquire(m_pConsumer->GetDevice(), m_pConsumerDeviceKey,
+                                                         pObject, &pSurface)))
+        {
+            return hr;
+        }
+
+        // Keep whichever open was published first
+        IUnknown* pPublished = (IUnknown*)InterlockedCompareExchangePointer(
+                                        (PVOID volatile*)&m_ConsumerSurfaces[i].pSurface, pSurface, NULL);
+        if (pPublished)
+        {
+            GetOpenedSurfaceCache()->Release(m_pConsumerDeviceKey, pObject);
+            pSurface = pPublished;
+        }
+
+        *ppSurface = pSurface;
+        return S_OK;
+    }
+
+    return E_FAIL;
+}
+
 //-----------------------------------------------------------------------------
 HRESULT CSurfaceQueue::AllocateMetaDataBuffers()
 {
@@ -797,28 +1482,44 @@ HRESULT CSurfaceQueue::CreateSurfaces()
         }
 
         m_CreatedSurfaces[i] = pSurfaceObject;
+    }
 
-        if (FAILED(hr = m_pCreator->CreateSharedSurface(
-                                            m_Desc.Width, 
-                                            m_Desc.Height,
-                                            m_Desc.Format,
-                                            &(pSurfaceObject->pSurface),
-                                            &(pSurfaceObject->hSharedHandle)
-                                            )))
-        {
-            return hr;
-        }
+    // The textures themselves may be created in parallel
+    if (FAILED(hr = CreateResources(m_pCreator, m_Desc.NumSurfaces, &CreateSharedSurface, this)))
+    {
+        return hr;
+    }
 
+    for (UINT i = 0; i < m_Desc.NumSurfaces; i++)
+    {
         // Important to note that created surfaces start in the flushed state.  This
         // lets the system start in a state that makes it ready to go.
         m_SurfaceQueue[i].surface = m_CreatedSurfaces[i];
         m_SurfaceQueue[i].surface->state  = SHARED_SURFACE_STATE_FLUSHED;
         m_SurfaceQueue[i].surface->queue  = this;
+
+        // Nothing has been rendered yet, so all of the surface is dirty
+        SetRect(&m_SurfaceQueue[i].DirtyRects[0], 0, 0, m_Desc.Width, m_Desc.Height);
+        m_SurfaceQueue[i].nDirtyRects = 1;
     }
 
     return S_OK;
 }
 
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueue::CreateSharedSurface(UINT Index, void* pContext)
+{
+    CSurfaceQueue*          pQueue          = (CSurfaceQueue*)pContext;
+    SharedSurfaceObject*    pSurfaceObject  = pQueue->m_CreatedSurfaces[Index];
+
+    return pQueue->m_pCreator->CreateSharedSurface(
+                                    pQueue->m_Desc.Width,
+                                    pQueue->m_Desc.Height,
+                                    pQueue->m_Desc.Format,
+                                    &(pSurfaceObject->pSurface),
+                                    &(pSurfaceObject->hSharedHandle));
+}
+
 //-----------------------------------------------------------------------------
 void CSurfaceQueue::CopySurfaceReferences(CSurfaceQueue* pRootQueue)
 {
@@ -849,12 +1550,14 @@ HRESULT CSurfaceQueue::Initialize(SURFACE_QUEUE_DESC* pDesc,
     m_Desc              = *pDesc;
     m_pRootQueue        = pRootQueue;
     m_IsMultithreaded   = !(m_Desc.Flags & SURFACE_QUEUE_FLAG_SINGLE_THREADED);
+    m_TraceId           = SurfaceQueueTraceNewQueue();
 
     AddQueueToNetwork();
    
     if (m_IsMultithreaded)
     { 
         InitializeCriticalSection(&m_QueueLock);
+        InitializeCriticalSection(&m_StateLock);
     }
 
     // Allocate Queue
@@ -899,6 +1602,13 @@ HRESULT CSurfaceQueue::Initialize(SURFACE_QUEUE_DESC* pDesc,
             goto cleanup;
         }
 
+        hr = m_SurfaceCharge.Acquire(pDevice, SURFACE_QUEUE_BUDGET_SURFACES, m_Desc.Format,
+                                     m_Desc.Width, m_Desc.Height, m_Desc.NumSurfaces);
+        if (FAILED(hr))
+        {
+            goto cleanup;
+        }
+
         hr = CreateSurfaces();
         if (FAILED(hr))
         {
@@ -936,16 +1646,14 @@ HRESULT CSurfaceQueue::Initialize(SURFACE_QUEUE_DESC* pDesc,
             hr = HRESULT_FROM_WIN32(GetLastError());
             goto cleanup;
         }
-
-        
-        // Initialize the slim reader/writer lock
-        InitializeSRWLock(&m_lock);
     }
     else
     {
 		m_nFlushedSurfaces = m_pRootQueue == this ? pDesc->NumSurfaces : 0;
     }
 
+    RegisterForWatchdog();
+
 cleanup:
     // The object will get destroyed if initialize fails.  Cleanup
     // will happen then.
@@ -968,10 +1676,13 @@ HRESULT CSurfaceQueue::OpenConsumer(
 
     *ppConsumer = NULL;
 
-    HRESULT hr = E_FAIL;
+    HRESULT             hr          = E_FAIL;
+    CSurfaceConsumer*   pConsumer   = NULL;
+    LONGLONG            TraceStart  = SurfaceQueueTraceBegin();
+
     if (m_IsMultithreaded)
     {
-        AcquireSRWLockExclusive(&m_lock);
+        m_LockProfile.Enter(SURFACE_QUEUE_LOCK_STATE, &m_StateLock);
     }
 
 	// 
@@ -983,27 +1694,46 @@ HRESULT CSurfaceQueue::OpenConsumer(
     {
         if (m_IsMultithreaded)
         {
-            ReleaseSRWLockExclusive(&m_lock);
+            LeaveCriticalSection(&m_StateLock);
         }
         return E_INVALIDARG;
     }
 
-    m_pConsumer = new QUEUE_NOTHROW_SPECIFIER CSurfaceConsumer(m_IsMultithreaded);
-    if (m_pConsumer == NULL)
+    //
+    // The consumer is built up privately and only published once it is fully
+    // initialized.  The high frequency calls don't hold any lock that would 
+    // keep them from seeing a half opened consumer.
+    //
+    pConsumer = new QUEUE_NOTHROW_SPECIFIER CSurfaceConsumer(m_IsMultithreaded);
+    if (pConsumer == NULL)
     {
         hr = E_OUTOFMEMORY;
         goto end;
     }
 
-    hr = m_pConsumer->Initialize(pDevice);
+    hr = pConsumer->Initialize(pDevice);
+    if (FAILED(hr))
+    {
+        goto end;
+    }
+
+    // The opened surfaces are shared by COM identity of the device
+    hr = pDevice->QueryInterface(__uuidof(IUnknown), (void**)&m_pConsumerDeviceKey);
     if (FAILED(hr))
     {
         goto end;
     }
+    // The consumer holds the device; the key is only compared
+    m_pConsumerDeviceKey->Release();
+
+    // Only the surfaces of this device are worth keeping around any more
+    GetOpenedSurfaceCache()->Trim(m_pConsumerDeviceKey);
 
     //
     // For all the surfaces in the queue, we want to open it with the producing device.
-    // This guarantees that surfaces are only open at creation time.
+    // This guarantees that surfaces are only open at creation time.  Surfaces other
+    // queues of the network already opened on the device are shared.  Lazy queues
+    // only record the surfaces here and open them on their first dequeue.
     //
     for (UINT i = 0; i < m_Desc.NumSurfaces; i++)
     {
@@ -1012,17 +1742,21 @@ HRESULT CSurfaceQueue::OpenConsumer(
 
 		if (NULL == m_CreatedSurfaces[i] || NULL == m_ConsumerSurfaces)
 		{
-			return E_FAIL;
+			hr = E_FAIL;
+			goto end;
 		}
 
+        if (m_Desc.Flags & SURFACE_QUEUE_FLAG_LAZY_OPEN)
+        {
+            m_ConsumerSurfaces[i].pObject     = m_CreatedSurfaces[i];
+            m_ConsumerSurfaces[i].pSurface    = NULL;
+            continue;
+        }
+
         IUnknown*   pSurface = NULL;
 
-        hr = m_pConsumer->GetDevice()->OpenSurface(
-                                        m_CreatedSurfaces[i]->hSharedHandle, 
-                                        (void**)&pSurface, 
-                                        m_Desc.Width, 
-                                        m_Desc.Height, 
-                                        m_Desc.Format);
+        hr = GetOpenedSurfaceCache()->Acquire(pConsumer->GetDevice(), m_pConsumerDeviceKey,
+                                              m_CreatedSurfaces[i], &pSurface);
         if (FAILED(hr))
         {
             goto end;
@@ -1034,42 +1768,38 @@ HRESULT CSurfaceQueue::OpenConsumer(
         m_ConsumerSurfaces[i].pSurface    = pSurface;
     }
 
-    hr = m_pConsumer->QueryInterface(__uuidof(ISurfaceConsumer), (void**) ppConsumer);
+    hr = pConsumer->QueryInterface(__uuidof(ISurfaceConsumer), (void**) ppConsumer);
     if (FAILED(hr))
     {
         goto end;
     }
 
-    m_pConsumer->SetQueue(this);
+    pConsumer->SetQueue(this);
+
+    // Publish the consumer.  The volatile store orders it after the opened surfaces.
+    m_pConsumer = pConsumer;
 
 end:
     if (FAILED(hr))
     {
         *ppConsumer = NULL;
         
-        if (m_pConsumer)
-        {
-            if (m_pConsumer->GetDevice())
-            {
-                for (UINT i = 0; i < m_Desc.NumSurfaces; i++)
-                {
-                    if (m_ConsumerSurfaces[i].pSurface)
-                    {
-                        m_ConsumerSurfaces[i].pSurface->Release();
-                    }
-                }
-            }
-            
-            ZeroMemory(m_ConsumerSurfaces, sizeof(SharedSurfaceOpenedMapping) * m_Desc.NumSurfaces);
- 
-            delete m_pConsumer;
-            m_pConsumer = NULL;
+        if (pConsumer)
+        {
+            ReleaseConsumerSurfaces();
+            delete pConsumer;
         }
     }
 
     if (m_IsMultithreaded)
     {
-        ReleaseSRWLockExclusive(&m_lock);
+        LeaveCriticalSection(&m_StateLock);
+    }
+
+    if (TraceStart)
+    {
+        SurfaceQueueTraceCall(SURFACE_QUEUE_TRACE_OPEN_CONSUMER, m_TraceId, TraceStart, hr, 0,
+                              SURFACE_QUEUE_TRACE_NO_SURFACE, 0, NULL, 0);
     }
     return hr;
 }
@@ -1090,77 +1820,101 @@ HRESULT CSurfaceQueue::OpenProducer(
 
     *ppProducer = NULL;
 
-    HRESULT hr = E_FAIL;
+    HRESULT             hr          = E_FAIL;
+    CSurfaceProducer*   pProducer   = NULL;
+    LONGLONG            TraceStart  = SurfaceQueueTraceBegin();
 
     if (m_IsMultithreaded)
     {
-        AcquireSRWLockExclusive(&m_lock);
+        m_LockProfile.Enter(SURFACE_QUEUE_LOCK_STATE, &m_StateLock);
     }
 
     if (m_pProducer)
     {
         if (m_IsMultithreaded)
         {
-            ReleaseSRWLockExclusive(&m_lock);
+            LeaveCriticalSection(&m_StateLock);
         }
         return E_INVALIDARG;
     }
 
-    m_pProducer = new QUEUE_NOTHROW_SPECIFIER CSurfaceProducer(m_IsMultithreaded);
-    if (m_pProducer == NULL)
+    pProducer = new QUEUE_NOTHROW_SPECIFIER CSurfaceProducer(m_IsMultithreaded);
+    if (pProducer == NULL)
     {
         hr = E_OUTOFMEMORY;
         goto end;
     }
 
-    hr = m_pProducer->Initialize(pDevice, m_Desc.NumSurfaces, &m_Desc);
+    hr = pProducer->Initialize(pDevice, m_Desc.NumSurfaces, &m_Desc);
     if (FAILED(hr))
     {
         goto end;
     }
     
-    hr = m_pProducer->QueryInterface(__uuidof(ISurfaceProducer), (void**)ppProducer);
+    hr = pProducer->QueryInterface(__uuidof(ISurfaceProducer), (void**)ppProducer);
     if (FAILED (hr))
     {
         goto end;
     }
 
-    m_pProducer->SetQueue(this);
+    pProducer->SetQueue(this);
+
+    // Publish the producer once it is fully initialized.
+    m_pProducer = pProducer;
+    InterlockedExchange64(&m_StagingBytes, (LONGLONG)pProducer->GetStagingBytes());
 
 end:
     if (FAILED(hr))
     {
         *ppProducer = NULL;
-        if (m_pProducer)
+        if (pProducer)
         {
-            delete m_pProducer;
-            m_pProducer = NULL;
-            *ppProducer = NULL;
+            delete pProducer;
         }
     }
 
     if (m_IsMultithreaded)
     {
-        ReleaseSRWLockExclusive(&m_lock);
+        LeaveCriticalSection(&m_StateLock);
+    }
+
+    if (TraceStart)
+    {
+        SurfaceQueueTraceCall(SURFACE_QUEUE_TRACE_OPEN_PRODUCER, m_TraceId, TraceStart, hr, 0,
+                              SURFACE_QUEUE_TRACE_NO_SURFACE, 0, NULL, 0);
     }
-    
     return hr;
 }
 
+//-----------------------------------------------------------------------------
+void CSurfaceQueue::SynchronizeEpoch()
+{
+    LONGLONG Start  = m_LockProfile.BeginWait();
+    BOOL     Waited = m_Epoch.Synchronize();
+
+    if (Start)
+    {
+        m_LockProfile.EndWait(SURFACE_QUEUE_LOCK_EPOCH, Start, Waited);
+    }
+}
+
 //-----------------------------------------------------------------------------
 void CSurfaceQueue::RemoveProducer()
 {
     if (m_IsMultithreaded)
     {
-        AcquireSRWLockExclusive(&m_lock);
+        m_LockProfile.Enter(SURFACE_QUEUE_LOCK_STATE, &m_StateLock);
     }
     
     ASSERT(m_pProducer);
     m_pProducer = NULL;
+    InterlockedExchange64(&m_StagingBytes, 0);
 
     if (m_IsMultithreaded)
     {
-        ReleaseSRWLockExclusive(&m_lock);
+        // Wait out the calls that may still be using the old producer
+        SynchronizeEpoch();
+        LeaveCriticalSection(&m_StateLock);
     }
 }
 
@@ -1169,24 +1923,151 @@ void CSurfaceQueue::RemoveConsumer()
 {
     if (m_IsMultithreaded)
     {
-        AcquireSRWLockExclusive(&m_lock);
+        m_LockProfile.Enter(SURFACE_QUEUE_LOCK_STATE, &m_StateLock);
     }
 
     ASSERT(m_pConsumer && m_pConsumer->GetDevice());
+
+    // 
+    // Unpublish the consumer first.  The opened surfaces can only be released
+    // once no call can still be reading them.
+    //
+    m_pConsumer = NULL;
+    if (m_IsMultithreaded)
+    {
+        SynchronizeEpoch();
+    }
+
+    ReleaseConsumerSurfaces();
+    
+    if (m_IsMultithreaded)
+    {
+        LeaveCriticalSection(&m_StateLock);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Gives the surfaces the consumer opened back to the cache of the network
+//-----------------------------------------------------------------------------
+void CSurfaceQueue::ReleaseConsumerSurfaces()
+{
     for (UINT i = 0; i < m_Desc.NumSurfaces; i++)
     {
+        ReleaseSurfaceData(i);
+
         if (m_ConsumerSurfaces[i].pSurface)
         {
-            m_ConsumerSurfaces[i].pSurface->Release();
+            GetOpenedSurfaceCache()->Release(m_pConsumerDeviceKey, m_ConsumerSurfaces[i].pObject);
         }
     }
     ZeroMemory(m_ConsumerSurfaces, sizeof(SharedSurfaceOpenedMapping) * m_Desc.NumSurfaces);
-    m_pConsumer = NULL; 
-    
-    if (m_IsMultithreaded)
+    m_pConsumerDeviceKey = NULL;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueue::ReclaimConsumerSurfaces(
+                    CSurfaceQueue*          pReturnQueue,
+                    ISurfaceQueueDevice*    pLostDevice,
+                    UINT*                   pNumReclaimed)
+{
+    ASSERT(pReturnQueue);
+
+    if (m_pConsumer || pReturnQueue->m_pProducer || pReturnQueue->m_pRootQueue != m_pRootQueue)
+    {
+        return E_INVALIDARG;
+    }
+
+    // Flushed surfaces can not go in behind ones that are still pending
+    if (m_nEnqueuedSurfaces)
+    {
+        return DXGI_ERROR_WAS_STILL_DRAWING;
+    }
+
+    UINT    nReclaimed = 0;
+    UINT    index, i;
+
+    //
+    // The surfaces the old producer of the return queue enqueued without
+    // flushing are at the end of its fifo.  Their staging resources went with
+    // the producer, so they come out as if they had never been enqueued.
+    //
+    for (index = pReturnQueue->m_iEnqueuedHead, i = 0; i < pReturnQueue->m_nEnqueuedSurfaces; i++, index++)
+    {
+        index = index % m_Desc.NumSurfaces;
+
+        SharedSurfaceQueueEntry& queueEntry = pReturnQueue->m_SurfaceQueue[index];
+
+        ASSERT(queueEntry.surface->state == SHARED_SURFACE_STATE_ENQUEUED);
+
+        queueEntry.surface->state   = SHARED_SURFACE_STATE_DEQUEUED;
+        queueEntry.surface->queue   = this;
+        queueEntry.pStagingResource = NULL;
+    }
+
+    if (pReturnQueue->m_IsMultithreaded)
+    {
+        pReturnQueue->m_LockProfile.Enter(SURFACE_QUEUE_LOCK_QUEUE, &pReturnQueue->m_QueueLock);
+    }
+    pReturnQueue->m_QueueSize -= pReturnQueue->m_nEnqueuedSurfaces;
+    if (pReturnQueue->m_IsMultithreaded)
     {
-        ReleaseSRWLockExclusive(&m_lock);
+        LeaveCriticalSection(&pReturnQueue->m_QueueLock);
     }
+    pReturnQueue->m_nEnqueuedSurfaces = 0;
+
+    //
+    // Everything the consumer held goes back flushed, all of it changed:
+    // the surfaces it still had dequeued, which carry its device, and the
+    // ones taken back from pReturnQueue above, which carry this queue.
+    // What the lost device left in the surfaces is undefined.
+    //
+    for (i = 0; i < m_Desc.NumSurfaces; i++)
+    {
+        SharedSurfaceObject* pObject = m_CreatedSurfaces[i];
+
+        if (pObject->state != SHARED_SURFACE_STATE_DEQUEUED)
+        {
+            continue;
+        }
+        if (pObject->device != pLostDevice &&
+            pObject->queue != static_cast<ISurfaceQueue*>(this))
+        {
+            continue;
+        }
+
+        SharedSurfaceQueueEntry QueueEntry;
+        QueueEntry.surface = pObject;
+        SetRect(&QueueEntry.DirtyRects[0], 0, 0, m_Desc.Width, m_Desc.Height);
+        QueueEntry.nDirtyRects = 1;
+
+        pObject->state = SHARED_SURFACE_STATE_FLUSHED;
+
+        m_iEnqueuedHead = (m_iEnqueuedHead + 1) % m_Desc.NumSurfaces;
+        Enqueue(QueueEntry);
+
+        if (m_IsMultithreaded)
+        {
+            ReleaseSemaphore(m_hSemaphore, 1, NULL);
+        }
+        else
+        {
+            m_nFlushedSurfaces++;
+        }
+
+        nReclaimed++;
+    }
+
+    if (nReclaimed)
+    {
+        NotifySurfacesReclaimed(nReclaimed);
+    }
+
+    if (pNumReclaimed)
+    {
+        *pNumReclaimed = nReclaimed;
+    }
+
+    return S_OK;
 }
 
 //-----------------------------------------------------------------------------
@@ -1209,17 +2090,20 @@ HRESULT CSurfaceQueue::Clone(
     {
         return E_INVALIDARG;
     }
-    if (pDesc->Flags != 0 && pDesc->Flags != SURFACE_QUEUE_FLAG_SINGLE_THREADED)
+    if (pDesc->Flags & ~SURFACE_QUEUE_VALID_CREATE_FLAGS)
     {
         return E_INVALIDARG;
     }
 
     *ppQueue    = NULL;
     HRESULT hr  = E_FAIL;
+
+    LONGLONG TraceStart = SurfaceQueueTraceBegin();
+    UINT     TraceId    = 0;
    
     if (m_IsMultithreaded)
     { 
-        AcquireSRWLockExclusive(&m_lock);
+        m_LockProfile.Enter(SURFACE_QUEUE_LOCK_STATE, &m_StateLock);
     }
 
     SURFACE_QUEUE_DESC createDesc = m_Desc;
@@ -1241,6 +2125,10 @@ HRESULT CSurfaceQueue::Clone(
     hr = pQueue->QueryInterface(__uuidof(ISurfaceQueue), (void**)ppQueue);
 
 end:
+    if (pQueue)
+    {
+        TraceId = pQueue->GetTraceId();
+    }
     if (FAILED(hr))
     {
         if (pQueue)
@@ -1252,7 +2140,13 @@ end:
 
     if (m_IsMultithreaded)
     {
-        ReleaseSRWLockExclusive(&m_lock);
+        LeaveCriticalSection(&m_StateLock);
+    }
+
+    if (TraceStart)
+    {
+        SurfaceQueueTraceCall(SURFACE_QUEUE_TRACE_CLONE, m_TraceId, TraceStart, hr, pDesc->Flags,
+                              SURFACE_QUEUE_TRACE_NO_SURFACE, TraceId, pDesc, sizeof(*pDesc));
     }
     return hr;
 }
@@ -1265,7 +2159,9 @@ HRESULT CSurfaceQueue::Enqueue(
                             DWORD       Flags,
                             IUnknown*   pStagingResource,
                             UINT        width,
-                            UINT        height
+                            UINT        height,
+                            const RECT* pDirtyRects,
+                            UINT        NumDirtyRects
                         )
 {
     ASSERT( pSurface );
@@ -1282,19 +2178,25 @@ HRESULT CSurfaceQueue::Enqueue(
     {
         return E_INVALIDARG;
     }
+    if (NumDirtyRects && !pDirtyRects)
+    {
+        return E_INVALIDARG;
+    }
 
     HRESULT hr = E_FAIL;
 
+    LONGLONG TraceStart = SurfaceQueueTraceBegin();
+
     if (m_IsMultithreaded)
     {
-        AcquireSRWLockShared(&m_lock);
+        m_Epoch.Enter(QUEUE_EPOCH_PRODUCER);
     }
 
     ASSERT( m_pProducer );
    
     SharedSurfaceQueueEntry QueueEntry;
     HANDLE                  hSharedHandle;
-    SharedSurfaceObject*    pSurfaceObject;
+    SharedSurfaceObject*    pSurfaceObject = NULL;
 
     // Require both the producer and consumer to be initialized.
     // This avoids a potential race condition
@@ -1340,6 +2242,24 @@ HRESULT CSurfaceQueue::Enqueue(
     QueueEntry.bMetaDataSize    = BufferSize;
     QueueEntry.pStagingResource = NULL;
 
+    BuildDirtyRectList(pDirtyRects, NumDirtyRects, m_Desc.Width, m_Desc.Height,
+                       QueueEntry.DirtyRects, &QueueEntry.nDirtyRects);
+
+    //
+    // The consumer of a producer on its own device can't see the surface
+    // before the rendering to it is done; the device runs their commands in
+    // order.  The surface is flushed right away, without the copy and lock,
+    // unless surfaces enqueued before it are still pending.
+    //
+    if (m_pProducer->GetDeviceKey() == m_pConsumerDeviceKey && !m_nEnqueuedSurfaces)
+    {
+        pSurfaceObject->queue = this;
+        InterlockedIncrement64(&m_SameDeviceEnqueues);
+
+        hr = S_OK;
+        goto flushed;
+    }
+
     // Copy a small portion of the surface onto the staging surface
     hr = m_pProducer->GetDevice()->CopySurface(pStagingResource, pSurface, width, height);
     if (FAILED(hr))
@@ -1356,6 +2276,12 @@ HRESULT CSurfaceQueue::Enqueue(
     // or FLUSHED state.
     //
 
+    if (!(Flags & SURFACE_QUEUE_FLAG_DO_NOT_WAIT))
+    {
+        // Without DO_NOT_WAIT, the flush below waits for the rendering
+        BeginWatchedWait(QUEUE_EPOCH_PRODUCER, QUEUE_WAIT_FLUSH);
+    }
+
     // 
     // Do not attempt to flush the surfaces if the DO_NOT_WAIT flag was used.
     // In these cases, simply add the surface to the FIFO queue as an ENQUEUED surface.
@@ -1378,6 +2304,8 @@ HRESULT CSurfaceQueue::Enqueue(
         Enqueue(QueueEntry);
         m_nEnqueuedSurfaces++;
 
+        NotifySurfaceEnqueued();
+
         //
         // Since the surface did not flush, set the return to DXGI_ERROR_WAS_STILL_DRAWING
         // and return.
@@ -1392,7 +2320,7 @@ HRESULT CSurfaceQueue::Enqueue(
         // currently not flushed.  First flush the existing surfaces and then perform the
         // current Enqueue.
         //
-        hr = Flush(0, NULL);
+        hr = FlushEnqueuedSurfaces(0, NULL);
         ASSERT(SUCCEEDED(hr));
     }
 
@@ -1412,6 +2340,7 @@ HRESULT CSurfaceQueue::Enqueue(
     // The call to lock the surface completed succesfully meaning the surface if flushed
     // and ready for dequeue.  Mark the surface as such and add it to the fifo queue.
     //
+flushed:
     pSurfaceObject->state = SHARED_SURFACE_STATE_FLUSHED;
 
     m_iEnqueuedHead = (m_iEnqueuedHead + 1) % m_Desc.NumSurfaces;
@@ -1426,21 +2355,34 @@ HRESULT CSurfaceQueue::Enqueue(
     {
         m_nFlushedSurfaces++;
     }
-    
+
+    NotifySurfacesFlushed(1);
 
 end:
+    EndWatchedWait(QUEUE_EPOCH_PRODUCER);
+
+    if (TraceStart)
+    {
+        SurfaceQueueTraceCall(SURFACE_QUEUE_TRACE_ENQUEUE, m_TraceId, TraceStart, hr, Flags,
+                              pSurfaceObject ? GetSurfaceIndex(pSurfaceObject) : SURFACE_QUEUE_TRACE_NO_SURFACE,
+                              BufferSize, NULL, 0);
+    }
+
     if (m_IsMultithreaded)
     {
-        ReleaseSRWLockShared(&m_lock);
+        m_Epoch.Leave(QUEUE_EPOCH_PRODUCER);
     }
     return hr;
 }
 
 //-----------------------------------------------------------------------------
 HRESULT CSurfaceQueue::Dequeue(
+                            REFIID                  id,
                             IUnknown**              ppSurface,
                             void*                   pBuffer,
                             UINT*                   BufferSize,
+                            RECT*                   pDirtyRects,
+                            UINT*                   pNumDirtyRects,
                             DWORD                   dwTimeout  
                         )
 {
@@ -1460,9 +2402,11 @@ HRESULT CSurfaceQueue::Dequeue(
        }
     }
 
+    LONGLONG TraceStart = SurfaceQueueTraceBegin();
+
     if (m_IsMultithreaded)
     {
-        AcquireSRWLockShared(&m_lock);
+        m_Epoch.Enter(QUEUE_EPOCH_CONSUMER);
     }
 
     SharedSurfaceQueueEntry QueueElement;
@@ -1480,7 +2424,12 @@ HRESULT CSurfaceQueue::Dequeue(
     if (m_IsMultithreaded)
     {
         // Wait on the semaphore until the queue is not empty
-        DWORD dwWait = WaitForSingleObject(m_hSemaphore, dwTimeout);
+        if (dwTimeout)
+        {
+            BeginWatchedWait(QUEUE_EPOCH_CONSUMER, QUEUE_WAIT_DEQUEUE);
+        }
+        DWORD dwWait = m_LockProfile.Wait(SURFACE_QUEUE_LOCK_SEMAPHORE, m_hSemaphore, dwTimeout);
+        EndWatchedWait(QUEUE_EPOCH_CONSUMER);
         switch (dwWait)
         {
             case WAIT_ABANDONED:
@@ -1540,16 +2489,43 @@ HRESULT CSurfaceQueue::Dequeue(
     ASSERT (QueueElement.surface->state == SHARED_SURFACE_STATE_FLUSHED);
     ASSERT (QueueElement.surface->queue == this);
 
+    // 
+    // Get the surface for the consuming device from the surface object, as the
+    // interface asked for.  A lazy queue may have to open it first.  If either
+    // fails the surface stays queued.
+    //
+    if (m_Desc.Flags & SURFACE_QUEUE_FLAG_LAZY_OPEN)
+    {
+        hr = OpenSurfaceLazily(QueueElement.surface, &pSurface);
+    }
+    else
+    {
+        pSurface = GetOpenedSurface(QueueElement.surface);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = GetSurfaceInterface(GetSurfaceIndex(QueueElement.surface), pSurface, id, &pSurface);
+    }
+
+    if (FAILED(hr))
+    {
+        if (m_IsMultithreaded)
+        {
+            ReleaseSemaphore(m_hSemaphore, 1, NULL);
+        }
+        else
+        {
+            m_nFlushedSurfaces++;
+        }
+        goto end;
+    }
+
     //
     // Update the state of the surface to dequeued
     //
     QueueElement.surface->state  = SHARED_SURFACE_STATE_DEQUEUED;
     QueueElement.surface->device = m_pConsumer->GetDevice();   
-   
-    // 
-    // Get the surface for the consuming device from the surface object
-    //
-    pSurface = GetOpenedSurface(QueueElement.surface);
 
     ASSERT(pSurface);
 
@@ -1573,6 +2549,11 @@ HRESULT CSurfaceQueue::Dequeue(
         *BufferSize = QueueElement.bMetaDataSize;
     }
 
+    if (pNumDirtyRects)
+    {
+        CopyDirtyRectList(QueueElement.DirtyRects, QueueElement.nDirtyRects, pDirtyRects, pNumDirtyRects);
+    }
+
     //
     // Remove the element from the queue.  We do it at the very end in case there are
     // errors.
@@ -1580,9 +2561,16 @@ HRESULT CSurfaceQueue::Dequeue(
     Dequeue(QueueElement);
 
 end:
+    if (TraceStart)
+    {
+        SurfaceQueueTraceCall(SURFACE_QUEUE_TRACE_DEQUEUE, m_TraceId, TraceStart, hr, 0,
+                              QueueElement.surface ? GetSurfaceIndex(QueueElement.surface) : SURFACE_QUEUE_TRACE_NO_SURFACE,
+                              dwTimeout, NULL, 0);
+    }
+
     if (m_IsMultithreaded)
     {
-        ReleaseSRWLockShared(&m_lock);
+        m_Epoch.Leave(QUEUE_EPOCH_CONSUMER);
     }
 
     return hr;
@@ -1594,11 +2582,42 @@ HRESULT CSurfaceQueue::Flush(
                             UINT*   pRemainingSurfaces
                         )
 {
+    LONGLONG TraceStart = SurfaceQueueTraceBegin();
+
+    if (m_IsMultithreaded)
+    {
+        m_Epoch.Enter(QUEUE_EPOCH_PRODUCER);
+    }
+
+    if (!(Flags & SURFACE_QUEUE_FLAG_DO_NOT_WAIT))
+    {
+        BeginWatchedWait(QUEUE_EPOCH_PRODUCER, QUEUE_WAIT_FLUSH);
+    }
+
+    HRESULT hr = FlushEnqueuedSurfaces(Flags, pRemainingSurfaces);
+
+    EndWatchedWait(QUEUE_EPOCH_PRODUCER);
+
+    if (TraceStart)
+    {
+        SurfaceQueueTraceCall(SURFACE_QUEUE_TRACE_FLUSH, m_TraceId, TraceStart, hr, Flags,
+                              SURFACE_QUEUE_TRACE_NO_SURFACE, m_nEnqueuedSurfaces, NULL, 0);
+    }
+
     if (m_IsMultithreaded)
     {
-        AcquireSRWLockShared(&m_lock);
+        m_Epoch.Leave(QUEUE_EPOCH_PRODUCER);
     }
 
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueue::FlushEnqueuedSurfaces(
+                            DWORD   Flags,
+                            UINT*   pRemainingSurfaces
+                        )
+{
     HRESULT hr = S_OK; 
     UINT    uiFlushedSurfaces = 0;
     UINT    index, i;
@@ -1668,17 +2687,127 @@ HRESULT CSurfaceQueue::Flush(
 
 end:
 
+    if (uiFlushedSurfaces)
+    {
+        NotifySurfacesFlushed(uiFlushedSurfaces);
+    }
+
     if (pRemainingSurfaces)
     {
         *pRemainingSurfaces = m_nEnqueuedSurfaces;
     }
-    
+
+    return hr; 
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueue::SetLockProfiling(BOOL Enable)
+{
+    m_LockProfile.SetEnabled(Enable);
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueue::GetStats(SURFACE_QUEUE_STATS* pStats)
+{
+    if (!pStats)
+    {
+        return E_INVALIDARG;
+    }
+
+    ZeroMemory(pStats, sizeof(*pStats));
+    m_LockProfile.GetStats(pStats);
+
+    pStats->SurfaceBytes = m_pRootQueue->m_SurfaceCharge.GetBytes();
+    pStats->StagingBytes = (ULONGLONG)InterlockedCompareExchange64(&m_StagingBytes, 0, 0);
+    pStats->SameDeviceEnqueues = (ULONGLONG)InterlockedCompareExchange64(&m_SameDeviceEnqueues, 0, 0);
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueue::ResetStats()
+{
+    m_LockProfile.Reset();
+    InterlockedExchange64(&m_SameDeviceEnqueues, 0);
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueue::SetNotify(QueueEpochSide side, ISurfaceQueueNotify* pNotify)
+{
+    if (side >= QUEUE_EPOCH_NUM_SIDES)
+    {
+        return E_INVALIDARG;
+    }
+
+    HRESULT hr = S_OK;
+
     if (m_IsMultithreaded)
     {
-        ReleaseSRWLockShared(&m_lock);
+        m_LockProfile.Enter(SURFACE_QUEUE_LOCK_STATE, &m_StateLock);
     }
 
-    return hr; 
+    if (pNotify && m_pNotify[side])
+    {
+        // Only one object can listen to each side of the queue
+        hr = E_INVALIDARG;
+    }
+    else
+    {
+        m_pNotify[side] = pNotify;
+
+        // Notifications are made inside the producer epoch.  Once the readers
+        // drain, the old object will not be called again.
+        if (m_IsMultithreaded && !pNotify)
+        {
+            SynchronizeEpoch();
+        }
+    }
+
+    if (m_IsMultithreaded)
+    {
+        LeaveCriticalSection(&m_StateLock);
+    }
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceQueue::NotifySurfaceEnqueued()
+{
+    for (UINT i = 0; i < QUEUE_EPOCH_NUM_SIDES; i++)
+    {
+        ISurfaceQueueNotify* pNotify = m_pNotify[i];
+        if (pNotify)
+        {
+            pNotify->OnSurfaceEnqueued(this);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceQueue::NotifySurfacesFlushed(UINT NumSurfaces)
+{
+    for (UINT i = 0; i < QUEUE_EPOCH_NUM_SIDES; i++)
+    {
+        ISurfaceQueueNotify* pNotify = m_pNotify[i];
+        if (pNotify)
+        {
+            pNotify->OnSurfacesFlushed(this, NumSurfaces);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceQueue::NotifySurfacesReclaimed(UINT NumSurfaces)
+{
+    for (UINT i = 0; i < QUEUE_EPOCH_NUM_SIDES; i++)
+    {
+        ISurfaceQueueNotify* pNotify = m_pNotify[i];
+        if (pNotify)
+        {
+            pNotify->OnSurfacesReclaimed(this, NumSurfaces);
+        }
+    }
 }
 
 //-----------------------------------------------------------------------------
@@ -1694,7 +2823,7 @@ void CSurfaceQueue::Dequeue(SharedSurfaceQueueEntry& entry)
     // can not be empty.
     if (m_IsMultithreaded)
     {
-        EnterCriticalSection(&m_QueueLock);
+        m_LockProfile.Enter(SURFACE_QUEUE_LOCK_QUEUE, &m_QueueLock);
     }
 
     entry = m_SurfaceQueue[m_QueueHead];
@@ -1717,7 +2846,7 @@ void CSurfaceQueue::Enqueue(SharedSurfaceQueueEntry& entry)
 
     if (m_IsMultithreaded)
     {
-        EnterCriticalSection(&m_QueueLock);
+        m_LockProfile.Enter(SURFACE_QUEUE_LOCK_QUEUE, &m_QueueLock);
     }
 
     UINT end = (m_QueueHead + m_QueueSize) % m_Desc.NumSurfaces;
@@ -1731,6 +2860,8 @@ void CSurfaceQueue::Enqueue(SharedSurfaceQueueEntry& entry)
     m_SurfaceQueue[end].surface          = entry.surface;
     m_SurfaceQueue[end].bMetaDataSize    = entry.bMetaDataSize;
     m_SurfaceQueue[end].pStagingResource = entry.pStagingResource;
+    m_SurfaceQueue[end].nDirtyRects      = entry.nDirtyRects;
+    memcpy(m_SurfaceQueue[end].DirtyRects, entry.DirtyRects, sizeof(RECT) * entry.nDirtyRects);
     if (entry.bMetaDataSize)
     {
         memcpy(m_SurfaceQueue[end].pMetaData, entry.pMetaData, sizeof(BYTE) * entry.bMetaDataSize);
@@ -13,9 +13,9 @@
 HRESULT CSurfaceConsumer::QueryInterface(REFIID id, void** ppInterface)
 {
     *ppInterface = NULL;
-    if (id == __uuidof(ISurfaceConsumer))
+    if (id == __uuidof(ISurfaceConsumer) || id == __uuidof(ISurfaceConsumer1) || id == __uuidof(ISurfaceConsumer2))
     {
-        *reinterpret_cast<ISurfaceConsumer**>(ppInterface) = this;
+        *reinterpret_cast<ISurfaceConsumer2**>(ppInterface) = this;
         AddRef();
         return S_OK;
     }
@@ -25,6 +25,13 @@ HRESULT CSurfaceConsumer::QueryInterface(REFIID id, void** ppInterface)
         AddRef();
         return S_OK;
     }
+    else if (id == __uuidof(CSurfaceConsumer))
+    {
+        // Lets the implementation get back to the object behind the interface
+        *reinterpret_cast<CSurfaceConsumer**>(ppInterface) = this;
+        AddRef();
+        return S_OK;
+    }
     return E_NOINTERFACE;
 }
 
@@ -51,9 +58,9 @@ ULONG CSurfaceConsumer::Release()
 HRESULT CSurfaceProducer::QueryInterface(REFIID id, void** ppInterface)
 {
     *ppInterface = NULL;
-    if (id == __uuidof(ISurfaceProducer))
+    if (id == __uuidof(ISurfaceProducer) || id == __uuidof(ISurfaceProducer1))
     {
-        *reinterpret_cast<ISurfaceProducer**>(ppInterface) = this;
+        *reinterpret_cast<ISurfaceProducer1**>(ppInterface) = this;
         AddRef();
         return S_OK;
     }
@@ -63,6 +70,13 @@ HRESULT CSurfaceProducer::QueryInterface(REFIID id, void** ppInterface)
         AddRef();
         return S_OK;
     }
+    else if (id == __uuidof(CSurfaceProducer))
+    {
+        // Lets the implementation get back to the object behind the interface
+        *reinterpret_cast<CSurfaceProducer**>(ppInterface) = this;
+        AddRef();
+        return S_OK;
+    }
     return E_NOINTERFACE;
 }
 
@@ -89,9 +103,9 @@ ULONG CSurfaceProducer::Release()
 HRESULT CSurfaceQueue::QueryInterface(REFIID id, void** ppInterface)
 {
     *ppInterface = NULL;
-    if (id == __uuidof(ISurfaceQueue))
+    if (id == __uuidof(ISurfaceQueue) || id == __uuidof(ISurfaceQueue1))
     {
-        *reinterpret_cast<ISurfaceQueue**>(ppInterface) = this;
+        *reinterpret_cast<ISurfaceQueue1**>(ppInterface) = this;
         AddRef();
         return S_OK;
     }
@@ -0,0 +1,506 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#include <new>
+#include "SurfaceQueueAsync.h"
+
+//
+// Notes about the work callback:  The queue notifications and the Begin* calls
+// only "kick" the wrapper.  The first kick schedules the work callback and the
+// following ones just bump m_nSignals.  The callback processes the pending
+// operation and then subtracts the signals it saw; if more arrived in the mean
+// time it runs again.  This guarantees that only one callback runs at a time and
+// that a notification arriving while the callback is running is never lost.
+//
+
+//-----------------------------------------------------------------------------
+// CSurfaceConsumerAsync implementation
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+CSurfaceConsumerAsync::CSurfaceConsumerAsync() :
+    m_pConsumer(NULL),
+    m_pQueue(NULL),
+    m_pWork(NULL),
+    m_nSignals(0),
+    m_IsPending(FALSE),
+    m_pBuffer(NULL),
+    m_BufferSize(0),
+    m_pfnCompletion(NULL),
+    m_pContext(NULL)
+{
+    ZeroMemory(&m_id, sizeof(m_id));
+}
+
+//-----------------------------------------------------------------------------
+CSurfaceConsumerAsync::~CSurfaceConsumerAsync()
+{
+    if (m_pQueue)
+    {
+        m_pQueue->SetNotify(QUEUE_EPOCH_CONSUMER, NULL);
+    }
+
+    if (m_pWork)
+    {
+        WaitForThreadpoolWorkCallbacks(m_pWork, TRUE);
+        CloseThreadpoolWork(m_pWork);
+    }
+
+    // Nothing will complete the outstanding operation anymore
+    if (InterlockedExchange(&m_IsPending, FALSE))
+    {
+        m_pfnCompletion(E_ABORT, NULL, 0, m_pContext);
+    }
+
+    if (m_pConsumer)
+    {
+        m_pConsumer->Release();
+    }
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceConsumerAsync::Initialize(ISurfaceConsumer* pConsumer)
+{
+    ASSERT(m_pConsumer == NULL);
+
+    if (pConsumer == NULL)
+    {
+        return E_INVALIDARG;
+    }
+
+    HRESULT             hr          = S_OK;
+    CSurfaceConsumer*   pImpl       = NULL;
+
+    if (FAILED(hr = pConsumer->QueryInterface(__uuidof(CSurfaceConsumer), (void**)&pImpl)))
+    {
+        goto end;
+    }
+
+    // Completions run on the thread pool
+    if (pImpl->GetQueue() == NULL || !pImpl->GetQueue()->IsMultithreaded())
+    {
+        hr = E_INVALIDARG;
+        goto end;
+    }
+
+    m_pWork = CreateThreadpoolWork(&WorkCallback, this, NULL);
+    if (m_pWork == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+
+    if (FAILED(hr = pImpl->GetQueue()->SetNotify(QUEUE_EPOCH_CONSUMER, this)))
+    {
+        goto end;
+    }
+
+    m_pQueue    = pImpl->GetQueue();
+    m_pConsumer = pConsumer;
+    m_pConsumer->AddRef();
+
+end:
+    if (FAILED(hr))
+    {
+        if (m_pWork)
+        {
+            CloseThreadpoolWork(m_pWork);
+            m_pWork = NULL;
+        }
+    }
+    if (pImpl)
+    {
+        pImpl->Release();
+    }
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceConsumerAsync::TryDequeue(REFIID id, IUnknown** ppSurface, void* pBuffer, UINT* pBufferSize)
+{
+    if (m_pConsumer == NULL)
+    {
+        return E_FAIL;
+    }
+    return m_pConsumer->Dequeue(id, ppSurface, pBuffer, pBufferSize, 0);
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceConsumerAsync::BeginDequeue(
+                                REFIID                          id,
+                                void*                           pBuffer,
+                                UINT                            BufferSize,
+                                PFN_SURFACE_DEQUEUE_COMPLETION  pfnCompletion,
+                                void*                           pContext)
+{
+    if (m_pConsumer == NULL)
+    {
+        return E_FAIL;
+    }
+    if (pfnCompletion == NULL)
+    {
+        return E_INVALIDARG;
+    }
+    if (m_IsPending)
+    {
+        return E_INVALIDARG;
+    }
+
+    m_id            = id;
+    m_pBuffer       = pBuffer;
+    m_BufferSize    = BufferSize;
+    m_pfnCompletion = pfnCompletion;
+    m_pContext      = pContext;
+
+    // The interlocked exchange publishes the operation to the work callback
+    InterlockedExchange(&m_IsPending, TRUE);
+
+    // The queue may already hold surfaces that won't be notified again
+    Kick();
+
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceConsumerAsync::OnSurfaceEnqueued(CSurfaceQueue*)
+{
+    // Nothing to dequeue until the surface is flushed
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceConsumerAsync::OnSurfacesFlushed(CSurfaceQueue*, UINT)
+{
+    if (m_IsPending)
+    {
+        Kick();
+    }
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceConsumerAsync::OnSurfacesReclaimed(CSurfaceQueue*, UINT)
+{
+    if (m_IsPending)
+    {
+        Kick();
+    }
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceConsumerAsync::Kick()
+{
+    if (InterlockedIncrement(&m_nSignals) == 1)
+    {
+        SubmitThreadpoolWork(m_pWork);
+    }
+}
+
+//-----------------------------------------------------------------------------
+void CALLBACK CSurfaceConsumerAsync::WorkCallback(PTP_CALLBACK_INSTANCE, PVOID pContext, PTP_WORK)
+{
+    CSurfaceConsumerAsync* pThis = static_cast<CSurfaceConsumerAsync*>(pContext);
+
+    LONG nSignals;
+    do
+    {
+        nSignals = pThis->m_nSignals;
+        pThis->ProcessPendingDequeue();
+    }
+    while (InterlockedExchangeAdd(&pThis->m_nSignals, -nSignals) != nSignals);
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceConsumerAsync::ProcessPendingDequeue()
+{
+    if (!m_IsPending)
+    {
+        return;
+    }
+
+    IUnknown*   pSurface    = NULL;
+    UINT        BufferSize  = m_BufferSize;
+    HRESULT     hr          = m_pConsumer->Dequeue(m_id, &pSurface, m_pBuffer, m_pBuffer ? &BufferSize : NULL, 0);
+
+    if (hr == HRESULT_FROM_WIN32(WAIT_TIMEOUT))
+    {
+        // Still empty; the next flush notification will retry
+        return;
+    }
+
+    if (FAILED(hr))
+    {
+        BufferSize = 0;
+    }
+
+    // Clear the operation before completing so the completion can start another one
+    InterlockedExchange(&m_IsPending, FALSE);
+    m_pfnCompletion(hr, pSurface, m_pBuffer ? BufferSize : 0, m_pContext);
+}
+
+//-----------------------------------------------------------------------------
+// CSurfaceProducerAsync implementation
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+CSurfaceProducerAsync::CSurfaceProducerAsync() :
+    m_pProducer(NULL),
+    m_pQueue(NULL),
+    m_pWork(NULL),
+    m_pTimer(NULL),
+    m_nSignals(0),
+    m_nEnqueued(0),
+    m_nFlushed(0),
+    m_IsPending(FALSE),
+    m_Ticket(0),
+    m_pfnCompletion(NULL),
+    m_pContext(NULL)
+{
+}
+
+//-----------------------------------------------------------------------------
+CSurfaceProducerAsync::~CSurfaceProducerAsync()
+{
+    if (m_pQueue)
+    {
+        m_pQueue->SetNotify(QUEUE_EPOCH_PRODUCER, NULL);
+    }
+
+    if (m_pTimer)
+    {
+        SetThreadpoolTimer(m_pTimer, NULL, 0, 0);
+        WaitForThreadpoolTimerCallbacks(m_pTimer, TRUE);
+        CloseThreadpoolTimer(m_pTimer);
+    }
+
+    if (m_pWork)
+    {
+        WaitForThreadpoolWorkCallbacks(m_pWork, TRUE);
+        CloseThreadpoolWork(m_pWork);
+    }
+
+    if (InterlockedExchange(&m_IsPending, FALSE))
+    {
+        m_pfnCompletion(E_ABORT, m_pContext);
+    }
+
+    if (m_pProducer)
+    {
+        m_pProducer->Release();
+    }
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceProducerAsync::Initialize(ISurfaceProducer* pProducer)
+{
+    ASSERT(m_pProducer == NULL);
+
+    if (pProducer == NULL)
+    {
+        return E_INVALIDARG;
+    }
+
+    HRESULT             hr          = S_OK;
+    CSurfaceProducer*   pImpl       = NULL;
+    UINT                nRemaining  = 0;
+
+    if (FAILED(hr = pProducer->QueryInterface(__uuidof(CSurfaceProducer), (void**)&pImpl)))
+    {
+        goto end;
+    }
+
+    if (pImpl->GetQueue() == NULL || !pImpl->GetQueue()->IsMultithreaded())
+    {
+        hr = E_INVALIDARG;
+        goto end;
+    }
+
+    m_pWork = CreateThreadpoolWork(&WorkCallback, this, NULL);
+    if (m_pWork == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+
+    m_pTimer = CreateThreadpoolTimer(&TimerCallback, this, NULL);
+    if (m_pTimer == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+
+    if (FAILED(hr = pImpl->GetQueue()->SetNotify(QUEUE_EPOCH_PRODUCER, this)))
+    {
+        goto end;
+    }
+
+    // Surfaces enqueued before the wrapper existed are ahead of everything it enqueues
+    pProducer->Flush(SURFACE_QUEUE_FLAG_DO_NOT_WAIT, &nRemaining);
+    m_nEnqueued = nRemaining;
+    m_nFlushed  = 0;
+
+    m_pQueue    = pImpl->GetQueue();
+    m_pProducer = pProducer;
+    m_pProducer->AddRef();
+
+end:
+    if (FAILED(hr))
+    {
+        if (m_pTimer)
+        {
+            CloseThreadpoolTimer(m_pTimer);
+            m_pTimer = NULL;
+        }
+        if (m_pWork)
+        {
+            CloseThreadpoolWork(m_pWork);
+            m_pWork = NULL;
+        }
+    }
+    if (pImpl)
+    {
+        pImpl->Release();
+    }
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceProducerAsync::BeginEnqueue(
+                                IUnknown*                       pSurface,
+                                void*                           pBuffer,
+                                UINT                            BufferSize,
+                                PFN_SURFACE_ENQUEUE_COMPLETION  pfnCompletion,
+                                void*                           pContext)
+{
+    if (m_pProducer == NULL)
+    {
+        return E_FAIL;
+    }
+    if (pfnCompletion == NULL)
+    {
+        return E_INVALIDARG;
+    }
+    if (m_IsPending)
+    {
+        return E_INVALIDARG;
+    }
+
+    //
+    // Take the ticket before enqueueing.  The flush notifications for this
+    // surface can arrive before Enqueue returns.
+    //
+    LONG Ticket = InterlockedIncrement(&m_nEnqueued) - 1;
+
+    HRESULT hr = m_pProducer->Enqueue(pSurface, pBuffer, BufferSize, SURFACE_QUEUE_FLAG_DO_NOT_WAIT);
+    if (FAILED(hr) && hr != DXGI_ERROR_WAS_STILL_DRAWING)
+    {
+        // Nothing was enqueued, and nobody else can have taken a ticket since
+        InterlockedDecrement(&m_nEnqueued);
+        return hr;
+    }
+
+    m_Ticket        = Ticket;
+    m_pfnCompletion = pfnCompletion;
+    m_pContext      = pContext;
+    InterlockedExchange(&m_IsPending, TRUE);
+
+    // The surface may already be flushed.  If not, poll until it is.
+    SetPolling(TRUE);
+    Kick();
+
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceProducerAsync::OnSurfaceEnqueued(CSurfaceQueue*)
+{
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceProducerAsync::OnSurfacesFlushed(CSurfaceQueue*, UINT NumSurfaces)
+{
+    InterlockedExchangeAdd(&m_nFlushed, (LONG)NumSurfaces);
+    if (m_IsPending)
+    {
+        Kick();
+    }
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceProducerAsync::OnSurfacesReclaimed(CSurfaceQueue*, UINT)
+{
+    // None of them was enqueued, so no ticket completes
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceProducerAsync::Kick()
+{
+    if (InterlockedIncrement(&m_nSignals) == 1)
+    {
+        SubmitThreadpoolWork(m_pWork);
+    }
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceProducerAsync::SetPolling(BOOL IsPolling)
+{
+    if (IsPolling)
+    {
+        // A negative due time is relative, in 100ns units
+        LONGLONG    DueTime = -10000LL * SURFACE_QUEUE_ASYNC_FLUSH_INTERVAL;
+        FILETIME    ftDueTime;
+        ftDueTime.dwLowDateTime     = (DWORD)DueTime;
+        ftDueTime.dwHighDateTime    = (DWORD)(DueTime >> 32);
+
+        SetThreadpoolTimer(m_pTimer, &ftDueTime, SURFACE_QUEUE_ASYNC_FLUSH_INTERVAL, 0);
+    }
+    else
+    {
+        SetThreadpoolTimer(m_pTimer, NULL, 0, 0);
+    }
+}
+
+//-----------------------------------------------------------------------------
+void CALLBACK CSurfaceProducerAsync::TimerCallback(PTP_CALLBACK_INSTANCE, PVOID pContext, PTP_TIMER)
+{
+    CSurfaceProducerAsync* pThis = static_cast<CSurfaceProducerAsync*>(pContext);
+
+    // Any surfaces that finished flushing are reported through OnSurfacesFlushed
+    pThis->m_pProducer->Flush(SURFACE_QUEUE_FLAG_DO_NOT_WAIT, NULL);
+}
+
+//-----------------------------------------------------------------------------
+void CALLBACK CSurfaceProducerAsync::WorkCallback(PTP_CALLBACK_INSTANCE, PVOID pContext, PTP_WORK)
+{
+    CSurfaceProducerAsync* pThis = static_cast<CSurfaceProducerAsync*>(pContext);
+
+    LONG nSignals;
+    do
+    {
+        nSignals = pThis->m_nSignals;
+        pThis->ProcessPendingEnqueue();
+    }
+    while (InterlockedExchangeAdd(&pThis->m_nSignals, -nSignals) != nSignals);
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceProducerAsync::ProcessPendingEnqueue()
+{
+    if (!m_IsPending)
+    {
+        return;
+    }
+
+    if (m_nFlushed <= m_Ticket)
+    {
+        // Still drawing; the timer keeps flushing
+        return;
+    }
+
+    SetPolling(FALSE);
+
+    InterlockedExchange(&m_IsPending, FALSE);
+    m_pfnCompletion(S_OK, m_pContext);
+}
@@ -0,0 +1,299 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#pragma once
+
+#include "SurfaceQueueImpl.h"
+
+//
+// Asynchronous wrappers over ISurfaceConsumer and ISurfaceProducer.  Instead of
+// blocking a thread in Dequeue(..., INFINITE) or Flush(0, ...), an operation is
+// started and a completion routine is called on the thread pool once it is done.
+//
+// Completions are driven by the queue's own notifications: a pending dequeue is
+// retried when the queue reports flushed surfaces, and a pending enqueue
+// completes when the queue reports its surface flushed.  The GPU has no
+// completion signal for the staging copies though, so something has to flush
+// the producer for that report to come.  While an enqueue is pending a thread
+// pool timer flushes it with DO_NOT_WAIT every SURFACE_QUEUE_ASYNC_FLUSH_INTERVAL
+// milliseconds, which costs:
+//
+//      - latency: the enqueue completes up to one timer period after the GPU
+//        finished the copy.  Thread pool timers run off the system timer, so
+//        the period is rounded up to its resolution, 15.6 ms by default and
+//        1 ms only when the process raised it with timeBeginPeriod.
+//      - CPU: every period a thread pool thread wakes up, takes the producer
+//        lock and tries to map the staging resource, for as long as the GPU
+//        is busy with the copy.
+//
+// An enqueue whose surface is already flushed when Enqueue returns, as on
+// software devices, completes before the timer first fires.  A caller that
+// can't take the latency is better off calling Flush(0, ...) on a thread of
+// its own.
+//
+// The wrappers require multithreaded queues, since completions run on the
+// thread pool.  Only one operation can be outstanding on a wrapper at a time
+// and all calls on the endpoint must go through the wrapper.  A wrapper must
+// not be destroyed from its own completion routine.
+//
+
+// Called when an asynchronous dequeue completes.  On success pSurface holds a
+// reference that the callee owns.  BufferSize is the number of meta data bytes
+// copied into the buffer passed to BeginDequeue.
+typedef void (CALLBACK *PFN_SURFACE_DEQUEUE_COMPLETION)(HRESULT hr, IUnknown* pSurface, UINT BufferSize, void* pContext);
+
+// Called when an asynchronous enqueue completes, that is when the surface is
+// FLUSHED and ready to be dequeued by the consumer.
+typedef void (CALLBACK *PFN_SURFACE_ENQUEUE_COMPLETION)(HRESULT hr, void* pContext);
+
+// Interval at which a pending enqueue polls the producer with DO_NOT_WAIT flushes.
+#define SURFACE_QUEUE_ASYNC_FLUSH_INTERVAL (1)
+
+//
+// With C++20 coroutines the wrappers can also be awaited:
+//
+//      IUnknown* pSurface;
+//      HRESULT hr = co_await consumer.DequeueAsync(__uuidof(ID3D11Texture2D), &pSurface);
+//      hr = co_await producer.EnqueueAsync(pSurface);
+//
+// The coroutine resumes on the thread pool thread that completed the operation,
+// or right away when the operation completes or fails at once.  The awaitables
+// are only available when the translation unit is compiled natively with
+// coroutine support.
+//
+#if defined(__cpp_impl_coroutine) && !defined(_M_CEE)
+#include <coroutine>
+#define SURFACE_QUEUE_COROUTINES
+
+class SurfaceDequeueAwaitable;
+class SurfaceEnqueueAwaitable;
+#endif
+
+class CSurfaceConsumerAsync : public ISurfaceQueueNotify
+{
+    public:
+        CSurfaceConsumerAsync();
+        ~CSurfaceConsumerAsync();
+
+        HRESULT Initialize(ISurfaceConsumer* pConsumer);
+
+        // Dequeues without waiting.  Returns HRESULT_FROM_WIN32(WAIT_TIMEOUT) when
+        // the queue is empty.
+        HRESULT TryDequeue(REFIID id, IUnknown** ppSurface, void* pBuffer, UINT* pBufferSize);
+
+        // Starts a dequeue.  The completion is always called on the thread pool,
+        // even if a surface is already available.  The buffer must stay valid
+        // until then.
+        HRESULT BeginDequeue(
+                            REFIID                          id,
+                            void*                           pBuffer,
+                            UINT                            BufferSize,
+                            PFN_SURFACE_DEQUEUE_COMPLETION  pfnCompletion,
+                            void*                           pContext
+                        );
+
+#ifdef SURFACE_QUEUE_COROUTINES
+        // TryDequeue, or BeginDequeue when the queue is empty.  The buffer and
+        // the outputs must stay valid until the coroutine resumes.
+        SurfaceDequeueAwaitable DequeueAsync(REFIID id, IUnknown** ppSurface, void* pBuffer = NULL, UINT* pBufferSize = NULL);
+#endif
+
+    // ISurfaceQueueNotify
+    public:
+        void OnSurfaceEnqueued(CSurfaceQueue* pQueue);
+        void OnSurfacesFlushed(CSurfaceQueue* pQueue, UINT NumSurfaces);
+        void OnSurfacesReclaimed(CSurfaceQueue* pQueue, UINT NumSurfaces);
+
+    private:
+        static void CALLBACK WorkCallback(PTP_CALLBACK_INSTANCE, PVOID pContext, PTP_WORK);
+
+        // Schedules the work callback unless it is already scheduled or running.
+        void Kick();
+        void ProcessPendingDequeue();
+
+    private:
+        ISurfaceConsumer*                   m_pConsumer;
+        CSurfaceQueue*                      m_pQueue;
+        PTP_WORK                            m_pWork;
+
+        // Number of kicks since the work callback last drained them
+        volatile LONG                       m_nSignals;
+
+        // The outstanding operation
+        volatile LONG                       m_IsPending;
+        IID                                 m_id;
+        void*                               m_pBuffer;
+        UINT                                m_BufferSize;
+        PFN_SURFACE_DEQUEUE_COMPLETION      m_pfnCompletion;
+        void*                               m_pContext;
+};
+
+class CSurfaceProducerAsync : public ISurfaceQueueNotify
+{
+    public:
+        CSurfaceProducerAsync();
+        ~CSurfaceProducerAsync();
+
+        HRESULT Initialize(ISurfaceProducer* pProducer);
+
+        // Enqueues the surface and completes once it is FLUSHED.  The copy to
+        // the staging resource is issued before the call returns.
+        HRESULT BeginEnqueue(
+                            IUnknown*                       pSurface,
+                            void*                           pBuffer,
+                            UINT                            BufferSize,
+                            PFN_SURFACE_ENQUEUE_COMPLETION  pfnCompletion,
+                            void*                           pContext
+                        );
+
+#ifdef SURFACE_QUEUE_COROUTINES
+        // BeginEnqueue, resuming the coroutine once the surface is FLUSHED.
+        SurfaceEnqueueAwaitable EnqueueAsync(IUnknown* pSurface, void* pBuffer = NULL, UINT BufferSize = 0);
+#endif
+
+    // ISurfaceQueueNotify
+    public:
+        void OnSurfaceEnqueued(CSurfaceQueue* pQueue);
+        void OnSurfacesFlushed(CSurfaceQueue* pQueue, UINT NumSurfaces);
+        void OnSurfacesReclaimed(CSurfaceQueue* pQueue, UINT NumSurfaces);
+
+    private:
+        static void CALLBACK WorkCallback(PTP_CALLBACK_INSTANCE, PVOID pContext, PTP_WORK);
+        static void CALLBACK TimerCallback(PTP_CALLBACK_INSTANCE, PVOID pContext, PTP_TIMER);
+
+        void Kick();
+        void ProcessPendingEnqueue();
+        void SetPolling(BOOL IsPolling);
+
+    private:
+        ISurfaceProducer*                   m_pProducer;
+        CSurfaceQueue*                      m_pQueue;
+        PTP_WORK                            m_pWork;
+        PTP_TIMER                           m_pTimer;
+
+        volatile LONG                       m_nSignals;
+
+        //
+        // Surfaces leave the queue's enqueued list in FIFO order, so a surface
+        // is FLUSHED once more surfaces have been flushed than were enqueued
+        // ahead of it.
+        //
+        volatile LONG                       m_nEnqueued;
+        volatile LONG                       m_nFlushed;
+
+        volatile LONG                       m_IsPending;
+        LONG                                m_Ticket;
+        PFN_SURFACE_ENQUEUE_COMPLETION      m_pfnCompletion;
+        void*                               m_pContext;
+};
+
+#ifdef SURFACE_QUEUE_COROUTINES
+class SurfaceDequeueAwaitable
+{
+    public:
+        SurfaceDequeueAwaitable(CSurfaceConsumerAsync& consumer, REFIID id, IUnknown** ppSurface,
+                                void* pBuffer = NULL, UINT* pBufferSize = NULL) :
+            m_Consumer(consumer), m_id(id), m_ppSurface(ppSurface),
+            m_pBuffer(pBuffer), m_pBufferSize(pBufferSize), m_hr(E_FAIL)
+        {
+        }
+
+        bool await_ready()
+        {
+            m_hr = m_Consumer.TryDequeue(m_id, m_ppSurface, m_pBuffer, m_pBufferSize);
+            return m_hr != HRESULT_FROM_WIN32(WAIT_TIMEOUT);
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            m_Handle = handle;
+            HRESULT hr = m_Consumer.BeginDequeue(m_id, m_pBuffer, m_pBufferSize ? *m_pBufferSize : 0,
+                                                 &Complete, this);
+            if (FAILED(hr))
+            {
+                m_hr = hr;
+                return false;
+            }
+            return true;
+        }
+
+        HRESULT await_resume() const { return m_hr; }
+
+    private:
+        static void CALLBACK Complete(HRESULT hr, IUnknown* pSurface, UINT BufferSize, void* pContext)
+        {
+            SurfaceDequeueAwaitable* pThis = static_cast<SurfaceDequeueAwaitable*>(pContext);
+            pThis->m_hr = hr;
+            *pThis->m_ppSurface = pSurface;
+            if (pThis->m_pBufferSize)
+            {
+                *pThis->m_pBufferSize = BufferSize;
+            }
+            pThis->m_Handle.resume();
+        }
+
+        CSurfaceConsumerAsync&              m_Consumer;
+        IID                                 m_id;
+        IUnknown**                          m_ppSurface;
+        void*                               m_pBuffer;
+        UINT*                               m_pBufferSize;
+        HRESULT                             m_hr;
+        std::coroutine_handle<>             m_Handle;
+};
+
+class SurfaceEnqueueAwaitable
+{
+    public:
+        SurfaceEnqueueAwaitable(CSurfaceProducerAsync& producer, IUnknown* pSurface,
+                                void* pBuffer = NULL, UINT BufferSize = 0) :
+            m_Producer(producer), m_pSurface(pSurface),
+            m_pBuffer(pBuffer), m_BufferSize(BufferSize), m_hr(E_FAIL)
+        {
+        }
+
+        bool await_ready() const { return false; }
+
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            m_Handle = handle;
+            HRESULT hr = m_Producer.BeginEnqueue(m_pSurface, m_pBuffer, m_BufferSize, &Complete, this);
+            if (FAILED(hr))
+            {
+                m_hr = hr;
+                return false;
+            }
+            return true;
+        }
+
+        HRESULT await_resume() const { return m_hr; }
+
+    private:
+        static void CALLBACK Complete(HRESULT hr, void* pContext)
+        {
+            SurfaceEnqueueAwaitable* pThis = static_cast<SurfaceEnqueueAwaitable*>(pContext);
+            pThis->m_hr = hr;
+            pThis->m_Handle.resume();
+        }
+
+        CSurfaceProducerAsync&              m_Producer;
+        IUnknown*                           m_pSurface;
+        void*                               m_pBuffer;
+        UINT                                m_BufferSize;
+        HRESULT                             m_hr;
+        std::coroutine_handle<>             m_Handle;
+};
+
+inline SurfaceDequeueAwaitable CSurfaceConsumerAsync::DequeueAsync(REFIID id, IUnknown** ppSurface, void* pBuffer, UINT* pBufferSize)
+{
+    return SurfaceDequeueAwaitable(*this, id, ppSurface, pBuffer, pBufferSize);
+}
+
+inline SurfaceEnqueueAwaitable CSurfaceProducerAsync::EnqueueAsync(IUnknown* pSurface, void* pBuffer, UINT BufferSize)
+{
+    return SurfaceEnqueueAwaitable(*this, pSurface, pBuffer, BufferSize);
+}
+#endif
@@ -0,0 +1,480 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#include <new>
+#include "SurfaceQueueImpl.h"
+
+//-----------------------------------------------------------------------------
+// CBudgetUsage
+//
+// Bytes charged per key (a device or a format).  There are only a handful of
+// devices and formats in a process, so this is a small array searched linearly.
+//-----------------------------------------------------------------------------
+class CBudgetUsage
+{
+    public:
+        ULONGLONG Get(ULONG_PTR Key) const
+        {
+            for (UINT i = 0; i < m_nEntries; i++)
+            {
+                if (m_pEntries[i].Key == Key)
+                {
+                    return m_pEntries[i].Bytes;
+                }
+            }
+            return 0;
+        }
+
+        BOOL Add(ULONG_PTR Key, ULONGLONG Bytes)
+        {
+            for (UINT i = 0; i < m_nEntries; i++)
+            {
+                if (m_pEntries[i].Key == Key)
+                {
+                    m_pEntries[i].Bytes += Bytes;
+                    return TRUE;
+                }
+            }
+
+            if (m_nEntries == m_nCapacity)
+            {
+                UINT    Capacity    = m_nCapacity ? m_nCapacity * 2 : 8;
+                Entry*  pEntries    = new QUEUE_NOTHROW_SPECIFIER Entry[Capacity];
+                if (!pEntries)
+                {
+                    return FALSE;
+                }
+                if (m_pEntries)
+                {
+                    memcpy(pEntries, m_pEntries, sizeof(Entry) * m_nEntries);
+                    delete[] m_pEntries;
+                }
+                m_pEntries  = pEntries;
+                m_nCapacity = Capacity;
+            }
+
+            m_pEntries[m_nEntries].Key      = Key;
+            m_pEntries[m_nEntries].Bytes    = Bytes;
+            m_nEntries++;
+            return TRUE;
+        }
+
+        void Remove(ULONG_PTR Key, ULONGLONG Bytes)
+        {
+            for (UINT i = 0; i < m_nEntries; i++)
+            {
+                if (m_pEntries[i].Key == Key)
+                {
+                    ASSERT(m_pEntries[i].Bytes >= Bytes);
+                    m_pEntries[i].Bytes -= Bytes;
+
+                    // Drop the entry so a device pointer that gets reused
+                    // starts from zero
+                    if (m_pEntries[i].Bytes == 0)
+                    {
+                        m_pEntries[i] = m_pEntries[--m_nEntries];
+                    }
+                    return;
+                }
+            }
+            ASSERT(FALSE);
+        }
+
+    private:
+        struct Entry
+        {
+            ULONG_PTR       Key;
+            ULONGLONG       Bytes;
+        };
+
+        // Only used for globals, which start out zeroed
+        Entry*              m_pEntries;
+        UINT                m_nEntries;
+        UINT                m_nCapacity;
+};
+
+//
+// The budget.  The totals and usage tables are protected by g_BudgetLock.
+//
+static SRWLOCK                      g_BudgetLock    = SRWLOCK_INIT;
+static ULONGLONG                    g_Budget        = 0;
+static SURFACE_QUEUE_BUDGET_POLICY  g_Policy        = SURFACE_QUEUE_BUDGET_POLICY_TRACK;
+static ULONGLONG                    g_CurrentBytes  = 0;
+static ULONGLONG                    g_HighWaterBytes = 0;
+static ULONGLONG                    g_KindBytes[SURFACE_QUEUE_BUDGET_NUM_KINDS];
+static UINT                         g_NumReclaims   = 0;
+static UINT                         g_NumRefused    = 0;
+static CBudgetUsage                 g_DeviceUsage;
+static CBudgetUsage                 g_FormatUsage;
+
+//
+// The reclaim callbacks.  g_ReclaimLock is held while they run, so only one
+// reclaim happens at a time and unregistering waits for it.
+//
+struct ReclaimCallback
+{
+    PFN_SURFACE_QUEUE_RECLAIM       pfnReclaim;
+    void*                           pContext;
+};
+
+static SRWLOCK                      g_ReclaimLock   = SRWLOCK_INIT;
+static volatile DWORD               g_ReclaimThread = 0;
+static ReclaimCallback              g_Callbacks[SURFACE_QUEUE_MAX_RECLAIM_CALLBACKS];
+static UINT                         g_nCallbacks    = 0;
+
+//-----------------------------------------------------------------------------
+// Estimated size of a resource.  Formats the software device doesn't know
+// are counted as 4 bytes per pixel.
+//-----------------------------------------------------------------------------
+static ULONGLONG GetResourceSize(DXGI_FORMAT Format, UINT Width, UINT Height)
+{
+    UINT PixelSize = GetSoftwareSurfaceFormatSize(Format);
+    if (PixelSize == 0)
+    {
+        PixelSize = 4;
+    }
+    return (ULONGLONG)Width * Height * PixelSize;
+}
+
+//-----------------------------------------------------------------------------
+// Bytes over the budget if Bytes more were charged.  The caller holds
+// g_BudgetLock.
+//-----------------------------------------------------------------------------
+static ULONGLONG GetBytesOverBudget(ULONGLONG Bytes)
+{
+    if (g_Budget == 0 || g_CurrentBytes + Bytes <= g_Budget)
+    {
+        return 0;
+    }
+    return g_CurrentBytes + Bytes - g_Budget;
+}
+
+//-----------------------------------------------------------------------------
+// Calls the reclaim callbacks until Bytes more fit in the budget
+//-----------------------------------------------------------------------------
+static void ReclaimBudget(ULONGLONG Bytes)
+{
+    // Resources created by a callback are not sent back to reclaim
+    if (g_ReclaimThread == GetCurrentThreadId())
+    {
+        return;
+    }
+
+    AcquireSRWLockExclusive(&g_ReclaimLock);
+    g_ReclaimThread = GetCurrentThreadId();
+
+    for (UINT i = 0; i < g_nCallbacks; i++)
+    {
+        ULONGLONG Needed;
+
+        AcquireSRWLockExclusive(&g_BudgetLock);
+        Needed = GetBytesOverBudget(Bytes);
+        if (Needed && i == 0)
+        {
+            g_NumReclaims++;
+        }
+        ReleaseSRWLockExclusive(&g_BudgetLock);
+
+        if (Needed == 0)
+        {
+            break;
+        }
+
+        g_Callbacks[i].pfnReclaim(Needed, g_Callbacks[i].pContext);
+    }
+
+    g_ReclaimThread = 0;
+    ReleaseSRWLockExclusive(&g_ReclaimLock);
+}
+
+//-----------------------------------------------------------------------------
+// CBudgetCharge implementation
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+CBudgetCharge::CBudgetCharge() :
+    m_pDevice(NULL),
+    m_Kind(SURFACE_QUEUE_BUDGET_SURFACES),
+    m_Format(DXGI_FORMAT_UNKNOWN),
+    m_Bytes(0)
+{
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CBudgetCharge::Acquire(
+                    IUnknown*                   pDevice,
+                    SURFACE_QUEUE_BUDGET_KIND   Kind,
+                    DXGI_FORMAT                 Format,
+                    UINT                        Width,
+                    UINT                        Height,
+                    UINT                        Count)
+{
+    ASSERT(pDevice);
+    ASSERT(m_Bytes == 0);
+
+    HRESULT     hr          = S_OK;
+    IUnknown*   pIdentity   = NULL;
+    ULONGLONG   Bytes       = GetResourceSize(Format, Width, Height) * Count;
+    BOOL        Reclaimed   = FALSE;
+
+    // The same device can be passed as any of its interfaces
+    if (FAILED(hr = pDevice->QueryInterface(__uuidof(IUnknown), (void**)&pIdentity)))
+    {
+        return hr;
+    }
+    // Only the pointer is kept, as a key
+    pIdentity->Release();
+
+    for (;;)
+    {
+        AcquireSRWLockExclusive(&g_BudgetLock);
+
+        if (g_Policy == SURFACE_QUEUE_BUDGET_POLICY_TRACK || GetBytesOverBudget(Bytes) == 0)
+        {
+            if (!g_DeviceUsage.Add((ULONG_PTR)pIdentity, Bytes))
+            {
+                hr = E_OUTOFMEMORY;
+            }
+            else if (!g_FormatUsage.Add((ULONG_PTR)Format, Bytes))
+            {
+                g_DeviceUsage.Remove((ULONG_PTR)pIdentity, Bytes);
+                hr = E_OUTOFMEMORY;
+            }
+            else
+            {
+                g_CurrentBytes      += Bytes;
+                g_KindBytes[Kind]   += Bytes;
+                g_HighWaterBytes    = max(g_HighWaterBytes, g_CurrentBytes);
+
+                m_pDevice   = pIdentity;
+                m_Kind      = Kind;
+                m_Format    = Format;
+                m_Bytes     = Bytes;
+            }
+            break;
+        }
+
+        if (g_Policy == SURFACE_QUEUE_BUDGET_POLICY_FAIL_FAST || Reclaimed)
+        {
+            g_NumRefused++;
+            hr = SURFACE_QUEUE_E_OVER_BUDGET;
+            break;
+        }
+
+        ReleaseSRWLockExclusive(&g_BudgetLock);
+
+        ReclaimBudget(Bytes);
+        Reclaimed = TRUE;
+    }
+
+    ReleaseSRWLockExclusive(&g_BudgetLock);
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+void CBudgetCharge::Release()
+{
+    if (m_Bytes == 0)
+    {
+        return;
+    }
+
+    AcquireSRWLockExclusive(&g_BudgetLock);
+
+    g_DeviceUsage.Remove((ULONG_PTR)m_pDevice, m_Bytes);
+    g_FormatUsage.Remove((ULONG_PTR)m_Format, m_Bytes);
+    g_CurrentBytes      -= m_Bytes;
+    g_KindBytes[m_Kind] -= m_Bytes;
+
+    ReleaseSRWLockExclusive(&g_BudgetLock);
+
+    m_pDevice   = NULL;
+    m_Bytes     = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Budget API
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI SetSurfaceQueueBudget(
+                    ULONGLONG                   BudgetBytes,
+                    SURFACE_QUEUE_BUDGET_POLICY Policy)
+{
+    if (Policy != SURFACE_QUEUE_BUDGET_POLICY_TRACK &&
+        Policy != SURFACE_QUEUE_BUDGET_POLICY_FAIL_FAST &&
+        Policy != SURFACE_QUEUE_BUDGET_POLICY_RECLAIM)
+    {
+        return E_INVALIDARG;
+    }
+
+    AcquireSRWLockExclusive(&g_BudgetLock);
+    g_Budget = BudgetBytes;
+    g_Policy = Policy;
+    ReleaseSRWLockExclusive(&g_BudgetLock);
+
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI GetSurfaceQueueBudgetStats(SURFACE_QUEUE_BUDGET_STATS* pStats)
+{
+    if (!pStats)
+    {
+        return E_INVALIDARG;
+    }
+
+    AcquireSRWLockShared(&g_BudgetLock);
+
+    pStats->Budget          = g_Budget;
+    pStats->Policy          = g_Policy;
+    pStats->CurrentBytes    = g_CurrentBytes;
+    pStats->HighWaterBytes  = g_HighWaterBytes;
+    for (UINT i = 0; i < SURFACE_QUEUE_BUDGET_NUM_KINDS; i++)
+    {
+        pStats->KindBytes[i] = g_KindBytes[i];
+    }
+    pStats->NumReclaims     = g_NumReclaims;
+    pStats->NumRefused      = g_NumRefused;
+
+    ReleaseSRWLockShared(&g_BudgetLock);
+
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI ResetSurfaceQueueHighWaterMark()
+{
+    AcquireSRWLockExclusive(&g_BudgetLock);
+    g_HighWaterBytes = g_CurrentBytes;
+    ReleaseSRWLockExclusive(&g_BudgetLock);
+
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI GetSurfaceQueueDeviceUsage(
+                    IUnknown*                   pDevice,
+                    ULONGLONG*                  pBytes)
+{
+    if (!pDevice || !pBytes)
+    {
+        return E_INVALIDARG;
+    }
+
+    HRESULT     hr          = S_OK;
+    IUnknown*   pIdentity   = NULL;
+
+    if (FAILED(hr = pDevice->QueryInterface(__uuidof(IUnknown), (void**)&pIdentity)))
+    {
+        return hr;
+    }
+
+    AcquireSRWLockShared(&g_BudgetLock);
+    *pBytes = g_DeviceUsage.Get((ULONG_PTR)pIdentity);
+    ReleaseSRWLockShared(&g_BudgetLock);
+
+    pIdentity->Release();
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI GetSurfaceQueueFormatUsage(
+                    DXGI_FORMAT                 Format,
+                    ULONGLONG*                  pBytes)
+{
+    if (!pBytes)
+    {
+        return E_INVALIDARG;
+    }
+
+    AcquireSRWLockShared(&g_BudgetLock);
+    *pBytes = g_FormatUsage.Get((ULONG_PTR)Format);
+    ReleaseSRWLockShared(&g_BudgetLock);
+
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI RegisterSurfaceQueueReclaimCallback(
+                    PFN_SURFACE_QUEUE_RECLAIM   pfnReclaim,
+                    void*                       pContext)
+{
+    if (!pfnReclaim)
+    {
+        return E_INVALIDARG;
+    }
+    // Changing the list from a callback would deadlock
+    if (g_ReclaimThread == GetCurrentThreadId())
+    {
+        return HRESULT_FROM_WIN32(ERROR_BUSY);
+    }
+
+    HRESULT hr = S_OK;
+
+    AcquireSRWLockExclusive(&g_ReclaimLock);
+
+    for (UINT i = 0; i < g_nCallbacks; i++)
+    {
+        if (g_Callbacks[i].pfnReclaim == pfnReclaim && g_Callbacks[i].pContext == pContext)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS);
+            goto end;
+        }
+    }
+
+    if (g_nCallbacks == SURFACE_QUEUE_MAX_RECLAIM_CALLBACKS)
+    {
+        hr = E_OUTOFMEMORY;
+        goto end;
+    }
+
+    g_Callbacks[g_nCallbacks].pfnReclaim    = pfnReclaim;
+    g_Callbacks[g_nCallbacks].pContext      = pContext;
+    g_nCallbacks++;
+
+end:
+    ReleaseSRWLockExclusive(&g_ReclaimLock);
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI UnregisterSurfaceQueueReclaimCallback(
+                    PFN_SURFACE_QUEUE_RECLAIM   pfnReclaim,
+                    void*                       pContext)
+{
+    if (!pfnReclaim)
+    {
+        return E_INVALIDARG;
+    }
+    if (g_ReclaimThread == GetCurrentThreadId())
+    {
+        return HRESULT_FROM_WIN32(ERROR_BUSY);
+    }
+
+    HRESULT hr = E_INVALIDARG;
+
+    AcquireSRWLockExclusive(&g_ReclaimLock);
+
+    for (UINT i = 0; i < g_nCallbacks; i++)
+    {
+        if (g_Callbacks[i].pfnReclaim == pfnReclaim && g_Callbacks[i].pContext == pContext)
+        {
+            // Keep the registration order
+            for (UINT j = i + 1; j < g_nCallbacks; j++)
+            {
+                g_Callbacks[j - 1] = g_Callbacks[j];
+            }
+            g_nCallbacks--;
+            hr = S_OK;
+            break;
+        }
+    }
+
+    ReleaseSRWLockExclusive(&g_ReclaimLock);
+    return hr;
+}
@@ -0,0 +1,106 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#pragma once
+
+#include "surfacequeue.h"
+
+//
+// Surface memory budget.
+//
+// Every queue network creates NumSurfaces shared surfaces, and every producer
+// and readback consumer creates its own copy resources.  The budget accounts
+// the memory of all of them in the process, per device and per format, and
+// keeps the highest total seen.  The size of a resource is estimated from its
+// dimensions and format; drivers may pad it.
+//
+// With a budget set, the resources of a queue, producer or readback consumer
+// are charged before they are created, and the creation fails with
+// SURFACE_QUEUE_E_OVER_BUDGET when the charge does not fit.  With the reclaim
+// policy the reclaim callbacks are asked to free memory first, for example
+// by releasing the queues of images that are not visible or pooled surfaces
+// that are not in use.  Queues can't shrink by themselves since their
+// surfaces may be held by devices at any time.
+//
+
+#define SURFACE_QUEUE_E_OVER_BUDGET             HRESULT_FROM_WIN32(ERROR_NOT_ENOUGH_QUOTA)
+
+#define SURFACE_QUEUE_MAX_RECLAIM_CALLBACKS     (16)
+
+enum SURFACE_QUEUE_BUDGET_POLICY
+{
+    // Only account; nothing is refused.  This is the default.
+    SURFACE_QUEUE_BUDGET_POLICY_TRACK = 0,
+    // Refuse what does not fit
+    SURFACE_QUEUE_BUDGET_POLICY_FAIL_FAST,
+    // Call the reclaim callbacks, then refuse what still does not fit
+    SURFACE_QUEUE_BUDGET_POLICY_RECLAIM,
+};
+
+enum SURFACE_QUEUE_BUDGET_KIND
+{
+    // The shared surfaces of the queue networks
+    SURFACE_QUEUE_BUDGET_SURFACES = 0,
+    // The copy resources of producers and readback consumers
+    SURFACE_QUEUE_BUDGET_STAGING,
+    SURFACE_QUEUE_BUDGET_NUM_KINDS,
+};
+
+struct SURFACE_QUEUE_BUDGET_STATS
+{
+    // 0 when no budget is set
+    ULONGLONG                   Budget;
+    SURFACE_QUEUE_BUDGET_POLICY Policy;
+
+    ULONGLONG                   CurrentBytes;
+    ULONGLONG                   HighWaterBytes;
+    ULONGLONG                   KindBytes[SURFACE_QUEUE_BUDGET_NUM_KINDS];
+
+    // Times the reclaim callbacks were called, and charges refused
+    UINT                        NumReclaims;
+    UINT                        NumRefused;
+};
+
+//
+// Called with the number of bytes that have to be freed for a charge to fit.
+// The callbacks are called in the order they were registered until enough is
+// free.  They run on the thread creating the resources and must not
+// unregister callbacks; queues they create are never sent back to reclaim.
+//
+typedef void (CALLBACK *PFN_SURFACE_QUEUE_RECLAIM)(
+                                ULONGLONG       BytesNeeded,
+                                void*           pContext);
+
+// Sets the budget in bytes and the policy.  A budget of 0 removes the limit.
+// Memory already charged is kept even if it is over the new budget.
+HRESULT WINAPI SetSurfaceQueueBudget(
+                    ULONGLONG                   BudgetBytes,
+                    SURFACE_QUEUE_BUDGET_POLICY Policy);
+
+HRESULT WINAPI GetSurfaceQueueBudgetStats(
+                    SURFACE_QUEUE_BUDGET_STATS* pStats);
+
+// Restarts the high-water mark at the current total
+HRESULT WINAPI ResetSurfaceQueueHighWaterMark();
+
+// Bytes charged for the resources created on a device, and of a format
+HRESULT WINAPI GetSurfaceQueueDeviceUsage(
+                    IUnknown*                   pDevice,
+                    ULONGLONG*                  pBytes);
+
+HRESULT WINAPI GetSurfaceQueueFormatUsage(
+                    DXGI_FORMAT                 Format,
+                    ULONGLONG*                  pBytes);
+
+HRESULT WINAPI RegisterSurfaceQueueReclaimCallback(
+                    PFN_SURFACE_QUEUE_RECLAIM   pfnReclaim,
+                    void*                       pContext);
+
+// Waits for a reclaim in progress to finish before it returns
+HRESULT WINAPI UnregisterSurfaceQueueReclaimCallback(
+                    PFN_SURFACE_QUEUE_RECLAIM   pfnReclaim,
+                    void*                       pContext);
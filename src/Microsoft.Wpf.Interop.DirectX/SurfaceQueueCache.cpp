@@ -0,0 +1,300 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#include <new>
+#include "SurfaceQueueImpl.h"
+
+//-----------------------------------------------------------------------------
+// COpenedSurfaceCache implementation
+//
+// A network has NumSurfaces surfaces and rarely more than a couple of consumer
+// devices, so the entries are kept in an array that is searched linearly.  The
+// lock is only taken when consumers are opened and removed, and by the first
+// dequeue of each surface of lazy queues.
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+COpenedSurfaceCache::COpenedSurfaceCache() :
+    m_pEntries(NULL),
+    m_nEntries(0),
+    m_nCapacity(0)
+{
+    InitializeSRWLock(&m_Lock);
+}
+
+//-----------------------------------------------------------------------------
+COpenedSurfaceCache::~COpenedSurfaceCache()
+{
+    // All of the consumers are gone by the time the network is
+    for (UINT i = 0; i < m_nEntries; i++)
+    {
+        ASSERT(m_pEntries[i].Users == 0);
+        m_pEntries[i].pSurface->Release();
+    }
+
+    if (m_pEntries)
+    {
+        delete[] m_pEntries;
+    }
+}
+
+//-----------------------------------------------------------------------------
+HRESULT COpenedSurfaceCache::Acquire(
+                    ISurfaceQueueDevice*        pDevice,
+                    IUnknown*                   pDeviceKey,
+                    const SharedSurfaceObject*  pObject,
+                    IUnknown**                  ppSurface)
+{
+    ASSERT(pDevice && pDeviceKey && pObject && ppSurface);
+
+    HRESULT     hr          = S_OK;
+    IUnknown*   pSurface    = NULL;
+
+    AcquireSRWLockExclusive(&m_Lock);
+
+    for (UINT i = 0; i < m_nEntries; i++)
+    {
+        if (m_pEntries[i].pDeviceKey == pDeviceKey && m_pEntries[i].pObject == pObject)
+        {
+            m_pEntries[i].Users++;
+            *ppSurface = m_pEntries[i].pSurface;
+            goto end;
+        }
+    }
+
+    if (m_nEntries == m_nCapacity)
+    {
+        UINT    Capacity    = m_nCapacity ? m_nCapacity * 2 : 8;
+        Entry*  pEntries    = new QUEUE_NOTHROW_SPECIFIER Entry[Capacity];
+        if (!pEntries)
+        {
+            hr = E_OUTOFMEMORY;
+            goto end;
+        }
+        if (m_pEntries)
+        {
+            memcpy(pEntries, m_pEntries, sizeof(Entry) * m_nEntries);
+            delete[] m_pEntries;
+        }
+        m_pEntries  = pEntries;
+        m_nCapacity = Capacity;
+    }
+
+    if (FAILED(hr = pDevice->OpenSurface(pObject->hSharedHandle,
+                                         (void**)&pSurface,
+                                         pObject->width,
+                                         pObject->height,
+                                         pObject->format)))
+    {
+        goto end;
+    }
+
+    ASSERT(pSurface);
+
+    m_pEntries[m_nEntries].pDeviceKey   = pDeviceKey;
+    m_pEntries[m_nEntries].pObject      = pObject;
+    m_pEntries[m_nEntries].pSurface     = pSurface;
+    m_pEntries[m_nEntries].Users        = 1;
+    m_nEntries++;
+
+    *ppSurface = pSurface;
+
+end:
+    ReleaseSRWLockExclusive(&m_Lock);
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+void COpenedSurfaceCache::Release(IUnknown* pDeviceKey, const SharedSurfaceObject* pObject)
+{
+    AcquireSRWLockExclusive(&m_Lock);
+
+    for (UINT i = 0; i < m_nEntries; i++)
+    {
+        if (m_pEntries[i].pDeviceKey == pDeviceKey && m_pEntries[i].pObject == pObject)
+        {
+            // The surface stays open for the next consumer on the device
+            ASSERT(m_pEntries[i].Users > 0);
+            m_pEntries[i].Users--;
+            break;
+        }
+    }
+
+    ReleaseSRWLockExclusive(&m_Lock);
+}
+
+//-----------------------------------------------------------------------------
+void COpenedSurfaceCache::Trim(IUnknown* pDeviceKey)
+{
+    AcquireSRWLockExclusive(&m_Lock);
+
+    for (UINT i = 0; i < m_nEntries; )
+    {
+        if (m_pEntries[i].Users == 0 && m_pEntries[i].pDeviceKey != pDeviceKey)
+        {
+            m_pEntries[i].pSurface->Release();
+            m_pEntries[i] = m_pEntries[--m_nEntries];
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    ReleaseSRWLockExclusive(&m_Lock);
+}
+
+//-----------------------------------------------------------------------------
+// Consumer surface data
+//
+// Each surface the consumer opened keeps a short list of the interfaces
+// Dequeue handed out and of the objects the consumer attached.  Only the
+// consumer touches the lists, under its own lock, and they are released with
+// it, after no call can still be reading them.
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+CSurfaceQueue::SharedSurfaceData** CSurfaceQueue::FindSurfaceData(UINT Index, REFGUID Key, BOOL IsInterface)
+{
+    ASSERT(Index < m_Desc.NumSurfaces);
+
+    SharedSurfaceData** ppData = &m_ConsumerSurfaces[Index].pData;
+
+    for (; *ppData; ppData = &(*ppData)->pNext)
+    {
+        if ((*ppData)->IsInterface == IsInterface && (*ppData)->Key == Key)
+        {
+            break;
+        }
+    }
+    return ppData;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueue::GetSurfaceInterface(UINT Index, IUnknown* pSurface, REFIID id, IUnknown** ppInterface)
+{
+    ASSERT(pSurface && ppInterface);
+
+    HRESULT             hr          = S_OK;
+    IUnknown*           pInterface  = NULL;
+    SharedSurfaceData** ppData      = FindSurfaceData(Index, id, TRUE);
+
+    if (*ppData)
+    {
+        *ppInterface = (*ppData)->pObject;
+        return S_OK;
+    }
+
+    if (FAILED(hr = pSurface->QueryInterface(id, (void**)&pInterface)))
+    {
+        return hr;
+    }
+
+    *ppData = new QUEUE_NOTHROW_SPECIFIER SharedSurfaceData;
+    if (!*ppData)
+    {
+        pInterface->Release();
+        return E_OUTOFMEMORY;
+    }
+
+    (*ppData)->Key          = id;
+    (*ppData)->IsInterface  = TRUE;
+    (*ppData)->pObject      = pInterface;
+    (*ppData)->pNext        = NULL;
+
+    *ppInterface = pInterface;
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueue::SetSurfaceData(HANDLE hSharedHandle, REFGUID Key, IUnknown* pData)
+{
+    SharedSurfaceObject*    pObject = GetSurfaceObjectFromHandle(hSharedHandle);
+    UINT                    Index   = pObject ? GetSurfaceIndex(pObject) : m_Desc.NumSurfaces;
+
+    // Only surfaces this consumer opened have data
+    if (Index >= m_Desc.NumSurfaces || !m_ConsumerSurfaces[Index].pSurface)
+    {
+        return E_INVALIDARG;
+    }
+
+    SharedSurfaceData** ppData = FindSurfaceData(Index, Key, FALSE);
+
+    if (!pData)
+    {
+        if (*ppData)
+        {
+            SharedSurfaceData* pRemoved = *ppData;
+
+            *ppData = pRemoved->pNext;
+            pRemoved->pObject->Release();
+            delete pRemoved;
+        }
+        return S_OK;
+    }
+
+    if (!*ppData)
+    {
+        *ppData = new QUEUE_NOTHROW_SPECIFIER SharedSurfaceData;
+        if (!*ppData)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        (*ppData)->Key          = Key;
+        (*ppData)->IsInterface  = FALSE;
+        (*ppData)->pObject      = NULL;
+        (*ppData)->pNext        = NULL;
+    }
+
+    pData->AddRef();
+    if ((*ppData)->pObject)
+    {
+        (*ppData)->pObject->Release();
+    }
+    (*ppData)->pObject = pData;
+
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueue::GetSurfaceData(HANDLE hSharedHandle, REFGUID Key, IUnknown** ppData)
+{
+    SharedSurfaceObject*    pObject = GetSurfaceObjectFromHandle(hSharedHandle);
+    UINT                    Index   = pObject ? GetSurfaceIndex(pObject) : m_Desc.NumSurfaces;
+
+    if (Index >= m_Desc.NumSurfaces || !m_ConsumerSurfaces[Index].pSurface)
+    {
+        return E_INVALIDARG;
+    }
+
+    SharedSurfaceData* pData = *FindSurfaceData(Index, Key, FALSE);
+    if (!pData)
+    {
+        return DXGI_ERROR_NOT_FOUND;
+    }
+
+    pData->pObject->AddRef();
+    *ppData = pData->pObject;
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceQueue::ReleaseSurfaceData(UINT Index)
+{
+    SharedSurfaceData* pData = m_ConsumerSurfaces[Index].pData;
+
+    while (pData)
+    {
+        SharedSurfaceData* pNext = pData->pNext;
+
+        pData->pObject->Release();
+        delete pData;
+        pData = pNext;
+    }
+    m_ConsumerSurfaces[Index].pData = NULL;
+}
@@ -0,0 +1,520 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#include <new>
+#include <dxgi.h>
+#include "SurfaceQueueImpl.h"
+#include "SurfaceQueueDevicePool.h"
+
+//
+// A set of devices in the pool.  The pool holds one reference to each device
+// and every holder one more.
+//
+struct PooledDeviceSet
+{
+    UINT                    Adapter;
+    ATOM                    WindowClass;
+    SURFACE_DEVICE_SET      Set;
+    UINT                    Holders;
+    // Lost sets are never handed out again and leave with their last holder
+    BOOL                    Lost;
+    // Held by the holder rendering on the D3D10 device
+    CRITICAL_SECTION        RenderLock;
+    PooledDeviceSet*        pNext;
+};
+
+static HRESULT CALLBACK CreateDefaultDeviceSet(UINT, HWND, SURFACE_DEVICE_SET*, void*);
+static BOOL CALLBACK IsDefaultDeviceSetLost(const SURFACE_DEVICE_SET*, void*);
+static BOOL CALLBACK IsDefaultRenderDeviceLost(const SURFACE_DEVICE_SET*, void*);
+
+//
+// Creating devices takes a while, but it is done under the lock anyway so that
+// callers racing for the same adapter end up sharing one set.
+//
+static SRWLOCK                          g_PoolLock      = SRWLOCK_INIT;
+static PooledDeviceSet*                 g_pFirstSet     = NULL;
+static UINT                             g_nSets         = 0;
+static PFN_SURFACE_DEVICE_SET_CREATE    g_pfnCreate     = &CreateDefaultDeviceSet;
+static PFN_SURFACE_DEVICE_SET_IS_LOST   g_pfnIsLost     = &IsDefaultDeviceSetLost;
+static PFN_SURFACE_DEVICE_SET_IS_LOST   g_pfnIsRenderLost = &IsDefaultRenderDeviceLost;
+static void*                            g_pFactoryContext = NULL;
+
+//-----------------------------------------------------------------------------
+static void AddRefDeviceSet(const SURFACE_DEVICE_SET* pSet)
+{
+    if (pSet->pD3D9)
+    {
+        pSet->pD3D9->AddRef();
+    }
+    if (pSet->pD3D9Device)
+    {
+        pSet->pD3D9Device->AddRef();
+    }
+    if (pSet->pD3D10Device)
+    {
+        pSet->pD3D10Device->AddRef();
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void ReleaseDeviceSet(SURFACE_DEVICE_SET* pSet)
+{
+    if (pSet->pD3D10Device)
+    {
+        pSet->pD3D10Device->Release();
+    }
+    if (pSet->pD3D9Device)
+    {
+        pSet->pD3D9Device->Release();
+    }
+    if (pSet->pD3D9)
+    {
+        pSet->pD3D9->Release();
+    }
+    ZeroMemory(pSet, sizeof(*pSet));
+}
+
+//-----------------------------------------------------------------------------
+// Finds the set holding the devices.  The caller holds g_PoolLock.  Holders
+// may still have the render device the set replaced, so only the D3D9 device
+// identifies it.
+//-----------------------------------------------------------------------------
+static PooledDeviceSet** FindDeviceSet(const SURFACE_DEVICE_SET* pSet)
+{
+    for (PooledDeviceSet** ppEntry = &g_pFirstSet; *ppEntry; ppEntry = &(*ppEntry)->pNext)
+    {
+        if ((*ppEntry)->Set.pD3D9Device == pSet->pD3D9Device)
+        {
+            return ppEntry;
+        }
+    }
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Default device creation, the same devices the interop helper used to create
+// for itself.
+//-----------------------------------------------------------------------------
+static HRESULT CALLBACK CreateDefaultDeviceSet(UINT Adapter, HWND hwnd, SURFACE_DEVICE_SET* pSet, void* pContext)
+{
+    UNREFERENCED_PARAMETER(pContext);
+
+    HRESULT                 hr          = S_OK;
+    IDXGIFactory1*          pFactory    = NULL;
+    IDXGIAdapter1*          pAdapter    = NULL;
+    D3DPRESENT_PARAMETERS   d3dpp;
+
+    // Only the render device is replaced
+    if (pSet->pD3D9Device)
+    {
+        goto render;
+    }
+
+    if (FAILED(hr = Direct3DCreate9Ex(D3D_SDK_VERSION, &pSet->pD3D9)))
+    {
+        goto end;
+    }
+
+    ZeroMemory(&d3dpp, sizeof(d3dpp));
+    d3dpp.Windowed              = TRUE;
+    d3dpp.SwapEffect            = D3DSWAPEFFECT_DISCARD;
+    d3dpp.hDeviceWindow         = NULL;
+    d3dpp.PresentationInterval  = D3DPRESENT_INTERVAL_IMMEDIATE;
+
+    if (FAILED(hr = pSet->pD3D9->CreateDeviceEx(
+                                    Adapter,
+                                    D3DDEVTYPE_HAL,
+                                    hwnd,
+                                    D3DCREATE_HARDWARE_VERTEXPROCESSING | D3DCREATE_MULTITHREADED | D3DCREATE_FPU_PRESERVE,
+                                    &d3dpp,
+                                    NULL,
+                                    &pSet->pD3D9Device)))
+    {
+        goto end;
+    }
+
+render:
+    //
+    // The D3D10 device has to be on the same adapter to open the surfaces.  D3D9
+    // and DXGI number the adapters differently, so match them by LUID.
+    //
+    if (Adapter != D3DADAPTER_DEFAULT)
+    {
+        LUID Luid;
+
+        if (FAILED(hr = pSet->pD3D9->GetAdapterLUID(Adapter, &Luid)) ||
+            FAILED(hr = CreateDXGIFactory1(__uuidof(IDXGIFactory1), (void**)&pFactory)))
+        {
+            goto end;
+        }
+
+        for (UINT i = 0; ; i++)
+        {
+            DXGI_ADAPTER_DESC1 Desc;
+
+            if (FAILED(hr = pFactory->EnumAdapters1(i, &pAdapter)))
+            {
+                goto end;
+            }
+            if (SUCCEEDED(pAdapter->GetDesc1(&Desc)) &&
+                Desc.AdapterLuid.LowPart == Luid.LowPart && Desc.AdapterLuid.HighPart == Luid.HighPart)
+            {
+                break;
+            }
+            pAdapter->Release();
+            pAdapter = NULL;
+        }
+    }
+
+    hr = D3D10CreateDevice1(pAdapter, D3D10_DRIVER_TYPE_HARDWARE, NULL,
+                            D3D10_CREATE_DEVICE_BGRA_SUPPORT, D3D10_FEATURE_LEVEL_10_0,
+                            D3D10_1_SDK_VERSION, &pSet->pD3D10Device);
+
+end:
+    if (pAdapter)
+    {
+        pAdapter->Release();
+    }
+    if (pFactory)
+    {
+        pFactory->Release();
+    }
+    if (FAILED(hr))
+    {
+        ReleaseDeviceSet(pSet);
+    }
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+static BOOL CALLBACK IsDefaultDeviceSetLost(const SURFACE_DEVICE_SET* pSet, void* pContext)
+{
+    UNREFERENCED_PARAMETER(pContext);
+
+    // Occlusion and mode changes are reported as successes
+    return FAILED(pSet->pD3D9Device->CheckDeviceState(NULL));
+}
+
+//-----------------------------------------------------------------------------
+static BOOL CALLBACK IsDefaultRenderDeviceLost(const SURFACE_DEVICE_SET* pSet, void* pContext)
+{
+    UNREFERENCED_PARAMETER(pContext);
+
+    return FAILED(pSet->pD3D10Device->GetDeviceRemovedReason());
+}
+
+//-----------------------------------------------------------------------------
+// Puts a new render device in the set, keeping its D3D9 devices.  The caller
+// holds g_PoolLock exclusively.
+//-----------------------------------------------------------------------------
+static HRESULT ReplaceSetRenderDevice(PooledDeviceSet* pEntry)
+{
+    HRESULT             hr  = S_OK;
+    SURFACE_DEVICE_SET  Set = pEntry->Set;
+
+    // The factory gets the D3D9 devices to keep and releases them on failure
+    Set.pD3D10Device = NULL;
+    AddRefDeviceSet(&Set);
+
+    if (FAILED(hr = g_pfnCreate(pEntry->Adapter, NULL, &Set, g_pFactoryContext)))
+    {
+        return hr;
+    }
+    ASSERT(Set.pD3D10Device);
+
+    pEntry->Set.pD3D10Device->Release();
+    pEntry->Set.pD3D10Device = Set.pD3D10Device;
+
+    Set.pD3D10Device = NULL;
+    ReleaseDeviceSet(&Set);
+
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI AcquireSharedSurfaceDevices(
+                    UINT                        Adapter,
+                    HWND                        hwnd,
+                    SURFACE_DEVICE_SET*         pSet)
+{
+    if (!pSet)
+    {
+        return E_INVALIDARG;
+    }
+
+    ZeroMemory(pSet, sizeof(*pSet));
+
+    HRESULT             hr          = S_OK;
+    ATOM                WindowClass = hwnd ? (ATOM)GetClassLongPtr(hwnd, GCW_ATOM) : 0;
+    PooledDeviceSet*    pEntry      = NULL;
+
+    AcquireSRWLockExclusive(&g_PoolLock);
+
+    for (pEntry = g_pFirstSet; pEntry; pEntry = pEntry->pNext)
+    {
+        if (!pEntry->Lost && pEntry->Adapter == Adapter && pEntry->WindowClass == WindowClass)
+        {
+            if (!g_pfnIsLost(&pEntry->Set, g_pFactoryContext))
+            {
+                break;
+            }
+            pEntry->Lost = TRUE;
+        }
+    }
+
+    //
+    // A set whose render device alone was removed keeps its D3D9 devices and
+    // its other holders; it gets the new render device they will pick up with
+    // ReplaceSharedRenderDevice.
+    //
+    if (pEntry && g_pfnIsRenderLost(&pEntry->Set, g_pFactoryContext))
+    {
+        if (FAILED(hr = ReplaceSetRenderDevice(pEntry)))
+        {
+            goto end;
+        }
+    }
+
+    if (!pEntry)
+    {
+        pEntry = new QUEUE_NOTHROW_SPECIFIER PooledDeviceSet;
+        if (!pEntry)
+        {
+            hr = E_OUTOFMEMORY;
+            goto end;
+        }
+        ZeroMemory(pEntry, sizeof(*pEntry));
+
+        if (FAILED(hr = g_pfnCreate(Adapter, hwnd, &pEntry->Set, g_pFactoryContext)))
+        {
+            delete pEntry;
+            goto end;
+        }
+        ASSERT(pEntry->Set.pD3D9Device && pEntry->Set.pD3D10Device);
+
+        InitializeCriticalSection(&pEntry->RenderLock);
+
+        pEntry->Adapter     = Adapter;
+        pEntry->WindowClass = WindowClass;
+        pEntry->pNext       = g_pFirstSet;
+        g_pFirstSet         = pEntry;
+        g_nSets++;
+    }
+
+    pEntry->Holders++;
+    *pSet = pEntry->Set;
+    AddRefDeviceSet(pSet);
+
+end:
+    ReleaseSRWLockExclusive(&g_PoolLock);
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI ReleaseSharedSurfaceDevices(SURFACE_DEVICE_SET* pSet)
+{
+    if (!pSet || !pSet->pD3D9Device)
+    {
+        return E_INVALIDARG;
+    }
+
+    HRESULT             hr          = S_OK;
+    PooledDeviceSet**   ppEntry     = NULL;
+
+    AcquireSRWLockExclusive(&g_PoolLock);
+
+    ppEntry = FindDeviceSet(pSet);
+    if (!ppEntry)
+    {
+        hr = E_INVALIDARG;
+        goto end;
+    }
+
+    ReleaseDeviceSet(pSet);
+
+    ASSERT((*ppEntry)->Holders > 0);
+    if (--(*ppEntry)->Holders == 0)
+    {
+        PooledDeviceSet* pEntry = *ppEntry;
+
+        *ppEntry = pEntry->pNext;
+        g_nSets--;
+
+        ReleaseDeviceSet(&pEntry->Set);
+        DeleteCriticalSection(&pEntry->RenderLock);
+        delete pEntry;
+    }
+
+end:
+    ReleaseSRWLockExclusive(&g_PoolLock);
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI ReportSharedSurfaceDevicesLost(const SURFACE_DEVICE_SET* pSet)
+{
+    if (!pSet || !pSet->pD3D9Device)
+    {
+        return E_INVALIDARG;
+    }
+
+    HRESULT             hr          = S_OK;
+    PooledDeviceSet**   ppEntry     = NULL;
+
+    AcquireSRWLockExclusive(&g_PoolLock);
+
+    ppEntry = FindDeviceSet(pSet);
+    if (ppEntry)
+    {
+        (*ppEntry)->Lost = TRUE;
+    }
+    else
+    {
+        hr = E_INVALIDARG;
+    }
+
+    ReleaseSRWLockExclusive(&g_PoolLock);
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI ReplaceSharedRenderDevice(SURFACE_DEVICE_SET* pSet)
+{
+    if (!pSet || !pSet->pD3D9Device || !pSet->pD3D10Device)
+    {
+        return E_INVALIDARG;
+    }
+
+    HRESULT             hr          = S_OK;
+    PooledDeviceSet**   ppEntry     = NULL;
+    PooledDeviceSet*    pEntry      = NULL;
+
+    AcquireSRWLockExclusive(&g_PoolLock);
+
+    ppEntry = FindDeviceSet(pSet);
+    if (!ppEntry)
+    {
+        hr = E_INVALIDARG;
+        goto end;
+    }
+    pEntry = *ppEntry;
+
+    //
+    // The first holder to notice replaces the device of the set; the others
+    // pick up the same new device.
+    //
+    if (pEntry->Set.pD3D10Device == pSet->pD3D10Device)
+    {
+        if (FAILED(hr = ReplaceSetRenderDevice(pEntry)))
+        {
+            goto end;
+        }
+    }
+
+    pSet->pD3D10Device->Release();
+    pSet->pD3D10Device = pEntry->Set.pD3D10Device;
+    pSet->pD3D10Device->AddRef();
+
+end:
+    ReleaseSRWLockExclusive(&g_PoolLock);
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+// Finds the render lock of the set.  The caller holds the set, so the entry
+// and its lock stay after g_PoolLock is released.
+//-----------------------------------------------------------------------------
+static CRITICAL_SECTION* FindRenderLock(const SURFACE_DEVICE_SET* pSet)
+{
+    CRITICAL_SECTION*   pLock   = NULL;
+    PooledDeviceSet**   ppEntry = NULL;
+
+    if (!pSet || !pSet->pD3D9Device)
+    {
+        return NULL;
+    }
+
+    AcquireSRWLockShared(&g_PoolLock);
+
+    ppEntry = FindDeviceSet(pSet);
+    if (ppEntry)
+    {
+        pLock = &(*ppEntry)->RenderLock;
+    }
+
+    ReleaseSRWLockShared(&g_PoolLock);
+    return pLock;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI LockSharedRenderDevice(const SURFACE_DEVICE_SET* pSet)
+{
+    CRITICAL_SECTION* pLock = FindRenderLock(pSet);
+    if (!pLock)
+    {
+        return E_INVALIDARG;
+    }
+
+    EnterCriticalSection(pLock);
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI UnlockSharedRenderDevice(const SURFACE_DEVICE_SET* pSet)
+{
+    CRITICAL_SECTION* pLock = FindRenderLock(pSet);
+    if (!pLock)
+    {
+        return E_INVALIDARG;
+    }
+
+    LeaveCriticalSection(pLock);
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI SetSurfaceDevicePoolFactory(
+                    PFN_SURFACE_DEVICE_SET_CREATE   pfnCreate,
+                    PFN_SURFACE_DEVICE_SET_IS_LOST  pfnIsLost,
+                    PFN_SURFACE_DEVICE_SET_IS_LOST  pfnIsRenderLost,
+                    void*                           pContext)
+{
+    // All or none
+    if (!pfnCreate != !pfnIsLost || !pfnCreate != !pfnIsRenderLost)
+    {
+        return E_INVALIDARG;
+    }
+
+    HRESULT hr = S_OK;
+
+    AcquireSRWLockExclusive(&g_PoolLock);
+
+    if (g_pFirstSet)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_BUSY);
+    }
+    else
+    {
+        g_pfnCreate         = pfnCreate ? pfnCreate : &CreateDefaultDeviceSet;
+        g_pfnIsLost         = pfnIsLost ? pfnIsLost : &IsDefaultDeviceSetLost;
+        g_pfnIsRenderLost   = pfnIsRenderLost ? pfnIsRenderLost : &IsDefaultRenderDeviceLost;
+        g_pFactoryContext   = pfnCreate ? pContext : NULL;
+    }
+
+    ReleaseSRWLockExclusive(&g_PoolLock);
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+UINT WINAPI GetSurfaceDevicePoolSize()
+{
+    AcquireSRWLockShared(&g_PoolLock);
+    UINT nSets = g_nSets;
+    ReleaseSRWLockShared(&g_PoolLock);
+
+    return nSets;
+}
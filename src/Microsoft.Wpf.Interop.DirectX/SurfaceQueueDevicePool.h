@@ -0,0 +1,114 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#pragma once
+
+#include <d3d9.h>
+#include <D3D10_1.h>
+
+#include "surfacequeue.h"
+
+//
+// Shared device pool.
+//
+// Every interop helper needs a D3D9Ex device to hand surfaces to D3DImage and a
+// D3D10.1 device to render with.  The pool hands out one set of devices per
+// adapter and window class and counts the holders, so images on the same
+// adapter share their devices instead of creating their own.  The devices are
+// created multithreaded and the pool can be used from any thread.
+//
+// The D3D9 device of a set uses the window of the first caller as its focus
+// window.  It only renders off screen, so the set can outlive that window.
+//
+// The holders of a set share its D3D10.1 device and with it the pipeline
+// state of the device.  A holder that renders takes the render lock of the
+// set from setting the state for a frame until the last command of the frame
+// is issued, and assumes no state from its earlier frames.
+//
+// A set whose D3D9 device is lost is taken out of the pool, either when a
+// caller reports it or when the next acquire finds it lost.  Callers still
+// holding the old set keep it until they release it; new callers get a new
+// set.  The surfaces belong to the D3D9 device, so a removed D3D10 device
+// alone doesn't make the set lost: its holders move to a new render device
+// with ReplaceSharedRenderDevice, and the next acquire replaces it as well.
+//
+
+struct SURFACE_DEVICE_SET
+{
+    IDirect3D9Ex*           pD3D9;
+    IDirect3DDevice9Ex*     pD3D9Device;
+    ID3D10Device1*          pD3D10Device;
+};
+
+//
+// Creates the devices of a new set.  The default creates a hardware D3D9Ex
+// device and a D3D10.1 device on the same adapter.  Tests can replace it with
+// SetSurfaceDevicePoolFactory to hand out fake devices.
+//
+// When the render device of a set is replaced, pSet comes with the D3D9
+// members filled in and only pD3D10Device is created; hwnd is NULL then.  On
+// failure the callback releases whatever pSet holds.
+//
+typedef HRESULT (CALLBACK *PFN_SURFACE_DEVICE_SET_CREATE)(
+                                UINT                    Adapter,
+                                HWND                    hwnd,
+                                SURFACE_DEVICE_SET*     pSet,
+                                void*                   pContext);
+
+//
+// Returns whether a device of a set is lost.  The pool asks separately about
+// the D3D9 device, whose default check is the device state, and about the
+// render device, whose default check is its removal reason.
+//
+typedef BOOL (CALLBACK *PFN_SURFACE_DEVICE_SET_IS_LOST)(
+                                const SURFACE_DEVICE_SET* pSet,
+                                void*                   pContext);
+
+//
+// Fills pSet with references to the pooled devices for the D3D9 adapter
+// ordinal and the class of hwnd, creating them if there are none.
+//
+HRESULT WINAPI AcquireSharedSurfaceDevices(
+                    UINT                        Adapter,
+                    HWND                        hwnd,
+                    SURFACE_DEVICE_SET*         pSet);
+
+// Releases the references in pSet and zeroes it.  The devices are destroyed
+// when their last holder releases them.
+HRESULT WINAPI ReleaseSharedSurfaceDevices(
+                    SURFACE_DEVICE_SET*         pSet);
+
+// Takes the set holding these devices out of the pool
+HRESULT WINAPI ReportSharedSurfaceDevicesLost(
+                    const SURFACE_DEVICE_SET*   pSet);
+
+// Replaces the D3D10 device in pSet after it was removed, while the D3D9
+// devices of the set are fine.  The set keeps its D3D9 devices and every
+// holder that calls this gets the same new render device.  pSet is unchanged
+// on failure.
+HRESULT WINAPI ReplaceSharedRenderDevice(
+                    SURFACE_DEVICE_SET*         pSet);
+
+// Serializes rendering on the render device of the set holding these
+// devices.  The lock stays with the set when its render device is replaced.
+// The caller holds the set until it unlocks.
+HRESULT WINAPI LockSharedRenderDevice(
+                    const SURFACE_DEVICE_SET*   pSet);
+
+HRESULT WINAPI UnlockSharedRenderDevice(
+                    const SURFACE_DEVICE_SET*   pSet);
+
+// Replaces how sets are created and checked.  Pass NULLs to restore the
+// defaults.  Fails while the pool holds any set.
+HRESULT WINAPI SetSurfaceDevicePoolFactory(
+                    PFN_SURFACE_DEVICE_SET_CREATE   pfnCreate,
+                    PFN_SURFACE_DEVICE_SET_IS_LOST  pfnIsLost,
+                    PFN_SURFACE_DEVICE_SET_IS_LOST  pfnIsRenderLost,
+                    void*                           pContext);
+
+// Number of device sets in the pool, lost sets that are still held included
+UINT WINAPI GetSurfaceDevicePoolSize();
@@ -0,0 +1,67 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#pragma once
+
+#include "surfacequeue.h"
+
+//
+// Dirty rectangles.
+//
+// A producer can describe which parts of a frame changed since the previous
+// frame it enqueued (the way D3DImage.AddDirtyRect does), and the consumer gets
+// the rectangles back when it dequeues the surface.  The rectangles travel
+// with the surface like the meta data, so they cross each queue of a network
+// the surface is enqueued to.
+//
+// The queue keeps at most SURFACE_QUEUE_MAX_DIRTY_RECTS rectangles per surface.
+// Overlapping rectangles are merged, and once the list is full each new
+// rectangle is merged into the one it grows the least.  A surface enqueued
+// without rectangles (including through ISurfaceProducer::Enqueue) is dirty as
+// a whole.
+//
+// The producer and consumer objects of CreateSurfaceQueue and of the shared
+// queues (SurfaceQueueShared.h) answer QueryInterface for these interfaces.
+//
+
+#define SURFACE_QUEUE_MAX_DIRTY_RECTS       (8)
+
+MIDL_INTERFACE("2762C435-6876-4492-B8C1-D23EE553FBB1")
+ISurfaceProducer1 : public ISurfaceProducer
+{
+    public:
+        // Same as Enqueue.  The rectangles are clipped to the surface;
+        // NumDirtyRects may be 0 for a surface that is dirty as a whole.
+        virtual HRESULT STDMETHODCALLTYPE EnqueueDirty(
+            /* [in] */ IUnknown* pSurface,
+            /* [in] */ void* pBuffer,
+            /* [in] */ UINT BufferSize,
+            /* [in] */ const RECT* pDirtyRects,
+            /* [in] */ UINT NumDirtyRects,
+            /* [in] */ DWORD Flags) = 0;
+};
+
+MIDL_INTERFACE("F4F8C8BA-FB5E-431C-9F2A-02626FC191DC")
+ISurfaceConsumer1 : public ISurfaceConsumer
+{
+    public:
+        //
+        // Same as Dequeue.  On input *pNumDirtyRects is the number of
+        // rectangles pDirtyRects can hold, on output the number it received.
+        // If the surface has more rectangles than fit, pDirtyRects[0] receives
+        // their union.  A surface that is dirty as a whole gets a single
+        // rectangle covering it.
+        //
+        virtual HRESULT STDMETHODCALLTYPE DequeueDirty(
+            /* [in] */ REFIID id,
+            /* [out] */ IUnknown** ppSurface,
+            /* [out] */ void* pBuffer,
+            /* [out][in] */ UINT* pBufferSize,
+            /* [out] */ RECT* pDirtyRects,
+            /* [out][in] */ UINT* pNumDirtyRects,
+            /* [in] */ DWORD dwTimeout) = 0;
+};
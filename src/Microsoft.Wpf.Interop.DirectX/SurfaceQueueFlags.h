@@ -0,0 +1,29 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#pragma once
+
+#include "surfacequeue.h"
+
+//
+// Queue flags beyond those of SURFACE_QUEUE_FLAG.  They are passed in the
+// Flags of SURFACE_QUEUE_DESC to CreateSurfaceQueue and of
+// SURFACE_QUEUE_CLONE_DESC to Clone, and apply to that queue only.
+//
+
+//
+// OpenConsumer doesn't open the surfaces of the network on the consuming
+// device; each one is opened the first time the consumer dequeues it and kept
+// until the consumer is released.  This takes the cost of opening all of the
+// surfaces out of OpenConsumer, at the price of a slower first Dequeue of each
+// surface.  A Dequeue that fails to open its surface leaves it in the queue.
+//
+#define SURFACE_QUEUE_FLAG_LAZY_OPEN            (0x4)
+
+// All of the flags a queue can be created or cloned with
+#define SURFACE_QUEUE_VALID_CREATE_FLAGS        (SURFACE_QUEUE_FLAG_SINGLE_THREADED | \
+                                                 SURFACE_QUEUE_FLAG_LAZY_OPEN)
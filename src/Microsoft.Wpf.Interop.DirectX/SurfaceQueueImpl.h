@@ -12,6 +12,14 @@
 #include <D3D11.h>
 
 #include "surfacequeue.h"
+#include "SurfaceQueueSoftware.h"
+#include "SurfaceQueueDirtyRects.h"
+#include "SurfaceQueueSurfaceData.h"
+#include "SurfaceQueueTrace.h"
+#include "SurfaceQueueStats.h"
+#include "SurfaceQueueWatchdog.h"
+#include "SurfaceQueueBudget.h"
+#include "SurfaceQueueFlags.h"
 
 #include <assert.h>
 #define ASSERT(x) assert(x);
@@ -70,6 +78,10 @@ class ISurfaceQueueDevice
         //    D3D11 will be expecting ID3D11Texture2D 
         virtual BOOL ValidateREFIID(REFIID) = 0;
 
+        // Whether resources can be created on the device from several threads
+        // at once
+        virtual BOOL IsThreadSafe() = 0;
+
         // Opens a shared surface with the given handle.
         virtual HRESULT OpenSurface(HANDLE, void**, UINT w, UINT h, DXGI_FORMAT) = 0;
 
@@ -83,10 +95,17 @@ class ISurfaceQueueDevice
         // Copy from the queue surface to the staging resource.
         virtual HRESULT CopySurface(IUnknown* pDst, IUnknown* pSrc, UINT width, UINT height) = 0;
 
+        // Copies the rectangle of pSrc to the same place in pDst.
+        virtual HRESULT CopySurfaceRect(IUnknown* pDst, IUnknown* pSrc, const RECT* pRect) = 0;
+
         // Locks the (staging) surface.  When this call completes, the surface
         // has been flushed and is ready to be used by another device
         virtual HRESULT LockSurface(IUnknown* pSurface, DWORD flags) = 0;
 
+        // Locks the (staging) surface like LockSurface and returns its bits.  
+        // Unlock it with UnlockSurface.
+        virtual HRESULT MapSurface(IUnknown* pSurface, DWORD flags, void** ppData, UINT* pPitch) = 0;
+
         // Unlocks the (staging) surface.
         virtual HRESULT UnlockSurface(IUnknown* pSurface) = 0;
 
@@ -103,12 +122,15 @@ class CSurfaceQueueDeviceD3D9 : public ISurfaceQueueDevice
                                     IUnknown** ppSurface,
                                     HANDLE* handle);
         BOOL ValidateREFIID(REFIID);
+        BOOL IsThreadSafe();
         HRESULT OpenSurface(HANDLE, void**, UINT Width, UINT Height, DXGI_FORMAT format);
         HRESULT GetSharedHandle(IUnknown*, HANDLE*);
         HRESULT CreateCopyResource(DXGI_FORMAT, UINT width, UINT height, IUnknown** pRes);
 
         HRESULT CopySurface(IUnknown* pDst, IUnknown* pSrc, UINT width, UINT height);
+        HRESULT CopySurfaceRect(IUnknown* pDst, IUnknown* pSrc, const RECT* pRect);
         HRESULT LockSurface(IUnknown* pSurface, DWORD flags);
+        HRESULT MapSurface(IUnknown* pSurface, DWORD flags, void** ppData, UINT* pPitch);
         HRESULT UnlockSurface(IUnknown* pSurface);
 
         CSurfaceQueueDeviceD3D9(IDirect3DDevice9Ex* pD3D9Device);
@@ -127,12 +149,15 @@ class CSurfaceQueueDeviceD3D10 : public ISurfaceQueueDevice
                                     IUnknown** ppSurface,
                                     HANDLE* handle);
         BOOL ValidateREFIID(REFIID);
+        BOOL IsThreadSafe();
         HRESULT OpenSurface(HANDLE, void**, UINT w, UINT h, DXGI_FORMAT);
         HRESULT GetSharedHandle(IUnknown*, HANDLE*);
         HRESULT CreateCopyResource(DXGI_FORMAT, UINT width, UINT height, IUnknown** pRes);
 
         HRESULT CopySurface(IUnknown* pDst, IUnknown* pSrc, UINT width, UINT height);
+        HRESULT CopySurfaceRect(IUnknown* pDst, IUnknown* pSrc, const RECT* pRect);
         HRESULT LockSurface(IUnknown* pSurface, DWORD flags);
+        HRESULT MapSurface(IUnknown* pSurface, DWORD flags, void** ppData, UINT* pPitch);
         HRESULT UnlockSurface(IUnknown* pSurface);
 
         CSurfaceQueueDeviceD3D10(ID3D10Device* pD3D10Device);
@@ -151,12 +176,15 @@ class CSurfaceQueueDeviceD3D11 : public ISurfaceQueueDevice
                                     IUnknown** ppSurface,
                                     HANDLE* handle);
         BOOL ValidateREFIID(REFIID);
+        BOOL IsThreadSafe();
         HRESULT OpenSurface(HANDLE, void**, UINT w, UINT h, DXGI_FORMAT);
         HRESULT GetSharedHandle(IUnknown*, HANDLE*);
         HRESULT CreateCopyResource(DXGI_FORMAT, UINT width, UINT height, IUnknown** pRes);
 
         HRESULT CopySurface(IUnknown* pDst, IUnknown* pSrc, UINT width, UINT height);
+        HRESULT CopySurfaceRect(IUnknown* pDst, IUnknown* pSrc, const RECT* pRect);
         HRESULT LockSurface(IUnknown* pSurface, DWORD flags);
+        HRESULT MapSurface(IUnknown* pSurface, DWORD flags, void** ppData, UINT* pPitch);
         HRESULT UnlockSurface(IUnknown* pSurface);
 
         CSurfaceQueueDeviceD3D11(ID3D11Device* pD3D11Device);
@@ -166,6 +194,120 @@ class CSurfaceQueueDeviceD3D11 : public ISurfaceQueueDevice
         ID3D11Device*           m_pDevice;
 };
 
+// Implementation of SurfaceQueueDevice for software (system memory) devices
+class CSurfaceQueueDeviceSoftware : public ISurfaceQueueDevice
+{
+    public:
+        HRESULT CreateSharedSurface(UINT Width, UINT Height, 
+                                    DXGI_FORMAT format, 
+                                    IUnknown** ppSurface,
+                                    HANDLE* handle);
+        BOOL ValidateREFIID(REFIID);
+        BOOL IsThreadSafe();
+        HRESULT OpenSurface(HANDLE, void**, UINT w, UINT h, DXGI_FORMAT);
+        HRESULT GetSharedHandle(IUnknown*, HANDLE*);
+        HRESULT CreateCopyResource(DXGI_FORMAT, UINT width, UINT height, IUnknown** pRes);
+
+        HRESULT CopySurface(IUnknown* pDst, IUnknown* pSrc, UINT width, UINT height);
+        HRESULT CopySurfaceRect(IUnknown* pDst, IUnknown* pSrc, const RECT* pRect);
+        HRESULT LockSurface(IUnknown* pSurface, DWORD flags);
+        HRESULT MapSurface(IUnknown* pSurface, DWORD flags, void** ppData, UINT* pPitch);
+        HRESULT UnlockSurface(IUnknown* pSurface);
+
+        CSurfaceQueueDeviceSoftware(ISoftwareSurfaceDevice* pDevice);
+        ~CSurfaceQueueDeviceSoftware();
+
+    private:
+        ISoftwareSurfaceDevice* m_pDevice;
+};
+
+// Creates the wrapper matching the runtime of the device.
+HRESULT CreateDeviceWrapper(IUnknown* pUnknown, ISurfaceQueueDevice** ppDevice);
+
+// Calls pfnCreate for each index below Count.  When the device is thread-safe
+// the calls are spread over the thread pool, otherwise they are made one after
+// the other on the calling thread.  Returns the first failure; resources that
+// were created are left for the caller to release.
+typedef HRESULT (*PFN_CREATE_RESOURCE)(UINT Index, void* pContext);
+
+HRESULT CreateResources(ISurfaceQueueDevice* pDevice, UINT Count, PFN_CREATE_RESOURCE pfnCreate, void* pContext);
+
+// Fills a dirty list of at most SURFACE_QUEUE_MAX_DIRTY_RECTS rectangles from
+// the rectangles passed to EnqueueDirty, clipped to Width x Height.  No
+// rectangles make the whole surface dirty.
+void BuildDirtyRectList(const RECT* pDirtyRects, UINT NumDirtyRects, UINT Width, UINT Height,
+                        RECT* pRects, UINT* pNumRects);
+
+// Copies a dirty list out the way DequeueDirty returns it: as is when it fits
+// in *pNumDirtyRects rectangles, as their union otherwise.
+void CopyDirtyRectList(const RECT* pRects, UINT NumRects, RECT* pDirtyRects, UINT* pNumDirtyRects);
+
+// Tracing of the queue calls, see SurfaceQueueTrace.h.  SurfaceQueueTraceBegin
+// returns the time the call is made, or 0 when no trace is running, in which
+// case the call is not logged.
+extern volatile LONG g_SurfaceQueueTraceEnabled;
+
+inline LONGLONG SurfaceQueueTraceBegin()
+{
+    if (!g_SurfaceQueueTraceEnabled)
+    {
+        return 0;
+    }
+
+    LARGE_INTEGER Now;
+    QueryPerformanceCounter(&Now);
+    return Now.QuadPart;
+}
+
+// Returns a process unique number for a new queue.
+UINT SurfaceQueueTraceNewQueue();
+
+// Set while the stall watchdog runs, see SurfaceQueueWatchdog.h
+extern volatile LONG g_SurfaceQueueWatchdogEnabled;
+
+// The waits the watchdog looks at
+enum QueueWaitKind
+{
+    QUEUE_WAIT_NONE = 0,
+    // Dequeue waiting for a flushed surface
+    QUEUE_WAIT_DEQUEUE,
+    // Enqueue or Flush waiting for the rendering to complete
+    QUEUE_WAIT_FLUSH,
+};
+
+class CStallDumpWriter;
+
+void SurfaceQueueTraceCall(
+                SURFACE_QUEUE_TRACE_CALL    Call,
+                UINT                        Queue,
+                LONGLONG                    Start,
+                HRESULT                     hr,
+                DWORD                       Flags,
+                UINT                        Surface,
+                UINT                        Param,
+                const void*                 pPayload,
+                UINT                        PayloadSize);
+
+// Receives state change notifications from a queue.  The notifications are made
+// on the thread that caused the change, from inside the queue call, so they must
+// be short and must not call back into the queue.
+class ISurfaceQueueNotify
+{
+    public:
+        // A surface was enqueued with DO_NOT_WAIT and has not been flushed yet.
+        // The producer has to flush again before it can be dequeued.
+        virtual void OnSurfaceEnqueued(CSurfaceQueue* pQueue) = 0;
+
+        // Surfaces finished flushing and are ready to be dequeued.
+        virtual void OnSurfacesFlushed(CSurfaceQueue* pQueue, UINT NumSurfaces) = 0;
+
+        // Surfaces a lost consumer held were put back ready to be dequeued.
+        // No producer enqueued or flushed them.
+        virtual void OnSurfacesReclaimed(CSurfaceQueue* pQueue, UINT NumSurfaces) = 0;
+
+        virtual ~ISurfaceQueueNotify() {};
+};
+
 enum SharedSurfaceState
 {
     SHARED_SURFACE_STATE_UNINITIALIZED = 0,
@@ -197,7 +339,176 @@ struct SharedSurfaceObject
     ~SharedSurfaceObject();
 };
 
-class CSurfaceConsumer : public ISurfaceConsumer
+// The two sides of a queue that make high frequency calls into it.
+enum QueueEpochSide
+{
+    QUEUE_EPOCH_PRODUCER = 0,
+    QUEUE_EPOCH_CONSUMER,
+    QUEUE_EPOCH_NUM_SIDES,
+};
+
+//
+// Epoch based protection for the rare queue state changes (opening and removing
+// the producer and consumer).  The high frequency calls only announce the current 
+// epoch in the reader slot for their side of the queue.  The producer and consumer 
+// objects already serialize the calls from their side, so a slot is written by one 
+// thread at a time and the hot path never touches a lock word shared with the other
+// side.  A state change publishes the new state and then waits for the readers that 
+// could have observed the old state to drain.
+//
+class CQueueEpoch
+{
+    public:
+        CQueueEpoch();
+
+        // Announces that the side is about to read the queue state.
+        void Enter(QueueEpochSide side);
+
+        // Announces that the side is no longer reading the queue state.
+        void Leave(QueueEpochSide side);
+
+        // Waits until every reader that entered before the call has left.
+        // Returns TRUE if it had to wait for one.
+        BOOL Synchronize();
+
+    private:
+        // Each slot sits on its own cache line so the producer and consumer 
+        // don't share one.
+        struct ReaderSlot
+        {
+            volatile LONG                   Epoch;
+            BYTE                            Padding[64 - sizeof(LONG)];
+        };
+
+        volatile LONG                       m_GlobalEpoch;
+        ReaderSlot                          m_Readers[QUEUE_EPOCH_NUM_SIDES];
+};
+
+//
+// Lock profiling for the locks of a queue, see SurfaceQueueStats.h.  The lock
+// functions check a flag and go straight to the lock while profiling is off.
+// The counters are updated with interlocked operations since the waits on the
+// semaphore and the epoch happen outside of any lock.
+//
+class CQueueLockProfile
+{
+    public:
+        CQueueLockProfile();
+
+        void SetEnabled(BOOL Enable) { InterlockedExchange(&m_Enabled, Enable ? 1 : 0); }
+        BOOL IsEnabled() const { return m_Enabled != 0; }
+
+        void Enter(SURFACE_QUEUE_LOCK Lock, CRITICAL_SECTION* pLock)
+        {
+            if (!m_Enabled)
+            {
+                EnterCriticalSection(pLock);
+                return;
+            }
+            EnterProfiled(Lock, pLock);
+        }
+
+        DWORD Wait(SURFACE_QUEUE_LOCK Lock, HANDLE hObject, DWORD dwTimeout)
+        {
+            if (!m_Enabled)
+            {
+                return WaitForSingleObject(hObject, dwTimeout);
+            }
+            return WaitProfiled(Lock, hObject, dwTimeout);
+        }
+
+        // Returns the start of a wait to pass to EndWait, or 0 while profiling
+        // is off.
+        LONGLONG BeginWait() const;
+        void EndWait(SURFACE_QUEUE_LOCK Lock, LONGLONG Start, BOOL Contended);
+
+        void GetStats(SURFACE_QUEUE_STATS* pStats) const;
+        void Reset();
+
+    private:
+        void EnterProfiled(SURFACE_QUEUE_LOCK Lock, CRITICAL_SECTION* pLock);
+        DWORD WaitProfiled(SURFACE_QUEUE_LOCK Lock, HANDLE hObject, DWORD dwTimeout);
+        void Record(SURFACE_QUEUE_LOCK Lock, BOOL Acquired, BOOL Contended, LONGLONG WaitTicks);
+
+        struct LockCounters
+        {
+            volatile LONGLONG               Acquisitions;
+            volatile LONGLONG               Contentions;
+            volatile LONGLONG               TotalWaitMicroseconds;
+            volatile LONGLONG               WaitHistogram[SURFACE_QUEUE_WAIT_HISTOGRAM_BUCKETS];
+        };
+
+        volatile LONG                       m_Enabled;
+        LONGLONG                            m_Frequency;
+        LockCounters                        m_Locks[SURFACE_QUEUE_NUM_LOCKS];
+};
+
+//
+// Memory charged to the budget for a set of resources of one device, see
+// SurfaceQueueBudget.h.  The charge is taken before the resources are created
+// and given back when the object holding them goes away.
+//
+class CBudgetCharge
+{
+    public:
+        CBudgetCharge();
+        ~CBudgetCharge() { Release(); }
+
+        // Charges Count resources of the given size.  Fails with
+        // SURFACE_QUEUE_E_OVER_BUDGET when the budget refuses them.
+        HRESULT Acquire(IUnknown* pDevice, SURFACE_QUEUE_BUDGET_KIND Kind,
+                        DXGI_FORMAT Format, UINT Width, UINT Height, UINT Count);
+        void Release();
+
+        ULONGLONG GetBytes() const { return m_Bytes; }
+
+    private:
+        // COM identity of the device
+        IUnknown*                           m_pDevice;
+        SURFACE_QUEUE_BUDGET_KIND           m_Kind;
+        DXGI_FORMAT                         m_Format;
+        ULONGLONG                           m_Bytes;
+};
+
+//
+// Surfaces of a queue network opened on consumer devices.  The root queue keeps
+// the cache for the whole network, so the queues of a network share what they
+// opened on the same device, and a consumer opened again on the device the last
+// one used finds its surfaces already open.  Each entry counts the consumers
+// using it.  Unused entries stay until a consumer is opened on another device
+// or the network goes away, and keep their device alive meanwhile.
+//
+class COpenedSurfaceCache
+{
+    public:
+        COpenedSurfaceCache();
+        ~COpenedSurfaceCache();
+
+        // Returns the surface opened on the device with key pDeviceKey, opening
+        // it with pDevice if needed.  It stays valid until the matching Release.
+        HRESULT Acquire(ISurfaceQueueDevice* pDevice, IUnknown* pDeviceKey,
+                        const SharedSurfaceObject* pObject, IUnknown** ppSurface);
+        void Release(IUnknown* pDeviceKey, const SharedSurfaceObject* pObject);
+
+        // Drops the unused surfaces of all devices but pDeviceKey
+        void Trim(IUnknown* pDeviceKey);
+
+    private:
+        struct Entry
+        {
+            IUnknown*                       pDeviceKey;
+            const SharedSurfaceObject*      pObject;
+            IUnknown*                       pSurface;
+            UINT                            Users;
+        };
+
+        SRWLOCK                             m_Lock;
+        Entry*                              m_pEntries;
+        UINT                                m_nEntries;
+        UINT                                m_nCapacity;
+};
+
+class __declspec(uuid("7BAFCFFE-4079-412A-A88E-6FBCE375C882")) CSurfaceConsumer : public ISurfaceConsumer2
 {
     // Com Interfaces
     public:
@@ -214,6 +525,28 @@ class CSurfaceConsumer : public ISurfaceConsumer
                                 UINT*  BufferSize,
                                 DWORD  dwTimeout 
                             );
+
+        STDMETHOD (DequeueDirty) (
+                                REFIID id,
+                                IUnknown** ppSurface,
+                                void*  pBuffer,
+                                UINT*  BufferSize,
+                                RECT*  pDirtyRects,
+                                UINT*  pNumDirtyRects,
+                                DWORD  dwTimeout 
+                            );
+
+        STDMETHOD (SetSurfaceData) (
+                                IUnknown* pSurface,
+                                REFGUID Key,
+                                IUnknown* pData
+                            );
+
+        STDMETHOD (GetSurfaceData) (
+                                IUnknown* pSurface,
+                                REFGUID Key,
+                                IUnknown** ppData
+                            );
     // Implementation
     public:
         CSurfaceConsumer(BOOL IsMultithreaded);
@@ -223,6 +556,7 @@ class CSurfaceConsumer : public ISurfaceConsumer
         void SetQueue(CSurfaceQueue*);
 
         ISurfaceQueueDevice* GetDevice() { return m_pDevice; }
+        CSurfaceQueue* GetQueue() { return m_pQueue; }
     
     private:
         
@@ -241,7 +575,7 @@ class CSurfaceConsumer : public ISurfaceConsumer
 
 };
 
-class CSurfaceProducer : public ISurfaceProducer
+class __declspec(uuid("90444545-D7EE-4C9E-ABC0-B24FBCC8EED3")) CSurfaceProducer : public ISurfaceProducer1
 {
     // Com Interfaces
     public:
@@ -258,6 +592,15 @@ class CSurfaceProducer : public ISurfaceProducer
                                 DWORD     Flags 
                             );
 
+        STDMETHOD (EnqueueDirty) ( 
+                                IUnknown*   pSurface,
+                                void*       pBuffer,
+                                UINT        BufferSize,
+                                const RECT* pDirtyRects,
+                                UINT        NumDirtyRects,
+                                DWORD       Flags 
+                            );
+
         STDMETHOD (Flush)   (
                                 DWORD     Flags,
                                 UINT*     NumSurfaces
@@ -272,6 +615,14 @@ class CSurfaceProducer : public ISurfaceProducer
         void SetQueue(CSurfaceQueue*);
         
         ISurfaceQueueDevice* GetDevice() { return m_pDevice; }
+        CSurfaceQueue* GetQueue() { return m_pQueue; }
+        ULONGLONG GetStagingBytes() const { return m_StagingCharge.GetBytes(); }
+
+        // COM identity of the producer device, compared to the consumer's
+        IUnknown* GetDeviceKey() const { return m_pDeviceKey; }
+
+    private:
+        static HRESULT CreateStagingResource(UINT Index, void* pContext);
 
     private:
         LONG                        m_RefCount;       
@@ -283,6 +634,10 @@ class CSurfaceProducer : public ISurfaceProducer
 
         // The producer device
         ISurfaceQueueDevice*        m_pDevice;
+        IUnknown*                   m_pDeviceKey;
+
+        // The staging resources charged to the budget
+        CBudgetCharge               m_StagingCharge;
         
         // Critical Section for the producer
         CRITICAL_SECTION            m_lock;
@@ -291,15 +646,16 @@ class CSurfaceProducer : public ISurfaceProducer
         UINT                        m_nStagingResources;
         IUnknown**                  m_pStagingResources;
 
-        // Size of staging resource
+        // Size and format of staging resource
         UINT                        m_uiStagingResourceWidth;
         UINT                        m_uiStagingResourceHeight;
+        DXGI_FORMAT                 m_StagingFormat;
 
         // Index of current staging resource to use
         UINT                        m_iCurrentResource;
 };
 
-class CSurfaceQueue : public ISurfaceQueue
+class CSurfaceQueue : public ISurfaceQueue1
 {
     // Com Functions
     public:
@@ -323,6 +679,12 @@ class CSurfaceQueue : public ISurfaceQueue
                                     SURFACE_QUEUE_CLONE_DESC*   pDesc,
                                     ISurfaceQueue**             ppQueue 
                                  );
+
+    // ISurfaceQueue1 functions
+    public:
+        STDMETHOD (SetLockProfiling) (BOOL Enable);
+        STDMETHOD (GetStats)         (SURFACE_QUEUE_STATS* pStats);
+        STDMETHOD (ResetStats)       ();
     
     // Implementation Functions
     public:
@@ -338,6 +700,18 @@ class CSurfaceQueue : public ISurfaceQueue
         // Removes the consumer device.  
         void RemoveConsumer();
 
+        // Puts the surfaces the removed consumer of this queue still held back
+        // into it after its device was lost, with the ones it enqueued into
+        // pReturnQueue that never flushed.  pLostDevice is the device the
+        // consumer was opened with, or NULL if unknown; it is only compared
+        // to, so it may already be destroyed.  The producer of pReturnQueue must be removed as well,
+        // this queue must have no surfaces pending a flush, and no other calls
+        // may be made into either queue meanwhile.
+        HRESULT ReclaimConsumerSurfaces(
+                            CSurfaceQueue*          pReturnQueue,
+                            ISurfaceQueueDevice*    pLostDevice,
+                            UINT*                   pNumReclaimed);
+
         HRESULT Enqueue(
                             IUnknown*   pSurface, 
                             void*       pBuffer, 
@@ -345,13 +719,19 @@ class CSurfaceQueue : public ISurfaceQueue
                             DWORD       Flags,
                             IUnknown*   pStagingResource,
                             UINT        width,
-                            UINT        height        
+                            UINT        height,
+                            const RECT* pDirtyRects,
+                            UINT        NumDirtyRects
                         );
 
+        // Hands out the surface as the id interface
         HRESULT Dequeue(
+                            REFIID      id,
                             IUnknown**      ppSurface,
                             void*       pBuffer,
                             UINT*       BufferSize,
+                            RECT*       pDirtyRects,
+                            UINT*       pNumDirtyRects,
                             DWORD       dwTimeout  
                         );
 
@@ -360,7 +740,53 @@ class CSurfaceQueue : public ISurfaceQueue
                             UINT*       NumSurfaces
                         );
 
+        // The objects the consumer attached to its surfaces.  Only called by
+        // the consumer.
+        HRESULT SetSurfaceData(HANDLE hSharedHandle, REFGUID Key, IUnknown* pData);
+        HRESULT GetSurfaceData(HANDLE hSharedHandle, REFGUID Key, IUnknown** ppData);
+
+        // Registers the object notified about state changes on one side of the
+        // queue.  Pass NULL to unregister.  When unregistering, the call waits 
+        // for notifications already in progress, so it must not be made from 
+        // inside a notification.
+        HRESULT SetNotify(QueueEpochSide side, ISurfaceQueueNotify* pNotify);
+
+        BOOL IsMultithreaded() const { return m_IsMultithreaded; }
+
+        // Number of the queue in traces
+        UINT GetTraceId() const { return m_TraceId; }
+
+        // The producer and consumer objects report their locks here
+        CQueueLockProfile* GetLockProfile() { return &m_LockProfile; }
+
+        // The watchdog keeps a list of every initialized queue.  These are
+        // defined with the watchdog.
+        void RegisterForWatchdog();
+        void UnregisterForWatchdog();
+
+        // Appends the state of the queue, or of the surfaces of the network for
+        // the root queue.  The caller holds the list lock.
+        void DumpState(CStallDumpWriter* pWriter);
+        void DumpSurfaces(CStallDumpWriter* pWriter);
+        CSurfaceQueue* GetRootQueue() const { return m_pRootQueue; }
+        CSurfaceQueue* GetNextRegistered() const { return m_pNextRegistered; }
+
+        // Returns TRUE once for each wait that started before Deadline, with
+        // the side that is waiting
+        BOOL CheckStall(LONGLONG Deadline, QueueEpochSide* pSide);
+
     private:
+        // Flushes the enqueued surfaces.  The caller must be inside the producer epoch.
+        HRESULT FlushEnqueuedSurfaces(
+                            DWORD       Flags,
+                            UINT*       NumSurfaces
+                        );
+
+        // Notifications are only made from the producer side of the queue.
+        void NotifySurfaceEnqueued();
+        void NotifySurfacesFlushed(UINT NumSurfaces);
+        void NotifySurfacesReclaimed(UINT NumSurfaces);
+
         struct SharedSurfaceQueueEntry
         {
             SharedSurfaceObject*    surface;
@@ -368,25 +794,68 @@ class CSurfaceQueue : public ISurfaceQueue
             UINT                    bMetaDataSize;
             IUnknown*               pStagingResource;
 
+            // The parts of the surface that changed; a surface enqueued without
+            // dirty rectangles has one covering all of it
+            RECT                    DirtyRects[SURFACE_QUEUE_MAX_DIRTY_RECTS];
+            UINT                    nDirtyRects;
+
             SharedSurfaceQueueEntry()
             {
                 surface             = NULL;
                 pMetaData           = NULL;
                 bMetaDataSize       = 0;
                 pStagingResource    = NULL;
+                nDirtyRects         = 0;
             }
         };
 
+        // An interface of a consumer surface Dequeue handed out, or an object
+        // the consumer attached to it
+        struct SharedSurfaceData
+        {
+            GUID                    Key;
+            BOOL                    IsInterface;
+            IUnknown*               pObject;
+            SharedSurfaceData*      pNext;
+        };
+
         struct SharedSurfaceOpenedMapping
         {
             SharedSurfaceObject*    pObject;
-            IUnknown*               pSurface;
+            // Published with an interlocked exchange when opened lazily
+            IUnknown* volatile      pSurface;
+            // Only touched by the consumer, and released with it
+            SharedSurfaceData*      pData;
         };
 
     private:
         void Destroy();
 
+        // Waits out the calls that may still see the old state
+        void SynchronizeEpoch();
+
+        // Marks a wait for the watchdog
+        void BeginWatchedWait(QueueEpochSide Side, QueueWaitKind Kind)
+        {
+            if (g_SurfaceQueueWatchdogEnabled)
+            {
+                LARGE_INTEGER Now;
+                QueryPerformanceCounter(&Now);
+                m_WaitKind[Side] = Kind;
+                InterlockedExchange64(&m_WaitStart[Side], Now.QuadPart);
+            }
+        }
+
+        void EndWatchedWait(QueueEpochSide Side)
+        {
+            if (m_WaitStart[Side])
+            {
+                InterlockedExchange64(&m_WaitStart[Side], 0);
+            }
+        }
+
         HRESULT CreateSurfaces();
+        static HRESULT CreateSharedSurface(UINT Index, void* pContext);
         void CopySurfaceReferences(CSurfaceQueue*);
         HRESULT AllocateMetaDataBuffers();
 
@@ -401,7 +870,19 @@ class CSurfaceQueue : public ISurfaceQueue
         void Front(SharedSurfaceQueueEntry& entry);
 
         SharedSurfaceObject* GetSurfaceObjectFromHandle(HANDLE h);
+        UINT GetSurfaceIndex(const SharedSurfaceObject*) const;
         IUnknown* GetOpenedSurface(const SharedSurfaceObject*) const;
+        HRESULT OpenSurfaceLazily(const SharedSurfaceObject*, IUnknown** ppSurface);
+        void ReleaseConsumerSurfaces();
+
+        // The id interface of an opened surface, from its data after the first
+        // time.  The reference stays with the data.
+        HRESULT GetSurfaceInterface(UINT Index, IUnknown* pSurface, REFIID id, IUnknown** ppInterface);
+        SharedSurfaceData** FindSurfaceData(UINT Index, REFGUID Key, BOOL IsInterface);
+        void ReleaseSurfaceData(UINT Index);
+
+        // The opened surface cache of the network lives in the root queue
+        COpenedSurfaceCache* GetOpenedSurfaceCache() { return &m_pRootQueue->m_OpenedSurfaces; }
 
     private:
         LONG                                    m_RefCount;
@@ -424,9 +905,10 @@ class CSurfaceQueue : public ISurfaceQueue
         // Number of Queue objects in the network - only stored in root queue
         volatile LONG                           m_NumQueuesInNetwork;
 
-        // References to producer and consumer objects
-        CSurfaceConsumer*                       m_pConsumer;
-        CSurfaceProducer*                       m_pProducer;
+        // References to producer and consumer objects.  These are published by the
+        // state changes and read by the high frequency calls inside the epoch.
+        CSurfaceConsumer* volatile              m_pConsumer;
+        CSurfaceProducer* volatile              m_pProducer;
 
         // Reference to the creating device
         ISurfaceQueueDevice*                    m_pCreator;
@@ -437,6 +919,8 @@ class CSurfaceQueue : public ISurfaceQueue
         UINT                                    m_QueueSize;
 
         SharedSurfaceOpenedMapping*             m_ConsumerSurfaces;
+        // COM identity of the consumer device, the key of its opened surfaces
+        IUnknown*                               m_pConsumerDeviceKey;
         SharedSurfaceObject**                   m_CreatedSurfaces;
        
         UINT                                    m_iEnqueuedHead; 
@@ -444,11 +928,44 @@ class CSurfaceQueue : public ISurfaceQueue
 
         SURFACE_QUEUE_DESC                      m_Desc;
         
-        // Lock around all of the public queue functions.  This should have very little contention
-        // and is used to synchronize rare queue state changes (i.e. the consumer device changes).
-        SRWLOCK                                 m_lock;
+        // Epoch entered by all of the high frequency queue functions.  The rare queue state 
+        // changes (i.e. the consumer device changes) wait on it before retiring old state.
+        CQueueEpoch                             m_Epoch;
+
+        // Serializes the rare queue state changes against each other.
+        CRITICAL_SECTION                        m_StateLock;
+
+        // Objects notified about the queue state changes, one for each side
+        ISurfaceQueueNotify* volatile           m_pNotify[QUEUE_EPOCH_NUM_SIDES];
 
         // Lock for access to the underlying queue
         CRITICAL_SECTION                        m_QueueLock;
+
+        UINT                                    m_TraceId;
+
+        CQueueLockProfile                       m_LockProfile;
+
+        // The shared surfaces charged to the budget, on the root queue, and
+        // the staging resources of the producer
+        CBudgetCharge                           m_SurfaceCharge;
+        volatile LONGLONG                       m_StagingBytes;
+
+        // Enqueues flushed at once because both sides share a device
+        volatile LONGLONG                       m_SameDeviceEnqueues;
+
+        // Surfaces opened by the consumers of the network, on the root queue
+        COpenedSurfaceCache                     m_OpenedSurfaces;
+
+        // Start of the wait in progress on each side, or 0.  Written by the
+        // side, read by the watchdog.
+        volatile LONGLONG                       m_WaitStart[QUEUE_EPOCH_NUM_SIDES];
+        volatile LONG                           m_WaitKind[QUEUE_EPOCH_NUM_SIDES];
+        // The last wait the watchdog reported; only touched by the watchdog
+        LONGLONG                                m_StallReported[QUEUE_EPOCH_NUM_SIDES];
+
+        // List of the queues known to the watchdog
+        BOOL                                    m_Registered;
+        CSurfaceQueue*                          m_pNextRegistered;
+        CSurfaceQueue*                          m_pPrevRegistered;
 };
 
@@ -6,49 +6,61 @@ using namespace System;
 using namespace System::Windows;
 using namespace System::Windows::Interop;
 
-#define WIDTH 640
-#define HEIGHT 480
+// Adaptive resolution: weight of a new frame time in the average, the factor the scale moves by, the fraction of
+// the budget below which it grows again, and the frames to let the average settle after a change
+#define FRAME_TIME_WEIGHT       0.1
+#define RESCALE_STEP            0.85
+#define RESCALE_UP_THRESHOLD    0.6
+#define RESCALE_SETTLE_FRAMES   30
 
 REFIID                  surfaceIDDXGI = __uuidof(IDXGISurface);
 REFIID                  surfaceID9 = __uuidof(IDirect3DTexture9);
 
+// The top level of a texture the display side dequeued, attached to the texture
+static const GUID       surfaceLevelKey = { 0x3b1c6f2e, 0x52d4, 0x4f0a, { 0x9c, 0x6e, 0x1a, 0x7d, 0x25, 0x88, 0xe4, 0x0b } };
+
 namespace Microsoft {
     namespace Windows {
         namespace Media {
-            HRESULT SurfaceQueueInteropHelper::InitD3D10()
+            SurfaceQueueInteropHelper::SurfaceQueueInteropHelper()
             {
-                HRESULT hr;
-                UINT		DeviceFlags = D3D10_CREATE_DEVICE_BGRA_SUPPORT;
-                //DWORD		dwShaderFlags = D3D10_SHADER_ENABLE_STRICTNESS;
-
-#ifdef _DEBUG
-                    // To debug DirectX, uncomment the following lines:
+                m_renderScale = 1.0;
+                m_minRenderScale = 1.0;
+                m_maxRenderScale = 1.0;
+                m_frameTimeBudget = 1000.0 / 60.0;
+                m_surfaceCount = 1;
+                m_surfaceFormat = InteropSurfaceFormat::Bgra32;
+            }
 
-                    //DeviceFlags |= D3D10_CREATE_DEVICE_DEBUG;
-                    //dwShaderFlags	|= D3D10_SHADER_DEBUG;
-#endif
+            HRESULT SurfaceQueueInteropHelper::InitDevices()
+            {
+                HRESULT hr;
+                SURFACE_DEVICE_SET set;
 
+                // Images on the same adapter share their devices through the pool.
+                if (FAILED(hr = AcquireSharedSurfaceDevices(D3DADAPTER_DEFAULT, m_hwnd, &set)))
                 {
-                    pin_ptr<ID3D10Device1*> pinD3D10Device = &m_D3D10Device;
-                    ID3D10Device1** ppD3D10Device = pinD3D10Device;
-
-                    if (FAILED(hr = D3D10CreateDevice1(NULL, D3D10_DRIVER_TYPE_HARDWARE, NULL,
-                        DeviceFlags, D3D10_FEATURE_LEVEL_10_0, D3D10_1_SDK_VERSION, ppD3D10Device)))
-                    {
-                        return hr;
-                    }
+                    return hr;
                 }
 
+                m_pD3D9 = set.pD3D9;
+                m_pD3D9Device = set.pD3D9Device;
+                m_D3D10Device = set.pD3D10Device;
+
+                return S_OK;
+            }
+
+            void SurfaceQueueInteropHelper::SetViewport(const DXGI_SURFACE_DESC& desc)
+            {
+                // The device is shared with other images, so the viewport is set for every frame.
                 D3D10_VIEWPORT vp;
-                vp.Width = WIDTH;
-                vp.Height = HEIGHT;
+                vp.Width = desc.Width;
+                vp.Height = desc.Height;
                 vp.MinDepth = 0.0f;
                 vp.MaxDepth = 1.0f;
                 vp.TopLeftX = 0;
                 vp.TopLeftY = 0;
                 m_D3D10Device->RSSetViewports(1, &vp);
-
-                return S_OK;
             }
 
             void SurfaceQueueInteropHelper::RenderToDXGI(IntPtr pdxgiSurface, bool isNewSurface)
@@ -59,68 +71,57 @@ namespace Microsoft {
                 }
             }
 
-            void SurfaceQueueInteropHelper::CleanupD3D10()
+            void SurfaceQueueInteropHelper::CleanupDevices()
             {
-                ReleaseInterface(m_D3D10Device);
+                if (NULL != m_pD3D9Device)
+                {
+                    SURFACE_DEVICE_SET set = { m_pD3D9, m_pD3D9Device, m_D3D10Device };
+
+                    ReleaseSharedSurfaceDevices(&set);
+                }
+
+                m_pD3D9 = NULL;
+                m_pD3D9Device = NULL;
+                m_D3D10Device = NULL;
             }
 
-            HRESULT SurfaceQueueInteropHelper::InitD3D9()
+            void SurfaceQueueInteropHelper::ReportDevicesLost()
             {
-                HRESULT hr;
-
-                {
-                    pin_ptr<IDirect3D9Ex*> pinD3D9 = &m_pD3D9;
-                    IDirect3D9Ex** ppD3D9 = pinD3D9;
+                SURFACE_DEVICE_SET set = { m_pD3D9, m_pD3D9Device, m_D3D10Device };
 
-                    Direct3DCreate9Ex(D3D_SDK_VERSION, ppD3D9);
-                }
+                // Other images holding the devices keep them until they notice,
+                // but no new image gets them.
+                ReportSharedSurfaceDevicesLost(&set);
+            }
 
-                if (!m_pD3D9)
-                {
-                    return E_FAIL;
-                }
+            HRESULT SurfaceQueueInteropHelper::RecoverRenderDevice()
+            {
+                HRESULT hr = S_OK;
+                UINT numReclaimed = 0;
+                SURFACE_DEVICE_SET set = { m_pD3D9, m_pD3D9Device, m_D3D10Device };
 
-                D3DPRESENT_PARAMETERS		d3dpp;
-                ZeroMemory(&d3dpp, sizeof(d3dpp));
-                d3dpp.Windowed = TRUE;
-                d3dpp.SwapEffect = D3DSWAPEFFECT_DISCARD;
-                d3dpp.hDeviceWindow = NULL;
-                d3dpp.PresentationInterval = D3DPRESENT_INTERVAL_IMMEDIATE;
+                // Other images on the set get the same new device when they notice.
+                IFC(ReplaceSharedRenderDevice(&set));
+                m_D3D10Device = set.pD3D10Device;
 
+                if (m_areSurfacesInitialized)
                 {
-                    pin_ptr<IDirect3DDevice9Ex*> pinD3D9Device = &m_pD3D9Device;
-                    IDirect3DDevice9Ex** ppD3D9Device = pinD3D9Device;
+                    IFC(m_pipeline->ReplaceRenderDevice(m_D3D10Device, &numReclaimed));
 
-                    hr = m_pD3D9->CreateDeviceEx(
-                        D3DADAPTER_DEFAULT,
-                        D3DDEVTYPE_HAL,
-                        m_hwnd,
-                        D3DCREATE_HARDWARE_VERTEXPROCESSING | D3DCREATE_MULTITHREADED | D3DCREATE_FPU_PRESERVE,
-                        &d3dpp,
-                        NULL,
-                        ppD3D9Device);
+                    // The frames the old device did not finish never show.
+                    m_framesInFlight -= min(numReclaimed, m_framesInFlight);
                 }
 
+            Cleanup:
                 return hr;
             }
 
-            void SurfaceQueueInteropHelper::CleanupD3D9()
-            {
-                ReleaseInterface(m_pD3D9Device);
-                ReleaseInterface(m_pD3D9);
-            }
-
             void SurfaceQueueInteropHelper::CleanupSurfaces()
             {
                 m_areSurfacesInitialized = false;
+                m_framesInFlight = 0;
 
-                ReleaseInterface(m_BAProducer);
-                ReleaseInterface(m_ABProducer);
-                ReleaseInterface(m_BAConsumer);
-                ReleaseInterface(m_ABConsumer);
-
-                ReleaseInterface(m_ABQueue);
-                ReleaseInterface(m_BAQueue);
+                ReleaseInterface(m_pipeline);
             }
 
             void SurfaceQueueInteropHelper::CleanupD3D()
@@ -132,8 +133,7 @@ namespace Microsoft {
 
                 m_isD3DInitialized = false;
 
-                CleanupD3D10();
-                CleanupD3D9();
+                CleanupDevices();
             }
 
             HRESULT SurfaceQueueInteropHelper::InitD3D()
@@ -142,8 +142,7 @@ namespace Microsoft {
 
                 if (!m_isD3DInitialized)
                 {
-                    IFC(InitD3D9());
-                    IFC(InitD3D10());
+                    IFC(InitDevices());
 
                     m_isD3DInitialized = true;
                 }
@@ -161,18 +160,19 @@ namespace Microsoft {
             {
                 HRESULT hr = S_OK;
 
-                SURFACE_QUEUE_DESC  desc;
+                INTEROP_PIPELINE_DESC desc;
                 ZeroMemory(&desc, sizeof(desc));
-                desc.Width = m_pixelWidth;
-                desc.Height = m_pixelHeight;
-                desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
-                desc.NumSurfaces = 1;
-                desc.MetaDataSize = sizeof(int);
-                desc.Flags = SURFACE_QUEUE_FLAG_SINGLE_THREADED;
-
-                SURFACE_QUEUE_CLONE_DESC CloneDesc = { 0 };
-                CloneDesc.MetaDataSize = 0;
-                CloneDesc.Flags = SURFACE_QUEUE_FLAG_SINGLE_THREADED;
+                // The surface is rendered at the adaptive scale; the image stretches it to the layout size.
+                desc.Width = ScaledSize(m_pixelWidth);
+                desc.Height = ScaledSize(m_pixelHeight);
+                desc.Format = (InteropSurfaceFormat::Bgr32 == m_surfaceFormat) ? DXGI_FORMAT_B8G8R8X8_UNORM : DXGI_FORMAT_B8G8R8A8_UNORM;
+                desc.NumSurfaces = max(m_surfaceCount, 1u);
+                // With a render thread the queues are used from two threads.
+                desc.Flags = (nullptr != m_renderThread) ? 0 : SURFACE_QUEUE_FLAG_SINGLE_THREADED;
+                // D3D10 renders; D3D9 creates the surfaces and hands them to D3DImage
+                desc.pBridgeDevice = m_pD3D9Device;
+                desc.pRenderDevice = m_D3D10Device;
+                desc.pDisplayDevice = m_pD3D9Device;
 
                 if (!m_isD3DInitialized || (desc.Width <= 0) || (desc.Height <= 0))
                 {
@@ -182,52 +182,11 @@ namespace Microsoft {
 
                 if (!m_areSurfacesInitialized)
                 {
-                    // 
-                    // Initialize the surface queues
-                    //
-
-                    {
-                        pin_ptr<ISurfaceQueue*> pinABQueue = &m_ABQueue;
-                        ISurfaceQueue** ppABQueue = pinABQueue;
-
-                        IFC(CreateSurfaceQueue(&desc, m_pD3D9Device, ppABQueue));
-                    }
-
-                    // Clone the queue           
-                    {
-                        pin_ptr<ISurfaceQueue*> pinBAQueue = &m_BAQueue;
-                        ISurfaceQueue** ppBAQueue = pinBAQueue;
-
-                        IFC(m_ABQueue->Clone(&CloneDesc, ppBAQueue));
-                    }
-
-                    // Setup queue management
-                    {
-                        pin_ptr<ISurfaceProducer*> pinm_BAProducer = &m_BAProducer;
-                        ISurfaceProducer** ppm_BAProducer = pinm_BAProducer;
-
-                        IFC(m_BAQueue->OpenProducer(m_D3D10Device, ppm_BAProducer));
-                    }
-
-                    {
-                        pin_ptr<ISurfaceConsumer*> pinm_ABConsumer = &m_ABConsumer;
-                        ISurfaceConsumer** ppm_ABConsumer = pinm_ABConsumer;
-
-                        IFC(m_ABQueue->OpenConsumer(m_D3D10Device, ppm_ABConsumer));
-                    }
-
                     {
-                        pin_ptr<ISurfaceProducer*> pinm_ABProducer = &m_ABProducer;
-                        ISurfaceProducer** ppm_ABProducer = pinm_ABProducer;
+                        pin_ptr<CInteropPipeline*> pinPipeline = &m_pipeline;
+                        CInteropPipeline** ppPipeline = pinPipeline;
 
-                        IFC(m_ABQueue->OpenProducer(m_pD3D9Device, ppm_ABProducer));
-                    }
-
-                    {
-                        pin_ptr<ISurfaceConsumer*> pinm_BAConsumer = &m_BAConsumer;
-                        ISurfaceConsumer** ppm_BAConsumer = pinm_BAConsumer;
-
-                        IFC(m_BAQueue->OpenConsumer(m_pD3D9Device, ppm_BAConsumer));
+                        IFC(CreateInteropPipeline(&desc, ppPipeline));
                     }
 
                     m_areSurfacesInitialized = true;
@@ -243,13 +202,33 @@ namespace Microsoft {
             {
                 HRESULT hr = S_OK;
 
+                LONGLONG recoveryStart = 0;
+                bool isRenderDeviceRecovery = false;
+
                 if (m_isD3DInitialized)
                 {
-                    hr = m_pD3D9Device->CheckDeviceState(NULL);
-
-                    if (D3D_OK != hr)
+                    // Occlusion and mode changes are reported as successes; the devices are fine.
+                    if (FAILED(m_pD3D9Device->CheckDeviceState(NULL)))
                     {
+                        recoveryStart = System::Diagnostics::Stopwatch::GetTimestamp();
+
+                        ReportDevicesLost();
                         CleanupD3D();
+                        m_areSurfacesRecovered = true;
+                    }
+                    else if (FAILED(m_D3D10Device->GetDeviceRemovedReason()))
+                    {
+                        recoveryStart = System::Diagnostics::Stopwatch::GetTimestamp();
+
+                        // The surfaces belong to the D3D9 device, so they and the queues outlive the render device.
+                        // If that fails the D3D9 device is still fine; the pool keeps the set and replaces the
+                        // render device for the next acquire.
+                        isRenderDeviceRecovery = SUCCEEDED(RecoverRenderDevice());
+                        if (!isRenderDeviceRecovery)
+                        {
+                            CleanupD3D();
+                        }
+                        m_areSurfacesRecovered = true;
                     }
                 }
 
@@ -273,6 +252,17 @@ namespace Microsoft {
                     CleanupD3D();
                 }
 
+                if ((0 != recoveryStart) && m_areSurfacesInitialized)
+                {
+                    m_lastRecoveryTime = (System::Diagnostics::Stopwatch::GetTimestamp() - recoveryStart) * 1000.0 /
+                                         System::Diagnostics::Stopwatch::Frequency;
+                    m_deviceRecoveries++;
+                    if (isRenderDeviceRecovery)
+                    {
+                        m_renderDeviceRecoveries++;
+                    }
+                }
+
                 return m_areSurfacesInitialized;
             }
 
@@ -282,22 +272,29 @@ namespace Microsoft {
             {
                 HRESULT hr = S_OK;
 
+                // The queues hand out the surfaces as the interfaces asked for.
                 IDXGISurface*           pDXGISurface = NULL;
-                IUnknown*               pUnkDXGISurface = NULL;
 
                 IDirect3DTexture9*      pTexture9 = NULL;
-                IUnknown*               pUnkTexture9 = NULL;
 
                 IDirect3DSurface9*      pSurface9 = NULL;
 
                 DXGI_SURFACE_DESC desc;
 
-                // D3D10 portion
-                int count = 0;
-                UINT size = sizeof(int);
+                // The area to invalidate; the whole surface unless the render reported less
+                RECT dirtyRect = { 0, 0, (LONG)m_pixelWidth, (LONG)m_pixelHeight };
+                UINT numDirtyRects = 1;
 
                 bool fNeedUnlock = false;
-                
+
+                // The render device is shared with the other images on the adapter, render threads included
+                SURFACE_DEVICE_SET renderSet;
+                bool fNeedRenderUnlock = false;
+
+                LONGLONG renderStart = 0;
+
+                ApplyPendingRescale();
+
                 bool isNewSurface = !m_areSurfacesInitialized;
 
                 if (m_shouldSkipRender || (nullptr == m_d3dImage) || !Initialize())
@@ -305,21 +302,47 @@ namespace Microsoft {
                     goto Cleanup;
                 }
 
+                if (m_areSurfacesRecovered)
+                {
+                    isNewSurface = true;
+                    m_areSurfacesRecovered = false;
+                }
+
                 m_d3dImage->Lock();
                 fNeedUnlock = true;
 
-                // Flush the AB queue
-                m_ABProducer->Flush(0 /* wait */, NULL);
+                renderSet.pD3D9 = m_pD3D9;
+                renderSet.pD3D9Device = m_pD3D9Device;
+                renderSet.pD3D10Device = m_D3D10Device;
+                IFC(LockSharedRenderDevice(&renderSet));
+                fNeedRenderUnlock = true;
 
-                // Dequeue from AB queue
-                IFC(m_ABConsumer->Dequeue(surfaceIDDXGI, &pUnkDXGISurface, &count, &size, INFINITE));
+                // Get a surface to render to.  If it isn't back yet, keep showing the last frame and try again on the
+                // next one rather than blocking the UI thread.
+                hr = m_pipeline->BeginFrame(surfaceIDDXGI, (IUnknown**)&pDXGISurface, 0);
+                if (HRESULT_FROM_WIN32(WAIT_TIMEOUT) == hr)
+                {
+                    m_droppedFrames++;
+                    ScheduleRetryRender();
 
-                IFC(pUnkDXGISurface->QueryInterface(surfaceIDDXGI, (void**)&pDXGISurface));
+                    hr = S_OK;
+                    numDirtyRects = 0;
+                    goto Cleanup;
+                }
+                IFC(hr);
 
                 IFC(pDXGISurface->GetDesc(&desc));
 
+                SetRect(&dirtyRect, 0, 0, desc.Width, desc.Height);
+
+                SetViewport(desc);
+
+                renderStart = System::Diagnostics::Stopwatch::GetTimestamp();
+
                 if (renderMode == QueueRenderMode::RenderDXGI)
                 {
+                    m_hasDirtyRect = false;
+
                     // Render D3D10 content
                     try
                     {
@@ -329,20 +352,44 @@ namespace Microsoft {
                     {
                         IFC(E_FAIL);
                     }
+
+                    // A new surface has no earlier content to keep, and with several surfaces the one rendered holds an
+                    // older frame than the one on screen.
+                    if (m_hasDirtyRect && !isNewSurface && !IsPipelined())
+                    {
+                        SetRect(&dirtyRect, m_dirtyLeft, m_dirtyTop, m_dirtyRight, m_dirtyBottom);
+                    }
                 }
 
-                // Produce the surface
-                m_BAProducer->Enqueue(pDXGISurface, NULL, NULL, SURFACE_QUEUE_FLAG_DO_NOT_WAIT);
+                // Produce the surface, along with the part of it that changed.  With a single surface, wait for the
+                // GPU so the frame shows now, once the other images may render again.  With several, show whichever
+                // earlier frame is done and let this one render while that one is composed.
+                IFC(m_pipeline->EndFrame(pDXGISurface, &dirtyRect, FALSE));
+                m_framesInFlight++;
 
-                // Flush the BA queue
-                m_BAProducer->Flush(0 /* wait, *not* SURFACE_QUEUE_FLAG_DO_NOT_WAIT*/, NULL);
+                UnlockSharedRenderDevice(&renderSet);
+                fNeedRenderUnlock = false;
 
-                // Dequeue from BA queue
-                IFC(m_BAConsumer->Dequeue(surfaceID9, &pUnkTexture9, NULL, NULL, INFINITE));
-                IFC(pUnkTexture9->QueryInterface(surfaceID9, (void**)&pTexture9));
+                if (!IsPipelined())
+                {
+                    IFC(m_pipeline->FlushRendered(0));
+                }
+
+                RecordFrameTime(renderStart);
 
-                // Get the top level surface from the texture
-                IFC(pTexture9->GetSurfaceLevel(0, &pSurface9));
+                // The queue hands back the union of the dirty rectangles
+                hr = m_pipeline->AcquireFrame(surfaceID9, (IUnknown**)&pTexture9, &dirtyRect, &numDirtyRects, IsPipelined() ? 0 : INFINITE);
+                if (HRESULT_FROM_WIN32(WAIT_TIMEOUT) == hr)
+                {
+                    // No frame is done yet; the last one stays on screen.
+                    hr = S_OK;
+                    numDirtyRects = 0;
+                    goto Cleanup;
+                }
+                IFC(hr);
+                m_framesInFlight--;
+
+                IFC(GetTopLevelSurface(pTexture9, &pSurface9));
 
                 m_d3dImage->SetBackBuffer(System::Windows::Interop::D3DResourceType::IDirect3DSurface9,
                     (IntPtr)(void*)pSurface9, 
@@ -351,44 +398,632 @@ namespace Microsoft {
                          // Was added in WPF 4.5
                     );
 
-                // Produce Surface
-                m_ABProducer->Enqueue(pTexture9, &count, sizeof(int), SURFACE_QUEUE_FLAG_DO_NOT_WAIT);
-
-                // Flush the AB queue - use "do not wait" here, we'll block at the top of the *next* call if we need to
-                m_ABProducer->Flush(SURFACE_QUEUE_FLAG_DO_NOT_WAIT, NULL);
+                // Hand the surface back.  This doesn't wait; the next frame flushes again, or skips if it is still pending.
+                m_pipeline->ReleaseFrame(pTexture9, &dirtyRect, numDirtyRects);
 
             Cleanup:
+                if (fNeedRenderUnlock)
+                {
+                    UnlockSharedRenderDevice(&renderSet);
+                }
+
                 if (fNeedUnlock)
                 {
-                    m_d3dImage->AddDirtyRect(Int32Rect(0, 0, m_d3dImage->PixelWidth, m_d3dImage->PixelHeight));
+                    if (FAILED(hr))
+                    {
+                        // Don't know what made it to the surface
+                        SetRect(&dirtyRect, 0, 0, m_d3dImage->PixelWidth, m_d3dImage->PixelHeight);
+                        numDirtyRects = 1;
+                    }
+                    if (numDirtyRects)
+                    {
+                        m_d3dImage->AddDirtyRect(Int32Rect(dirtyRect.left, dirtyRect.top,
+                                                           dirtyRect.right - dirtyRect.left, dirtyRect.bottom - dirtyRect.top));
+                    }
                     m_d3dImage->Unlock();
                 }
 
+                // Frames left in the pipeline are shown on the next composition pass, even if no render follows.
+                if (IsPipelined() && (m_framesInFlight > 0))
+                {
+                    SchedulePresent();
+                }
+
                 ReleaseInterface(pSurface9);
 
                 ReleaseInterface(pTexture9);
-                ReleaseInterface(pUnkTexture9);
 
                 ReleaseInterface(pDXGISurface);
-                ReleaseInterface(pUnkDXGISurface);
             }
 
+            HRESULT SurfaceQueueInteropHelper::GetTopLevelSurface(IDirect3DTexture9* pTexture9, IDirect3DSurface9** ppSurface9)
+            {
+                HRESULT hr = S_OK;
+
+                // Looked up once per texture and kept with it
+                if (SUCCEEDED(m_pipeline->GetFrameData(pTexture9, surfaceLevelKey, (IUnknown**)ppSurface9)))
+                {
+                    goto Cleanup;
+                }
+
+                IFC(pTexture9->GetSurfaceLevel(0, ppSurface9));
+
+                m_pipeline->SetFrameData(pTexture9, surfaceLevelKey, *ppSurface9);
+
+            Cleanup:
+                return hr;
+            }
+
+            UINT SurfaceQueueInteropHelper::ScaledSize(UINT size)
+            {
+                if (0 == size)
+                {
+                    return 0;
+                }
+
+                return max((UINT)(size * m_renderScale + 0.5), 1u);
+            }
+
+            void SurfaceQueueInteropHelper::RecordFrameTime(LONGLONG renderStart)
+            {
+                double frameTime = (System::Diagnostics::Stopwatch::GetTimestamp() - renderStart) * 1000.0 /
+                                   System::Diagnostics::Stopwatch::Frequency;
+
+                m_averageFrameTime = (0.0 == m_averageFrameTime) ? frameTime :
+                                     m_averageFrameTime + (frameTime - m_averageFrameTime) * FRAME_TIME_WEIGHT;
+
+                if (++m_framesSinceRescale < RESCALE_SETTLE_FRAMES)
+                {
+                    return;
+                }
+
+                // Area goes with the square of the scale, so growing again needs clearly more headroom than the
+                // budget; this keeps the scale from flipping between two steps.
+                double scale = m_renderScale;
+                if (m_averageFrameTime > m_frameTimeBudget)
+                {
+                    scale = max(m_renderScale * RESCALE_STEP, m_minRenderScale);
+                }
+                else if (m_averageFrameTime < m_frameTimeBudget * RESCALE_UP_THRESHOLD)
+                {
+                    scale = min(m_renderScale / RESCALE_STEP, m_maxRenderScale);
+                }
+
+                if (scale != m_renderScale)
+                {
+                    m_renderScale = scale;
+                    m_isRescalePending = true;
+                    m_framesSinceRescale = 0;
+                    m_averageFrameTime = 0.0;
+                }
+            }
+
+            void SurfaceQueueInteropHelper::ApplyPendingRescale()
+            {
+                if (m_isRescalePending)
+                {
+                    m_isRescalePending = false;
+                    CleanupSurfaces();
+                }
+            }
+
+            void SurfaceQueueInteropHelper::SetRenderScaleRange(double minScale, double maxScale)
+            {
+                if (!(minScale > 0.0) || (minScale > maxScale) || (maxScale > 1.0))
+                {
+                    throw gcnew ArgumentOutOfRangeException("minScale", "The scales must satisfy 0 < minScale <= maxScale <= 1.");
+                }
+
+                if (nullptr != m_renderThread)
+                {
+                    System::Threading::Monitor::Enter(m_queueLock);
+                }
+                try
+                {
+                    m_minRenderScale = minScale;
+                    m_maxRenderScale = maxScale;
+
+                    double scale = min(max(m_renderScale, minScale), maxScale);
+                    if (scale != m_renderScale)
+                    {
+                        m_renderScale = scale;
+                        m_isRescalePending = true;
+                        m_framesSinceRescale = 0;
+                        m_averageFrameTime = 0.0;
+                    }
+                }
+                finally
+                {
+                    if (nullptr != m_renderThread)
+                    {
+                        System::Threading::Monitor::Exit(m_queueLock);
+                    }
+                }
+            }
+
+            void SurfaceQueueInteropHelper::SurfaceCount::set(unsigned int value)
+            {
+                if ((value < 1) || (value > MAX_INTEROP_SURFACES))
+                {
+                    throw gcnew ArgumentOutOfRangeException("value");
+                }
+
+                if (value != m_surfaceCount)
+                {
+                    SetSurfaceOptions(value, m_surfaceFormat);
+                }
+            }
+
+            void SurfaceQueueInteropHelper::SurfaceFormat::set(InteropSurfaceFormat value)
+            {
+                if (value != m_surfaceFormat)
+                {
+                    SetSurfaceOptions(m_surfaceCount, value);
+                }
+            }
+
+            void SurfaceQueueInteropHelper::SetSurfaceOptions(unsigned int surfaceCount, InteropSurfaceFormat format)
+            {
+                if (nullptr != m_renderThread)
+                {
+                    System::Threading::Monitor::Enter(m_queueLock);
+                }
+                try
+                {
+                    m_surfaceCount = surfaceCount;
+                    m_surfaceFormat = format;
+
+                    // Takes effect with the next frame
+                    CleanupSurfaces();
+                }
+                finally
+                {
+                    if (nullptr != m_renderThread)
+                    {
+                        System::Threading::Monitor::Exit(m_queueLock);
+                    }
+                }
+            }
+
+            void SurfaceQueueInteropHelper::HookRendering()
+            {
+                if (!m_isRenderingHooked)
+                {
+                    if (nullptr == m_retryRender)
+                    {
+                        m_retryRender = gcnew EventHandler(this, &SurfaceQueueInteropHelper::OnRetryRender);
+                    }
+                    System::Windows::Media::CompositionTarget::Rendering += m_retryRender;
+                    m_isRenderingHooked = true;
+                }
+            }
+
+            void SurfaceQueueInteropHelper::ScheduleRetryRender()
+            {
+                m_isRetryScheduled = true;
+                HookRendering();
+            }
+
+            void SurfaceQueueInteropHelper::SchedulePresent()
+            {
+                m_isPresentScheduled = true;
+                HookRendering();
+            }
+
+            void SurfaceQueueInteropHelper::CancelRetryRender()
+            {
+                if (m_isRenderingHooked)
+                {
+                    System::Windows::Media::CompositionTarget::Rendering -= m_retryRender;
+                    m_isRenderingHooked = false;
+                }
+                m_isRetryScheduled = false;
+                m_isPresentScheduled = false;
+            }
+
+            void SurfaceQueueInteropHelper::OnRetryRender(Object^ sender, EventArgs^ e)
+            {
+                bool isRetryScheduled = m_isRetryScheduled;
+                bool isPresentScheduled = m_isPresentScheduled;
+
+                CancelRetryRender();
+
+                if (nullptr != m_renderThread)
+                {
+                    return;
+                }
+
+                // A render stands in for the requests that were coalesced while the frame was skipped, and shows
+                // earlier frames as well.
+                if (isRetryScheduled)
+                {
+                    QueueHelper(QueueRenderMode::RenderDXGI);
+                }
+                else if (isPresentScheduled)
+                {
+                    PresentPendingFrame();
+                }
+            }
+
+            void SurfaceQueueInteropHelper::PresentPendingFrame()
+            {
+                if (!m_areSurfacesInitialized || (nullptr == m_d3dImage))
+                {
+                    return;
+                }
+
+                m_pipeline->FlushRendered(SURFACE_QUEUE_FLAG_DO_NOT_WAIT);
+
+                if (PresentRenderedSurfaceLocked() && (m_framesInFlight > 0))
+                {
+                    m_framesInFlight--;
+                }
+
+                if (m_framesInFlight > 0)
+                {
+                    SchedulePresent();
+                }
+            }
+
+            void SurfaceQueueInteropHelper::StartRenderThread()
+            {
+                if (nullptr == m_queueLock)
+                {
+                    m_queueLock = gcnew Object();
+                }
+
+                // The queues are recreated for use from two threads.
+                CleanupSurfaces();
+
+                CancelRetryRender();
+
+                m_isRenderRequested = 0;
+                m_renderRequested = gcnew System::Threading::AutoResetEvent(false);
+                m_stopRenderThread = gcnew System::Threading::ManualResetEvent(false);
+
+                m_renderThread = gcnew System::Threading::Thread(
+                    gcnew System::Threading::ThreadStart(this, &SurfaceQueueInteropHelper::RenderThreadProc));
+                m_renderThread->IsBackground = true;
+                m_renderThread->Name = "D3D11Image render thread";
+                m_renderThread->Start();
+            }
+
+            void SurfaceQueueInteropHelper::StopRenderThread()
+            {
+                if (nullptr == m_renderThread)
+                {
+                    return;
+                }
+
+                m_stopRenderThread->Set();
+                m_renderThread->Join();
+
+                m_renderThread = nullptr;
+                m_renderRequested = nullptr;
+                m_stopRenderThread = nullptr;
+
+                // Back to single threaded queues on the UI thread
+                CleanupSurfaces();
+            }
+
+            void SurfaceQueueInteropHelper::RenderThreadProc()
+            {
+                array<System::Threading::WaitHandle^>^ handles = { m_stopRenderThread, m_renderRequested };
+
+                // Requests made while a frame renders collapse into one more frame.
+                while (System::Threading::WaitHandle::WaitAny(handles) == 1)
+                {
+                    System::Threading::Interlocked::Exchange(m_isRenderRequested, 0);
+                    RenderOnThread();
+                }
+            }
+
+            bool SurfaceQueueInteropHelper::AcquireThreadPipeline(CInteropPipeline** ppPipeline, SURFACE_DEVICE_SET* pRenderSet, bool* pIsNewSurface)
+            {
+                System::Threading::Monitor::Enter(m_queueLock);
+                try
+                {
+                    ApplyPendingRescale();
+
+                    *pIsNewSurface = !m_areSurfacesInitialized;
+
+                    if (m_shouldSkipRender || (nullptr == m_d3dImage) || !Initialize())
+                    {
+                        return false;
+                    }
+
+                    if (m_areSurfacesRecovered)
+                    {
+                        *pIsNewSurface = true;
+                        m_areSurfacesRecovered = false;
+                    }
+
+                    // The frame keeps the pipeline alive if the UI thread replaces it meanwhile.
+                    *ppPipeline = m_pipeline;
+                    m_pipeline->AddRef();
+
+                    // The devices the pipeline was made with, which identify the render lock
+                    pRenderSet->pD3D9 = m_pD3D9;
+                    pRenderSet->pD3D9Device = m_pD3D9Device;
+                    pRenderSet->pD3D10Device = m_D3D10Device;
+
+                    return true;
+                }
+                finally
+                {
+                    System::Threading::Monitor::Exit(m_queueLock);
+                }
+            }
+
+
+            void SurfaceQueueInteropHelper::RenderOnThread()
+            {
+                HRESULT hr = S_OK;
+
+                CInteropPipeline*       pPipeline = NULL;
+
+                IDXGISurface*           pDXGISurface = NULL;
+
+                DXGI_SURFACE_DESC desc;
+                RECT dirtyRect;
+
+                bool isNewSurface = false;
+
+                SURFACE_DEVICE_SET renderSet;
+                bool fNeedRenderUnlock = false;
+
+                LONGLONG renderStart = 0;
+
+                System::Windows::Interop::D3DImage^ d3dImage = m_d3dImage;
+
+                if (!AcquireThreadPipeline(&pPipeline, &renderSet, &isNewSurface))
+                {
+                    goto Cleanup;
+                }
+
+                // Wait for the UI thread to hand the surface back.  Its flush does not wait, so flush again here
+                // while the surface is still in flight.
+                for (;;)
+                {
+                    hr = pPipeline->BeginFrame(surfaceIDDXGI, (IUnknown**)&pDXGISurface, 16);
+                    if (HRESULT_FROM_WIN32(WAIT_TIMEOUT) != hr)
+                    {
+                        break;
+                    }
+                    if (m_stopRenderThread->WaitOne(0))
+                    {
+                        goto Cleanup;
+                    }
+                    pPipeline->FlushReturned(0 /* wait */);
+                }
+                IFC(hr);
+
+                IFC(pDXGISurface->GetDesc(&desc));
+
+                SetRect(&dirtyRect, 0, 0, desc.Width, desc.Height);
+
+                // Taken once the surface is here, so the UI thread can render other images while this one waits
+                IFC(LockSharedRenderDevice(&renderSet));
+                fNeedRenderUnlock = true;
+
+                SetViewport(desc);
+
+                renderStart = System::Diagnostics::Stopwatch::GetTimestamp();
+
+                m_hasDirtyRect = false;
+
+                try
+                {
+                    RenderToDXGI((IntPtr)(void*)pDXGISurface, isNewSurface);
+                }
+                catch (Exception^)
+                {
+                    // Nothing is known about the content; it all goes to the UI thread as changed.
+                    m_hasDirtyRect = false;
+                }
+
+                if (m_hasDirtyRect && !isNewSurface && !IsPipelined())
+                {
+                    SetRect(&dirtyRect, m_dirtyLeft, m_dirtyTop, m_dirtyRight, m_dirtyBottom);
+                }
+
+                IFC(pPipeline->EndFrame(pDXGISurface, &dirtyRect, FALSE));
+
+                UnlockSharedRenderDevice(&renderSet);
+                fNeedRenderUnlock = false;
+
+                // The GPU wait happens here instead of on the UI thread.
+                IFC(pPipeline->FlushRendered(0));
+
+                System::Threading::Monitor::Enter(m_queueLock);
+                try
+                {
+                    RecordFrameTime(renderStart);
+                }
+                finally
+                {
+                    System::Threading::Monitor::Exit(m_queueLock);
+                }
+
+                if (nullptr != d3dImage)
+                {
+                    d3dImage->Dispatcher->BeginInvoke(gcnew Action(this, &SurfaceQueueInteropHelper::PresentRenderedSurface));
+                }
+
+            Cleanup:
+                if (fNeedRenderUnlock)
+                {
+                    UnlockSharedRenderDevice(&renderSet);
+                }
+
+                ReleaseInterface(pDXGISurface);
+
+                ReleaseInterface(pPipeline);
+            }
+
+            void SurfaceQueueInteropHelper::PresentRenderedSurface()
+            {
+                // The mode may have been turned off since the frame was posted.
+                if (nullptr == m_renderThread)
+                {
+                    return;
+                }
+
+                System::Threading::Monitor::Enter(m_queueLock);
+                try
+                {
+                    PresentRenderedSurfaceLocked();
+                }
+                finally
+                {
+                    System::Threading::Monitor::Exit(m_queueLock);
+                }
+            }
+
+            bool SurfaceQueueInteropHelper::PresentRenderedSurfaceLocked()
+            {
+                HRESULT hr = S_OK;
+
+                IDirect3DTexture9*      pTexture9 = NULL;
+
+                IDirect3DSurface9*      pSurface9 = NULL;
+
+                RECT dirtyRect = { 0, 0, (LONG)m_pixelWidth, (LONG)m_pixelHeight };
+                UINT numDirtyRects = 1;
+
+                bool fNeedUnlock = false;
+                bool fPresented = false;
+
+                if (!m_areSurfacesInitialized || (nullptr == m_d3dImage))
+                {
+                    goto Cleanup;
+                }
+
+                m_d3dImage->Lock();
+                fNeedUnlock = true;
+
+                // Never wait here; a frame that is not ready is picked up by its own post.
+                if (FAILED(m_pipeline->AcquireFrame(surfaceID9, (IUnknown**)&pTexture9, &dirtyRect, &numDirtyRects, 0)))
+                {
+                    // Nothing new to show
+                    numDirtyRects = 0;
+                    goto Cleanup;
+                }
+
+                IFC(GetTopLevelSurface(pTexture9, &pSurface9));
+
+                m_d3dImage->SetBackBuffer(System::Windows::Interop::D3DResourceType::IDirect3DSurface9,
+                    (IntPtr)(void*)pSurface9,
+                    true // enableSoftwareFallback
+                    );
+                fPresented = true;
+
+                // Hand the surface back to the render side
+                m_pipeline->ReleaseFrame(pTexture9, &dirtyRect, numDirtyRects);
+
+            Cleanup:
+                if (fNeedUnlock)
+                {
+                    if (FAILED(hr))
+                    {
+                        SetRect(&dirtyRect, 0, 0, m_d3dImage->PixelWidth, m_d3dImage->PixelHeight);
+                        numDirtyRects = 1;
+                    }
+                    if (numDirtyRects)
+                    {
+                        m_d3dImage->AddDirtyRect(Int32Rect(dirtyRect.left, dirtyRect.top,
+                                                           dirtyRect.right - dirtyRect.left, dirtyRect.bottom - dirtyRect.top));
+                    }
+                    m_d3dImage->Unlock();
+                }
+
+                ReleaseInterface(pSurface9);
+
+                ReleaseInterface(pTexture9);
+
+                return fPresented;
+            }
 
             void SurfaceQueueInteropHelper::SetPixelSize(unsigned int pixelWidth, unsigned int pixelHeight)
             {
                 if ((m_pixelWidth != pixelWidth) ||
                     (m_pixelHeight != pixelHeight))
                 {
-                    m_pixelWidth = pixelWidth;
-                    m_pixelHeight = pixelHeight;
-                    CleanupSurfaces();
-                    QueueHelper(QueueRenderMode::RenderDXGI);
+                    if (nullptr != m_renderThread)
+                    {
+                        System::Threading::Monitor::Enter(m_queueLock);
+                        try
+                        {
+                            m_pixelWidth = pixelWidth;
+                            m_pixelHeight = pixelHeight;
+                            CleanupSurfaces();
+                        }
+                        finally
+                        {
+                            System::Threading::Monitor::Exit(m_queueLock);
+                        }
+                        m_renderRequested->Set();
+                    }
+                    else
+                    {
+                        m_pixelWidth = pixelWidth;
+                        m_pixelHeight = pixelHeight;
+                        CleanupSurfaces();
+                        QueueHelper(QueueRenderMode::RenderDXGI);
+                    }
                 }
             }
 
             void SurfaceQueueInteropHelper::RequestRenderD2D()
             {
-                QueueHelper(QueueRenderMode::RenderDXGI);
+                if (nullptr != m_renderThread)
+                {
+                    // A request the render thread has not picked up yet already covers this one.
+                    if (System::Threading::Interlocked::Exchange(m_isRenderRequested, 1))
+                    {
+                        m_coalescedRenders++;
+                    }
+                    else
+                    {
+                        m_renderRequested->Set();
+                    }
+                }
+                else if (m_isRetryScheduled)
+                {
+                    // The skipped frame is rendered on the next composition pass.
+                    m_coalescedRenders++;
+                }
+                else
+                {
+                    QueueHelper(QueueRenderMode::RenderDXGI);
+                }
+            }
+
+            void SurfaceQueueInteropHelper::AddDirtyRect(Int32Rect rect)
+            {
+                if (rect.Width <= 0 || rect.Height <= 0)
+                {
+                    return;
+                }
+
+                LONG right = rect.X + rect.Width;
+                LONG bottom = rect.Y + rect.Height;
+
+                if (!m_hasDirtyRect)
+                {
+                    m_dirtyLeft = rect.X;
+                    m_dirtyTop = rect.Y;
+                    m_dirtyRight = right;
+                    m_dirtyBottom = bottom;
+                    m_hasDirtyRect = true;
+                }
+                else
+                {
+                    m_dirtyLeft = min(m_dirtyLeft, (LONG)rect.X);
+                    m_dirtyTop = min(m_dirtyTop, (LONG)rect.Y);
+                    m_dirtyRight = max(m_dirtyRight, right);
+                    m_dirtyBottom = max(m_dirtyBottom, bottom);
+                }
             }
 
             SurfaceQueueInteropHelper::!SurfaceQueueInteropHelper()
@@ -398,6 +1033,9 @@ namespace Microsoft {
 
             SurfaceQueueInteropHelper::~SurfaceQueueInteropHelper()
             {
+                // The static Rendering event would otherwise keep this instance alive.
+                CancelRetryRender();
+                StopRenderThread();
                 CleanupD3D();
             }
         }
@@ -8,10 +8,22 @@ using namespace System;
 using namespace System::Windows;
 using namespace System::Windows::Interop;
 
+// Most surfaces the queues of a helper may hold
+#define MAX_INTEROP_SURFACES 4
+
 namespace Microsoft {
     namespace Windows {
         namespace Media {
 
+            /// The formats D3DImage can show.
+            public enum class InteropSurfaceFormat
+            {
+                /// 32 bits per pixel with alpha; DXGI_FORMAT_B8G8R8A8_UNORM
+                Bgra32 = 0,
+                /// 32 bits per pixel, opaque; DXGI_FORMAT_B8G8R8X8_UNORM
+                Bgr32 = 1
+            };
+
             /// A helper class which enables several versions of DirectX to share the same rendering surface.
             public ref class SurfaceQueueInteropHelper : IDisposable
             {
@@ -27,18 +39,58 @@ namespace Microsoft {
 
                 ID3D10Device1*          m_D3D10Device;
 
-                ISurfaceQueue*			m_ABQueue;
-                ISurfaceQueue*			m_BAQueue;
-
-                ISurfaceConsumer*		m_ABConsumer;
-                ISurfaceProducer*		m_BAProducer;
-                ISurfaceConsumer*		m_BAConsumer;
-                ISurfaceProducer*		m_ABProducer;
+                // The AB/BA queues between the D3D9 and D3D10 devices
+                CInteropPipeline*       m_pipeline;
 
                 bool m_isD3DInitialized;
                 bool m_areSurfacesInitialized;
                 bool m_shouldSkipRender;
 
+                // Render thread mode.  The thread renders and flushes; the UI thread only picks up the finished surface.
+                // m_queueLock guards the queues and devices while the thread runs.
+                System::Threading::Thread^ m_renderThread;
+                System::Threading::AutoResetEvent^ m_renderRequested;
+                System::Threading::ManualResetEvent^ m_stopRenderThread;
+                Object^ m_queueLock;
+                int m_isRenderRequested;
+
+                // Frames skipped because the previous one was still in flight, and requests folded into another render
+                unsigned int m_droppedFrames;
+                unsigned int m_coalescedRenders;
+
+                // A skipped frame is retried, and a frame left in the pipeline shown, on the next CompositionTarget.Rendering
+                bool m_isRetryScheduled;
+                bool m_isPresentScheduled;
+                bool m_isRenderingHooked;
+                EventHandler^ m_retryRender;
+
+                // Queue options.  With more than one surface the UI thread doesn't wait for the frame it renders; it shows
+                // an earlier one that is done.  m_framesInFlight counts the frames rendered but not shown yet.
+                unsigned int m_surfaceCount;
+                InteropSurfaceFormat m_surfaceFormat;
+                unsigned int m_framesInFlight;
+
+                // Adaptive resolution.  The surface is m_renderScale times the pixel size; the scale moves within the
+                // range after the average render and flush time in milliseconds leaves the budget.
+                double m_renderScale;
+                double m_minRenderScale, m_maxRenderScale;
+                double m_frameTimeBudget;
+                double m_averageFrameTime;
+                unsigned int m_framesSinceRescale;
+                bool m_isRescalePending;
+
+                // Device loss.  Recoveries that rebuilt the surfaces, those of them that only replaced a removed render
+                // device and kept the queues, and the milliseconds the last one took to have surfaces again.
+                unsigned int m_deviceRecoveries;
+                unsigned int m_renderDeviceRecoveries;
+                double m_lastRecoveryTime;
+                // The surfaces came back from a device loss; the render callback sees them as new on the next frame
+                bool m_areSurfacesRecovered;
+
+                // Union of the rectangles passed to AddDirtyRect during the render
+                bool m_hasDirtyRect;
+                LONG m_dirtyLeft, m_dirtyTop, m_dirtyRight, m_dirtyBottom;
+
                 // Could hypothetically add additional types
                 enum struct QueueRenderMode
                 {
@@ -46,15 +98,16 @@ namespace Microsoft {
                     RenderDXGI = 1
                 };
 
-                HRESULT InitD3D10();
+                HRESULT InitDevices();
 
                 void RenderToDXGI(IntPtr pdxgiSurface, bool isNewSurface);
 
-                void CleanupD3D10();
+                void CleanupDevices();
 
-                HRESULT InitD3D9();
+                void ReportDevicesLost();
 
-                void CleanupD3D9();
+                // Moves the surfaces to a new render device when only the D3D10 device was removed
+                HRESULT RecoverRenderDevice();
 
                 void CleanupSurfaces();
 
@@ -70,8 +123,55 @@ namespace Microsoft {
                 // In any case, this method always initializes m_d3dImage which incurrs no cost if this results in no change.
                 void QueueHelper(QueueRenderMode renderMode);
 
+                // The top level of a texture the display side dequeued
+                HRESULT GetTopLevelSurface(IDirect3DTexture9* pTexture9, IDirect3DSurface9** ppSurface9);
+
+                UINT ScaledSize(UINT size);
+
+                void RecordFrameTime(LONGLONG renderStart);
+
+                // Recreates the surfaces at a new scale.  Runs before a frame, under m_queueLock with a render thread.
+                void ApplyPendingRescale();
+
+                bool IsPipelined() { return m_surfaceCount > 1; }
+
+                void SetSurfaceOptions(unsigned int surfaceCount, InteropSurfaceFormat format);
+
+                void SetViewport(const DXGI_SURFACE_DESC& desc);
+
+                void HookRendering();
+
+                void ScheduleRetryRender();
+
+                void SchedulePresent();
+
+                void PresentPendingFrame();
+
+                void CancelRetryRender();
+
+                void OnRetryRender(Object^ sender, EventArgs^ e);
+
+                void StartRenderThread();
+
+                void StopRenderThread();
+
+                void RenderThreadProc();
+
+                // Renders one frame on the render thread and posts it to the UI thread.
+                void RenderOnThread();
+
+                bool AcquireThreadPipeline(CInteropPipeline** ppPipeline, SURFACE_DEVICE_SET* pRenderSet, bool* pIsNewSurface);
+
+                // Runs on the UI thread; shows the surface the render thread finished, if any.
+                void PresentRenderedSurface();
+
+                // Returns whether a frame was shown
+                bool PresentRenderedSurfaceLocked();
+
             public:
 
+                SurfaceQueueInteropHelper();
+
                 /// The action delegate called when a render is required.
                 property Action<IntPtr, bool>^ SurfaceQueueInteropHelper::RenderD2D
                 {
@@ -130,9 +230,114 @@ namespace Microsoft {
                     void set(IntPtr hwnd) { m_hwnd = (::HWND)(void*)hwnd; }
                 }
 
-                /// Requests render to happen.
+                /// Gets or sets whether the render callback runs on a dedicated render thread.  The UI thread then only
+                /// shows the finished surfaces and does not wait on the GPU.  The callback must not touch UI objects.
+                /// Images on an adapter share one render device; their callbacks run one at a time, on any thread.
+                property bool RenderOnWorkerThread
+                {
+                    bool get() { return m_renderThread != nullptr; }
+                    void set(bool value)
+                    {
+                        if (value != (m_renderThread != nullptr))
+                        {
+                            if (value)
+                            {
+                                StartRenderThread();
+                            }
+                            else
+                            {
+                                StopRenderThread();
+                            }
+                        }
+                    }
+                }
+
+                /// Gets the number of frames skipped because the previous frame was still on the GPU.  The last frame stays on
+                /// screen meanwhile; a steadily growing count means the render is GPU bound.
+                property unsigned int DroppedFrameCount
+                {
+                    unsigned int get() { return m_droppedFrames; }
+                }
+
+                /// Gets the number of render requests folded into a render that was already pending.
+                property unsigned int CoalescedRenderCount
+                {
+                    unsigned int get() { return m_coalescedRenders; }
+                }
+
+                /// Gets the number of times lost devices were recreated and the surfaces rendered to again.
+                property unsigned int DeviceRecoveryCount
+                {
+                    unsigned int get() { return m_deviceRecoveries; }
+                }
+
+                /// Gets the number of recoveries that only replaced a removed render device and kept the queues and the
+                /// surfaces.  The render callback sees the surfaces as new after one.
+                property unsigned int RenderDeviceRecoveryCount
+                {
+                    unsigned int get() { return m_renderDeviceRecoveries; }
+                }
+
+                /// Gets the time in milliseconds the last recovery took, from noticing the loss to having surfaces again.
+                property double LastDeviceRecoveryTime
+                {
+                    double get() { return m_lastRecoveryTime; }
+                }
+
+                /// Sets the range the render resolution may scale in, as fractions of the pixel size.  While the average time
+                /// to render and flush a frame is over FrameTimeBudget the surfaces shrink a step at a time, and they grow back
+                /// when there is headroom.  The default range of 1 to 1 keeps the full resolution.  The render callback sees
+                /// the new size as a new surface.
+                void SetRenderScaleRange(double minScale, double maxScale);
+
+                /// Gets or sets the time in milliseconds a frame may take to render and flush before the resolution drops.
+                property double FrameTimeBudget
+                {
+                    double get() { return m_frameTimeBudget; }
+                    void set(double value)
+                    {
+                        if (!(value > 0.0))
+                        {
+                            throw gcnew ArgumentOutOfRangeException("value");
+                        }
+                        m_frameTimeBudget = value;
+                    }
+                }
+
+                /// Gets the current render scale, and the average render and flush time in milliseconds it is based on.
+                property double RenderScale
+                {
+                    double get() { return m_renderScale; }
+                }
+
+                property double AverageFrameTime
+                {
+                    double get() { return m_averageFrameTime; }
+                }
+
+                /// Gets or sets the number of surfaces in the queues, 1 to 4.  With more than one, a frame renders while the
+                /// previous one is composed, and shows one frame later.  The render should then redraw the whole surface, as
+                /// the surface it gets holds an older frame than the one on screen; AddDirtyRect is ignored.
+                property unsigned int SurfaceCount
+                {
+                    unsigned int get() { return m_surfaceCount; }
+                    void set(unsigned int value);
+                }
+
+                /// Gets or sets the format of the surfaces.
+                property InteropSurfaceFormat SurfaceFormat
+                {
+                    InteropSurfaceFormat get() { return m_surfaceFormat; }
+                    void set(InteropSurfaceFormat value);
+                }
+
+                /// Requests render to happen.  Requests made while a frame is still in flight are coalesced into one.
                 void RequestRenderD2D();
 
+                /// Marks part of the surface as changed by the render in progress.  Call from the render callback; the calls
+                /// accumulate.  Without a call the whole surface is invalidated.
+                void AddDirtyRect(Int32Rect rect);
+
                 !SurfaceQueueInteropHelper();
 
                 ~SurfaceQueueInteropHelper();
@@ -0,0 +1,378 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#include <new>
+#include "SurfaceQueueImpl.h"
+#include "SurfaceQueueInteropPipeline.h"
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI CreateInteropPipeline(const INTEROP_PIPELINE_DESC* pDesc, CInteropPipeline** ppPipeline)
+{
+    HRESULT             hr          = S_OK;
+    CInteropPipeline*   pPipeline   = NULL;
+
+    if (!pDesc || !ppPipeline)
+    {
+        return E_INVALIDARG;
+    }
+
+    *ppPipeline = NULL;
+
+    pPipeline = new QUEUE_NOTHROW_SPECIFIER CInteropPipeline();
+    if (!pPipeline)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    if (FAILED(hr = pPipeline->Initialize(pDesc)))
+    {
+        pPipeline->Release();
+        return hr;
+    }
+
+    *ppPipeline = pPipeline;
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+CInteropPipeline::CInteropPipeline() :
+    m_RefCount(1),
+    m_pABQueue(NULL),
+    m_pBAQueue(NULL),
+    m_pABConsumer(NULL),
+    m_pBAProducer(NULL),
+    m_pBAProducer1(NULL),
+    m_pBAConsumer(NULL),
+    m_pBAConsumer1(NULL),
+    m_pBAConsumer2(NULL),
+    m_pABProducer(NULL),
+    m_pABProducer1(NULL)
+{
+    ZeroMemory(&m_Desc, sizeof(m_Desc));
+    InitializeCriticalSection(&m_ReturnLock);
+}
+
+//-----------------------------------------------------------------------------
+CInteropPipeline::~CInteropPipeline()
+{
+    // The endpoints go before the queues
+    if (m_pABProducer1)
+    {
+        m_pABProducer1->Release();
+    }
+    if (m_pABProducer)
+    {
+        m_pABProducer->Release();
+    }
+    if (m_pBAConsumer2)
+    {
+        m_pBAConsumer2->Release();
+    }
+    if (m_pBAConsumer1)
+    {
+        m_pBAConsumer1->Release();
+    }
+    if (m_pBAConsumer)
+    {
+        m_pBAConsumer->Release();
+    }
+    if (m_pBAProducer1)
+    {
+        m_pBAProducer1->Release();
+    }
+    if (m_pBAProducer)
+    {
+        m_pBAProducer->Release();
+    }
+    if (m_pABConsumer)
+    {
+        m_pABConsumer->Release();
+    }
+    if (m_pBAQueue)
+    {
+        m_pBAQueue->Release();
+    }
+    if (m_pABQueue)
+    {
+        m_pABQueue->Release();
+    }
+
+    DeleteCriticalSection(&m_ReturnLock);
+}
+
+//-----------------------------------------------------------------------------
+ULONG CInteropPipeline::AddRef()
+{
+    return InterlockedIncrement(&m_RefCount);
+}
+
+//-----------------------------------------------------------------------------
+ULONG CInteropPipeline::Release()
+{
+    ULONG RefCount = InterlockedDecrement(&m_RefCount);
+    if (RefCount == 0)
+    {
+        delete this;
+    }
+    return RefCount;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CInteropPipeline::Initialize(const INTEROP_PIPELINE_DESC* pDesc)
+{
+    ASSERT(pDesc);
+    ASSERT(!m_pABQueue);
+
+    HRESULT                     hr = S_OK;
+    SURFACE_QUEUE_DESC          QueueDesc;
+    SURFACE_QUEUE_CLONE_DESC    CloneDesc;
+
+    if (!pDesc->pBridgeDevice || !pDesc->pRenderDevice || !pDesc->pDisplayDevice ||
+        (pDesc->Flags & ~SURFACE_QUEUE_FLAG_SINGLE_THREADED))
+    {
+        return E_INVALIDARG;
+    }
+
+    m_Desc = *pDesc;
+
+    ZeroMemory(&QueueDesc, sizeof(QueueDesc));
+    QueueDesc.Width         = pDesc->Width;
+    QueueDesc.Height        = pDesc->Height;
+    QueueDesc.Format        = pDesc->Format;
+    QueueDesc.NumSurfaces   = pDesc->NumSurfaces;
+    QueueDesc.MetaDataSize  = 0;
+    QueueDesc.Flags         = pDesc->Flags;
+
+    ZeroMemory(&CloneDesc, sizeof(CloneDesc));
+    CloneDesc.MetaDataSize  = 0;
+    CloneDesc.Flags         = pDesc->Flags;
+
+    if (FAILED(hr = CreateSurfaceQueue(&QueueDesc, pDesc->pBridgeDevice, &m_pABQueue)))
+    {
+        goto end;
+    }
+    if (FAILED(hr = m_pABQueue->Clone(&CloneDesc, &m_pBAQueue)))
+    {
+        goto end;
+    }
+
+    if (FAILED(hr = m_pBAQueue->OpenProducer(pDesc->pRenderDevice, &m_pBAProducer)) ||
+        FAILED(hr = m_pABQueue->OpenConsumer(pDesc->pRenderDevice, &m_pABConsumer)) ||
+        FAILED(hr = m_pABQueue->OpenProducer(pDesc->pDisplayDevice, &m_pABProducer)) ||
+        FAILED(hr = m_pBAQueue->OpenConsumer(pDesc->pDisplayDevice, &m_pBAConsumer)))
+    {
+        goto end;
+    }
+
+    // Without the dirty rectangle interfaces the whole surface changes every frame
+    m_pBAProducer->QueryInterface(__uuidof(ISurfaceProducer1), (void**)&m_pBAProducer1);
+    m_pABProducer->QueryInterface(__uuidof(ISurfaceProducer1), (void**)&m_pABProducer1);
+    m_pBAConsumer->QueryInterface(__uuidof(ISurfaceConsumer1), (void**)&m_pBAConsumer1);
+    m_pBAConsumer->QueryInterface(__uuidof(ISurfaceConsumer2), (void**)&m_pBAConsumer2);
+
+end:
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CInteropPipeline::BeginFrame(REFIID id, IUnknown** ppSurface, DWORD dwTimeout)
+{
+    ASSERT(m_pABConsumer);
+
+    // Surfaces the display side returned are only dequeued once flushed
+    FlushReturned(SURFACE_QUEUE_FLAG_DO_NOT_WAIT);
+
+    return m_pABConsumer->Dequeue(id, ppSurface, NULL, NULL, dwTimeout);
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CInteropPipeline::EndFrame(IUnknown* pSurface, const RECT* pDirtyRect, BOOL Wait)
+{
+    ASSERT(m_pBAProducer);
+
+    HRESULT hr;
+
+    if (m_pBAProducer1 && pDirtyRect)
+    {
+        hr = m_pBAProducer1->EnqueueDirty(pSurface, NULL, 0, pDirtyRect, 1, SURFACE_QUEUE_FLAG_DO_NOT_WAIT);
+    }
+    else
+    {
+        hr = m_pBAProducer->Enqueue(pSurface, NULL, 0, SURFACE_QUEUE_FLAG_DO_NOT_WAIT);
+    }
+
+    // A surface that is still rendering is enqueued and goes out with the flush
+    if (FAILED(hr) && hr != DXGI_ERROR_WAS_STILL_DRAWING)
+    {
+        return hr;
+    }
+
+    return FlushRendered(Wait ? 0 : SURFACE_QUEUE_FLAG_DO_NOT_WAIT);
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CInteropPipeline::FlushRendered(DWORD Flags)
+{
+    ASSERT(m_pBAProducer);
+
+    HRESULT hr = m_pBAProducer->Flush(Flags, NULL);
+
+    return (hr == DXGI_ERROR_WAS_STILL_DRAWING) ? S_OK : hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CInteropPipeline::AcquireFrame(REFIID id, IUnknown** ppSurface, RECT* pDirtyRect, UINT* pNumDirtyRects, DWORD dwTimeout)
+{
+    ASSERT(m_pBAConsumer);
+
+    if (m_pBAConsumer1 && pDirtyRect && pNumDirtyRects)
+    {
+        return m_pBAConsumer1->DequeueDirty(id, ppSurface, NULL, NULL, pDirtyRect, pNumDirtyRects, dwTimeout);
+    }
+
+    // Unknown, so everything
+    if (pDirtyRect && pNumDirtyRects && *pNumDirtyRects)
+    {
+        SetRect(pDirtyRect, 0, 0, m_Desc.Width, m_Desc.Height);
+        *pNumDirtyRects = 1;
+    }
+    return m_pBAConsumer->Dequeue(id, ppSurface, NULL, NULL, dwTimeout);
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CInteropPipeline::ReleaseFrame(IUnknown* pSurface, const RECT* pDirtyRects, UINT NumDirtyRects)
+{
+    ASSERT(m_pABProducer);
+
+    HRESULT hr;
+
+    EnterCriticalSection(&m_ReturnLock);
+
+    // The rectangles go back with the surface, so the render side sees what was last shown.
+    if (m_pABProducer1 && pDirtyRects && NumDirtyRects)
+    {
+        hr = m_pABProducer1->EnqueueDirty(pSurface, NULL, 0, pDirtyRects, NumDirtyRects, SURFACE_QUEUE_FLAG_DO_NOT_WAIT);
+    }
+    else
+    {
+        hr = m_pABProducer->Enqueue(pSurface, NULL, 0, SURFACE_QUEUE_FLAG_DO_NOT_WAIT);
+    }
+
+    if (SUCCEEDED(hr) || hr == DXGI_ERROR_WAS_STILL_DRAWING)
+    {
+        // The render side flushes again before it dequeues
+        hr = m_pABProducer->Flush(SURFACE_QUEUE_FLAG_DO_NOT_WAIT, NULL);
+        if (hr == DXGI_ERROR_WAS_STILL_DRAWING)
+        {
+            hr = S_OK;
+        }
+    }
+
+    LeaveCriticalSection(&m_ReturnLock);
+
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CInteropPipeline::FlushReturned(DWORD Flags)
+{
+    ASSERT(m_pABProducer);
+
+    EnterCriticalSection(&m_ReturnLock);
+    HRESULT hr = m_pABProducer->Flush(Flags, NULL);
+    LeaveCriticalSection(&m_ReturnLock);
+
+    return (hr == DXGI_ERROR_WAS_STILL_DRAWING) ? S_OK : hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CInteropPipeline::SetFrameData(IUnknown* pSurface, REFGUID Key, IUnknown* pData)
+{
+    if (!m_pBAConsumer2)
+    {
+        return E_NOINTERFACE;
+    }
+    return m_pBAConsumer2->SetSurfaceData(pSurface, Key, pData);
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CInteropPipeline::GetFrameData(IUnknown* pSurface, REFGUID Key, IUnknown** ppData)
+{
+    if (!m_pBAConsumer2)
+    {
+        return E_NOINTERFACE;
+    }
+    return m_pBAConsumer2->GetSurfaceData(pSurface, Key, ppData);
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CInteropPipeline::ReplaceRenderDevice(IUnknown* pRenderDevice, UINT* pNumReclaimed)
+{
+    ASSERT(m_pABQueue && m_pBAQueue);
+
+    HRESULT                 hr          = S_OK;
+    ISurfaceQueueDevice*    pLostDevice = NULL;
+
+    if (!pRenderDevice)
+    {
+        return E_INVALIDARG;
+    }
+
+    // Marks the surfaces the render side had dequeued when the device was
+    // lost.  There is none if an earlier replace failed after releasing it.
+    if (m_pABConsumer)
+    {
+        pLostDevice = static_cast<CSurfaceConsumer*>(m_pABConsumer)->GetDevice();
+    }
+
+    // The endpoints take their staging resources and opened surfaces with them
+    if (m_pBAProducer1)
+    {
+        m_pBAProducer1->Release();
+        m_pBAProducer1 = NULL;
+    }
+    if (m_pBAProducer)
+    {
+        m_pBAProducer->Release();
+        m_pBAProducer = NULL;
+    }
+    if (m_pABConsumer)
+    {
+        m_pABConsumer->Release();
+        m_pABConsumer = NULL;
+    }
+
+    m_Desc.pRenderDevice = pRenderDevice;
+
+    EnterCriticalSection(&m_ReturnLock);
+
+    // The returned surfaces are flushed first so the reclaimed ones can follow them
+    hr = m_pABProducer->Flush(0, NULL);
+    if (SUCCEEDED(hr))
+    {
+        hr = static_cast<CSurfaceQueue*>(m_pABQueue)->ReclaimConsumerSurfaces(
+                                            static_cast<CSurfaceQueue*>(m_pBAQueue), pLostDevice, pNumReclaimed);
+    }
+
+    LeaveCriticalSection(&m_ReturnLock);
+
+    if (FAILED(hr))
+    {
+        goto end;
+    }
+
+    if (FAILED(hr = m_pBAQueue->OpenProducer(pRenderDevice, &m_pBAProducer)) ||
+        FAILED(hr = m_pABQueue->OpenConsumer(pRenderDevice, &m_pABConsumer)))
+    {
+        goto end;
+    }
+
+    m_pBAProducer->QueryInterface(__uuidof(ISurfaceProducer1), (void**)&m_pBAProducer1);
+
+end:
+    return hr;
+}
@@ -0,0 +1,129 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#pragma once
+
+#include "surfacequeue.h"
+#include "SurfaceQueueDirtyRects.h"
+#include "SurfaceQueueSurfaceData.h"
+
+//
+// Interop pipeline.
+//
+// The pair of queues that carries surfaces between a device that renders and
+// a device that displays them, as used by the WPF interop helper:
+//
+//      AB queue    display device -> render device     (surfaces to render)
+//      BA queue    render device  -> display device    (rendered surfaces)
+//
+// The bridge device creates the shared surfaces; the helper uses its D3D9Ex
+// device, which also displays.  Any device a queue accepts works, so the
+// pipeline runs just as well on software devices, without WPF or a GPU.
+//
+// A frame goes round as:
+//
+//      render side     BeginFrame -> render -> EndFrame
+//      display side    AcquireFrame -> show -> ReleaseFrame
+//
+// The render side and the display side may run on different threads unless
+// the pipeline was created SINGLE_THREADED.  FlushReturned may be called from
+// either side.
+//
+
+struct INTEROP_PIPELINE_DESC
+{
+    UINT            Width;
+    UINT            Height;
+    DXGI_FORMAT     Format;
+    UINT            NumSurfaces;
+    // 0 or SURFACE_QUEUE_FLAG_SINGLE_THREADED
+    DWORD           Flags;
+    IUnknown*       pBridgeDevice;
+    IUnknown*       pRenderDevice;
+    IUnknown*       pDisplayDevice;
+};
+
+class CInteropPipeline
+{
+    public:
+        CInteropPipeline();
+
+        // The pipeline is reference counted so a frame in progress can keep
+        // it alive while its owner replaces it.
+        ULONG AddRef();
+        ULONG Release();
+
+        HRESULT Initialize(const INTEROP_PIPELINE_DESC* pDesc);
+
+        //
+        // Render side.  BeginFrame flushes the surfaces the display side
+        // returned without waiting and dequeues one of them.  EndFrame sends
+        // the surface to the display side with the part of it that changed
+        // (NULL for all of it), and with Wait waits for the render device to
+        // finish with it.
+        //
+        HRESULT BeginFrame(REFIID id, IUnknown** ppSurface, DWORD dwTimeout);
+        HRESULT EndFrame(IUnknown* pSurface, const RECT* pDirtyRect, BOOL Wait);
+
+        // Flushes frames EndFrame left pending
+        HRESULT FlushRendered(DWORD Flags);
+
+        //
+        // Display side.  AcquireFrame dequeues a rendered surface and the union
+        // of the rectangles that changed since the display side last had it.
+        // ReleaseFrame hands it back to the render side with the rectangles
+        // that were shown, without waiting.
+        //
+        HRESULT AcquireFrame(REFIID id, IUnknown** ppSurface, RECT* pDirtyRect, UINT* pNumDirtyRects, DWORD dwTimeout);
+        HRESULT ReleaseFrame(IUnknown* pSurface, const RECT* pDirtyRects, UINT NumDirtyRects);
+
+        // Flushes surfaces ReleaseFrame left pending
+        HRESULT FlushReturned(DWORD Flags);
+
+        // Objects the display side attaches to its surfaces, such as the level
+        // of a texture, so they are not looked up for every frame.  They are
+        // released with the pipeline.
+        HRESULT SetFrameData(IUnknown* pSurface, REFGUID Key, IUnknown* pData);
+        HRESULT GetFrameData(IUnknown* pSurface, REFGUID Key, IUnknown** ppData);
+
+        //
+        // Moves the render side to a new device after the render device was
+        // removed, keeping the queues and the display side.  The surfaces the
+        // old device held or had not finished rendering go back to the render
+        // side with all of them changed.  No other call may be in progress.
+        //
+        HRESULT ReplaceRenderDevice(IUnknown* pRenderDevice, UINT* pNumReclaimed);
+
+        const INTEROP_PIPELINE_DESC& GetDesc() const { return m_Desc; }
+
+    private:
+        ~CInteropPipeline();
+
+    private:
+        volatile LONG           m_RefCount;
+        INTEROP_PIPELINE_DESC   m_Desc;
+
+        ISurfaceQueue*          m_pABQueue;
+        ISurfaceQueue*          m_pBAQueue;
+
+        // Render side
+        ISurfaceConsumer*       m_pABConsumer;
+        ISurfaceProducer*       m_pBAProducer;
+        ISurfaceProducer1*      m_pBAProducer1;
+
+        // Display side
+        ISurfaceConsumer*       m_pBAConsumer;
+        ISurfaceConsumer1*      m_pBAConsumer1;
+        ISurfaceConsumer2*      m_pBAConsumer2;
+        ISurfaceProducer*       m_pABProducer;
+        ISurfaceProducer1*      m_pABProducer1;
+
+        // The AB producer is used by both sides
+        CRITICAL_SECTION        m_ReturnLock;
+};
+
+HRESULT WINAPI CreateInteropPipeline(const INTEROP_PIPELINE_DESC* pDesc, CInteropPipeline** ppPipeline);
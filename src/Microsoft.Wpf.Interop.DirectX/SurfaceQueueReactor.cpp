@@ -0,0 +1,563 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#include <new>
+#include "SurfaceQueueReactor.h"
+
+//
+// Notes about the ready list:
+//
+// The queue notifications can come from any thread and are made while the
+// producer holds its locks.  They only update the endpoint's counters and,
+// the first time the endpoint becomes ready, link it onto the ready list and
+// signal the event.  m_ReadyLock is never held while calling into a queue, so
+// this can't deadlock.
+//
+// While an endpoint is on the ready list (or on the reactor's local copy of
+// it) m_IsReady is TRUE and no other thread touches m_pNextReady.  Dispatch
+// clears m_IsReady right before looking at the counters, so notifications
+// arriving after that put the endpoint back on the list for the next round.
+//
+
+//-----------------------------------------------------------------------------
+// CSurfaceQueueReactorEndpoint implementation
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+CSurfaceQueueReactorEndpoint::CSurfaceQueueReactorEndpoint() :
+    m_pReactor(NULL),
+    m_pEndpoint(NULL),
+    m_pProducer(NULL),
+    m_pQueue(NULL),
+    m_Side(QUEUE_EPOCH_CONSUMER),
+    m_pfnCallback(NULL),
+    m_pContext(NULL),
+    m_nFlushed(0),
+    m_NeedsFlush(FALSE),
+    m_IsReady(FALSE),
+    m_pNextReady(NULL),
+    m_pNextPoll(NULL),
+    m_pNextRemoved(NULL),
+    m_IsPolling(FALSE),
+    m_IsRemoved(FALSE)
+{
+}
+
+//-----------------------------------------------------------------------------
+CSurfaceQueueReactorEndpoint::~CSurfaceQueueReactorEndpoint()
+{
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceQueueReactorEndpoint::OnSurfaceEnqueued(CSurfaceQueue*)
+{
+    // Consumers can't do anything until the surface is flushed
+    if (m_pProducer)
+    {
+        InterlockedExchange(&m_NeedsFlush, TRUE);
+        m_pReactor->SignalReady(this);
+    }
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceQueueReactorEndpoint::OnSurfacesFlushed(CSurfaceQueue*, UINT NumSurfaces)
+{
+    InterlockedExchangeAdd(&m_nFlushed, (LONG)NumSurfaces);
+    m_pReactor->SignalReady(this);
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceQueueReactorEndpoint::OnSurfacesReclaimed(CSurfaceQueue*, UINT NumSurfaces)
+{
+    // Ready for the consumer, but nothing the producer flushed
+    if (!m_pProducer)
+    {
+        InterlockedExchangeAdd(&m_nFlushed, (LONG)NumSurfaces);
+        m_pReactor->SignalReady(this);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// CSurfaceQueueReactor implementation
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+CSurfaceQueueReactor::CSurfaceQueueReactor() :
+    m_IsInitialized(FALSE),
+    m_hReady(NULL),
+    m_pReadyHead(NULL),
+    m_pReadyTail(NULL),
+    m_pPollHead(NULL),
+    m_pRemovedHead(NULL),
+    m_IsDispatching(FALSE),
+    m_ppEndpoints(NULL),
+    m_nEndpoints(0),
+    m_nMaxEndpoints(0)
+{
+}
+
+//-----------------------------------------------------------------------------
+CSurfaceQueueReactor::~CSurfaceQueueReactor()
+{
+    ASSERT(!m_IsDispatching);
+
+    for (UINT i = 0; i < m_nEndpoints; i++)
+    {
+        m_ppEndpoints[i]->m_pQueue->SetNotify(m_ppEndpoints[i]->m_Side, NULL);
+        DestroyEndpoint(m_ppEndpoints[i]);
+    }
+    if (m_ppEndpoints)
+    {
+        delete[] m_ppEndpoints;
+    }
+    if (m_hReady)
+    {
+        CloseHandle(m_hReady);
+    }
+    if (m_IsInitialized)
+    {
+        DeleteCriticalSection(&m_ReadyLock);
+    }
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueueReactor::Initialize()
+{
+    ASSERT(!m_IsInitialized);
+
+    // Auto reset; Dispatch drains the whole ready list every time it wakes up
+    m_hReady = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (m_hReady == NULL)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    InitializeCriticalSection(&m_ReadyLock);
+    m_IsInitialized = TRUE;
+
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueueReactor::RegisterConsumer(ISurfaceConsumer* pConsumer, PFN_SURFACE_REACTOR_CALLBACK pfnCallback, void* pContext)
+{
+    return Register(pConsumer, QUEUE_EPOCH_CONSUMER, pfnCallback, pContext);
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueueReactor::RegisterProducer(ISurfaceProducer* pProducer, PFN_SURFACE_REACTOR_CALLBACK pfnCallback, void* pContext)
+{
+    return Register(pProducer, QUEUE_EPOCH_PRODUCER, pfnCallback, pContext);
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueueReactor::Register(
+                                IUnknown*                       pEndpoint,
+                                QueueEpochSide                  side,
+                                PFN_SURFACE_REACTOR_CALLBACK    pfnCallback,
+                                void*                           pContext)
+{
+    if (!m_IsInitialized)
+    {
+        return E_FAIL;
+    }
+    if (pEndpoint == NULL || pfnCallback == NULL)
+    {
+        return E_INVALIDARG;
+    }
+
+    HRESULT                         hr              = S_OK;
+    CSurfaceConsumer*               pConsumerImpl   = NULL;
+    CSurfaceProducer*               pProducerImpl   = NULL;
+    CSurfaceQueue*                  pQueue          = NULL;
+    CSurfaceQueueReactorEndpoint*   pNew            = NULL;
+
+    if (side == QUEUE_EPOCH_CONSUMER)
+    {
+        if (FAILED(hr = pEndpoint->QueryInterface(__uuidof(CSurfaceConsumer), (void**)&pConsumerImpl)))
+        {
+            goto end;
+        }
+        pQueue = pConsumerImpl->GetQueue();
+    }
+    else
+    {
+        if (FAILED(hr = pEndpoint->QueryInterface(__uuidof(CSurfaceProducer), (void**)&pProducerImpl)))
+        {
+            goto end;
+        }
+        pQueue = pProducerImpl->GetQueue();
+    }
+
+    if (pQueue == NULL)
+    {
+        hr = E_INVALIDARG;
+        goto end;
+    }
+
+    // Make room for the new endpoint
+    if (m_nEndpoints == m_nMaxEndpoints)
+    {
+        UINT                            nMaxEndpoints   = m_nMaxEndpoints ? m_nMaxEndpoints * 2 : 16;
+        CSurfaceQueueReactorEndpoint**  ppEndpoints     = new QUEUE_NOTHROW_SPECIFIER CSurfaceQueueReactorEndpoint*[nMaxEndpoints];
+
+        if (ppEndpoints == NULL)
+        {
+            hr = E_OUTOFMEMORY;
+            goto end;
+        }
+        if (m_ppEndpoints)
+        {
+            memcpy(ppEndpoints, m_ppEndpoints, sizeof(CSurfaceQueueReactorEndpoint*) * m_nEndpoints);
+            delete[] m_ppEndpoints;
+        }
+        m_ppEndpoints   = ppEndpoints;
+        m_nMaxEndpoints = nMaxEndpoints;
+    }
+
+    pNew = new QUEUE_NOTHROW_SPECIFIER CSurfaceQueueReactorEndpoint();
+    if (pNew == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto end;
+    }
+
+    pNew->m_pReactor    = this;
+    pNew->m_pEndpoint   = pEndpoint;
+    pNew->m_pProducer   = (side == QUEUE_EPOCH_PRODUCER) ? static_cast<ISurfaceProducer*>(pEndpoint) : NULL;
+    pNew->m_pQueue      = pQueue;
+    pNew->m_Side        = side;
+    pNew->m_pfnCallback = pfnCallback;
+    pNew->m_pContext    = pContext;
+
+    // Fails if something else is already listening to this side of the queue
+    if (FAILED(hr = pQueue->SetNotify(side, pNew)))
+    {
+        goto end;
+    }
+
+    pEndpoint->AddRef();
+    m_ppEndpoints[m_nEndpoints++] = pNew;
+
+    // The producer may have surfaces waiting to be flushed already
+    if (pNew->m_pProducer)
+    {
+        InterlockedExchange(&pNew->m_NeedsFlush, TRUE);
+        SignalReady(pNew);
+    }
+
+    pNew = NULL;
+
+end:
+    if (pNew)
+    {
+        delete pNew;
+    }
+    if (pConsumerImpl)
+    {
+        pConsumerImpl->Release();
+    }
+    if (pProducerImpl)
+    {
+        pProducerImpl->Release();
+    }
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueueReactor::Unregister(IUnknown* pEndpoint)
+{
+    CSurfaceQueueReactorEndpoint* pRemoved = NULL;
+
+    for (UINT i = 0; i < m_nEndpoints; i++)
+    {
+        if (m_ppEndpoints[i]->m_pEndpoint == pEndpoint)
+        {
+            pRemoved = m_ppEndpoints[i];
+            m_ppEndpoints[i] = m_ppEndpoints[--m_nEndpoints];
+            break;
+        }
+    }
+
+    if (pRemoved == NULL)
+    {
+        return E_INVALIDARG;
+    }
+
+    // No notifications are in flight once this returns
+    pRemoved->m_pQueue->SetNotify(pRemoved->m_Side, NULL);
+    pRemoved->m_IsRemoved = TRUE;
+
+    // Unlink it from the ready list
+    EnterCriticalSection(&m_ReadyLock);
+    {
+        CSurfaceQueueReactorEndpoint* pPrev = NULL;
+        for (CSurfaceQueueReactorEndpoint* p = m_pReadyHead; p; pPrev = p, p = p->m_pNextReady)
+        {
+            if (p == pRemoved)
+            {
+                if (pPrev)
+                {
+                    pPrev->m_pNextReady = p->m_pNextReady;
+                }
+                else
+                {
+                    m_pReadyHead = p->m_pNextReady;
+                }
+                if (m_pReadyTail == p)
+                {
+                    m_pReadyTail = pPrev;
+                }
+                break;
+            }
+        }
+    }
+    LeaveCriticalSection(&m_ReadyLock);
+
+    // And from the list of producers being polled
+    if (pRemoved->m_IsPolling)
+    {
+        CSurfaceQueueReactorEndpoint** ppLink = &m_pPollHead;
+        while (*ppLink != pRemoved)
+        {
+            ppLink = &(*ppLink)->m_pNextPoll;
+        }
+        *ppLink = pRemoved->m_pNextPoll;
+        pRemoved->m_IsPolling = FALSE;
+    }
+
+    //
+    // A callback may be unregistering an endpoint that is still on the list
+    // being dispatched.  Keep it alive until the dispatch is over.
+    //
+    if (m_IsDispatching)
+    {
+        pRemoved->m_pNextRemoved = m_pRemovedHead;
+        m_pRemovedHead = pRemoved;
+    }
+    else
+    {
+        DestroyEndpoint(pRemoved);
+    }
+
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceQueueReactor::DestroyEndpoint(CSurfaceQueueReactorEndpoint* pEndpoint)
+{
+    pEndpoint->m_pEndpoint->Release();
+    delete pEndpoint;
+}
+
+//-----------------------------------------------------------------------------
+DWORD CSurfaceQueueReactor::GetWaitTimeout(DWORD dwTimeout) const
+{
+    if (m_pPollHead && dwTimeout > SURFACE_QUEUE_REACTOR_POLL_INTERVAL)
+    {
+        return SURFACE_QUEUE_REACTOR_POLL_INTERVAL;
+    }
+    return dwTimeout;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueueReactor::Dispatch(DWORD dwTimeout, UINT* pNumEvents)
+{
+    if (!m_IsInitialized)
+    {
+        return E_FAIL;
+    }
+
+    // Dispatch can't be called from a callback
+    if (m_IsDispatching)
+    {
+        return E_FAIL;
+    }
+
+    UINT    nEvents = 0;
+    DWORD   dwStart = GetTickCount();
+
+    for (;;)
+    {
+        DWORD dwRemaining = INFINITE;
+        if (dwTimeout != INFINITE)
+        {
+            DWORD dwElapsed = GetTickCount() - dwStart;
+            dwRemaining = (dwElapsed < dwTimeout) ? dwTimeout - dwElapsed : 0;
+        }
+
+        WaitForSingleObject(m_hReady, GetWaitTimeout(dwRemaining));
+
+        nEvents = DispatchOnce();
+        if (nEvents || dwRemaining == 0)
+        {
+            break;
+        }
+    }
+
+    if (pNumEvents)
+    {
+        *pNumEvents = nEvents;
+    }
+    return nEvents ? S_OK : HRESULT_FROM_WIN32(WAIT_TIMEOUT);
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceQueueReactor::SignalReady(CSurfaceQueueReactorEndpoint* pEndpoint)
+{
+    if (InterlockedExchange(&pEndpoint->m_IsReady, TRUE))
+    {
+        // Already on the list
+        return;
+    }
+
+    EnterCriticalSection(&m_ReadyLock);
+
+    pEndpoint->m_pNextReady = NULL;
+    if (m_pReadyTail)
+    {
+        m_pReadyTail->m_pNextReady = pEndpoint;
+    }
+    else
+    {
+        m_pReadyHead = pEndpoint;
+    }
+    m_pReadyTail = pEndpoint;
+
+    LeaveCriticalSection(&m_ReadyLock);
+
+    SetEvent(m_hReady);
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceQueueReactor::TakeReadyList(CSurfaceQueueReactorEndpoint** ppHead, CSurfaceQueueReactorEndpoint** ppTail)
+{
+    EnterCriticalSection(&m_ReadyLock);
+
+    *ppHead = m_pReadyHead;
+    *ppTail = m_pReadyTail;
+    m_pReadyHead = NULL;
+    m_pReadyTail = NULL;
+
+    LeaveCriticalSection(&m_ReadyLock);
+}
+
+//-----------------------------------------------------------------------------
+UINT CSurfaceQueueReactor::DispatchOnce()
+{
+    CSurfaceQueueReactorEndpoint*   pHead   = NULL;
+    CSurfaceQueueReactorEndpoint*   pTail   = NULL;
+    CSurfaceQueueReactorEndpoint*   pPoll   = NULL;
+    CSurfaceQueueReactorEndpoint*   pNext   = NULL;
+    UINT                            nEvents = 0;
+
+    m_IsDispatching = TRUE;
+
+    TakeReadyList(&pHead, &pTail);
+
+    // Producers with newly enqueued surfaces join the ones already polling
+    for (CSurfaceQueueReactorEndpoint* p = pHead; p; p = p->m_pNextReady)
+    {
+        if (p->m_pProducer && p->m_NeedsFlush && !p->m_IsPolling)
+        {
+            p->m_IsPolling  = TRUE;
+            p->m_pNextPoll  = m_pPollHead;
+            m_pPollHead     = p;
+        }
+    }
+
+    //
+    // Flush the producers without waiting.  The surfaces that finished are
+    // reported through OnSurfacesFlushed, which puts the producers (and the
+    // consumers of the same queues) on the ready list.
+    //
+    pPoll       = m_pPollHead;
+    m_pPollHead = NULL;
+    while (pPoll)
+    {
+        CSurfaceQueueReactorEndpoint*   p           = pPoll;
+        UINT                            nRemaining  = 0;
+
+        pPoll = p->m_pNextPoll;
+
+        InterlockedExchange(&p->m_NeedsFlush, FALSE);
+        p->m_pProducer->Flush(SURFACE_QUEUE_FLAG_DO_NOT_WAIT, &nRemaining);
+
+        if (nRemaining)
+        {
+            p->m_pNextPoll  = m_pPollHead;
+            m_pPollHead     = p;
+        }
+        else
+        {
+            p->m_IsPolling  = FALSE;
+        }
+    }
+
+    // Pick up everything that became ready while flushing
+    {
+        CSurfaceQueueReactorEndpoint* pMoreHead;
+        CSurfaceQueueReactorEndpoint* pMoreTail;
+
+        TakeReadyList(&pMoreHead, &pMoreTail);
+        if (pMoreHead)
+        {
+            if (pTail)
+            {
+                pTail->m_pNextReady = pMoreHead;
+            }
+            else
+            {
+                pHead = pMoreHead;
+            }
+            pTail = pMoreTail;
+        }
+    }
+
+    for (CSurfaceQueueReactorEndpoint* p = pHead; p; p = pNext)
+    {
+        pNext = p->m_pNextReady;
+
+        // From here on the endpoint can be put back on the ready list
+        InterlockedExchange(&p->m_IsReady, FALSE);
+
+        if (p->m_IsRemoved)
+        {
+            continue;
+        }
+
+        // Enqueued while we were flushing; poll it next time
+        if (p->m_pProducer && p->m_NeedsFlush && !p->m_IsPolling)
+        {
+            p->m_IsPolling  = TRUE;
+            p->m_pNextPoll  = m_pPollHead;
+            m_pPollHead     = p;
+        }
+
+        LONG nFlushed = InterlockedExchange(&p->m_nFlushed, 0);
+        if (nFlushed)
+        {
+            p->m_pfnCallback(p->m_pEndpoint,
+                             p->m_pProducer ? SURFACE_REACTOR_EVENT_FLUSHED : SURFACE_REACTOR_EVENT_DEQUEUE_READY,
+                             (UINT)nFlushed,
+                             p->m_pContext);
+            nEvents++;
+        }
+    }
+
+    m_IsDispatching = FALSE;
+
+    // Now it is safe to free the endpoints that were unregistered by callbacks
+    while (m_pRemovedHead)
+    {
+        CSurfaceQueueReactorEndpoint* p = m_pRemovedHead;
+        m_pRemovedHead = p->m_pNextRemoved;
+        DestroyEndpoint(p);
+    }
+
+    return nEvents;
+}
@@ -0,0 +1,140 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#pragma once
+
+#include "SurfaceQueueImpl.h"
+
+//
+// The reactor services any number of queue endpoints from a single thread.
+// Endpoints are registered with a callback, and Dispatch waits until any of
+// them has something to report:
+//
+//  SURFACE_REACTOR_EVENT_DEQUEUE_READY     (consumers) Surfaces were flushed
+//                                          into the queue and can be dequeued
+//                                          with a timeout of 0.
+//  SURFACE_REACTOR_EVENT_FLUSHED           (producers) Surfaces enqueued with
+//                                          DO_NOT_WAIT finished flushing.
+//
+// The reactor listens to the queues' own notifications, so idle queues cost
+// nothing.  The GPU has no completion signal for the staging copies; producers
+// with surfaces that are ENQUEUED but not yet FLUSHED are flushed with
+// DO_NOT_WAIT every SURFACE_QUEUE_REACTOR_POLL_INTERVAL ms until they drain.
+// Only those producers are polled.
+//
+// All methods must be called from the thread that owns the reactor.  Endpoints
+// of single threaded queues can only be registered if that is the thread that
+// uses them.  A registered endpoint occupies its side of the queue's notify
+// slot, so it can't also be wrapped by CSurfaceConsumerAsync or
+// CSurfaceProducerAsync.  Surfaces that were flushed before a consumer was
+// registered are not reported; drain the consumer before registering it.
+//
+
+enum SURFACE_REACTOR_EVENT
+{
+    SURFACE_REACTOR_EVENT_DEQUEUE_READY = 0,
+    SURFACE_REACTOR_EVENT_FLUSHED,
+};
+
+// pEndpoint is the consumer or producer that was registered.  NumSurfaces is
+// the number of surfaces flushed since its previous event.  The callback may
+// register and unregister endpoints, but must not call Dispatch.
+typedef void (CALLBACK *PFN_SURFACE_REACTOR_CALLBACK)(IUnknown* pEndpoint, SURFACE_REACTOR_EVENT Event, UINT NumSurfaces, void* pContext);
+
+#define SURFACE_QUEUE_REACTOR_POLL_INTERVAL (1)
+
+class CSurfaceQueueReactor;
+
+class CSurfaceQueueReactorEndpoint : public ISurfaceQueueNotify
+{
+    friend class CSurfaceQueueReactor;
+
+    // ISurfaceQueueNotify
+    public:
+        void OnSurfaceEnqueued(CSurfaceQueue* pQueue);
+        void OnSurfacesFlushed(CSurfaceQueue* pQueue, UINT NumSurfaces);
+        void OnSurfacesReclaimed(CSurfaceQueue* pQueue, UINT NumSurfaces);
+
+    private:
+        CSurfaceQueueReactorEndpoint();
+        ~CSurfaceQueueReactorEndpoint();
+
+    private:
+        CSurfaceQueueReactor*               m_pReactor;
+        IUnknown*                           m_pEndpoint;
+        ISurfaceProducer*                   m_pProducer;    // NULL for consumers
+        CSurfaceQueue*                      m_pQueue;
+        QueueEpochSide                      m_Side;
+        PFN_SURFACE_REACTOR_CALLBACK        m_pfnCallback;
+        void*                               m_pContext;
+
+        // Updated by the notifications, which can come from any thread
+        volatile LONG                       m_nFlushed;
+        volatile LONG                       m_NeedsFlush;
+        volatile LONG                       m_IsReady;
+
+        // Protected by the reactor's ready lock
+        CSurfaceQueueReactorEndpoint*       m_pNextReady;
+
+        // Only used by the reactor thread
+        CSurfaceQueueReactorEndpoint*       m_pNextPoll;
+        CSurfaceQueueReactorEndpoint*       m_pNextRemoved;
+        BOOL                                m_IsPolling;
+        BOOL                                m_IsRemoved;
+};
+
+class CSurfaceQueueReactor
+{
+    friend class CSurfaceQueueReactorEndpoint;
+
+    public:
+        CSurfaceQueueReactor();
+        ~CSurfaceQueueReactor();
+
+        HRESULT Initialize();
+
+        HRESULT RegisterConsumer(ISurfaceConsumer* pConsumer, PFN_SURFACE_REACTOR_CALLBACK pfnCallback, void* pContext);
+        HRESULT RegisterProducer(ISurfaceProducer* pProducer, PFN_SURFACE_REACTOR_CALLBACK pfnCallback, void* pContext);
+        HRESULT Unregister(IUnknown* pEndpoint);
+
+        //
+        // Waits up to dwTimeout ms for events and dispatches all of them.  Returns
+        // HRESULT_FROM_WIN32(WAIT_TIMEOUT) if nothing was dispatched.
+        //
+        HRESULT Dispatch(DWORD dwTimeout, UINT* pNumEvents);
+
+        //
+        // To wait on the reactor together with other objects (for example with
+        // MsgWaitForMultipleObjects on a UI thread), wait on the handle for at
+        // most GetWaitTimeout(dwTimeout) and then call Dispatch(0, ...).
+        //
+        HANDLE  GetWaitHandle() const { return m_hReady; }
+        DWORD   GetWaitTimeout(DWORD dwTimeout) const;
+
+    private:
+        HRESULT Register(IUnknown* pEndpoint, QueueEpochSide side, PFN_SURFACE_REACTOR_CALLBACK pfnCallback, void* pContext);
+        void    DestroyEndpoint(CSurfaceQueueReactorEndpoint* pEndpoint);
+
+        void    SignalReady(CSurfaceQueueReactorEndpoint* pEndpoint);
+        void    TakeReadyList(CSurfaceQueueReactorEndpoint** ppHead, CSurfaceQueueReactorEndpoint** ppTail);
+        UINT    DispatchOnce();
+
+    private:
+        CRITICAL_SECTION                    m_ReadyLock;
+        BOOL                                m_IsInitialized;
+        HANDLE                              m_hReady;
+        CSurfaceQueueReactorEndpoint*       m_pReadyHead;
+        CSurfaceQueueReactorEndpoint*       m_pReadyTail;
+
+        CSurfaceQueueReactorEndpoint*       m_pPollHead;
+        CSurfaceQueueReactorEndpoint*       m_pRemovedHead;
+        BOOL                                m_IsDispatching;
+
+        CSurfaceQueueReactorEndpoint**      m_ppEndpoints;
+        UINT                                m_nEndpoints;
+        UINT                                m_nMaxEndpoints;
+};
@@ -0,0 +1,393 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#include <new>
+#include <malloc.h>
+#include "SurfaceQueueReadback.h"
+#include "SurfaceFormatConvert.h"
+
+//-----------------------------------------------------------------------------
+// CSurfaceReadbackConsumer implementation
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+CSurfaceReadbackConsumer::CSurfaceReadbackConsumer() :
+    m_pConsumer(NULL),
+    m_pConsumer1(NULL),
+    m_pProducer(NULL),
+    m_pDevice(NULL),
+    m_pSlots(NULL),
+    m_nSlots(0),
+    m_iHead(0),
+    m_nInFlight(0),
+    m_pfnCallback(NULL),
+    m_pContext(NULL),
+    m_ConvertFlags(0),
+    m_pConverted(NULL),
+    m_ConvertedPitch(0)
+{
+    ZeroMemory(&m_id, sizeof(m_id));
+    ZeroMemory(&m_Desc, sizeof(m_Desc));
+    ZeroMemory(&m_OutputDesc, sizeof(m_OutputDesc));
+}
+
+//-----------------------------------------------------------------------------
+CSurfaceReadbackConsumer::~CSurfaceReadbackConsumer()
+{
+    if (m_pSlots)
+    {
+        for (UINT i = 0; i < m_nSlots; i++)
+        {
+            if (m_pSlots[i].pCopy)
+            {
+                m_pSlots[i].pCopy->Release();
+            }
+            if (m_pSlots[i].pMetaData)
+            {
+                delete[] m_pSlots[i].pMetaData;
+            }
+        }
+        delete[] m_pSlots;
+    }
+    if (m_pConverted)
+    {
+        _aligned_free(m_pConverted);
+    }
+    if (m_pDevice)
+    {
+        delete m_pDevice;
+    }
+    if (m_pProducer)
+    {
+        m_pProducer->Release();
+    }
+    if (m_pConsumer1)
+    {
+        m_pConsumer1->Release();
+    }
+    if (m_pConsumer)
+    {
+        m_pConsumer->Release();
+    }
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceReadbackConsumer::Initialize(
+                                ISurfaceConsumer*               pConsumer,
+                                ISurfaceProducer*               pProducer,
+                                IUnknown*                       pDevice,
+                                REFIID                          id,
+                                const SURFACE_QUEUE_DESC*       pDesc,
+                                UINT                            Depth,
+                                PFN_SURFACE_READBACK_CALLBACK   pfnCallback,
+                                void*                           pContext)
+{
+    ASSERT(m_pConsumer == NULL);
+
+    if (pConsumer == NULL || pProducer == NULL || pDevice == NULL || pDesc == NULL || pfnCallback == NULL)
+    {
+        return E_INVALIDARG;
+    }
+    if (Depth < SURFACE_READBACK_MIN_DEPTH)
+    {
+        return E_INVALIDARG;
+    }
+
+    HRESULT hr = S_OK;
+
+    if (FAILED(hr = CreateDeviceWrapper(pDevice, &m_pDevice)))
+    {
+        goto end;
+    }
+    if (!m_pDevice->ValidateREFIID(id))
+    {
+        hr = E_INVALIDARG;
+        goto end;
+    }
+
+    m_pSlots = new QUEUE_NOTHROW_SPECIFIER ReadbackSlot[Depth];
+    if (!m_pSlots)
+    {
+        hr = E_OUTOFMEMORY;
+        goto end;
+    }
+    ZeroMemory(m_pSlots, sizeof(ReadbackSlot) * Depth);
+    m_nSlots = Depth;
+
+    if (FAILED(hr = m_CopyCharge.Acquire(pDevice, SURFACE_QUEUE_BUDGET_STAGING, pDesc->Format,
+                                         pDesc->Width, pDesc->Height, m_nSlots)))
+    {
+        goto end;
+    }
+
+    for (UINT i = 0; i < m_nSlots; i++)
+    {
+        // Same as the staging resources of the producer, only full size
+        if (FAILED(hr = m_pDevice->CreateCopyResource(pDesc->Format, pDesc->Width, pDesc->Height, &m_pSlots[i].pCopy)))
+        {
+            goto end;
+        }
+
+        // Nothing has been copied yet
+        SetRect(&m_pSlots[i].Stale, 0, 0, pDesc->Width, pDesc->Height);
+
+        if (pDesc->MetaDataSize)
+        {
+            m_pSlots[i].pMetaData = new QUEUE_NOTHROW_SPECIFIER BYTE[pDesc->MetaDataSize];
+            if (!m_pSlots[i].pMetaData)
+            {
+                hr = E_OUTOFMEMORY;
+                goto end;
+            }
+        }
+    }
+
+    m_id            = id;
+    m_Desc          = *pDesc;
+    m_OutputDesc    = *pDesc;
+    m_pfnCallback   = pfnCallback;
+    m_pContext      = pContext;
+
+    m_pConsumer     = pConsumer;
+    m_pConsumer->AddRef();
+
+    // Without dirty rectangles every frame is copied whole
+    if (FAILED(pConsumer->QueryInterface(__uuidof(ISurfaceConsumer1), (void**)&m_pConsumer1)))
+    {
+        m_pConsumer1 = NULL;
+    }
+    m_pProducer     = pProducer;
+    m_pProducer->AddRef();
+
+end:
+    // The object will get destroyed if this fails.  Cleanup will happen then.
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceReadbackConsumer::Process(DWORD dwTimeout, UINT* pNumFrames)
+{
+    if (m_pConsumer == NULL)
+    {
+        return E_FAIL;
+    }
+
+    HRESULT hr      = S_OK;
+    UINT    nFrames = 0;
+
+    // The copies that already landed free up their slots first
+    if (FAILED(hr = DeliverFrames(SURFACE_QUEUE_FLAG_DO_NOT_WAIT, &nFrames)))
+    {
+        goto end;
+    }
+
+    while (m_nInFlight < m_nSlots)
+    {
+        ReadbackSlot&   slot            = m_pSlots[(m_iHead + m_nInFlight) % m_nSlots];
+        IUnknown*       pSurface        = NULL;
+        UINT            MetaDataSize    = m_Desc.MetaDataSize;
+        RECT            Dirty           = { 0, 0, (LONG)m_Desc.Width, (LONG)m_Desc.Height };
+        UINT            NumDirty        = 1;
+        HRESULT         hrEnqueue;
+
+        if (m_pConsumer1)
+        {
+            hr = m_pConsumer1->DequeueDirty(m_id,
+                                            &pSurface,
+                                            MetaDataSize ? slot.pMetaData : NULL,
+                                            MetaDataSize ? &MetaDataSize : NULL,
+                                            &Dirty,
+                                            &NumDirty,
+                                            dwTimeout);
+        }
+        else
+        {
+            hr = m_pConsumer->Dequeue(m_id,
+                                      &pSurface,
+                                      MetaDataSize ? slot.pMetaData : NULL,
+                                      MetaDataSize ? &MetaDataSize : NULL,
+                                      dwTimeout);
+        }
+
+        // Only the first dequeue waits
+        dwTimeout = 0;
+
+        if (hr == HRESULT_FROM_WIN32(WAIT_TIMEOUT))
+        {
+            hr = S_OK;
+            break;
+        }
+        if (FAILED(hr))
+        {
+            goto end;
+        }
+
+        //
+        // Every copy resource falls behind by what changed in this frame.  The
+        // one taking the frame is brought up to date; the rest of it still
+        // holds an older frame that matches.
+        //
+        for (UINT i = 0; i < m_nSlots; i++)
+        {
+            UnionRect(&m_pSlots[i].Stale, &m_pSlots[i].Stale, &Dirty);
+        }
+
+        //
+        // Copy the frame and hand the surface straight back.  The copy is
+        // issued before the producer's synchronization copy on the same device,
+        // so the surface won't be rendered to again before it is done.
+        //
+        hr = S_OK;
+        if (!IsRectEmpty(&slot.Stale))
+        {
+            hr = m_pDevice->CopySurfaceRect(slot.pCopy, pSurface, &slot.Stale);
+        }
+        SetRectEmpty(&slot.Stale);
+
+        hrEnqueue = m_pProducer->Enqueue(pSurface, NULL, 0, SURFACE_QUEUE_FLAG_DO_NOT_WAIT);
+        pSurface->Release();
+
+        if (FAILED(hr))
+        {
+            goto end;
+        }
+        if (FAILED(hrEnqueue) && hrEnqueue != DXGI_ERROR_WAS_STILL_DRAWING)
+        {
+            hr = hrEnqueue;
+            goto end;
+        }
+
+        slot.MetaDataSize = MetaDataSize;
+        m_nInFlight++;
+    }
+
+    // Move the recycled surfaces along without waiting for them
+    m_pProducer->Flush(SURFACE_QUEUE_FLAG_DO_NOT_WAIT, NULL);
+
+    hr = DeliverFrames(SURFACE_QUEUE_FLAG_DO_NOT_WAIT, &nFrames);
+
+end:
+    if (pNumFrames)
+    {
+        *pNumFrames = nFrames;
+    }
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceReadbackConsumer::SetOutputFormat(DXGI_FORMAT Format, DWORD ConvertFlags)
+{
+    if (m_pConsumer == NULL)
+    {
+        return E_FAIL;
+    }
+
+    BOOL Convert = (Format != m_Desc.Format || ConvertFlags != 0);
+
+    if (Convert && !IsSurfaceFormatConvertible(Format, m_Desc.Format))
+    {
+        return E_INVALIDARG;
+    }
+
+    if (m_pConverted)
+    {
+        _aligned_free(m_pConverted);
+        m_pConverted = NULL;
+    }
+
+    if (Convert)
+    {
+        UINT Pitch = (m_Desc.Width * GetSoftwareSurfaceFormatSize(Format) + SOFTWARE_SURFACE_ALIGNMENT - 1) &
+                     ~(SOFTWARE_SURFACE_ALIGNMENT - 1);
+
+        m_pConverted = (BYTE*)_aligned_malloc((SIZE_T)Pitch * m_Desc.Height, SOFTWARE_SURFACE_ALIGNMENT);
+        if (!m_pConverted)
+        {
+            // Fall back to delivering the frames as they are
+            m_OutputDesc    = m_Desc;
+            m_ConvertFlags  = 0;
+            return E_OUTOFMEMORY;
+        }
+        m_ConvertedPitch = Pitch;
+    }
+
+    m_OutputDesc        = m_Desc;
+    m_OutputDesc.Format = Format;
+    m_ConvertFlags      = ConvertFlags;
+
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceReadbackConsumer::Drain(UINT* pNumFrames)
+{
+    if (m_pConsumer == NULL)
+    {
+        return E_FAIL;
+    }
+
+    UINT    nFrames = 0;
+    HRESULT hr      = DeliverFrames(0, &nFrames);
+
+    m_pProducer->Flush(0, NULL);
+
+    if (pNumFrames)
+    {
+        *pNumFrames = nFrames;
+    }
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceReadbackConsumer::DeliverFrames(DWORD Flags, UINT* pNumFrames)
+{
+    HRESULT hr = S_OK;
+
+    // Copies complete in order, so stop at the first one still in flight
+    while (m_nInFlight)
+    {
+        ReadbackSlot&   slot    = m_pSlots[m_iHead];
+        void*           pData   = NULL;
+        UINT            Pitch   = 0;
+
+        hr = m_pDevice->MapSurface(slot.pCopy, Flags, &pData, &Pitch);
+        if (hr == DXGI_ERROR_WAS_STILL_DRAWING)
+        {
+            hr = S_OK;
+            break;
+        }
+        if (FAILED(hr))
+        {
+            break;
+        }
+
+        if (m_pConverted)
+        {
+            hr = ConvertSurfaceFormat(m_pConverted, m_ConvertedPitch, m_OutputDesc.Format,
+                                      pData, Pitch, m_Desc.Format,
+                                      m_Desc.Width, m_Desc.Height, m_ConvertFlags);
+            pData = m_pConverted;
+            Pitch = m_ConvertedPitch;
+        }
+
+        if (FAILED(hr))
+        {
+            m_pDevice->UnlockSurface(slot.pCopy);
+            break;
+        }
+
+        m_pfnCallback(pData, Pitch, &m_OutputDesc, slot.pMetaData, slot.MetaDataSize, m_pContext);
+
+        m_pDevice->UnlockSurface(slot.pCopy);
+
+        m_iHead = (m_iHead + 1) % m_nSlots;
+        m_nInFlight--;
+        (*pNumFrames)++;
+    }
+
+    return hr;
+}
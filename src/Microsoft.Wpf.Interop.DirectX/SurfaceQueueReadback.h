@@ -0,0 +1,125 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#pragma once
+
+#include "SurfaceQueueImpl.h"
+
+//
+// Reads frames from a queue back into system memory without stalling the GPU,
+// for screenshots and recording.
+//
+// The readback consumer owns a ring of full size copy resources.  Each frame it
+// dequeues is copied into the next free one, and the surface is enqueued back
+// to the producer right away (the copy is queued on the GPU before the
+// producer's own synchronization copy, so the producer can't overwrite it).
+// The bytes are handed to the callback only once the copy can be mapped without
+// waiting, so the GPU runs several frames ahead of the CPU.
+//
+// When every copy is still in flight, Process stops dequeuing and the frames
+// stay in the queue, so a slow callback throttles the producer rather than
+// stalling the device.  The ring has to be at least SURFACE_READBACK_MIN_DEPTH
+// deep for the readback to keep up with the producer.
+//
+// The frames can be converted to another format on the way out, see
+// SetOutputFormat.  When the consumer supports ISurfaceConsumer1, each copy
+// only covers what changed since the frame the copy resource held before.
+//
+// The consumer is not thread safe; make all calls from one thread.
+//
+
+// Called with the bits of a frame.  pData is only valid during the call.  Rows
+// are Pitch bytes apart and in the format of the queue.
+typedef void (CALLBACK *PFN_SURFACE_READBACK_CALLBACK)(
+                                const void*                 pData,
+                                UINT                        Pitch,
+                                const SURFACE_QUEUE_DESC*   pDesc,
+                                const void*                 pMetaData,
+                                UINT                        MetaDataSize,
+                                void*                       pContext);
+
+#define SURFACE_READBACK_MIN_DEPTH      (3)
+
+class CSurfaceReadbackConsumer
+{
+    public:
+        CSurfaceReadbackConsumer();
+        ~CSurfaceReadbackConsumer();
+
+        //
+        // pConsumer delivers the frames and pProducer returns the surfaces to
+        // whoever renders them (the other queue of the pair).  Both must have
+        // been opened with pDevice; id is the interface to dequeue the surfaces
+        // as.  pDesc is the description the queue was created with.
+        //
+        HRESULT Initialize(
+                            ISurfaceConsumer*               pConsumer,
+                            ISurfaceProducer*               pProducer,
+                            IUnknown*                       pDevice,
+                            REFIID                          id,
+                            const SURFACE_QUEUE_DESC*       pDesc,
+                            UINT                            Depth,
+                            PFN_SURFACE_READBACK_CALLBACK   pfnCallback,
+                            void*                           pContext
+                          );
+
+        //
+        // Delivers the frames whose copies have landed, then dequeues and copies
+        // frames while there are free copy resources.  Only the first dequeue
+        // waits, for up to dwTimeout ms.  pNumFrames receives the number of
+        // frames handed to the callback.
+        //
+        HRESULT Process(DWORD dwTimeout, UINT* pNumFrames);
+
+        //
+        // Converts the frames to Format before handing them to the callback,
+        // optionally premultiplying or unpremultiplying them (ConvertFlags are
+        // the SURFACE_CONVERT_FLAG values).  The callback then gets a
+        // description with the new format.  Call after Initialize.
+        //
+        HRESULT SetOutputFormat(DXGI_FORMAT Format, DWORD ConvertFlags);
+
+        // Waits for every copy in flight and delivers it.
+        HRESULT Drain(UINT* pNumFrames);
+
+    private:
+        HRESULT DeliverFrames(DWORD Flags, UINT* pNumFrames);
+
+        struct ReadbackSlot
+        {
+            IUnknown*                       pCopy;
+            BYTE*                           pMetaData;
+            UINT                            MetaDataSize;
+
+            // The part of pCopy that is older than the latest frame dequeued
+            RECT                            Stale;
+        };
+
+    private:
+        ISurfaceConsumer*                   m_pConsumer;
+        ISurfaceConsumer1*                  m_pConsumer1;
+        ISurfaceProducer*                   m_pProducer;
+        ISurfaceQueueDevice*                m_pDevice;
+        IID                                 m_id;
+        SURFACE_QUEUE_DESC                  m_Desc;
+
+        // Ring of copies; m_nInFlight of them starting at m_iHead hold frames
+        ReadbackSlot*                       m_pSlots;
+        UINT                                m_nSlots;
+        CBudgetCharge                       m_CopyCharge;
+        UINT                                m_iHead;
+        UINT                                m_nInFlight;
+
+        PFN_SURFACE_READBACK_CALLBACK       m_pfnCallback;
+        void*                               m_pContext;
+
+        // Frames are converted into m_pConverted when the output differs
+        SURFACE_QUEUE_DESC                  m_OutputDesc;
+        DWORD                               m_ConvertFlags;
+        BYTE*                               m_pConverted;
+        UINT                                m_ConvertedPitch;
+};
@@ -0,0 +1,1148 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#include <new>
+#include <malloc.h>
+#include <limits.h>
+#include <emmintrin.h>
+#include "SurfaceQueueRecorder.h"
+#include "SurfaceQueueSoftware.h"
+
+//-----------------------------------------------------------------------------
+// Frame compression
+//
+// A byte oriented LZ77 in the style of LZ4.  The stream is a list of sequences:
+//
+//      token                       literal length in the high nibble, match
+//                                  length - 4 in the low nibble
+//      [literal length bytes]      when the nibble is 15: bytes of 255 and a
+//                                  last byte below 255 that are all added
+//      literals
+//      offset                      2 bytes, little endian, back from the
+//                                  current position
+//      [match length bytes]        like the literal length
+//
+// The last sequence ends after its literals.  Matches are found through a
+// hash table of the last position of each 4 byte value, which is fast and
+// good enough for the long runs of zeros of delta frames.
+//-----------------------------------------------------------------------------
+
+#define RECORDING_LZ_MIN_MATCH      (4)
+#define RECORDING_LZ_MAX_OFFSET     (0xFFFF)
+#define RECORDING_LZ_HASH_BITS      (14)
+#define RECORDING_LZ_HASH_SIZE      (1 << RECORDING_LZ_HASH_BITS)
+
+//-----------------------------------------------------------------------------
+static inline UINT ReadUINT(const BYTE* p)
+{
+    UINT v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+//-----------------------------------------------------------------------------
+static inline UINT64 ReadUINT64(const BYTE* p)
+{
+    UINT64 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+//-----------------------------------------------------------------------------
+static inline BYTE* WriteLength(BYTE* pOut, UINT Length)
+{
+    while (Length >= 255)
+    {
+        *pOut++ = 255;
+        Length -= 255;
+    }
+    *pOut++ = (BYTE)Length;
+    return pOut;
+}
+
+//-----------------------------------------------------------------------------
+// Writes a sequence, or returns NULL if it does not fit before pEnd.
+// MatchLength is 0 for the last sequence.
+//-----------------------------------------------------------------------------
+static BYTE* WriteSequence(
+                BYTE*           pOut,
+                BYTE*           pEnd,
+                const BYTE*     pLiterals,
+                UINT            LiteralLength,
+                UINT            Offset,
+                UINT            MatchLength)
+{
+    ULONGLONG Needed = 1 + LiteralLength / 255 + 1 + LiteralLength + 2 + MatchLength / 255 + 1;
+
+    if (Needed > (ULONGLONG)(pEnd - pOut))
+    {
+        return NULL;
+    }
+
+    BYTE*   pToken = pOut++;
+    BYTE    Token;
+
+    Token = (BYTE)((LiteralLength >= 15 ? 15 : LiteralLength) << 4);
+    if (LiteralLength >= 15)
+    {
+        pOut = WriteLength(pOut, LiteralLength - 15);
+    }
+    memcpy(pOut, pLiterals, LiteralLength);
+    pOut += LiteralLength;
+
+    if (MatchLength)
+    {
+        ASSERT(MatchLength >= RECORDING_LZ_MIN_MATCH);
+        ASSERT(Offset > 0 && Offset <= RECORDING_LZ_MAX_OFFSET);
+
+        UINT Length = MatchLength - RECORDING_LZ_MIN_MATCH;
+
+        *pOut++ = (BYTE)(Offset & 0xFF);
+        *pOut++ = (BYTE)(Offset >> 8);
+
+        Token |= (BYTE)(Length >= 15 ? 15 : Length);
+        if (Length >= 15)
+        {
+            pOut = WriteLength(pOut, Length - 15);
+        }
+    }
+
+    *pToken = Token;
+    return pOut;
+}
+
+//-----------------------------------------------------------------------------
+// Compresses Size bytes of pSrc into pDst.  Returns the compressed size, or 0
+// if it would not fit in Capacity bytes.  pHashTable holds
+// RECORDING_LZ_HASH_SIZE entries.
+//-----------------------------------------------------------------------------
+static UINT RecordingCompress(
+                const BYTE*     pSrc,
+                UINT            Size,
+                BYTE*           pDst,
+                UINT            Capacity,
+                UINT*           pHashTable)
+{
+    BYTE*   pOut    = pDst;
+    BYTE*   pEnd    = pDst + Capacity;
+    UINT    Anchor  = 0;
+    UINT    Pos     = 0;
+
+    // Empty entries point at position 0; comparing the bytes weeds them out
+    ZeroMemory(pHashTable, sizeof(UINT) * RECORDING_LZ_HASH_SIZE);
+
+    while (Size >= RECORDING_LZ_MIN_MATCH && Pos <= Size - RECORDING_LZ_MIN_MATCH)
+    {
+        UINT Value      = ReadUINT(pSrc + Pos);
+        UINT Hash       = (Value * 2654435761U) >> (32 - RECORDING_LZ_HASH_BITS);
+        UINT Candidate  = pHashTable[Hash];
+
+        pHashTable[Hash] = Pos;
+
+        if (Candidate < Pos && Pos - Candidate <= RECORDING_LZ_MAX_OFFSET && ReadUINT(pSrc + Candidate) == Value)
+        {
+            UINT Length = RECORDING_LZ_MIN_MATCH;
+
+            while (Pos + Length + sizeof(UINT64) <= Size &&
+                   ReadUINT64(pSrc + Candidate + Length) == ReadUINT64(pSrc + Pos + Length))
+            {
+                Length += sizeof(UINT64);
+            }
+            while (Pos + Length < Size && pSrc[Candidate + Length] == pSrc[Pos + Length])
+            {
+                Length++;
+            }
+
+            pOut = WriteSequence(pOut, pEnd, pSrc + Anchor, Pos - Anchor, Pos - Candidate, Length);
+            if (!pOut)
+            {
+                return 0;
+            }
+
+            Pos     += Length;
+            Anchor  = Pos;
+        }
+        else
+        {
+            Pos++;
+        }
+    }
+
+    pOut = WriteSequence(pOut, pEnd, pSrc + Anchor, Size - Anchor, 0, 0);
+    if (!pOut)
+    {
+        return 0;
+    }
+
+    return (UINT)(pOut - pDst);
+}
+
+//-----------------------------------------------------------------------------
+static inline BOOL ReadLength(const BYTE** ppIn, const BYTE* pEnd, UINT* pLength)
+{
+    const BYTE* pIn = *ppIn;
+    BYTE        b;
+
+    do
+    {
+        if (pIn == pEnd)
+        {
+            return FALSE;
+        }
+        b = *pIn++;
+        if (*pLength > UINT_MAX - b)
+        {
+            return FALSE;
+        }
+        *pLength += b;
+    }
+    while (b == 255);
+
+    *ppIn = pIn;
+    return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+// Decompresses pSrc into exactly DstSize bytes at pDst.  The stream comes from
+// a file, so every length and offset is checked.
+//-----------------------------------------------------------------------------
+static HRESULT RecordingDecompress(
+                const BYTE*     pSrc,
+                UINT            SrcSize,
+                BYTE*           pDst,
+                UINT            DstSize)
+{
+    const BYTE* pIn     = pSrc;
+    const BYTE* pInEnd  = pSrc + SrcSize;
+    BYTE*       pOut    = pDst;
+    BYTE*       pOutEnd = pDst + DstSize;
+
+    while (pIn < pInEnd)
+    {
+        BYTE Token          = *pIn++;
+        UINT LiteralLength  = Token >> 4;
+
+        if (LiteralLength == 15 && !ReadLength(&pIn, pInEnd, &LiteralLength))
+        {
+            return E_FAIL;
+        }
+        if (LiteralLength > (UINT)(pInEnd - pIn) || LiteralLength > (UINT)(pOutEnd - pOut))
+        {
+            return E_FAIL;
+        }
+        memcpy(pOut, pIn, LiteralLength);
+        pIn     += LiteralLength;
+        pOut    += LiteralLength;
+
+        if (pIn == pInEnd)
+        {
+            break;
+        }
+        if (pInEnd - pIn < 2)
+        {
+            return E_FAIL;
+        }
+
+        UINT Offset         = pIn[0] | (pIn[1] << 8);
+        UINT MatchLength    = Token & 15;
+
+        pIn += 2;
+        if (MatchLength == 15 && !ReadLength(&pIn, pInEnd, &MatchLength))
+        {
+            return E_FAIL;
+        }
+        MatchLength += RECORDING_LZ_MIN_MATCH;
+
+        if (Offset == 0 || Offset > (UINT)(pOut - pDst) || MatchLength > (UINT)(pOutEnd - pOut))
+        {
+            return E_FAIL;
+        }
+
+        // The match can overlap what it writes, a run of one byte has an
+        // offset of 1
+        const BYTE* pMatch = pOut - Offset;
+        if (Offset >= MatchLength)
+        {
+            memcpy(pOut, pMatch, MatchLength);
+            pOut += MatchLength;
+        }
+        else
+        {
+            for (UINT i = 0; i < MatchLength; i++)
+            {
+                *pOut++ = *pMatch++;
+            }
+        }
+    }
+
+    return pOut == pOutEnd ? S_OK : E_FAIL;
+}
+
+//-----------------------------------------------------------------------------
+// pDst = pA ^ pB for Size bytes; none of them have to be aligned
+//-----------------------------------------------------------------------------
+static void XorBytes(BYTE* pDst, const BYTE* pA, const BYTE* pB, UINT Size)
+{
+    UINT i = 0;
+
+    for (; i + 16 <= Size; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(pA + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(pB + i));
+        _mm_storeu_si128((__m128i*)(pDst + i), _mm_xor_si128(a, b));
+    }
+    for (; i < Size; i++)
+    {
+        pDst[i] = pA[i] ^ pB[i];
+    }
+}
+
+//-----------------------------------------------------------------------------
+static inline ULONGLONG AlignOffset(ULONGLONG Offset, ULONGLONG Alignment)
+{
+    return (Offset + Alignment - 1) & ~(Alignment - 1);
+}
+
+//-----------------------------------------------------------------------------
+// CSurfaceRecorder implementation
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+CSurfaceRecorder::CSurfaceRecorder() :
+    m_pReadback(NULL),
+    m_hFile(INVALID_HANDLE_VALUE),
+    m_hMapping(NULL),
+    m_pHeader(NULL),
+    m_pIndex(NULL),
+    m_pBase(NULL),
+    m_Flags(0),
+    m_FrameSize(0),
+    m_KeyFrameInterval(0),
+    m_KeyFrame(0),
+    m_pKeyFrame(NULL),
+    m_hrRecord(S_OK),
+    m_nFreeJobs(0),
+    m_iPendingHead(0),
+    m_nPendingJobs(0),
+    m_hFreeJobs(NULL),
+    m_pWork(NULL)
+{
+    ZeroMemory(m_Jobs, sizeof(m_Jobs));
+    InitializeCriticalSection(&m_JobLock);
+}
+
+//-----------------------------------------------------------------------------
+CSurfaceRecorder::~CSurfaceRecorder()
+{
+    Close();
+
+    if (m_pWork)
+    {
+        CloseThreadpoolWork(m_pWork);
+    }
+    if (m_hFreeJobs)
+    {
+        CloseHandle(m_hFreeJobs);
+    }
+    for (UINT i = 0; i < SURFACE_RECORDER_MAX_JOBS; i++)
+    {
+        if (m_Jobs[i].pMetaData)
+        {
+            delete[] m_Jobs[i].pMetaData;
+        }
+        if (m_Jobs[i].pFrame)
+        {
+            delete[] m_Jobs[i].pFrame;
+        }
+        if (m_Jobs[i].pCompressed)
+        {
+            delete[] m_Jobs[i].pCompressed;
+        }
+        if (m_Jobs[i].pHashTable)
+        {
+            delete[] m_Jobs[i].pHashTable;
+        }
+    }
+    if (m_pKeyFrame)
+    {
+        delete[] m_pKeyFrame;
+    }
+
+    DeleteCriticalSection(&m_JobLock);
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceRecorder::Initialize(
+                                ISurfaceConsumer*           pConsumer,
+                                ISurfaceProducer*           pProducer,
+                                IUnknown*                   pDevice,
+                                REFIID                      id,
+                                const SURFACE_QUEUE_DESC*   pDesc,
+                                LPCWSTR                     pPath,
+                                UINT                        MaxFrames,
+                                ULONGLONG                   MaxDataSize,
+                                DWORD                       Flags,
+                                UINT                        KeyFrameInterval)
+{
+    ASSERT(m_pReadback == NULL);
+
+    if (pDesc == NULL || pPath == NULL || MaxFrames == 0 || MaxDataSize == 0)
+    {
+        return E_INVALIDARG;
+    }
+    if (Flags & ~(SURFACE_RECORDER_FLAG_DELTA | SURFACE_RECORDER_FLAG_COMPRESS))
+    {
+        return E_INVALIDARG;
+    }
+    if ((Flags & SURFACE_RECORDER_FLAG_DELTA) && KeyFrameInterval == 0)
+    {
+        return E_INVALIDARG;
+    }
+
+    HRESULT         hr          = S_OK;
+    UINT            PixelSize   = GetSoftwareSurfaceFormatSize(pDesc->Format);
+    ULONGLONG       FrameSize   = (ULONGLONG)pDesc->Width * PixelSize * pDesc->Height;
+    ULONGLONG       IndexOffset = AlignOffset(sizeof(SurfaceRecordingHeader), 64);
+    ULONGLONG       DataOffset  = AlignOffset(IndexOffset + (ULONGLONG)MaxFrames * sizeof(SurfaceRecordingFrame), 4096);
+    ULONGLONG       FileSize    = DataOffset + MaxDataSize;
+    LARGE_INTEGER   Frequency;
+
+    if (PixelSize == 0 || FrameSize == 0)
+    {
+        return E_INVALIDARG;
+    }
+    // The whole file is mapped at once
+    if (FrameSize > UINT_MAX || FileSize > (SIZE_T)-1)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    m_Flags             = Flags;
+    m_FrameSize         = (UINT)FrameSize;
+    m_KeyFrameInterval  = KeyFrameInterval;
+
+    if (m_Flags & SURFACE_RECORDER_FLAG_DELTA)
+    {
+        m_pKeyFrame = new QUEUE_NOTHROW_SPECIFIER BYTE[m_FrameSize];
+        if (!m_pKeyFrame)
+        {
+            hr = E_OUTOFMEMORY;
+            goto end;
+        }
+    }
+
+    if (m_Flags & SURFACE_RECORDER_FLAG_COMPRESS)
+    {
+        for (UINT i = 0; i < SURFACE_RECORDER_MAX_JOBS; i++)
+        {
+            if (pDesc->MetaDataSize)
+            {
+                m_Jobs[i].pMetaData = new QUEUE_NOTHROW_SPECIFIER BYTE[pDesc->MetaDataSize];
+            }
+            m_Jobs[i].pFrame        = new QUEUE_NOTHROW_SPECIFIER BYTE[m_FrameSize];
+            m_Jobs[i].pCompressed   = new QUEUE_NOTHROW_SPECIFIER BYTE[m_FrameSize];
+            m_Jobs[i].pHashTable    = new QUEUE_NOTHROW_SPECIFIER UINT[RECORDING_LZ_HASH_SIZE];
+
+            if ((pDesc->MetaDataSize && !m_Jobs[i].pMetaData) || !m_Jobs[i].pFrame ||
+                !m_Jobs[i].pCompressed || !m_Jobs[i].pHashTable)
+            {
+                hr = E_OUTOFMEMORY;
+                goto end;
+            }
+
+            m_FreeJobs[i] = i;
+        }
+        m_nFreeJobs = SURFACE_RECORDER_MAX_JOBS;
+
+        m_hFreeJobs = CreateSemaphore(NULL, SURFACE_RECORDER_MAX_JOBS, SURFACE_RECORDER_MAX_JOBS, NULL);
+        if (!m_hFreeJobs)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            goto end;
+        }
+
+        m_pWork = CreateThreadpoolWork(WorkCallback, this, NULL);
+        if (!m_pWork)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            goto end;
+        }
+    }
+
+    //
+    // Create the file at its full size and map all of it.  Readers share the
+    // file while it is recorded.
+    //
+    m_hFile = CreateFileW(pPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                          CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+
+    m_hMapping = CreateFileMappingW(m_hFile, NULL, PAGE_READWRITE,
+                                    (DWORD)(FileSize >> 32), (DWORD)FileSize, NULL);
+    if (!m_hMapping)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+
+    m_pBase = (BYTE*)MapViewOfFile(m_hMapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)FileSize);
+    if (!m_pBase)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+
+    QueryPerformanceFrequency(&Frequency);
+
+    // The new file reads as zeros, so the index starts out empty
+    m_pHeader = (SurfaceRecordingHeader*)m_pBase;
+    m_pIndex  = (SurfaceRecordingFrame*)(m_pBase + IndexOffset);
+
+    m_pHeader->Version              = SURFACE_RECORDING_VERSION;
+    m_pHeader->Width                = pDesc->Width;
+    m_pHeader->Height               = pDesc->Height;
+    m_pHeader->Format               = pDesc->Format;
+    m_pHeader->RowSize              = pDesc->Width * PixelSize;
+    m_pHeader->MaxMetaDataSize      = pDesc->MetaDataSize;
+    m_pHeader->MaxFrames            = MaxFrames;
+    m_pHeader->NumFrames            = 0;
+    m_pHeader->TimestampFrequency   = Frequency.QuadPart;
+    m_pHeader->IndexOffset          = IndexOffset;
+    m_pHeader->DataOffset           = DataOffset;
+    m_pHeader->DataEnd              = (LONGLONG)DataOffset;
+    m_pHeader->FileSize             = FileSize;
+
+    // Readers check the magic last
+    MemoryBarrier();
+    m_pHeader->Magic = SURFACE_RECORDING_MAGIC;
+
+    m_pReadback = new QUEUE_NOTHROW_SPECIFIER CSurfaceReadbackConsumer();
+    if (!m_pReadback)
+    {
+        hr = E_OUTOFMEMORY;
+        goto end;
+    }
+
+    if (FAILED(hr = m_pReadback->Initialize(pConsumer, pProducer, pDevice, id, pDesc,
+                                            SURFACE_READBACK_MIN_DEPTH, OnFrame, this)))
+    {
+        goto end;
+    }
+
+end:
+    if (FAILED(hr))
+    {
+        Close();
+    }
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceRecorder::Process(DWORD dwTimeout, UINT* pNumFrames)
+{
+    if (!m_pReadback)
+    {
+        return E_INVALIDARG;
+    }
+
+    HRESULT hr = m_pReadback->Process(dwTimeout, pNumFrames);
+
+    if (SUCCEEDED(hr) && FAILED(m_hrRecord))
+    {
+        hr = m_hrRecord;
+    }
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceRecorder::Close()
+{
+    HRESULT hr = S_OK;
+
+    if (m_pReadback)
+    {
+        // Delivers the frames still in flight through OnFrame
+        hr = m_pReadback->Drain(NULL);
+        delete m_pReadback;
+        m_pReadback = NULL;
+    }
+
+    if (m_pWork)
+    {
+        WaitForThreadpoolWorkCallbacks(m_pWork, FALSE);
+    }
+
+    if (m_pBase)
+    {
+        FlushViewOfFile(m_pBase, 0);
+
+        LARGE_INTEGER End;
+        End.QuadPart = m_pHeader->DataEnd;
+        if (End.QuadPart > (LONGLONG)m_pHeader->FileSize)
+        {
+            // Reservations that did not fit are never written
+            End.QuadPart = (LONGLONG)m_pHeader->FileSize;
+        }
+        m_pHeader->DataEnd  = End.QuadPart;
+        m_pHeader->FileSize = End.QuadPart;
+
+        UnmapViewOfFile(m_pBase);
+        m_pBase     = NULL;
+        m_pHeader   = NULL;
+        m_pIndex    = NULL;
+
+        CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+
+        // Fails while a reader still has the file mapped, in which case the
+        // file keeps its full size
+        if (SetFilePointerEx(m_hFile, End, NULL, FILE_BEGIN))
+        {
+            SetEndOfFile(m_hFile);
+        }
+    }
+
+    if (m_hMapping)
+    {
+        CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+    }
+    if (m_hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+
+    if (SUCCEEDED(hr) && FAILED(m_hrRecord) && m_hrRecord != HRESULT_FROM_WIN32(ERROR_DISK_FULL))
+    {
+        hr = m_hrRecord;
+    }
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+void CALLBACK CSurfaceRecorder::OnFrame(
+                                const void*                 pData,
+                                UINT                        Pitch,
+                                const SURFACE_QUEUE_DESC*   pDesc,
+                                const void*                 pMetaData,
+                                UINT                        MetaDataSize,
+                                void*                       pContext)
+{
+    UNREFERENCED_PARAMETER(pDesc);
+
+    CSurfaceRecorder* pThis = (CSurfaceRecorder*)pContext;
+    pThis->RecordFrame((const BYTE*)pData, Pitch, pMetaData, MetaDataSize);
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceRecorder::PackRows(BYTE* pDst, const BYTE* pSrc, UINT Pitch, const BYTE* pKeyFrame)
+{
+    UINT RowSize = m_pHeader->RowSize;
+
+    for (UINT y = 0; y < m_pHeader->Height; y++)
+    {
+        if (pKeyFrame)
+        {
+            XorBytes(pDst, pSrc, pKeyFrame, RowSize);
+            pKeyFrame += RowSize;
+        }
+        else
+        {
+            memcpy(pDst, pSrc, RowSize);
+        }
+        pDst += RowSize;
+        pSrc += Pitch;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Reserves Size bytes at the end of the data, or returns NULL once the file is
+// full.  Safe to call from the callback and the workers at the same time.
+//-----------------------------------------------------------------------------
+BYTE* CSurfaceRecorder::ReserveData(UINT Size, ULONGLONG* pOffset)
+{
+    LONGLONG Offset = InterlockedExchangeAdd64(&m_pHeader->DataEnd, Size);
+
+    if ((ULONGLONG)Offset + Size > m_pHeader->FileSize)
+    {
+        m_hrRecord = HRESULT_FROM_WIN32(ERROR_DISK_FULL);
+        return NULL;
+    }
+
+    *pOffset = (ULONGLONG)Offset;
+    return m_pBase + Offset;
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceRecorder::PublishFrame(UINT Index, ULONGLONG Offset, UINT StoredSize, LONG Flags)
+{
+    SurfaceRecordingFrame* pFrame = &m_pIndex[Index];
+
+    pFrame->Offset      = Offset;
+    pFrame->StoredSize  = StoredSize;
+
+    // Readers look at the flags first; everything else has to be in place
+    // before the frame turns valid
+    InterlockedExchange(&pFrame->Flags, Flags | SURFACE_RECORDING_FRAME_VALID);
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceRecorder::RecordFrame(const BYTE* pData, UINT Pitch, const void* pMetaData, UINT MetaDataSize)
+{
+    if (FAILED(m_hrRecord))
+    {
+        return;
+    }
+
+    UINT Index = (UINT)m_pHeader->NumFrames;
+    if (Index >= m_pHeader->MaxFrames)
+    {
+        m_hrRecord = HRESULT_FROM_WIN32(ERROR_DISK_FULL);
+        return;
+    }
+
+    LARGE_INTEGER           Now;
+    BOOL                    KeyFrame    = TRUE;
+    LONG                    Flags       = 0;
+    const BYTE*             pKeyFrame   = NULL;
+    SurfaceRecordingFrame*  pFrame      = &m_pIndex[Index];
+
+    QueryPerformanceCounter(&Now);
+
+    if (m_Flags & SURFACE_RECORDER_FLAG_DELTA)
+    {
+        KeyFrame = (Index == 0 || Index - m_KeyFrame >= m_KeyFrameInterval);
+        if (KeyFrame)
+        {
+            // Deltas until the next key frame are taken against this one
+            m_KeyFrame = Index;
+            PackRows(m_pKeyFrame, pData, Pitch, NULL);
+        }
+        else
+        {
+            pKeyFrame   = m_pKeyFrame;
+            Flags       = SURFACE_RECORDING_FRAME_DELTA;
+        }
+    }
+
+    pFrame->Timestamp       = Now.QuadPart;
+    pFrame->KeyFrame        = m_KeyFrame;
+    pFrame->MetaDataSize    = MetaDataSize;
+
+    // The entry stays invalid until the frame is written; a frame that does
+    // not fit stays invalid for good
+    InterlockedExchange(&m_pHeader->NumFrames, (LONG)(Index + 1));
+
+    if (!(m_Flags & SURFACE_RECORDER_FLAG_COMPRESS))
+    {
+        ULONGLONG   Offset;
+        BYTE*       pDst = ReserveData(MetaDataSize + m_FrameSize, &Offset);
+
+        if (!pDst)
+        {
+            return;
+        }
+
+        memcpy(pDst, pMetaData, MetaDataSize);
+        if (KeyFrame && m_pKeyFrame)
+        {
+            memcpy(pDst + MetaDataSize, m_pKeyFrame, m_FrameSize);
+        }
+        else
+        {
+            PackRows(pDst + MetaDataSize, pData, Pitch, pKeyFrame);
+        }
+
+        PublishFrame(Index, Offset, m_FrameSize, Flags);
+        return;
+    }
+
+    //
+    // Pack the frame into a free job and leave the compression to the thread
+    // pool.  When every job is busy this waits, which in turn holds back the
+    // readback and the producer.
+    //
+    WaitForSingleObject(m_hFreeJobs, INFINITE);
+
+    EnterCriticalSection(&m_JobLock);
+    ASSERT(m_nFreeJobs > 0);
+    RecordingJob* pJob = &m_Jobs[m_FreeJobs[--m_nFreeJobs]];
+    LeaveCriticalSection(&m_JobLock);
+
+    pJob->Index         = Index;
+    pJob->Flags         = Flags;
+    pJob->MetaDataSize  = MetaDataSize;
+    memcpy(pJob->pMetaData, pMetaData, MetaDataSize);
+
+    if (KeyFrame && m_pKeyFrame)
+    {
+        memcpy(pJob->pFrame, m_pKeyFrame, m_FrameSize);
+    }
+    else
+    {
+        PackRows(pJob->pFrame, pData, Pitch, pKeyFrame);
+    }
+
+    EnterCriticalSection(&m_JobLock);
+    m_PendingJobs[(m_iPendingHead + m_nPendingJobs) % SURFACE_RECORDER_MAX_JOBS] = (UINT)(pJob - m_Jobs);
+    m_nPendingJobs++;
+    LeaveCriticalSection(&m_JobLock);
+
+    SubmitThreadpoolWork(m_pWork);
+}
+
+//-----------------------------------------------------------------------------
+void CALLBACK CSurfaceRecorder::WorkCallback(PTP_CALLBACK_INSTANCE pInstance, PVOID pContext, PTP_WORK pWork)
+{
+    UNREFERENCED_PARAMETER(pInstance);
+    UNREFERENCED_PARAMETER(pWork);
+
+    CSurfaceRecorder* pThis = (CSurfaceRecorder*)pContext;
+    pThis->CompressJob();
+}
+
+//-----------------------------------------------------------------------------
+// Runs once for each submitted job.  The jobs can finish in any order, so the
+// frame data is not necessarily in frame order.
+//-----------------------------------------------------------------------------
+void CSurfaceRecorder::CompressJob()
+{
+    EnterCriticalSection(&m_JobLock);
+    ASSERT(m_nPendingJobs > 0);
+    UINT JobIndex = m_PendingJobs[m_iPendingHead];
+    m_iPendingHead = (m_iPendingHead + 1) % SURFACE_RECORDER_MAX_JOBS;
+    m_nPendingJobs--;
+    LeaveCriticalSection(&m_JobLock);
+
+    RecordingJob*   pJob    = &m_Jobs[JobIndex];
+    const BYTE*     pPixels = pJob->pFrame;
+    UINT            Size    = m_FrameSize;
+    LONG            Flags   = pJob->Flags;
+    UINT            CompressedSize;
+
+    // Frames that do not get smaller are stored as they are
+    CompressedSize = RecordingCompress(pJob->pFrame, m_FrameSize, pJob->pCompressed, m_FrameSize - 1, pJob->pHashTable);
+    if (CompressedSize)
+    {
+        pPixels = pJob->pCompressed;
+        Size    = CompressedSize;
+        Flags   |= SURFACE_RECORDING_FRAME_COMPRESSED;
+    }
+
+    ULONGLONG   Offset;
+    BYTE*       pDst = ReserveData(pJob->MetaDataSize + Size, &Offset);
+
+    if (pDst)
+    {
+        memcpy(pDst, pJob->pMetaData, pJob->MetaDataSize);
+        memcpy(pDst + pJob->MetaDataSize, pPixels, Size);
+        PublishFrame(pJob->Index, Offset, Size, Flags);
+    }
+
+    EnterCriticalSection(&m_JobLock);
+    m_FreeJobs[m_nFreeJobs++] = JobIndex;
+    LeaveCriticalSection(&m_JobLock);
+
+    ReleaseSemaphore(m_hFreeJobs, 1, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// CSurfaceRecordingReader implementation
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+CSurfaceRecordingReader::CSurfaceRecordingReader() :
+    m_hFile(INVALID_HANDLE_VALUE),
+    m_hMapping(NULL),
+    m_pBase(NULL),
+    m_Size(0),
+    m_pHeader(NULL),
+    m_pIndex(NULL),
+    m_FrameSize(0),
+    m_pFrameScratch(NULL),
+    m_pKeyScratch(NULL)
+{
+}
+
+//-----------------------------------------------------------------------------
+CSurfaceRecordingReader::~CSurfaceRecordingReader()
+{
+    if (m_pBase)
+    {
+        UnmapViewOfFile(m_pBase);
+    }
+    if (m_hMapping)
+    {
+        CloseHandle(m_hMapping);
+    }
+    if (m_hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_hFile);
+    }
+    if (m_pFrameScratch)
+    {
+        delete[] m_pFrameScratch;
+    }
+    if (m_pKeyScratch)
+    {
+        delete[] m_pKeyScratch;
+    }
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceRecordingReader::Open(LPCWSTR pPath)
+{
+    ASSERT(m_pBase == NULL);
+
+    if (pPath == NULL)
+    {
+        return E_INVALIDARG;
+    }
+
+    HRESULT         hr = S_OK;
+    LARGE_INTEGER   Size;
+    ULONGLONG       FrameSize;
+    ULONGLONG       IndexEnd;
+
+    // The recorder keeps the file open for writing
+    m_hFile = CreateFileW(pPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+
+    if (!GetFileSizeEx(m_hFile, &Size))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+    if ((ULONGLONG)Size.QuadPart < sizeof(SurfaceRecordingHeader) || (ULONGLONG)Size.QuadPart > (SIZE_T)-1)
+    {
+        hr = E_FAIL;
+        goto end;
+    }
+    m_Size = (ULONGLONG)Size.QuadPart;
+
+    m_hMapping = CreateFileMappingW(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!m_hMapping)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+
+    m_pBase = (const BYTE*)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (!m_pBase)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+
+    m_pHeader = (const SurfaceRecordingHeader*)m_pBase;
+    if (m_pHeader->Magic != SURFACE_RECORDING_MAGIC || m_pHeader->Version != SURFACE_RECORDING_VERSION)
+    {
+        hr = E_FAIL;
+        goto end;
+    }
+    MemoryBarrier();
+
+    FrameSize = (ULONGLONG)m_pHeader->RowSize * m_pHeader->Height;
+    IndexEnd  = m_pHeader->IndexOffset + (ULONGLONG)m_pHeader->MaxFrames * sizeof(SurfaceRecordingFrame);
+    if (FrameSize == 0 || FrameSize > UINT_MAX ||
+        m_pHeader->RowSize != m_pHeader->Width * GetSoftwareSurfaceFormatSize(m_pHeader->Format) ||
+        m_pHeader->IndexOffset < sizeof(SurfaceRecordingHeader) ||
+        IndexEnd < m_pHeader->IndexOffset || IndexEnd > m_Size)
+    {
+        hr = E_FAIL;
+        goto end;
+    }
+    m_FrameSize = (UINT)FrameSize;
+    m_pIndex    = (const SurfaceRecordingFrame*)(m_pBase + m_pHeader->IndexOffset);
+
+    m_pFrameScratch = new QUEUE_NOTHROW_SPECIFIER BYTE[m_FrameSize];
+    m_pKeyScratch   = new QUEUE_NOTHROW_SPECIFIER BYTE[m_FrameSize];
+    if (!m_pFrameScratch || !m_pKeyScratch)
+    {
+        hr = E_OUTOFMEMORY;
+        goto end;
+    }
+
+end:
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+UINT CSurfaceRecordingReader::GetNumFrames() const
+{
+    if (!m_pHeader)
+    {
+        return 0;
+    }
+
+    UINT NumFrames = (UINT)m_pHeader->NumFrames;
+    return NumFrames < m_pHeader->MaxFrames ? NumFrames : m_pHeader->MaxFrames;
+}
+
+//-----------------------------------------------------------------------------
+// Looks up a frame that has been completely written and lies within the file
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceRecordingReader::GetFrame(UINT Index, const SurfaceRecordingFrame** ppFrame) const
+{
+    if (Index >= GetNumFrames())
+    {
+        return E_INVALIDARG;
+    }
+
+    const SurfaceRecordingFrame* pFrame = &m_pIndex[Index];
+
+    if (!(pFrame->Flags & SURFACE_RECORDING_FRAME_VALID))
+    {
+        // Still being written, or dropped when the file filled up
+        return HRESULT_FROM_WIN32(ERROR_NOT_READY);
+    }
+    MemoryBarrier();
+
+    ULONGLONG End = pFrame->Offset + pFrame->MetaDataSize + pFrame->StoredSize;
+    if (pFrame->Offset < m_pHeader->DataOffset || End < pFrame->Offset || End > m_Size ||
+        pFrame->MetaDataSize > m_pHeader->MaxMetaDataSize)
+    {
+        return E_FAIL;
+    }
+
+    *ppFrame = pFrame;
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceRecordingReader::DecodePixels(
+                                const SurfaceRecordingFrame*    pFrame,
+                                BYTE*                           pScratch,
+                                const BYTE**                    ppPixels) const
+{
+    const BYTE* pStored = m_pBase + pFrame->Offset + pFrame->MetaDataSize;
+
+    if (pFrame->Flags & SURFACE_RECORDING_FRAME_COMPRESSED)
+    {
+        HRESULT hr = RecordingDecompress(pStored, pFrame->StoredSize, pScratch, m_FrameSize);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+        *ppPixels = pScratch;
+    }
+    else
+    {
+        if (pFrame->StoredSize != m_FrameSize)
+        {
+            return E_FAIL;
+        }
+        *ppPixels = pStored;
+    }
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceRecordingReader::ReadFrame(
+                                UINT        Index,
+                                void*       pDst,
+                                UINT        DstPitch,
+                                void*       pMetaData,
+                                UINT*       pMetaDataSize,
+                                LONGLONG*   pTimestamp)
+{
+    if (!m_pBase)
+    {
+        return E_INVALIDARG;
+    }
+    if (pDst && DstPitch < m_pHeader->RowSize)
+    {
+        return E_INVALIDARG;
+    }
+
+    HRESULT                         hr;
+    const SurfaceRecordingFrame*    pFrame;
+
+    if (FAILED(hr = GetFrame(Index, &pFrame)))
+    {
+        return hr;
+    }
+
+    if (pMetaDataSize)
+    {
+        if (pMetaData)
+        {
+            memcpy(pMetaData, m_pBase + pFrame->Offset, min(*pMetaDataSize, pFrame->MetaDataSize));
+        }
+        *pMetaDataSize = pFrame->MetaDataSize;
+    }
+    if (pTimestamp)
+    {
+        *pTimestamp = pFrame->Timestamp;
+    }
+
+    if (!pDst)
+    {
+        return S_OK;
+    }
+
+    const BYTE* pPixels;
+    const BYTE* pKeyPixels = NULL;
+
+    if (FAILED(hr = DecodePixels(pFrame, m_pFrameScratch, &pPixels)))
+    {
+        return hr;
+    }
+
+    if (pFrame->Flags & SURFACE_RECORDING_FRAME_DELTA)
+    {
+        const SurfaceRecordingFrame* pKeyFrame;
+
+        // Key frames come before their deltas and are never deltas themselves
+        if (pFrame->KeyFrame >= Index)
+        {
+            return E_FAIL;
+        }
+        if (FAILED(hr = GetFrame(pFrame->KeyFrame, &pKeyFrame)))
+        {
+            return hr;
+        }
+        if (pKeyFrame->Flags & SURFACE_RECORDING_FRAME_DELTA)
+        {
+            return E_FAIL;
+        }
+        if (FAILED(hr = DecodePixels(pKeyFrame, m_pKeyScratch, &pKeyPixels)))
+        {
+            return hr;
+        }
+    }
+
+    BYTE*   pRow    = (BYTE*)pDst;
+    UINT    RowSize = m_pHeader->RowSize;
+
+    for (UINT y = 0; y < m_pHeader->Height; y++)
+    {
+        if (pKeyPixels)
+        {
+            XorBytes(pRow, pPixels, pKeyPixels, RowSize);
+            pKeyPixels += RowSize;
+        }
+        else
+        {
+            memcpy(pRow, pPixels, RowSize);
+        }
+        pPixels += RowSize;
+        pRow    += DstPitch;
+    }
+
+    return S_OK;
+}
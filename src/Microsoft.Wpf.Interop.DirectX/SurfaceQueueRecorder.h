@@ -0,0 +1,235 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#pragma once
+
+#include "SurfaceQueueReadback.h"
+
+//
+// Records the frames of a queue into a file, for looking into performance
+// regressions after the fact.
+//
+// The recorder reads the frames back with a CSurfaceReadbackConsumer and
+// appends them, with their meta data, to a memory mapped file.  The file is
+// laid out as
+//
+//      SurfaceRecordingHeader
+//      SurfaceRecordingFrame[MaxFrames]    (the index)
+//      frame data                          (meta data, then the pixels)
+//
+// The index has a fixed size, so the entry of any frame is found in O(1).
+// Frame data is appended in the order it becomes ready, which is not
+// necessarily frame order once compression is on; the index records where each
+// frame went.
+//
+// Pixels are stored as tightly packed rows in the queue format.  With
+// SURFACE_RECORDER_FLAG_DELTA, frames between key frames are stored XORed with
+// the last key frame, so unchanged pixels are zero and compress to almost
+// nothing.  Deltas are taken against the key frame rather than the previous
+// frame so that any frame decodes from at most two stored frames.  With
+// SURFACE_RECORDER_FLAG_COMPRESS, frames are LZ compressed on the thread pool.
+//
+// The file is created at its full size and truncated to what was written by
+// Close.  Readers can open it while it is being recorded; frames only show up
+// in the index once they are completely written.
+//
+
+#define SURFACE_RECORDING_MAGIC             (0x43525153)    // 'SQRC'
+#define SURFACE_RECORDING_VERSION           (1)
+
+// Store frames between key frames as the XOR against the key frame
+#define SURFACE_RECORDER_FLAG_DELTA         (0x1)
+// LZ compress the frames on the thread pool
+#define SURFACE_RECORDER_FLAG_COMPRESS      (0x2)
+
+// SurfaceRecordingFrame::Flags
+#define SURFACE_RECORDING_FRAME_VALID       (0x1)
+#define SURFACE_RECORDING_FRAME_DELTA       (0x2)
+#define SURFACE_RECORDING_FRAME_COMPRESSED  (0x4)
+
+// Frames compressed at the same time
+#define SURFACE_RECORDER_MAX_JOBS           (4)
+
+#pragma pack(push, 8)
+struct SurfaceRecordingHeader
+{
+    DWORD                   Magic;
+    DWORD                   Version;
+    UINT                    Width;
+    UINT                    Height;
+    DXGI_FORMAT             Format;
+    // Bytes in a stored row of pixels
+    UINT                    RowSize;
+    UINT                    MaxMetaDataSize;
+    UINT                    MaxFrames;
+    // Frames that have an index entry; entries without
+    // SURFACE_RECORDING_FRAME_VALID are still being written or were dropped
+    volatile LONG           NumFrames;
+    UINT                    Reserved;
+    // Ticks per second of the frame timestamps
+    LONGLONG                TimestampFrequency;
+    ULONGLONG               IndexOffset;
+    ULONGLONG               DataOffset;
+    // End of the data written so far
+    volatile LONGLONG       DataEnd;
+    ULONGLONG               FileSize;
+};
+
+struct SurfaceRecordingFrame
+{
+    // Meta data followed by the pixels
+    ULONGLONG               Offset;
+    UINT                    StoredSize;
+    UINT                    MetaDataSize;
+    // QueryPerformanceCounter when the frame reached system memory
+    LONGLONG                Timestamp;
+    // The frame a delta frame was taken against
+    UINT                    KeyFrame;
+    volatile LONG           Flags;
+};
+#pragma pack(pop)
+
+class CSurfaceRecorder
+{
+    public:
+        CSurfaceRecorder();
+        ~CSurfaceRecorder();
+
+        //
+        // pConsumer, pProducer, pDevice, id and pDesc are the same as for
+        // CSurfaceReadbackConsumer::Initialize.  The file at pPath is replaced;
+        // it holds up to MaxFrames frames and MaxDataSize bytes of frame data,
+        // and recording stops once either runs out.  With
+        // SURFACE_RECORDER_FLAG_DELTA every KeyFrameInterval-th frame is a key
+        // frame.
+        //
+        HRESULT Initialize(
+                            ISurfaceConsumer*           pConsumer,
+                            ISurfaceProducer*           pProducer,
+                            IUnknown*                   pDevice,
+                            REFIID                      id,
+                            const SURFACE_QUEUE_DESC*   pDesc,
+                            LPCWSTR                     pPath,
+                            UINT                        MaxFrames,
+                            ULONGLONG                   MaxDataSize,
+                            DWORD                       Flags,
+                            UINT                        KeyFrameInterval
+                          );
+
+        // Same as CSurfaceReadbackConsumer::Process.  Fails once the recording
+        // is full.
+        HRESULT Process(DWORD dwTimeout, UINT* pNumFrames);
+
+        // Records the frames still in flight, waits for the compression and
+        // closes the file.
+        HRESULT Close();
+
+    private:
+        static void CALLBACK OnFrame(
+                                const void*                 pData,
+                                UINT                        Pitch,
+                                const SURFACE_QUEUE_DESC*   pDesc,
+                                const void*                 pMetaData,
+                                UINT                        MetaDataSize,
+                                void*                       pContext);
+
+        static void CALLBACK WorkCallback(PTP_CALLBACK_INSTANCE, PVOID, PTP_WORK);
+
+        void RecordFrame(const BYTE* pData, UINT Pitch, const void* pMetaData, UINT MetaDataSize);
+        void PackRows(BYTE* pDst, const BYTE* pSrc, UINT Pitch, const BYTE* pKeyFrame);
+        void CompressJob();
+        BYTE* ReserveData(UINT Size, ULONGLONG* pOffset);
+        void PublishFrame(UINT Index, ULONGLONG Offset, UINT StoredSize, LONG Flags);
+
+        struct RecordingJob
+        {
+            UINT                    Index;
+            LONG                    Flags;
+            UINT                    MetaDataSize;
+            BYTE*                   pMetaData;
+            BYTE*                   pFrame;
+            BYTE*                   pCompressed;
+            UINT*                   pHashTable;
+        };
+
+    private:
+        CSurfaceReadbackConsumer*           m_pReadback;
+
+        HANDLE                              m_hFile;
+        HANDLE                              m_hMapping;
+        SurfaceRecordingHeader*             m_pHeader;
+        SurfaceRecordingFrame*              m_pIndex;
+        BYTE*                               m_pBase;
+
+        DWORD                               m_Flags;
+        UINT                                m_FrameSize;
+        UINT                                m_KeyFrameInterval;
+        UINT                                m_KeyFrame;
+        BYTE*                               m_pKeyFrame;
+
+        // The first failure while recording; stops the recording
+        volatile HRESULT                    m_hrRecord;
+
+        // Compression jobs.  m_hFreeJobs counts the free ones.
+        RecordingJob                        m_Jobs[SURFACE_RECORDER_MAX_JOBS];
+        UINT                                m_FreeJobs[SURFACE_RECORDER_MAX_JOBS];
+        UINT                                m_nFreeJobs;
+        UINT                                m_PendingJobs[SURFACE_RECORDER_MAX_JOBS];
+        UINT                                m_iPendingHead;
+        UINT                                m_nPendingJobs;
+        HANDLE                              m_hFreeJobs;
+        PTP_WORK                            m_pWork;
+        CRITICAL_SECTION                    m_JobLock;
+};
+
+class CSurfaceRecordingReader
+{
+    public:
+        CSurfaceRecordingReader();
+        ~CSurfaceRecordingReader();
+
+        // Maps the recording at pPath.  It may still be being recorded.
+        HRESULT Open(LPCWSTR pPath);
+
+        const SurfaceRecordingHeader* GetHeader() const { return m_pHeader; }
+
+        // Number of frames with an index entry.  Only some of the last ones
+        // may not be readable yet.
+        UINT GetNumFrames() const;
+
+        //
+        // Decodes frame Index into pDst, as Height rows DstPitch bytes apart in
+        // the format of the recording.  pMetaData receives up to
+        // *pMetaDataSize bytes of meta data and *pMetaDataSize the size
+        // stored.  Any of the outputs can be NULL.
+        //
+        HRESULT ReadFrame(
+                            UINT        Index,
+                            void*       pDst,
+                            UINT        DstPitch,
+                            void*       pMetaData,
+                            UINT*       pMetaDataSize,
+                            LONGLONG*   pTimestamp
+                          );
+
+    private:
+        HRESULT GetFrame(UINT Index, const SurfaceRecordingFrame** ppFrame) const;
+        HRESULT DecodePixels(const SurfaceRecordingFrame* pFrame, BYTE* pScratch, const BYTE** ppPixels) const;
+
+    private:
+        HANDLE                              m_hFile;
+        HANDLE                              m_hMapping;
+        const BYTE*                         m_pBase;
+        ULONGLONG                           m_Size;
+        const SurfaceRecordingHeader*       m_pHeader;
+        const SurfaceRecordingFrame*        m_pIndex;
+        UINT                                m_FrameSize;
+
+        // Decompressed pixels of the frame and of its key frame
+        BYTE*                               m_pFrameScratch;
+        BYTE*                               m_pKeyScratch;
+};
@@ -0,0 +1,1379 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#include <new>
+#include <stdio.h>
+#include <wchar.h>
+#include "SurfaceQueueShared.h"
+
+//
+// Notes about synchronization:
+//
+// The ring follows the same protocol as the FIFO of CSurfaceQueue, except that
+// the two ends can be in different processes.  The producer fills in the entry
+// at Tail and then advances Tail; the consumer only reads an entry after it
+// acquired the ring's semaphore, which the producer releases once the surface
+// is FLUSHED.  Surfaces are flushed in ring order, so an acquired semaphore
+// count always refers to the entry at Head.  ReleaseSemaphore and the wait are
+// full barriers, so the entry is visible to the consumer by then.
+//
+// Head is only written by the consumer and Tail only by the producer, and a
+// ring has at most one of each.  Each side serializes its own calls with a
+// critical section, like CSurfaceConsumer and CSurfaceProducer do.
+//
+
+//-----------------------------------------------------------------------------
+// Helper Functions
+//-----------------------------------------------------------------------------
+static UINT SharedQueueAlign(UINT Size)
+{
+    return (Size + 7) & ~7;
+}
+
+//-----------------------------------------------------------------------------
+// CreateSharedSurfaceQueue / OpenSharedSurfaceQueue
+//-----------------------------------------------------------------------------
+HRESULT WINAPI CreateSharedSurfaceQueue(
+                    SURFACE_QUEUE_DESC*  pDesc,
+                    IUnknown*            pDevice,
+                    LPCWSTR              pName,
+                    ISurfaceQueue**      ppQueue)
+{
+    HRESULT hr  = E_FAIL;
+
+    if (ppQueue == NULL)
+    {
+        return E_INVALIDARG;
+    }
+
+    *ppQueue    = NULL;
+
+    if (pDesc == NULL || pDevice == NULL || pName == NULL)
+    {
+        return E_INVALIDARG;
+    }
+    if (pDesc->NumSurfaces == 0)
+    {
+        return E_INVALIDARG;
+    }
+    if (pDesc->Width == 0 || pDesc->Height == 0)
+    {
+        return E_INVALIDARG;
+    }
+
+    // The other end is in another process, so the queue is always multithreaded
+    if (pDesc->Flags != 0)
+    {
+        return E_INVALIDARG;
+    }
+
+    CSharedSurfaceQueue* pSurfaceQueue = new QUEUE_NOTHROW_SPECIFIER CSharedSurfaceQueue();
+    if (!pSurfaceQueue)
+    {
+        hr = E_OUTOFMEMORY;
+        goto end;
+    }
+
+    hr = pSurfaceQueue->Create(pDesc, pDevice, pName);
+    if (FAILED(hr))
+    {
+        goto end;
+    }
+
+    hr = pSurfaceQueue->QueryInterface(__uuidof(ISurfaceQueue), (void**)ppQueue);
+
+end:
+    if (FAILED(hr))
+    {
+        if (pSurfaceQueue)
+        {
+            delete pSurfaceQueue;
+        }
+        *ppQueue = NULL;
+    }
+
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI OpenSharedSurfaceQueue(
+                    LPCWSTR              pName,
+                    UINT                 Ring,
+                    ISurfaceQueue**      ppQueue)
+{
+    HRESULT hr  = E_FAIL;
+
+    if (ppQueue == NULL)
+    {
+        return E_INVALIDARG;
+    }
+
+    *ppQueue    = NULL;
+
+    if (pName == NULL || Ring >= SHARED_SURFACE_QUEUE_MAX_RINGS)
+    {
+        return E_INVALIDARG;
+    }
+
+    CSharedSurfaceQueue* pSurfaceQueue = new QUEUE_NOTHROW_SPECIFIER CSharedSurfaceQueue();
+    if (!pSurfaceQueue)
+    {
+        hr = E_OUTOFMEMORY;
+        goto end;
+    }
+
+    hr = pSurfaceQueue->Open(pName, Ring, NULL);
+    if (FAILED(hr))
+    {
+        goto end;
+    }
+
+    hr = pSurfaceQueue->QueryInterface(__uuidof(ISurfaceQueue), (void**)ppQueue);
+
+end:
+    if (FAILED(hr))
+    {
+        if (pSurfaceQueue)
+        {
+            delete pSurfaceQueue;
+        }
+        *ppQueue = NULL;
+    }
+
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+// Returns FALSE once the process has exited.  A process this one may not
+// open is still running.
+//-----------------------------------------------------------------------------
+static BOOL IsProcessRunning(DWORD ProcessId)
+{
+    HANDLE  hProcess    = OpenProcess(SYNCHRONIZE, FALSE, ProcessId);
+    BOOL    IsRunning;
+
+    if (hProcess == NULL)
+    {
+        return GetLastError() == ERROR_ACCESS_DENIED;
+    }
+    IsRunning = (WaitForSingleObject(hProcess, 0) == WAIT_TIMEOUT);
+    CloseHandle(hProcess);
+    return IsRunning;
+}
+
+//-----------------------------------------------------------------------------
+// Records this process as the owner of a producer or consumer of a ring.
+// Fails while another endpoint of a running process owns it; the endpoint of
+// a process that exited without closing it is taken over.
+//-----------------------------------------------------------------------------
+static BOOL ClaimRingEndpoint(volatile LONG* pOwner)
+{
+    LONG Self = (LONG)GetCurrentProcessId();
+
+    for (;;)
+    {
+        LONG Owner = *pOwner;
+
+        if (Owner != 0 && (Owner == Self || IsProcessRunning((DWORD)Owner)))
+        {
+            return FALSE;
+        }
+        if (InterlockedCompareExchange(pOwner, Self, Owner) == Owner)
+        {
+            return TRUE;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void ReleaseRingEndpoint(volatile LONG* pOwner)
+{
+    InterlockedCompareExchange(pOwner, 0, (LONG)GetCurrentProcessId());
+}
+
+//-----------------------------------------------------------------------------
+// CSharedSurfaceQueue implementation
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+CSharedSurfaceQueue::CSharedSurfaceQueue() :
+    m_RefCount(0),
+    m_hMapping(NULL),
+    m_pHeader(NULL),
+    m_Ring(0),
+    m_hSemaphore(NULL),
+    m_pRootQueue(NULL),
+    m_pCreator(NULL),
+    m_ppCreatedSurfaces(NULL)
+{
+    m_Name[0] = L'\0';
+}
+
+//-----------------------------------------------------------------------------
+CSharedSurfaceQueue::~CSharedSurfaceQueue()
+{
+    if (m_ppCreatedSurfaces)
+    {
+        for (UINT i = 0; i < m_pHeader->Desc.NumSurfaces; i++)
+        {
+            if (m_ppCreatedSurfaces[i])
+            {
+                m_ppCreatedSurfaces[i]->Release();
+            }
+        }
+        delete[] m_ppCreatedSurfaces;
+    }
+    if (m_pCreator)
+    {
+        delete m_pCreator;
+    }
+    if (m_hSemaphore)
+    {
+        CloseHandle(m_hSemaphore);
+    }
+    if (m_pHeader)
+    {
+        UnmapViewOfFile(m_pHeader);
+    }
+    if (m_hMapping)
+    {
+        CloseHandle(m_hMapping);
+    }
+    if (m_pRootQueue)
+    {
+        m_pRootQueue->Release();
+    }
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSharedSurfaceQueue::QueryInterface(REFIID id, void** ppInterface)
+{
+    *ppInterface = NULL;
+    if (id == __uuidof(ISurfaceQueue))
+    {
+        *reinterpret_cast<ISurfaceQueue**>(ppInterface) = this;
+        AddRef();
+        return S_OK;
+    }
+    else if (id == __uuidof(IUnknown))
+    {
+        *reinterpret_cast<ISurfaceQueue**>(ppInterface) = this;
+        AddRef();
+        return S_OK;
+    }
+    return E_NOINTERFACE;
+}
+
+ULONG CSharedSurfaceQueue::AddRef()
+{
+    return InterlockedIncrement(&m_RefCount);
+}
+
+ULONG CSharedSurfaceQueue::Release()
+{
+    ULONG RefCount = InterlockedDecrement(&m_RefCount);
+    if (RefCount == 0)
+    {
+        delete this;
+    }
+    return RefCount;
+}
+
+//-----------------------------------------------------------------------------
+DWORD CSharedSurfaceQueue::GetRingStride(const SURFACE_QUEUE_DESC* pDesc)
+{
+    return SharedQueueAlign(pDesc->NumSurfaces * sizeof(UINT) * 2 +
+                            pDesc->NumSurfaces * sizeof(SharedQueueDirtyRects) +
+                            pDesc->NumSurfaces * pDesc->MetaDataSize);
+}
+
+//-----------------------------------------------------------------------------
+void CSharedSurfaceQueue::GetSemaphoreName(LPCWSTR pName, UINT Ring, WCHAR* pBuffer)
+{
+    // The buffer is SHARED_SURFACE_QUEUE_MAX_NAME + 16 characters long
+    swprintf_s(pBuffer, SHARED_SURFACE_QUEUE_MAX_NAME + 16, L"%s.Ring%u", pName, Ring);
+}
+
+//-----------------------------------------------------------------------------
+SharedQueueSurfaceSlot* CSharedSurfaceQueue::GetSurfaceSlot(UINT i) const
+{
+    ASSERT(i < m_pHeader->Desc.NumSurfaces);
+
+    BYTE* pSlots = (BYTE*)m_pHeader + SharedQueueAlign(sizeof(SharedQueueHeader));
+    return (SharedQueueSurfaceSlot*)pSlots + i;
+}
+
+//-----------------------------------------------------------------------------
+UINT* CSharedSurfaceQueue::GetRingEntries() const
+{
+    BYTE* pRings = (BYTE*)GetSurfaceSlot(0) +
+                   SharedQueueAlign(sizeof(SharedQueueSurfaceSlot) * m_pHeader->Desc.NumSurfaces);
+    return (UINT*)(pRings + m_pHeader->RingStride * m_Ring);
+}
+
+//-----------------------------------------------------------------------------
+UINT* CSharedSurfaceQueue::GetRingMetaDataSizes() const
+{
+    return GetRingEntries() + m_pHeader->Desc.NumSurfaces;
+}
+
+//-----------------------------------------------------------------------------
+SharedQueueDirtyRects* CSharedSurfaceQueue::GetRingDirtyRects(UINT Entry) const
+{
+    ASSERT(Entry < m_pHeader->Desc.NumSurfaces);
+
+    SharedQueueDirtyRects* pDirtyRects = (SharedQueueDirtyRects*)(GetRingMetaDataSizes() + m_pHeader->Desc.NumSurfaces);
+    return pDirtyRects + Entry;
+}
+
+//-----------------------------------------------------------------------------
+BYTE* CSharedSurfaceQueue::GetRingMetaData(UINT Entry) const
+{
+    ASSERT(Entry < m_pHeader->Desc.NumSurfaces);
+
+    BYTE* pMetaData = (BYTE*)(GetRingDirtyRects(0) + m_pHeader->Desc.NumSurfaces);
+    return pMetaData + Entry * m_pHeader->Desc.MetaDataSize;
+}
+
+//-----------------------------------------------------------------------------
+INT CSharedSurfaceQueue::FindSurfaceSlot(HANDLE hSharedHandle) const
+{
+    ULONGLONG Handle = (ULONGLONG)(ULONG_PTR)hSharedHandle;
+
+    for (UINT i = 0; i < m_pHeader->Desc.NumSurfaces; i++)
+    {
+        if (GetSurfaceSlot(i)->hSharedHandle == Handle)
+        {
+            return (INT)i;
+        }
+    }
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSharedSurfaceQueue::MapSegment()
+{
+    ASSERT(m_hMapping);
+
+    m_pHeader = (SharedQueueHeader*)MapViewOfFile(m_hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (m_pHeader == NULL)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSharedSurfaceQueue::InitializeRing(UINT Ring, UINT MetaDataSize, BOOL IsFull)
+{
+    //
+    // Called by the process that claimed the ring, before the ring is marked
+    // as created.  Nobody else can be using it yet.
+    //
+    HRESULT             hr      = S_OK;
+    SharedQueueRing*    pRing   = &m_pHeader->Rings[Ring];
+    UINT                n       = m_pHeader->Desc.NumSurfaces;
+    WCHAR               SemaphoreName[SHARED_SURFACE_QUEUE_MAX_NAME + 16];
+
+    m_Ring = Ring;
+
+    pRing->ProducerProcessId    = 0;
+    pRing->ConsumerProcessId    = 0;
+    pRing->MetaDataSize         = MetaDataSize;
+    pRing->Head         = 0;
+    pRing->Tail         = IsFull ? n : 0;
+
+    // A full ring holds every surface, in order, without meta data
+    for (UINT i = 0; i < n; i++)
+    {
+        GetRingEntries()[i]         = i;
+        GetRingMetaDataSizes()[i]   = 0;
+        BuildDirtyRectList(NULL, 0, m_pHeader->Desc.Width, m_pHeader->Desc.Height,
+                           GetRingDirtyRects(i)->Rects, &GetRingDirtyRects(i)->NumRects);
+    }
+
+    GetSemaphoreName(m_Name, Ring, SemaphoreName);
+    m_hSemaphore = CreateSemaphoreW(NULL, IsFull ? n : 0, n, SemaphoreName);
+    if (m_hSemaphore == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+    if (GetLastError() == ERROR_ALREADY_EXISTS)
+    {
+        // Left over from another network with the same name
+        hr = HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS);
+        goto end;
+    }
+
+    // Publish the ring
+    InterlockedExchange(&pRing->State, SHARED_RING_CREATED);
+
+end:
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSharedSurfaceQueue::Create(SURFACE_QUEUE_DESC* pDesc, IUnknown* pDevice, LPCWSTR pName)
+{
+    ASSERT(pDesc && pDevice && pName);
+
+    HRESULT hr          = S_OK;
+    DWORD   SegmentSize = 0;
+
+    if (wcslen(pName) >= SHARED_SURFACE_QUEUE_MAX_NAME)
+    {
+        return E_INVALIDARG;
+    }
+    wcscpy_s(m_Name, SHARED_SURFACE_QUEUE_MAX_NAME, pName);
+
+    SegmentSize = SharedQueueAlign(sizeof(SharedQueueHeader)) +
+                  SharedQueueAlign(sizeof(SharedQueueSurfaceSlot) * pDesc->NumSurfaces) +
+                  GetRingStride(pDesc) * SHARED_SURFACE_QUEUE_MAX_RINGS;
+
+    // The pages of a new mapping are zero filled
+    m_hMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, SegmentSize, m_Name);
+    if (m_hMapping == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+    if (GetLastError() == ERROR_ALREADY_EXISTS)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS);
+        goto end;
+    }
+
+    if (FAILED(hr = MapSegment()))
+    {
+        goto end;
+    }
+
+    m_pHeader->Version      = SHARED_SURFACE_QUEUE_VERSION;
+    m_pHeader->SegmentSize  = SegmentSize;
+    m_pHeader->RingStride   = GetRingStride(pDesc);
+    m_pHeader->Desc         = *pDesc;
+
+    // Nobody else can see the segment before it is published
+    m_pHeader->Rings[0].State = SHARED_RING_CLAIMED;
+
+    // Create the surfaces.  They start out FLUSHED on ring 0, ready to go.
+    hr = CreateDeviceWrapper(pDevice, &m_pCreator);
+    if (FAILED(hr))
+    {
+        goto end;
+    }
+
+    hr = m_SurfaceCharge.Acquire(pDevice, SURFACE_QUEUE_BUDGET_SURFACES, pDesc->Format,
+                                 pDesc->Width, pDesc->Height, pDesc->NumSurfaces);
+    if (FAILED(hr))
+    {
+        goto end;
+    }
+
+    m_ppCreatedSurfaces = new QUEUE_NOTHROW_SPECIFIER IUnknown*[pDesc->NumSurfaces];
+    if (!m_ppCreatedSurfaces)
+    {
+        hr = E_OUTOFMEMORY;
+        goto end;
+    }
+    ZeroMemory(m_ppCreatedSurfaces, sizeof(IUnknown*) * pDesc->NumSurfaces);
+
+    for (UINT i = 0; i < pDesc->NumSurfaces; i++)
+    {
+        HANDLE hSharedHandle = NULL;
+
+        if (FAILED(hr = m_pCreator->CreateSharedSurface(
+                                            pDesc->Width,
+                                            pDesc->Height,
+                                            pDesc->Format,
+                                            &m_ppCreatedSurfaces[i],
+                                            &hSharedHandle
+                                            )))
+        {
+            goto end;
+        }
+
+        GetSurfaceSlot(i)->hSharedHandle    = (ULONGLONG)(ULONG_PTR)hSharedHandle;
+        GetSurfaceSlot(i)->State            = SHARED_SURFACE_STATE_FLUSHED;
+    }
+
+    if (FAILED(hr = InitializeRing(0, pDesc->MetaDataSize, TRUE)))
+    {
+        goto end;
+    }
+
+    // Publish the segment
+    InterlockedExchange((volatile LONG*)&m_pHeader->Magic, SHARED_SURFACE_QUEUE_MAGIC);
+
+end:
+    // The object will get destroyed if this fails.  Cleanup will happen then.
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSharedSurfaceQueue::Open(LPCWSTR pName, UINT Ring, CSharedSurfaceQueue* pRootQueue)
+{
+    ASSERT(pName);
+
+    HRESULT hr = S_OK;
+    WCHAR   SemaphoreName[SHARED_SURFACE_QUEUE_MAX_NAME + 16];
+
+    if (wcslen(pName) >= SHARED_SURFACE_QUEUE_MAX_NAME)
+    {
+        return E_INVALIDARG;
+    }
+    wcscpy_s(m_Name, SHARED_SURFACE_QUEUE_MAX_NAME, pName);
+
+    if (pRootQueue)
+    {
+        m_pRootQueue = pRootQueue;
+        m_pRootQueue->AddRef();
+    }
+
+    m_hMapping = OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, m_Name);
+    if (m_hMapping == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+
+    if (FAILED(hr = MapSegment()))
+    {
+        goto end;
+    }
+
+    // The creator may still be filling in the segment
+    if (m_pHeader->Magic != SHARED_SURFACE_QUEUE_MAGIC)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_NOT_READY);
+        goto end;
+    }
+    if (m_pHeader->Version != SHARED_SURFACE_QUEUE_VERSION)
+    {
+        hr = E_FAIL;
+        goto end;
+    }
+    if (Ring >= SHARED_SURFACE_QUEUE_MAX_RINGS || m_pHeader->Rings[Ring].State != SHARED_RING_CREATED)
+    {
+        hr = E_INVALIDARG;
+        goto end;
+    }
+
+    m_Ring = Ring;
+
+    GetSemaphoreName(m_Name, Ring, SemaphoreName);
+    m_hSemaphore = OpenSemaphoreW(SYNCHRONIZE | SEMAPHORE_MODIFY_STATE, FALSE, SemaphoreName);
+    if (m_hSemaphore == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+
+end:
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSharedSurfaceQueue::OpenConsumer(
+                    IUnknown*              pDevice,
+                    ISurfaceConsumer**     ppConsumer)
+{
+    if (pDevice == NULL)
+    {
+        return E_INVALIDARG;
+    }
+    if (ppConsumer == NULL)
+    {
+        return E_INVALIDARG;
+    }
+
+    *ppConsumer = NULL;
+
+    HRESULT                 hr          = E_FAIL;
+    CSharedSurfaceConsumer* pConsumer   = new QUEUE_NOTHROW_SPECIFIER CSharedSurfaceConsumer();
+
+    if (pConsumer == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto end;
+    }
+
+    hr = pConsumer->Initialize(pDevice, this);
+    if (FAILED(hr))
+    {
+        goto end;
+    }
+
+    hr = pConsumer->QueryInterface(__uuidof(ISurfaceConsumer), (void**)ppConsumer);
+
+end:
+    if (FAILED(hr))
+    {
+        *ppConsumer = NULL;
+        if (pConsumer)
+        {
+            delete pConsumer;
+        }
+    }
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSharedSurfaceQueue::OpenProducer(
+                    IUnknown*              pDevice,
+                    ISurfaceProducer**     ppProducer)
+{
+    if (pDevice == NULL)
+    {
+        return E_INVALIDARG;
+    }
+    if (ppProducer == NULL)
+    {
+        return E_INVALIDARG;
+    }
+
+    *ppProducer = NULL;
+
+    HRESULT                 hr          = E_FAIL;
+    CSharedSurfaceProducer* pProducer   = new QUEUE_NOTHROW_SPECIFIER CSharedSurfaceProducer();
+
+    if (pProducer == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto end;
+    }
+
+    hr = pProducer->Initialize(pDevice, this);
+    if (FAILED(hr))
+    {
+        goto end;
+    }
+
+    hr = pProducer->QueryInterface(__uuidof(ISurfaceProducer), (void**)ppProducer);
+
+end:
+    if (FAILED(hr))
+    {
+        *ppProducer = NULL;
+        if (pProducer)
+        {
+            delete pProducer;
+        }
+    }
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSharedSurfaceQueue::Clone(
+                    SURFACE_QUEUE_CLONE_DESC*   pDesc,
+                    ISurfaceQueue**             ppQueue)
+{
+    if (!pDesc)
+    {
+        return E_INVALIDARG;
+    }
+    if (!ppQueue)
+    {
+        return E_INVALIDARG;
+    }
+    if (pDesc->Flags != 0)
+    {
+        return E_INVALIDARG;
+    }
+
+    // The ring layout is fixed when the segment is created
+    if (pDesc->MetaDataSize > m_pHeader->Desc.MetaDataSize)
+    {
+        return E_INVALIDARG;
+    }
+
+    *ppQueue    = NULL;
+    HRESULT     hr      = E_FAIL;
+    UINT        Ring;
+
+    // Claim the first free ring.  Other processes may be cloning at the same time.
+    for (Ring = 1; Ring < SHARED_SURFACE_QUEUE_MAX_RINGS; Ring++)
+    {
+        if (InterlockedCompareExchange(&m_pHeader->Rings[Ring].State, SHARED_RING_CLAIMED, SHARED_RING_FREE) == SHARED_RING_FREE)
+        {
+            break;
+        }
+    }
+    if (Ring == SHARED_SURFACE_QUEUE_MAX_RINGS)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    CSharedSurfaceQueue* pQueue = new QUEUE_NOTHROW_SPECIFIER CSharedSurfaceQueue();
+    if (!pQueue)
+    {
+        hr = E_OUTOFMEMORY;
+        goto end;
+    }
+
+    //
+    // Map the segment for the new queue and set the ring up through it.  Clones
+    // made in the creating process keep the creating queue, and with it the
+    // surfaces, alive.
+    //
+    wcscpy_s(pQueue->m_Name, SHARED_SURFACE_QUEUE_MAX_NAME, m_Name);
+    if (m_pRootQueue || m_pCreator)
+    {
+        pQueue->m_pRootQueue = m_pRootQueue ? m_pRootQueue : this;
+        pQueue->m_pRootQueue->AddRef();
+    }
+
+    pQueue->m_hMapping = OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, m_Name);
+    if (pQueue->m_hMapping == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+    if (FAILED(hr = pQueue->MapSegment()))
+    {
+        goto end;
+    }
+    if (FAILED(hr = pQueue->InitializeRing(Ring, pDesc->MetaDataSize, FALSE)))
+    {
+        goto end;
+    }
+
+    hr = pQueue->QueryInterface(__uuidof(ISurfaceQueue), (void**)ppQueue);
+
+end:
+    if (FAILED(hr))
+    {
+        if (pQueue)
+        {
+            delete pQueue;
+        }
+        *ppQueue = NULL;
+
+        // Give the ring back for the next Clone
+        InterlockedExchange(&m_pHeader->Rings[Ring].State, SHARED_RING_FREE);
+    }
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+// CSharedSurfaceConsumer implementation
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+CSharedSurfaceConsumer::CSharedSurfaceConsumer() :
+    m_RefCount(0),
+    m_pQueue(NULL),
+    m_pDevice(NULL),
+    m_IsAttached(FALSE),
+    m_ppSurfaces(NULL)
+{
+    InitializeCriticalSection(&m_lock);
+}
+
+//-----------------------------------------------------------------------------
+CSharedSurfaceConsumer::~CSharedSurfaceConsumer()
+{
+    if (m_ppSurfaces)
+    {
+        for (UINT i = 0; i < m_pQueue->GetDesc().NumSurfaces; i++)
+        {
+            if (m_ppSurfaces[i])
+            {
+                m_ppSurfaces[i]->Release();
+            }
+        }
+        delete[] m_ppSurfaces;
+    }
+    if (m_pDevice)
+    {
+        delete m_pDevice;
+    }
+    if (m_pQueue)
+    {
+        if (m_IsAttached)
+        {
+            ReleaseRingEndpoint(&m_pQueue->GetRing()->ConsumerProcessId);
+        }
+        m_pQueue->Release();
+    }
+    DeleteCriticalSection(&m_lock);
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSharedSurfaceConsumer::QueryInterface(REFIID id, void** ppInterface)
+{
+    *ppInterface = NULL;
+    if (id == __uuidof(ISurfaceConsumer))
+    {
+        *reinterpret_cast<ISurfaceConsumer**>(ppInterface) = this;
+        AddRef();
+        return S_OK;
+    }
+    else if (id == __uuidof(ISurfaceConsumer1))
+    {
+        *reinterpret_cast<ISurfaceConsumer1**>(ppInterface) = this;
+        AddRef();
+        return S_OK;
+    }
+    else if (id == __uuidof(IUnknown))
+    {
+        *reinterpret_cast<ISurfaceConsumer**>(ppInterface) = this;
+        AddRef();
+        return S_OK;
+    }
+    return E_NOINTERFACE;
+}
+
+ULONG CSharedSurfaceConsumer::AddRef()
+{
+    return InterlockedIncrement(&m_RefCount);
+}
+
+ULONG CSharedSurfaceConsumer::Release()
+{
+    ULONG RefCount = InterlockedDecrement(&m_RefCount);
+    if (RefCount == 0)
+    {
+        delete this;
+    }
+    return RefCount;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSharedSurfaceConsumer::Initialize(IUnknown* pDevice, CSharedSurfaceQueue* pQueue)
+{
+    ASSERT(pDevice && pQueue);
+    ASSERT(m_pQueue == NULL);
+
+    HRESULT                     hr      = S_OK;
+    const SURFACE_QUEUE_DESC&   desc    = pQueue->GetDesc();
+
+    m_pQueue = pQueue;
+    m_pQueue->AddRef();
+
+    // Only one consumer per ring, in any process
+    if (!ClaimRingEndpoint(&m_pQueue->GetRing()->ConsumerProcessId))
+    {
+        hr = E_INVALIDARG;
+        goto end;
+    }
+    m_IsAttached = TRUE;
+
+    if (FAILED(hr = CreateDeviceWrapper(pDevice, &m_pDevice)))
+    {
+        goto end;
+    }
+
+    m_ppSurfaces = new QUEUE_NOTHROW_SPECIFIER IUnknown*[desc.NumSurfaces];
+    if (!m_ppSurfaces)
+    {
+        hr = E_OUTOFMEMORY;
+        goto end;
+    }
+    ZeroMemory(m_ppSurfaces, sizeof(IUnknown*) * desc.NumSurfaces);
+
+    // As with regular queues, all the surfaces are opened up front
+    for (UINT i = 0; i < desc.NumSurfaces; i++)
+    {
+        HANDLE hSharedHandle = (HANDLE)(ULONG_PTR)m_pQueue->GetSurfaceSlot(i)->hSharedHandle;
+
+        if (FAILED(hr = m_pDevice->OpenSurface(hSharedHandle, (void**)&m_ppSurfaces[i],
+                                               desc.Width, desc.Height, desc.Format)))
+        {
+            goto end;
+        }
+    }
+
+end:
+    // The object will get destroyed if this fails.  Cleanup will happen then.
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSharedSurfaceConsumer::Dequeue(
+                        REFIID id,
+                        IUnknown** ppSurface,
+                        void*  pBuffer,
+                        UINT*  BufferSize,
+                        DWORD  dwTimeout)
+{
+    return DequeueSurface(id, ppSurface, pBuffer, BufferSize, NULL, NULL, dwTimeout);
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSharedSurfaceConsumer::DequeueDirty(
+                        REFIID id,
+                        IUnknown** ppSurface,
+                        void*  pBuffer,
+                        UINT*  BufferSize,
+                        RECT*  pDirtyRects,
+                        UINT*  pNumDirtyRects,
+                        DWORD  dwTimeout)
+{
+    if (pDirtyRects == NULL || pNumDirtyRects == NULL || *pNumDirtyRects == 0)
+    {
+        return E_INVALIDARG;
+    }
+    return DequeueSurface(id, ppSurface, pBuffer, BufferSize, pDirtyRects, pNumDirtyRects, dwTimeout);
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSharedSurfaceConsumer::DequeueSurface(
+                        REFIID id,
+                        IUnknown** ppSurface,
+                        void*  pBuffer,
+                        UINT*  BufferSize,
+                        RECT*  pDirtyRects,
+                        UINT*  pNumDirtyRects,
+                        DWORD  dwTimeout)
+{
+    if (ppSurface == NULL)
+    {
+        return E_INVALIDARG;
+    }
+    if (!pBuffer && BufferSize)
+    {
+        return E_INVALIDARG;
+    }
+    if (pBuffer)
+    {
+        if (!BufferSize || *BufferSize == 0)
+        {
+            return E_INVALIDARG;
+        }
+        if (*BufferSize > m_pQueue->GetRing()->MetaDataSize)
+        {
+            return E_INVALIDARG;
+        }
+    }
+
+    *ppSurface = NULL;
+
+    HRESULT             hr      = S_OK;
+    SharedQueueRing*    pRing   = m_pQueue->GetRing();
+    UINT                n       = m_pQueue->GetDesc().NumSurfaces;
+    UINT                Entry;
+    UINT                Slot;
+    DWORD               dwWait;
+
+    EnterCriticalSection(&m_lock);
+
+    if (!m_pDevice->ValidateREFIID(id))
+    {
+        hr = E_INVALIDARG;
+        goto end;
+    }
+
+    // Wait until the producer flushed a surface onto the ring
+    dwWait = WaitForSingleObject(m_pQueue->GetSemaphore(), dwTimeout);
+    switch (dwWait)
+    {
+        case WAIT_OBJECT_0:
+            hr = S_OK;
+            break;
+        case WAIT_TIMEOUT:
+            hr = HRESULT_FROM_WIN32(WAIT_TIMEOUT);
+            break;
+        case WAIT_FAILED:
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        default:
+            hr = E_FAIL;
+            break;
+    }
+    if (FAILED(hr))
+    {
+        goto end;
+    }
+
+    Entry   = (UINT)pRing->Head % n;
+    Slot    = m_pQueue->GetRingEntries()[Entry];
+
+    if (Slot >= n)
+    {
+        // The segment is corrupt
+        hr = E_FAIL;
+        goto end;
+    }
+
+    ASSERT(m_pQueue->GetSurfaceSlot(Slot)->State == SHARED_SURFACE_STATE_FLUSHED);
+    InterlockedExchange(&m_pQueue->GetSurfaceSlot(Slot)->State, SHARED_SURFACE_STATE_DEQUEUED);
+
+    m_ppSurfaces[Slot]->AddRef();
+    *ppSurface = m_ppSurfaces[Slot];
+
+    if (BufferSize)
+    {
+        UINT MetaDataSize = min(m_pQueue->GetRingMetaDataSizes()[Entry], *BufferSize);
+        memcpy(pBuffer, m_pQueue->GetRingMetaData(Entry), MetaDataSize);
+        *BufferSize = MetaDataSize;
+    }
+
+    if (pNumDirtyRects)
+    {
+        // Another process wrote the count; don't read past the entry
+        const SharedQueueDirtyRects* pEntryRects = m_pQueue->GetRingDirtyRects(Entry);
+        UINT nEntryRects = min(pEntryRects->NumRects, (UINT)SURFACE_QUEUE_MAX_DIRTY_RECTS);
+
+        CopyDirtyRectList(pEntryRects->Rects, nEntryRects, pDirtyRects, pNumDirtyRects);
+    }
+
+    // Give the entry back to the producer
+    InterlockedIncrement(&pRing->Head);
+
+end:
+    LeaveCriticalSection(&m_lock);
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+// CSharedSurfaceProducer implementation
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+CSharedSurfaceProducer::CSharedSurfaceProducer() :
+    m_RefCount(0),
+    m_pQueue(NULL),
+    m_pDevice(NULL),
+    m_IsAttached(FALSE),
+    m_nStagingResources(0),
+    m_pStagingResources(NULL),
+    m_uiStagingResourceWidth(0),
+    m_uiStagingResourceHeight(0),
+    m_iCurrentResource(0),
+    m_pPending(NULL),
+    m_iPendingHead(0),
+    m_nPending(0)
+{
+    InitializeCriticalSection(&m_lock);
+}
+
+//-----------------------------------------------------------------------------
+CSharedSurfaceProducer::~CSharedSurfaceProducer()
+{
+    if (m_pStagingResources)
+    {
+        for (UINT i = 0; i < m_nStagingResources; i++)
+        {
+            if (m_pStagingResources[i])
+            {
+                m_pStagingResources[i]->Release();
+            }
+        }
+        delete[] m_pStagingResources;
+    }
+    if (m_pPending)
+    {
+        delete[] m_pPending;
+    }
+    if (m_pDevice)
+    {
+        delete m_pDevice;
+    }
+    if (m_pQueue)
+    {
+        if (m_IsAttached)
+        {
+            ReleaseRingEndpoint(&m_pQueue->GetRing()->ProducerProcessId);
+        }
+        m_pQueue->Release();
+    }
+    DeleteCriticalSection(&m_lock);
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSharedSurfaceProducer::QueryInterface(REFIID id, void** ppInterface)
+{
+    *ppInterface = NULL;
+    if (id == __uuidof(ISurfaceProducer))
+    {
+        *reinterpret_cast<ISurfaceProducer**>(ppInterface) = this;
+        AddRef();
+        return S_OK;
+    }
+    else if (id == __uuidof(ISurfaceProducer1))
+    {
+        *reinterpret_cast<ISurfaceProducer1**>(ppInterface) = this;
+        AddRef();
+        return S_OK;
+    }
+    else if (id == __uuidof(IUnknown))
+    {
+        *reinterpret_cast<ISurfaceProducer**>(ppInterface) = this;
+        AddRef();
+        return S_OK;
+    }
+    return E_NOINTERFACE;
+}
+
+ULONG CSharedSurfaceProducer::AddRef()
+{
+    return InterlockedIncrement(&m_RefCount);
+}
+
+ULONG CSharedSurfaceProducer::Release()
+{
+    ULONG RefCount = InterlockedDecrement(&m_RefCount);
+    if (RefCount == 0)
+    {
+        delete this;
+    }
+    return RefCount;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSharedSurfaceProducer::Initialize(IUnknown* pDevice, CSharedSurfaceQueue* pQueue)
+{
+    ASSERT(pDevice && pQueue);
+    ASSERT(m_pQueue == NULL);
+
+    HRESULT                     hr      = S_OK;
+    const SURFACE_QUEUE_DESC&   desc    = pQueue->GetDesc();
+
+    m_pQueue = pQueue;
+    m_pQueue->AddRef();
+
+    // Only one producer per ring, in any process
+    if (!ClaimRingEndpoint(&m_pQueue->GetRing()->ProducerProcessId))
+    {
+        hr = E_INVALIDARG;
+        goto end;
+    }
+    m_IsAttached = TRUE;
+
+    if (FAILED(hr = CreateDeviceWrapper(pDevice, &m_pDevice)))
+    {
+        goto end;
+    }
+
+    m_pPending = new QUEUE_NOTHROW_SPECIFIER PendingSurface[desc.NumSurfaces];
+    if (!m_pPending)
+    {
+        hr = E_OUTOFMEMORY;
+        goto end;
+    }
+
+    m_pStagingResources = new QUEUE_NOTHROW_SPECIFIER IUnknown*[desc.NumSurfaces];
+    if (!m_pStagingResources)
+    {
+        hr = E_OUTOFMEMORY;
+        goto end;
+    }
+    ZeroMemory(m_pStagingResources, sizeof(IUnknown*) * desc.NumSurfaces);
+    m_nStagingResources = desc.NumSurfaces;
+
+    m_uiStagingResourceWidth    = min(desc.Width, SHARED_SURFACE_COPY_SIZE);
+    m_uiStagingResourceHeight   = min(desc.Height, SHARED_SURFACE_COPY_SIZE);
+
+    if (FAILED(hr = m_StagingCharge.Acquire(pDevice, SURFACE_QUEUE_BUDGET_STAGING, desc.Format,
+                                            m_uiStagingResourceWidth, m_uiStagingResourceHeight,
+                                            m_nStagingResources)))
+    {
+        goto end;
+    }
+
+    for (UINT i = 0; i < m_nStagingResources; i++)
+    {
+        if (FAILED(hr = m_pDevice->CreateCopyResource(desc.Format, m_uiStagingResourceWidth,
+                                                      m_uiStagingResourceHeight, &(m_pStagingResources[i]))))
+        {
+            goto end;
+        }
+    }
+
+end:
+    // The object will get destroyed if this fails.  Cleanup will happen then.
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSharedSurfaceProducer::Enqueue(
+                        IUnknown*   pSurface,
+                        void*       pBuffer,
+                        UINT        BufferSize,
+                        DWORD       Flags )
+{
+    // The whole surface is dirty
+    return EnqueueDirty(pSurface, pBuffer, BufferSize, NULL, 0, Flags);
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSharedSurfaceProducer::EnqueueDirty(
+                        IUnknown*   pSurface,
+                        void*       pBuffer,
+                        UINT        BufferSize,
+                        const RECT* pDirtyRects,
+                        UINT        NumDirtyRects,
+                        DWORD       Flags )
+{
+    if (!pSurface)
+    {
+        return E_INVALIDARG;
+    }
+    if (Flags && Flags != SURFACE_QUEUE_FLAG_DO_NOT_WAIT)
+    {
+        return E_INVALIDARG;
+    }
+    if (BufferSize > m_pQueue->GetRing()->MetaDataSize || (BufferSize && !pBuffer))
+    {
+        return E_INVALIDARG;
+    }
+    if (NumDirtyRects && !pDirtyRects)
+    {
+        return E_INVALIDARG;
+    }
+
+    HRESULT                 hr              = S_OK;
+    SharedQueueRing*        pRing           = m_pQueue->GetRing();
+    UINT                    n               = m_pQueue->GetDesc().NumSurfaces;
+    HANDLE                  hSharedHandle   = NULL;
+    INT                     Slot;
+    UINT                    Entry;
+    IUnknown*               pStagingResource;
+    SharedQueueSurfaceSlot* pSlot;
+
+    EnterCriticalSection(&m_lock);
+
+    // Validate that this surface is one that can be part of this queue
+    if (FAILED(hr = m_pDevice->GetSharedHandle(pSurface, &hSharedHandle)))
+    {
+        goto end;
+    }
+
+    Slot = m_pQueue->FindSurfaceSlot(hSharedHandle);
+    if (Slot < 0)
+    {
+        hr = E_INVALIDARG;
+        goto end;
+    }
+
+    pSlot = m_pQueue->GetSurfaceSlot(Slot);
+    if (pSlot->State != SHARED_SURFACE_STATE_DEQUEUED)
+    {
+        hr = E_INVALIDARG;
+        goto end;
+    }
+
+    // Enqueuing onto a full ring is not a scenario that makes sense
+    if ((UINT)(pRing->Tail - pRing->Head) >= n)
+    {
+        hr = E_INVALIDARG;
+        goto end;
+    }
+
+    // Copy a small portion of the surface onto the staging surface
+    pStagingResource = m_pStagingResources[m_iCurrentResource];
+    if (FAILED(hr = m_pDevice->CopySurface(pStagingResource, pSurface,
+                                           m_uiStagingResourceWidth, m_uiStagingResourceHeight)))
+    {
+        goto end;
+    }
+
+    // Fill in the entry.  The consumer won't look at it before it is FLUSHED.
+    Entry = (UINT)pRing->Tail % n;
+    m_pQueue->GetRingEntries()[Entry]       = (UINT)Slot;
+    m_pQueue->GetRingMetaDataSizes()[Entry] = BufferSize;
+    if (BufferSize)
+    {
+        memcpy(m_pQueue->GetRingMetaData(Entry), pBuffer, BufferSize);
+    }
+    BuildDirtyRectList(pDirtyRects, NumDirtyRects, m_pQueue->GetDesc().Width, m_pQueue->GetDesc().Height,
+                       m_pQueue->GetRingDirtyRects(Entry)->Rects, &m_pQueue->GetRingDirtyRects(Entry)->NumRects);
+
+    InterlockedExchange(&pSlot->State, SHARED_SURFACE_STATE_ENQUEUED);
+    InterlockedIncrement(&pRing->Tail);
+
+    if (Flags & SURFACE_QUEUE_FLAG_DO_NOT_WAIT)
+    {
+        // Remember the staging resource for the flush
+        PendingSurface& pending = m_pPending[(m_iPendingHead + m_nPending) % n];
+        pending.Slot                = (UINT)Slot;
+        pending.pStagingResource    = pStagingResource;
+        m_nPending++;
+
+        m_iCurrentResource = (m_iCurrentResource + 1) % m_nStagingResources;
+
+        hr = DXGI_ERROR_WAS_STILL_DRAWING;
+        goto end;
+    }
+
+    // The surfaces already enqueued have to reach the consumer first
+    if (m_nPending)
+    {
+        hr = FlushPendingSurfaces(0);
+        ASSERT(SUCCEEDED(hr));
+    }
+
+    // Force rendering to complete by locking the staging resource.
+    if (FAILED(hr = m_pDevice->LockSurface(pStagingResource, 0)))
+    {
+        goto end;
+    }
+    if (FAILED(hr = m_pDevice->UnlockSurface(pStagingResource)))
+    {
+        goto end;
+    }
+
+    InterlockedExchange(&pSlot->State, SHARED_SURFACE_STATE_FLUSHED);
+    ReleaseSemaphore(m_pQueue->GetSemaphore(), 1, NULL);
+
+end:
+    LeaveCriticalSection(&m_lock);
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSharedSurfaceProducer::Flush(
+                        DWORD       Flags,
+                        UINT*       NumSurfaces )
+{
+    if (Flags && Flags != SURFACE_QUEUE_FLAG_DO_NOT_WAIT)
+    {
+        return E_INVALIDARG;
+    }
+
+    EnterCriticalSection(&m_lock);
+
+    HRESULT hr = FlushPendingSurfaces(Flags);
+
+    if (NumSurfaces)
+    {
+        *NumSurfaces = m_nPending;
+    }
+
+    LeaveCriticalSection(&m_lock);
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSharedSurfaceProducer::FlushPendingSurfaces(DWORD Flags)
+{
+    HRESULT hr  = S_OK;
+    UINT    n   = m_pQueue->GetDesc().NumSurfaces;
+
+    while (m_nPending)
+    {
+        PendingSurface& pending = m_pPending[m_iPendingHead];
+
+        // As soon as the first surface is not flushed, skip the remaining
+        if (FAILED(hr = m_pDevice->LockSurface(pending.pStagingResource, Flags)))
+        {
+            break;
+        }
+        hr = m_pDevice->UnlockSurface(pending.pStagingResource);
+        ASSERT(SUCCEEDED(hr));
+
+        InterlockedExchange(&m_pQueue->GetSurfaceSlot(pending.Slot)->State, SHARED_SURFACE_STATE_FLUSHED);
+        ReleaseSemaphore(m_pQueue->GetSemaphore(), 1, NULL);
+
+        m_iPendingHead = (m_iPendingHead + 1) % n;
+        m_nPending--;
+    }
+
+    return hr;
+}
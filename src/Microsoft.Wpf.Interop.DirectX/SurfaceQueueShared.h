@@ -0,0 +1,328 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#pragma once
+
+#include "SurfaceQueueImpl.h"
+
+//
+// Cross process surface queues.
+//
+// CreateSurfaceQueue keeps the queue state on the process heap, so both ends
+// of a queue have to live in the same process.  A shared queue keeps all of its
+// state in a named shared memory segment instead:
+//
+//      - the table of shared surfaces (their shared handles and states)
+//      - one ring per queue in the network, with the surface index and the meta
+//        data of every entry
+//
+// Each ring has a named semaphore that counts the FLUSHED surfaces on it, just
+// like the semaphore of a regular multithreaded queue.  Enqueue and Dequeue
+// only touch the segment and the semaphore; there is no other communication
+// between the processes per frame.
+//
+// The process that calls CreateSharedSurfaceQueue creates the surfaces and ring
+// 0, which starts out full.  Clone adds the first free ring to the segment, and
+// frees it again if it can't set the ring up.  Another process opens a ring by
+// name and index with OpenSharedSurfaceQueue, and then opens its producer or
+// consumer on it like on any other queue.  A typical setup is the host creating
+// ring 0 (renderer to host) and cloning ring 1 (host to renderer), and the
+// renderer opening both.
+//
+// The producers and consumers of shared queues answer QueryInterface for
+// ISurfaceProducer1 and ISurfaceConsumer1; the dirty rectangles are kept in
+// the ring with the meta data.  They are not the objects of CreateSurfaceQueue
+// though: they don't answer for ISurfaceConsumer2 or for the implementation
+// classes, so the async endpoints and the reactor fail on them with
+// E_NOINTERFACE.
+//
+// Shared queues are always multithreaded.  Each ring accepts one producer and
+// one consumer at a time, across all processes.  The ring records the process
+// that opened each of them, and a process that exits without closing its end
+// doesn't keep the next process from opening it, although the surfaces it held
+// are not recovered.  The creating process must keep its queue alive until the
+// other processes have opened their consumers.
+//
+
+// Maximum number of rings (queues) in a shared network
+#define SHARED_SURFACE_QUEUE_MAX_RINGS      (8)
+
+// Maximum length of the name of a shared queue, including the terminator
+#define SHARED_SURFACE_QUEUE_MAX_NAME       (200)
+
+HRESULT WINAPI CreateSharedSurfaceQueue( SURFACE_QUEUE_DESC*  pDesc,
+                                         IUnknown*            pDevice,
+                                         LPCWSTR              pName,
+                                         ISurfaceQueue**      ppQueue);
+
+HRESULT WINAPI OpenSharedSurfaceQueue(   LPCWSTR              pName,
+                                         UINT                 Ring,
+                                         ISurfaceQueue**      ppQueue);
+
+//
+// Layout of the shared memory segment.  Only fixed size types are used so that
+// 32 and 64 bit processes can share a queue.
+//
+//      SharedQueueHeader
+//      SharedQueueSurfaceSlot      Surfaces[NumSurfaces]
+//      for each ring:
+//          UINT                    Entries[NumSurfaces]
+//          UINT                    MetaDataSizes[NumSurfaces]
+//          SharedQueueDirtyRects   DirtyRects[NumSurfaces]
+//          BYTE                    MetaData[NumSurfaces][MetaDataSize]
+//
+struct SharedQueueSurfaceSlot
+{
+    // Shared handles of D3D surfaces are valid in every process
+    ULONGLONG                   hSharedHandle;
+
+    // SharedSurfaceState
+    volatile LONG               State;
+    LONG                        Reserved;
+};
+
+// SharedQueueRing::State
+#define SHARED_RING_FREE                (0)
+#define SHARED_RING_CLAIMED             (1)     // Being set up by Create or Clone
+#define SHARED_RING_CREATED             (2)
+
+// The dirty rectangles of a ring entry, as kept by BuildDirtyRectList
+struct SharedQueueDirtyRects
+{
+    UINT                        NumRects;
+    RECT                        Rects[SURFACE_QUEUE_MAX_DIRTY_RECTS];
+};
+
+struct SharedQueueRing
+{
+    volatile LONG               State;
+
+    // Ids of the processes that have the producer and the consumer open, or 0
+    volatile LONG               ProducerProcessId;
+    volatile LONG               ConsumerProcessId;
+    UINT                        MetaDataSize;
+
+    // Free running entry counters.  Head is only written by the consumer and
+    // Tail only by the producer.  Tail - Head is the number of entries.
+    volatile LONG               Head;
+    volatile LONG               Tail;
+};
+
+struct SharedQueueHeader
+{
+    // Set last by the creator.  Opening fails until it is set.
+    volatile DWORD              Magic;
+    DWORD                       Version;
+    DWORD                       SegmentSize;
+    DWORD                       RingStride;
+    SURFACE_QUEUE_DESC          Desc;
+    SharedQueueRing             Rings[SHARED_SURFACE_QUEUE_MAX_RINGS];
+};
+
+#define SHARED_SURFACE_QUEUE_MAGIC      (0x51535053)    // 'SPSQ'
+#define SHARED_SURFACE_QUEUE_VERSION    (2)
+
+class CSharedSurfaceQueue : public ISurfaceQueue
+{
+    // Com Functions
+    public:
+        STDMETHOD(  QueryInterface) (REFIID ID, void** ppInterface);
+        STDMETHOD_( ULONG, AddRef)();
+        STDMETHOD_( ULONG, Release)();
+
+    // ISurfaceQueue functions
+    public:
+        STDMETHOD (OpenProducer) (
+                                    IUnknown*                   pDevice,
+                                    ISurfaceProducer**          ppProducer
+                                 );
+
+        STDMETHOD (OpenConsumer) (
+                                    IUnknown*                   pDevice,
+                                    ISurfaceConsumer**          ppConsumer
+                                 );
+
+        STDMETHOD (Clone)        (
+                                    SURFACE_QUEUE_CLONE_DESC*   pDesc,
+                                    ISurfaceQueue**             ppQueue
+                                 );
+
+    // Implementation Functions
+    public:
+        CSharedSurfaceQueue();
+        ~CSharedSurfaceQueue();
+
+        // Creates the segment, the surfaces and ring 0.
+        HRESULT Create(SURFACE_QUEUE_DESC* pDesc, IUnknown* pDevice, LPCWSTR pName);
+
+        // Opens an existing ring.  pRootQueue is the creating queue when the ring
+        // is opened from the creating process, so it can keep the surfaces alive.
+        HRESULT Open(LPCWSTR pName, UINT Ring, CSharedSurfaceQueue* pRootQueue);
+
+        const SURFACE_QUEUE_DESC&   GetDesc() const     { return m_pHeader->Desc; }
+        SharedQueueRing*            GetRing() const     { return &m_pHeader->Rings[m_Ring]; }
+        HANDLE                      GetSemaphore() const { return m_hSemaphore; }
+
+        SharedQueueSurfaceSlot*     GetSurfaceSlot(UINT i) const;
+        UINT*                       GetRingEntries() const;
+        UINT*                       GetRingMetaDataSizes() const;
+        SharedQueueDirtyRects*      GetRingDirtyRects(UINT Entry) const;
+        BYTE*                       GetRingMetaData(UINT Entry) const;
+
+        // Returns the index of the surface with the shared handle, or -1
+        INT                         FindSurfaceSlot(HANDLE hSharedHandle) const;
+
+    private:
+        HRESULT MapSegment();
+        HRESULT InitializeRing(UINT Ring, UINT MetaDataSize, BOOL IsFull);
+
+        static DWORD GetRingStride(const SURFACE_QUEUE_DESC* pDesc);
+        static void  GetSemaphoreName(LPCWSTR pName, UINT Ring, WCHAR* pBuffer);
+
+    private:
+        LONG                                    m_RefCount;
+
+        WCHAR                                   m_Name[SHARED_SURFACE_QUEUE_MAX_NAME];
+        HANDLE                                  m_hMapping;
+        SharedQueueHeader*                      m_pHeader;
+        UINT                                    m_Ring;
+
+        // Counts the FLUSHED surfaces on the ring
+        HANDLE                                  m_hSemaphore;
+
+        // The creating queue, when it lives in this process
+        CSharedSurfaceQueue*                    m_pRootQueue;
+
+        // Only set on the creating queue
+        ISurfaceQueueDevice*                    m_pCreator;
+        IUnknown**                              m_ppCreatedSurfaces;
+        CBudgetCharge                           m_SurfaceCharge;
+};
+
+class CSharedSurfaceConsumer : public ISurfaceConsumer1
+{
+    // Com Interfaces
+    public:
+        STDMETHOD(  QueryInterface) (REFIID ID, void** ppInterface);
+        STDMETHOD_( ULONG, AddRef)();
+        STDMETHOD_( ULONG, Release)();
+
+    // Public Interfaces
+    public:
+        STDMETHOD (Dequeue) (
+                                REFIID id,
+                                IUnknown** ppSurface,
+                                void*  pBuffer,
+                                UINT*  BufferSize,
+                                DWORD  dwTimeout
+                            );
+
+        STDMETHOD (DequeueDirty) (
+                                REFIID id,
+                                IUnknown** ppSurface,
+                                void*  pBuffer,
+                                UINT*  BufferSize,
+                                RECT*  pDirtyRects,
+                                UINT*  pNumDirtyRects,
+                                DWORD  dwTimeout
+                            );
+    // Implementation
+    public:
+        CSharedSurfaceConsumer();
+        ~CSharedSurfaceConsumer();
+
+        HRESULT Initialize(IUnknown* pDevice, CSharedSurfaceQueue* pQueue);
+
+    private:
+        // Dequeue and DequeueDirty, without the dirty rectangles when
+        // pNumDirtyRects is NULL.
+        HRESULT DequeueSurface(REFIID id, IUnknown** ppSurface, void* pBuffer, UINT* BufferSize,
+                               RECT* pDirtyRects, UINT* pNumDirtyRects, DWORD dwTimeout);
+
+    private:
+        LONG                                m_RefCount;
+        CSharedSurfaceQueue*                m_pQueue;
+        ISurfaceQueueDevice*                m_pDevice;
+        BOOL                                m_IsAttached;
+
+        // The surfaces of the network opened with the consumer device, by slot
+        IUnknown**                          m_ppSurfaces;
+
+        CRITICAL_SECTION                    m_lock;
+};
+
+class CSharedSurfaceProducer : public ISurfaceProducer1
+{
+    // Com Interfaces
+    public:
+        STDMETHOD(  QueryInterface) (REFIID ID, void** ppInterface);
+        STDMETHOD_( ULONG, AddRef)();
+        STDMETHOD_( ULONG, Release)();
+
+    // Public Interfaces
+    public:
+        STDMETHOD (Enqueue) (
+                                IUnknown* pSurface,
+                                void*     pBuffer,
+                                UINT      BufferSize,
+                                DWORD     Flags
+                            );
+
+        STDMETHOD (EnqueueDirty) (
+                                IUnknown*   pSurface,
+                                void*       pBuffer,
+                                UINT        BufferSize,
+                                const RECT* pDirtyRects,
+                                UINT        NumDirtyRects,
+                                DWORD       Flags
+                            );
+
+        STDMETHOD (Flush)   (
+                                DWORD     Flags,
+                                UINT*     NumSurfaces
+                            );
+
+    // Implementation
+    public:
+        CSharedSurfaceProducer();
+        ~CSharedSurfaceProducer();
+
+        HRESULT Initialize(IUnknown* pDevice, CSharedSurfaceQueue* pQueue);
+
+    private:
+        // Flushes the surfaces enqueued with DO_NOT_WAIT, in order.
+        HRESULT FlushPendingSurfaces(DWORD Flags);
+
+    private:
+        LONG                        m_RefCount;
+        CSharedSurfaceQueue*        m_pQueue;
+        ISurfaceQueueDevice*        m_pDevice;
+        BOOL                        m_IsAttached;
+
+        CRITICAL_SECTION            m_lock;
+
+        // Circular buffer of staging resources, as in CSurfaceProducer
+        UINT                        m_nStagingResources;
+        IUnknown**                  m_pStagingResources;
+        UINT                        m_uiStagingResourceWidth;
+        UINT                        m_uiStagingResourceHeight;
+        UINT                        m_iCurrentResource;
+        CBudgetCharge               m_StagingCharge;
+
+        //
+        // The surfaces that are ENQUEUED but not FLUSHED.  The staging resources
+        // are local to this process, so unlike the ring this lives here.
+        //
+        struct PendingSurface
+        {
+            UINT                    Slot;
+            IUnknown*               pStagingResource;
+        };
+        PendingSurface*             m_pPending;
+        UINT                        m_iPendingHead;
+        UINT                        m_nPending;
+};
@@ -0,0 +1,64 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#pragma once
+
+#include "surfacequeue.h"
+
+//
+// Software (system memory) devices and surfaces.
+//
+// A software device can be passed to CreateSurfaceQueue, OpenProducer and
+// OpenConsumer wherever a D3D device is accepted.  Its surfaces are aligned
+// images in system memory and their shared handles index a process wide
+// table, so a queue network built on software devices runs without a GPU,
+// for example under Remote Desktop, on GPU-less machines or in tests.
+// Surfaces are dequeued as ISoftwareSurface.
+//
+// Software surfaces can only be shared with other software devices in the
+// same process.
+//
+
+// The bits and the pitch of software surfaces are aligned to this many bytes
+#define SOFTWARE_SURFACE_ALIGNMENT      (64)
+
+MIDL_INTERFACE("60AEB278-B007-4E01-B7A2-C78BC7188F18")
+ISoftwareSurface : public IUnknown
+{
+    public:
+        virtual void STDMETHODCALLTYPE GetDesc(
+            /* [out] */ UINT* pWidth,
+            /* [out] */ UINT* pHeight,
+            /* [out] */ DXGI_FORMAT* pFormat) = 0;
+
+        // Returns the bits of the surface.  Rows are *pPitch bytes apart.
+        virtual void* STDMETHODCALLTYPE GetBits(
+            /* [out] */ UINT* pPitch) = 0;
+
+        // Fails for surfaces that were not created shared.
+        virtual HRESULT STDMETHODCALLTYPE GetSharedHandle(
+            /* [out] */ HANDLE* pHandle) = 0;
+};
+
+MIDL_INTERFACE("39A8ADA0-EDFA-4D77-8604-D38FB0F4A18C")
+ISoftwareSurfaceDevice : public IUnknown
+{
+    public:
+        // Creates a surface that is private to the caller, for example to
+        // render into before copying to a queue surface.
+        virtual HRESULT STDMETHODCALLTYPE CreateSurface(
+            /* [in] */ UINT Width,
+            /* [in] */ UINT Height,
+            /* [in] */ DXGI_FORMAT Format,
+            /* [out] */ ISoftwareSurface** ppSurface) = 0;
+};
+
+HRESULT WINAPI CreateSoftwareSurfaceDevice(ISoftwareSurfaceDevice** ppDevice);
+
+// Returns the size of a pixel in bytes, or 0 for formats software surfaces
+// don't support.
+UINT GetSoftwareSurfaceFormatSize(DXGI_FORMAT Format);
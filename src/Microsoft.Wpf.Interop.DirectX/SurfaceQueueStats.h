@@ -0,0 +1,89 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#pragma once
+
+#include "surfacequeue.h"
+
+//
+// Queue statistics.
+//
+// The queue objects of CreateSurfaceQueue and Clone answer QueryInterface for
+// ISurfaceQueue1, which reports statistics about the queue.
+//
+// Lock profiling counts, for each lock of a queue, how often it was taken, how
+// often a caller had to wait for it and how long the waits took.  It is off by
+// default and can be switched on and off at any time; while it is off the
+// locks are taken without any bookkeeping.  Single threaded queues take no
+// locks and report zeros.
+//
+
+enum SURFACE_QUEUE_LOCK
+{
+    // Serializes the calls on the producer object
+    SURFACE_QUEUE_LOCK_PRODUCER = 0,
+    // Serializes the calls on the consumer object
+    SURFACE_QUEUE_LOCK_CONSUMER,
+    // Serializes opening and removing the producer and consumer, Clone and
+    // the notification changes
+    SURFACE_QUEUE_LOCK_STATE,
+    // State changes waiting for the Enqueue, Dequeue and Flush calls that
+    // could still see the old state
+    SURFACE_QUEUE_LOCK_EPOCH,
+    // Protects the FIFO of surfaces
+    SURFACE_QUEUE_LOCK_QUEUE,
+    // Dequeue waiting for a surface to be flushed into the queue
+    SURFACE_QUEUE_LOCK_SEMAPHORE,
+    SURFACE_QUEUE_NUM_LOCKS,
+};
+
+// Bucket 0 counts the waits under 1us, bucket i the waits of 2^(i-1) to
+// 2^i - 1us and the last bucket everything longer.
+#define SURFACE_QUEUE_WAIT_HISTOGRAM_BUCKETS    (20)
+
+struct SURFACE_QUEUE_LOCK_STATS
+{
+    ULONGLONG           Acquisitions;
+    // Times a caller found the lock taken (or the semaphore empty) and
+    // waited, including waits that timed out
+    ULONGLONG           Contentions;
+    ULONGLONG           TotalWaitMicroseconds;
+    ULONGLONG           WaitHistogram[SURFACE_QUEUE_WAIT_HISTOGRAM_BUCKETS];
+};
+
+struct SURFACE_QUEUE_STATS
+{
+    BOOL                        LockProfiling;
+    SURFACE_QUEUE_LOCK_STATS    Locks[SURFACE_QUEUE_NUM_LOCKS];
+
+    // Memory charged to the budget (see SurfaceQueueBudget.h) for the shared
+    // surfaces of the queue network and the staging resources of the producer
+    ULONGLONG                   SurfaceBytes;
+    ULONGLONG                   StagingBytes;
+
+    // Enqueues that skipped the copy to a staging resource and its lock
+    // because the producer and consumer are the same device, whose commands
+    // already run in order
+    ULONGLONG                   SameDeviceEnqueues;
+};
+
+MIDL_INTERFACE("FAEDE723-0651-4702-945B-34FDA9C89CD2")
+ISurfaceQueue1 : public ISurfaceQueue
+{
+    public:
+        // Switches the lock profiling of the queue on or off.  The counters
+        // keep their values while it is off.
+        virtual HRESULT STDMETHODCALLTYPE SetLockProfiling(
+            /* [in] */ BOOL Enable) = 0;
+
+        // The counters are read without stopping the queue, so they can be
+        // slightly out of step with each other while calls are in flight.
+        virtual HRESULT STDMETHODCALLTYPE GetStats(
+            /* [out] */ SURFACE_QUEUE_STATS* pStats) = 0;
+
+        virtual HRESULT STDMETHODCALLTYPE ResetStats() = 0;
+};
@@ -0,0 +1,48 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#pragma once
+
+#include "surfacequeue.h"
+#include "SurfaceQueueDirtyRects.h"
+
+//
+// Surface data.
+//
+// Dequeue hands out the surface as the interface asked for by id.  The
+// consumer keeps each interface it handed out for each surface, so dequeuing
+// the surface again costs no QueryInterface.
+//
+// Objects made from a surface, such as a view of it or the level of a texture,
+// can be attached to the surface under a GUID of the caller's choice and found
+// again whenever the surface is dequeued.  They belong to the consumer: they
+// are released with it, and another consumer of the same surface does not see
+// them.
+//
+// The consumer objects of CreateSurfaceQueue answer QueryInterface for this
+// interface.
+//
+
+MIDL_INTERFACE("80FC8D26-6C01-4714-9FD2-0764C3EC8983")
+ISurfaceConsumer2 : public ISurfaceConsumer1
+{
+    public:
+        // Attaches pData to a surface of the queue, as dequeued by this
+        // consumer, in place of what was attached under Key.  The consumer
+        // holds a reference to it.  NULL removes it.
+        virtual HRESULT STDMETHODCALLTYPE SetSurfaceData(
+            /* [in] */ IUnknown* pSurface,
+            /* [in] */ REFGUID Key,
+            /* [in] */ IUnknown* pData) = 0;
+
+        // Gets what is attached to the surface under Key, with a reference.
+        // Fails with DXGI_ERROR_NOT_FOUND if nothing is.
+        virtual HRESULT STDMETHODCALLTYPE GetSurfaceData(
+            /* [in] */ IUnknown* pSurface,
+            /* [in] */ REFGUID Key,
+            /* [out] */ IUnknown** ppData) = 0;
+};
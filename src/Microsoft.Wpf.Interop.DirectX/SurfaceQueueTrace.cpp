@@ -0,0 +1,768 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#include <new>
+#include <limits.h>
+#include "SurfaceQueueImpl.h"
+#include "SurfaceQueueTrace.h"
+
+//
+// Records are collected in a buffer and written out when it fills up, so a
+// traced call costs a copy under a lock rather than a write to the file.
+//
+#define SURFACE_QUEUE_TRACE_BUFFER_SIZE     (64 * 1024)
+
+volatile LONG           g_SurfaceQueueTraceEnabled  = 0;
+
+static volatile LONG    g_LastTraceQueue            = 0;
+
+// Protects everything below
+static SRWLOCK          g_TraceLock                 = SRWLOCK_INIT;
+static HANDLE           g_hTraceFile                = INVALID_HANDLE_VALUE;
+static BYTE*            g_pTraceBuffer              = NULL;
+static UINT             g_TraceBufferUsed           = 0;
+// The first write that failed; the records after it are dropped
+static HRESULT          g_hrTrace                   = S_OK;
+
+//-----------------------------------------------------------------------------
+// The caller holds g_TraceLock.
+//-----------------------------------------------------------------------------
+static void FlushTraceBuffer()
+{
+    DWORD Written;
+
+    if (g_TraceBufferUsed && SUCCEEDED(g_hrTrace))
+    {
+        if (!WriteFile(g_hTraceFile, g_pTraceBuffer, g_TraceBufferUsed, &Written, NULL))
+        {
+            g_hrTrace = HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+    g_TraceBufferUsed = 0;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI StartSurfaceQueueTrace(LPCWSTR pPath)
+{
+    if (pPath == NULL)
+    {
+        return E_INVALIDARG;
+    }
+
+    HRESULT                 hr = S_OK;
+    SurfaceQueueTraceHeader Header;
+    LARGE_INTEGER           Frequency;
+    LARGE_INTEGER           Now;
+
+    AcquireSRWLockExclusive(&g_TraceLock);
+
+    if (g_hTraceFile != INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_BUSY);
+        goto end;
+    }
+
+    g_pTraceBuffer = new QUEUE_NOTHROW_SPECIFIER BYTE[SURFACE_QUEUE_TRACE_BUFFER_SIZE];
+    if (!g_pTraceBuffer)
+    {
+        hr = E_OUTOFMEMORY;
+        goto end;
+    }
+
+    g_hTraceFile = CreateFileW(pPath, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                               CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (g_hTraceFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Now);
+
+    Header.Magic                = SURFACE_QUEUE_TRACE_MAGIC;
+    Header.Version              = SURFACE_QUEUE_TRACE_VERSION;
+    Header.TimestampFrequency   = Frequency.QuadPart;
+    Header.StartTimestamp       = Now.QuadPart;
+
+    memcpy(g_pTraceBuffer, &Header, sizeof(Header));
+    g_TraceBufferUsed   = sizeof(Header);
+    g_hrTrace           = S_OK;
+
+    InterlockedExchange(&g_SurfaceQueueTraceEnabled, 1);
+
+end:
+    if (FAILED(hr) && hr != HRESULT_FROM_WIN32(ERROR_BUSY))
+    {
+        if (g_pTraceBuffer)
+        {
+            delete[] g_pTraceBuffer;
+            g_pTraceBuffer = NULL;
+        }
+    }
+
+    ReleaseSRWLockExclusive(&g_TraceLock);
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI StopSurfaceQueueTrace()
+{
+    HRESULT hr;
+
+    AcquireSRWLockExclusive(&g_TraceLock);
+
+    if (g_hTraceFile == INVALID_HANDLE_VALUE)
+    {
+        ReleaseSRWLockExclusive(&g_TraceLock);
+        return E_INVALIDARG;
+    }
+
+    // Calls already past the check are dropped once they get the lock
+    InterlockedExchange(&g_SurfaceQueueTraceEnabled, 0);
+
+    FlushTraceBuffer();
+    CloseHandle(g_hTraceFile);
+    g_hTraceFile = INVALID_HANDLE_VALUE;
+
+    delete[] g_pTraceBuffer;
+    g_pTraceBuffer = NULL;
+
+    hr = g_hrTrace;
+
+    ReleaseSRWLockExclusive(&g_TraceLock);
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+UINT SurfaceQueueTraceNewQueue()
+{
+    return (UINT)InterlockedIncrement(&g_LastTraceQueue);
+}
+
+//-----------------------------------------------------------------------------
+void SurfaceQueueTraceCall(
+                SURFACE_QUEUE_TRACE_CALL    Call,
+                UINT                        Queue,
+                LONGLONG                    Start,
+                HRESULT                     hr,
+                DWORD                       Flags,
+                UINT                        Surface,
+                UINT                        Param,
+                const void*                 pPayload,
+                UINT                        PayloadSize)
+{
+    ASSERT(Start);
+    ASSERT(sizeof(SurfaceQueueTraceRecord) + PayloadSize <= SURFACE_QUEUE_TRACE_BUFFER_SIZE);
+
+    SurfaceQueueTraceRecord Record;
+    LARGE_INTEGER           Now;
+    LONGLONG                Duration;
+
+    QueryPerformanceCounter(&Now);
+    Duration = Now.QuadPart - Start;
+
+    Record.Size         = (WORD)(sizeof(Record) + PayloadSize);
+    Record.Call         = (BYTE)Call;
+    Record.Reserved     = 0;
+    Record.Queue        = Queue;
+    Record.Timestamp    = Start;
+    Record.Duration     = Duration > UINT_MAX ? UINT_MAX : (UINT)Duration;
+    Record.ThreadId     = GetCurrentThreadId();
+    Record.Result       = hr;
+    Record.Flags        = Flags;
+    Record.Surface      = Surface;
+    Record.Param        = Param;
+
+    AcquireSRWLockExclusive(&g_TraceLock);
+
+    if (g_hTraceFile != INVALID_HANDLE_VALUE)
+    {
+        if (g_TraceBufferUsed + Record.Size > SURFACE_QUEUE_TRACE_BUFFER_SIZE)
+        {
+            FlushTraceBuffer();
+        }
+
+        memcpy(g_pTraceBuffer + g_TraceBufferUsed, &Record, sizeof(Record));
+        if (PayloadSize)
+        {
+            memcpy(g_pTraceBuffer + g_TraceBufferUsed + sizeof(Record), pPayload, PayloadSize);
+        }
+        g_TraceBufferUsed += Record.Size;
+    }
+
+    ReleaseSRWLockExclusive(&g_TraceLock);
+}
+
+//-----------------------------------------------------------------------------
+// Replay
+//-----------------------------------------------------------------------------
+
+class CSurfaceQueueReplay
+{
+    public:
+        CSurfaceQueueReplay();
+        ~CSurfaceQueueReplay();
+
+        HRESULT Run(LPCWSTR pPath, DWORD Flags, SURFACE_QUEUE_REPLAY_STATS* pStats);
+
+    private:
+        struct ReplayQueue
+        {
+            // Number of the queue in the trace, and of its root queue
+            UINT                Id;
+            UINT                Root;
+            UINT                MetaDataSize;
+            ISurfaceQueue*      pQueue;
+            ISurfaceProducer*   pProducer;
+            ISurfaceConsumer*   pConsumer;
+
+            // The surfaces of the network by their index, as last dequeued;
+            // only kept by root queues
+            IUnknown**          ppSurfaces;
+            UINT                NumSurfaces;
+        };
+
+        HRESULT Issue(const SurfaceQueueTraceRecord* pRecord, const BYTE* pPayload, BOOL* pSkipped);
+
+        HRESULT AddQueue(UINT Id, UINT Root, UINT MetaDataSize, UINT NumSurfaces, ISurfaceQueue* pQueue);
+        ReplayQueue* FindQueue(UINT Id);
+        void ReleaseQueue(ReplayQueue* pQueue);
+        HRESULT EnsureScratch(UINT Size);
+
+    private:
+        ISoftwareSurfaceDevice*             m_pDevice;
+
+        ReplayQueue*                        m_pQueues;
+        UINT                                m_nQueues;
+        UINT                                m_nMaxQueues;
+
+        // Meta data handed to Enqueue and Dequeue
+        BYTE*                               m_pScratch;
+        UINT                                m_ScratchSize;
+};
+
+//-----------------------------------------------------------------------------
+CSurfaceQueueReplay::CSurfaceQueueReplay() :
+    m_pDevice(NULL),
+    m_pQueues(NULL),
+    m_nQueues(0),
+    m_nMaxQueues(0),
+    m_pScratch(NULL),
+    m_ScratchSize(0)
+{
+}
+
+//-----------------------------------------------------------------------------
+CSurfaceQueueReplay::~CSurfaceQueueReplay()
+{
+    // Clones first, the roots own the surfaces
+    for (UINT i = 0; i < m_nQueues; i++)
+    {
+        if (m_pQueues[i].Id != m_pQueues[i].Root)
+        {
+            ReleaseQueue(&m_pQueues[i]);
+        }
+    }
+    for (UINT i = 0; i < m_nQueues; i++)
+    {
+        ReleaseQueue(&m_pQueues[i]);
+    }
+    if (m_pQueues)
+    {
+        delete[] m_pQueues;
+    }
+    if (m_pScratch)
+    {
+        delete[] m_pScratch;
+    }
+    if (m_pDevice)
+    {
+        m_pDevice->Release();
+    }
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueueReplay::AddQueue(UINT Id, UINT Root, UINT MetaDataSize, UINT NumSurfaces, ISurfaceQueue* pQueue)
+{
+    if (m_nQueues == m_nMaxQueues)
+    {
+        UINT            nMaxQueues  = m_nMaxQueues ? m_nMaxQueues * 2 : 8;
+        ReplayQueue*    pQueues     = new QUEUE_NOTHROW_SPECIFIER ReplayQueue[nMaxQueues];
+
+        if (!pQueues)
+        {
+            return E_OUTOFMEMORY;
+        }
+        if (m_pQueues)
+        {
+            memcpy(pQueues, m_pQueues, sizeof(ReplayQueue) * m_nQueues);
+            delete[] m_pQueues;
+        }
+        m_pQueues       = pQueues;
+        m_nMaxQueues    = nMaxQueues;
+    }
+
+    ReplayQueue* pEntry = &m_pQueues[m_nQueues];
+    ZeroMemory(pEntry, sizeof(ReplayQueue));
+
+    if (NumSurfaces)
+    {
+        pEntry->ppSurfaces = new QUEUE_NOTHROW_SPECIFIER IUnknown*[NumSurfaces];
+        if (!pEntry->ppSurfaces)
+        {
+            return E_OUTOFMEMORY;
+        }
+        ZeroMemory(pEntry->ppSurfaces, sizeof(IUnknown*) * NumSurfaces);
+        pEntry->NumSurfaces = NumSurfaces;
+    }
+
+    pEntry->Id              = Id;
+    pEntry->Root            = Root;
+    pEntry->MetaDataSize    = MetaDataSize;
+    pEntry->pQueue          = pQueue;
+    m_nQueues++;
+
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+CSurfaceQueueReplay::ReplayQueue* CSurfaceQueueReplay::FindQueue(UINT Id)
+{
+    for (UINT i = 0; i < m_nQueues; i++)
+    {
+        if (m_pQueues[i].Id == Id && m_pQueues[i].pQueue)
+        {
+            return &m_pQueues[i];
+        }
+    }
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceQueueReplay::ReleaseQueue(ReplayQueue* pQueue)
+{
+    for (UINT i = 0; i < pQueue->NumSurfaces; i++)
+    {
+        if (pQueue->ppSurfaces[i])
+        {
+            pQueue->ppSurfaces[i]->Release();
+        }
+    }
+    if (pQueue->ppSurfaces)
+    {
+        delete[] pQueue->ppSurfaces;
+        pQueue->ppSurfaces  = NULL;
+        pQueue->NumSurfaces = 0;
+    }
+    if (pQueue->pProducer)
+    {
+        pQueue->pProducer->Release();
+        pQueue->pProducer = NULL;
+    }
+    if (pQueue->pConsumer)
+    {
+        pQueue->pConsumer->Release();
+        pQueue->pConsumer = NULL;
+    }
+    if (pQueue->pQueue)
+    {
+        pQueue->pQueue->Release();
+        pQueue->pQueue = NULL;
+    }
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueueReplay::EnsureScratch(UINT Size)
+{
+    if (Size <= m_ScratchSize)
+    {
+        return S_OK;
+    }
+
+    BYTE* pScratch = new QUEUE_NOTHROW_SPECIFIER BYTE[Size];
+    if (!pScratch)
+    {
+        return E_OUTOFMEMORY;
+    }
+    ZeroMemory(pScratch, Size);
+
+    if (m_pScratch)
+    {
+        delete[] m_pScratch;
+    }
+    m_pScratch      = pScratch;
+    m_ScratchSize   = Size;
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+// Issues the call of one record.  *pSkipped is set when the call could not be
+// made.
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueueReplay::Issue(const SurfaceQueueTraceRecord* pRecord, const BYTE* pPayload, BOOL* pSkipped)
+{
+    HRESULT         hr;
+    UINT            PayloadSize = pRecord->Size - sizeof(SurfaceQueueTraceRecord);
+    ReplayQueue*    pQueue      = NULL;
+    ReplayQueue*    pRoot       = NULL;
+
+    *pSkipped = FALSE;
+
+    if (pRecord->Call == SURFACE_QUEUE_TRACE_CREATE)
+    {
+        SURFACE_QUEUE_DESC  Desc;
+        ISurfaceQueue*      pNewQueue = NULL;
+
+        // Creations that failed when traced left nothing to replay against
+        if (PayloadSize < sizeof(Desc) || FAILED(pRecord->Result))
+        {
+            *pSkipped = TRUE;
+            return S_OK;
+        }
+        memcpy(&Desc, pPayload, sizeof(Desc));
+
+        if (FAILED(hr = EnsureScratch(Desc.MetaDataSize)))
+        {
+            return hr;
+        }
+        if (FAILED(hr = CreateSurfaceQueue(&Desc, m_pDevice, &pNewQueue)))
+        {
+            return hr;
+        }
+        if (FAILED(hr = AddQueue(pRecord->Queue, pRecord->Queue, Desc.MetaDataSize, Desc.NumSurfaces, pNewQueue)))
+        {
+            pNewQueue->Release();
+        }
+        return hr;
+    }
+
+    pQueue = FindQueue(pRecord->Queue);
+    if (!pQueue)
+    {
+        *pSkipped = TRUE;
+        return S_OK;
+    }
+    pRoot = FindQueue(pQueue->Root);
+
+    switch (pRecord->Call)
+    {
+        case SURFACE_QUEUE_TRACE_CLONE:
+        {
+            SURFACE_QUEUE_CLONE_DESC    Desc;
+            ISurfaceQueue*              pNewQueue = NULL;
+
+            if (PayloadSize < sizeof(Desc) || FAILED(pRecord->Result))
+            {
+                *pSkipped = TRUE;
+                return S_OK;
+            }
+            memcpy(&Desc, pPayload, sizeof(Desc));
+
+            if (FAILED(hr = EnsureScratch(Desc.MetaDataSize)))
+            {
+                return hr;
+            }
+            if (FAILED(hr = pQueue->pQueue->Clone(&Desc, &pNewQueue)))
+            {
+                return hr;
+            }
+
+            // AddQueue can move the queues, pQueue is stale after it
+            if (FAILED(hr = AddQueue(pRecord->Param, pQueue->Root, Desc.MetaDataSize, 0, pNewQueue)))
+            {
+                pNewQueue->Release();
+            }
+            return hr;
+        }
+
+        case SURFACE_QUEUE_TRACE_OPEN_PRODUCER:
+            if (pQueue->pProducer)
+            {
+                pQueue->pProducer->Release();
+                pQueue->pProducer = NULL;
+            }
+            return pQueue->pQueue->OpenProducer(m_pDevice, &pQueue->pProducer);
+
+        case SURFACE_QUEUE_TRACE_OPEN_CONSUMER:
+            if (pQueue->pConsumer)
+            {
+                pQueue->pConsumer->Release();
+                pQueue->pConsumer = NULL;
+            }
+            return pQueue->pQueue->OpenConsumer(m_pDevice, &pQueue->pConsumer);
+
+        case SURFACE_QUEUE_TRACE_ENQUEUE:
+        {
+            IUnknown* pSurface = NULL;
+
+            if (pRoot && pRecord->Surface < pRoot->NumSurfaces)
+            {
+                pSurface = pRoot->ppSurfaces[pRecord->Surface];
+            }
+            if (!pQueue->pProducer || !pSurface || pRecord->Param > m_ScratchSize)
+            {
+                *pSkipped = TRUE;
+                return S_OK;
+            }
+            return pQueue->pProducer->Enqueue(pSurface, pRecord->Param ? m_pScratch : NULL,
+                                              pRecord->Param, pRecord->Flags);
+        }
+
+        case SURFACE_QUEUE_TRACE_DEQUEUE:
+        {
+            IUnknown*   pSurface        = NULL;
+            UINT        MetaDataSize    = pQueue->MetaDataSize;
+
+            if (!pQueue->pConsumer)
+            {
+                *pSkipped = TRUE;
+                return S_OK;
+            }
+
+            hr = pQueue->pConsumer->Dequeue(__uuidof(ISoftwareSurface), &pSurface,
+                                            MetaDataSize ? m_pScratch : NULL,
+                                            MetaDataSize ? &MetaDataSize : NULL, 0);
+            if (SUCCEEDED(hr))
+            {
+                // Keep the surface under the index it had when traced, that is
+                // what the Enqueue records refer to
+                if (pRoot && pRecord->Surface < pRoot->NumSurfaces)
+                {
+                    IUnknown** ppSlot = &pRoot->ppSurfaces[pRecord->Surface];
+                    if (*ppSlot)
+                    {
+                        (*ppSlot)->Release();
+                    }
+                    *ppSlot = pSurface;
+                }
+                else
+                {
+                    pSurface->Release();
+                }
+            }
+            return hr;
+        }
+
+        case SURFACE_QUEUE_TRACE_FLUSH:
+        {
+            UINT Remaining;
+
+            if (!pQueue->pProducer)
+            {
+                *pSkipped = TRUE;
+                return S_OK;
+            }
+            return pQueue->pProducer->Flush(pRecord->Flags, &Remaining);
+        }
+
+        case SURFACE_QUEUE_TRACE_DESTROY:
+            // The surfaces of a root outlive its clones, which hold references
+            // to it
+            if (pQueue->Id == pQueue->Root)
+            {
+                for (UINT i = 0; i < m_nQueues; i++)
+                {
+                    if (m_pQueues[i].Root == pQueue->Id && m_pQueues[i].Id != pQueue->Id)
+                    {
+                        ReleaseQueue(&m_pQueues[i]);
+                    }
+                }
+            }
+            ReleaseQueue(pQueue);
+            return S_OK;
+
+        default:
+            *pSkipped = TRUE;
+            return S_OK;
+    }
+}
+
+//-----------------------------------------------------------------------------
+HRESULT CSurfaceQueueReplay::Run(LPCWSTR pPath, DWORD Flags, SURFACE_QUEUE_REPLAY_STATS* pStats)
+{
+    HRESULT                         hr          = S_OK;
+    HANDLE                          hFile       = INVALID_HANDLE_VALUE;
+    HANDLE                          hMapping    = NULL;
+    const BYTE*                     pBase       = NULL;
+    const SurfaceQueueTraceHeader*  pHeader;
+    LARGE_INTEGER                   Size;
+    LARGE_INTEGER                   Frequency;
+    LARGE_INTEGER                   ReplayStart;
+    LONGLONG                        TraceStart  = 0;
+    ULONGLONG                       Offset;
+
+    ZeroMemory(pStats, sizeof(*pStats));
+
+    if (FAILED(hr = CreateSoftwareSurfaceDevice(&m_pDevice)))
+    {
+        goto end;
+    }
+
+    hFile = CreateFileW(pPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+    if (!GetFileSizeEx(hFile, &Size))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+    if ((ULONGLONG)Size.QuadPart < sizeof(SurfaceQueueTraceHeader) || (ULONGLONG)Size.QuadPart > (SIZE_T)-1)
+    {
+        hr = E_FAIL;
+        goto end;
+    }
+
+    hMapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!hMapping)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+    pBase = (const BYTE*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (!pBase)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+
+    pHeader = (const SurfaceQueueTraceHeader*)pBase;
+    if (pHeader->Magic != SURFACE_QUEUE_TRACE_MAGIC || pHeader->Version != SURFACE_QUEUE_TRACE_VERSION ||
+        pHeader->TimestampFrequency <= 0)
+    {
+        hr = E_FAIL;
+        goto end;
+    }
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&ReplayStart);
+    pStats->TimestampFrequency = Frequency.QuadPart;
+
+    for (Offset = sizeof(SurfaceQueueTraceHeader);
+         Offset + sizeof(SurfaceQueueTraceRecord) <= (ULONGLONG)Size.QuadPart; )
+    {
+        SurfaceQueueTraceRecord Record;
+        LARGE_INTEGER           Before;
+        LARGE_INTEGER           After;
+        BOOL                    Skipped;
+        HRESULT                 hrCall;
+
+        memcpy(&Record, pBase + Offset, sizeof(Record));
+        if (Record.Size < sizeof(Record) || Offset + Record.Size > (ULONGLONG)Size.QuadPart ||
+            Record.Call >= SURFACE_QUEUE_TRACE_NUM_CALLS)
+        {
+            hr = E_FAIL;
+            goto end;
+        }
+
+        if (Flags & SURFACE_QUEUE_REPLAY_FLAG_REALTIME)
+        {
+            // Records are in the order the calls returned and carry the time
+            // they were made, so the target can lie in the past
+            if (TraceStart == 0)
+            {
+                TraceStart = Record.Timestamp;
+            }
+
+            LONGLONG Target = ReplayStart.QuadPart +
+                              (LONGLONG)((double)(Record.Timestamp - TraceStart) * Frequency.QuadPart / pHeader->TimestampFrequency);
+
+            for (;;)
+            {
+                QueryPerformanceCounter(&Before);
+                if (Before.QuadPart >= Target)
+                {
+                    break;
+                }
+
+                LONGLONG Ms = (Target - Before.QuadPart) * 1000 / Frequency.QuadPart;
+                if (Ms > 2)
+                {
+                    Sleep((DWORD)(Ms - 1));
+                }
+                else
+                {
+                    YieldProcessor();
+                }
+            }
+        }
+
+        QueryPerformanceCounter(&Before);
+        hrCall = Issue(&Record, pBase + Offset + sizeof(Record), &Skipped);
+        QueryPerformanceCounter(&After);
+
+        if (hrCall == E_OUTOFMEMORY)
+        {
+            hr = hrCall;
+            goto end;
+        }
+
+        if (Skipped)
+        {
+            pStats->NumSkipped++;
+        }
+        else
+        {
+            pStats->NumCalls++;
+            pStats->CallCount[Record.Call]++;
+            pStats->TracedTicks[Record.Call]    += (LONGLONG)((double)Record.Duration * Frequency.QuadPart / pHeader->TimestampFrequency);
+            pStats->ReplayedTicks[Record.Call]  += After.QuadPart - Before.QuadPart;
+
+            if (!SUCCEEDED(hrCall) != !SUCCEEDED(Record.Result))
+            {
+                pStats->NumMismatches++;
+            }
+        }
+
+        Offset += Record.Size;
+    }
+
+end:
+    if (pBase)
+    {
+        UnmapViewOfFile(pBase);
+    }
+    if (hMapping)
+    {
+        CloseHandle(hMapping);
+    }
+    if (hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(hFile);
+    }
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI ReplaySurfaceQueueTrace(
+                    LPCWSTR                         pPath,
+                    DWORD                           Flags,
+                    SURFACE_QUEUE_REPLAY_STATS*     pStats)
+{
+    if (pPath == NULL || pStats == NULL)
+    {
+        return E_INVALIDARG;
+    }
+    if (Flags & ~SURFACE_QUEUE_REPLAY_FLAG_REALTIME)
+    {
+        return E_INVALIDARG;
+    }
+
+    CSurfaceQueueReplay* pReplay = new QUEUE_NOTHROW_SPECIFIER CSurfaceQueueReplay();
+    if (!pReplay)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    HRESULT hr = pReplay->Run(pPath, Flags, pStats);
+
+    delete pReplay;
+    return hr;
+}
@@ -0,0 +1,125 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#pragma once
+
+#include "surfacequeue.h"
+
+//
+// Tracing and replay of the queue API.
+//
+// While a trace is running, every queue in the process logs its calls (queue
+// creation, Clone, OpenProducer, OpenConsumer, Enqueue, Dequeue and Flush, and
+// the release of the queue) to a binary file.  Each record holds the call, the
+// queue, the flags, the result, the QueryPerformanceCounter time the call was
+// made, how long it took, the calling thread and the index of the surface.
+// Calls rejected for bad arguments before they reach the queue are not logged.
+// When no trace is running the calls only check a flag.
+//
+// ReplaySurfaceQueueTrace issues the same calls again, in the order they
+// returned, against queues built on a software device.  Frame pacing problems
+// seen in the field can be reproduced from the trace, and two builds of the
+// queue can be compared on the same trace.  Microsoft.Wpf.Interop.DirectX.Replay
+// runs it on trace files from the command line.
+//
+// The file is a SurfaceQueueTraceHeader followed by the records.  Each record
+// starts with a SurfaceQueueTraceRecord; Size covers the payload after it.
+//
+
+#define SURFACE_QUEUE_TRACE_MAGIC       (0x52545153)    // 'SQTR'
+#define SURFACE_QUEUE_TRACE_VERSION     (1)
+
+// SurfaceQueueTraceRecord::Surface when the call has no surface
+#define SURFACE_QUEUE_TRACE_NO_SURFACE  (0xFFFFFFFF)
+
+// Replays the calls with the gaps they had when they were traced
+#define SURFACE_QUEUE_REPLAY_FLAG_REALTIME  (0x1)
+
+enum SURFACE_QUEUE_TRACE_CALL
+{
+    // Payload: SURFACE_QUEUE_DESC
+    SURFACE_QUEUE_TRACE_CREATE = 0,
+    // Param: the new queue.  Payload: SURFACE_QUEUE_CLONE_DESC
+    SURFACE_QUEUE_TRACE_CLONE,
+    SURFACE_QUEUE_TRACE_OPEN_PRODUCER,
+    SURFACE_QUEUE_TRACE_OPEN_CONSUMER,
+    // Param: meta data size
+    SURFACE_QUEUE_TRACE_ENQUEUE,
+    // Param: timeout
+    SURFACE_QUEUE_TRACE_DEQUEUE,
+    // Param: surfaces left unflushed
+    SURFACE_QUEUE_TRACE_FLUSH,
+    // The last reference to the queue was released
+    SURFACE_QUEUE_TRACE_DESTROY,
+    SURFACE_QUEUE_TRACE_NUM_CALLS,
+};
+
+#pragma pack(push, 8)
+struct SurfaceQueueTraceHeader
+{
+    DWORD               Magic;
+    DWORD               Version;
+    // Ticks per second of the timestamps
+    LONGLONG            TimestampFrequency;
+    LONGLONG            StartTimestamp;
+};
+
+struct SurfaceQueueTraceRecord
+{
+    // Bytes in the record, including the payload
+    WORD                Size;
+    BYTE                Call;
+    BYTE                Reserved;
+    // Process unique number of the queue
+    UINT                Queue;
+    // QueryPerformanceCounter when the call was made, and ticks it took
+    LONGLONG            Timestamp;
+    UINT                Duration;
+    DWORD               ThreadId;
+    HRESULT             Result;
+    DWORD               Flags;
+    // Index of the surface within the queue network
+    UINT                Surface;
+    UINT                Param;
+};
+#pragma pack(pop)
+
+struct SURFACE_QUEUE_REPLAY_STATS
+{
+    LONGLONG            TimestampFrequency;
+
+    UINT                NumCalls;
+    // Calls that succeeded when traced and failed when replayed or the other
+    // way around
+    UINT                NumMismatches;
+    // Calls that could not be replayed because what they worked on was not
+    // there (for example a queue whose creation failed)
+    UINT                NumSkipped;
+
+    // Per SURFACE_QUEUE_TRACE_CALL
+    UINT                CallCount[SURFACE_QUEUE_TRACE_NUM_CALLS];
+    LONGLONG            TracedTicks[SURFACE_QUEUE_TRACE_NUM_CALLS];
+    LONGLONG            ReplayedTicks[SURFACE_QUEUE_TRACE_NUM_CALLS];
+};
+
+// Starts tracing every queue of the process to the file at pPath, which is
+// replaced.  Fails if a trace is already running.
+HRESULT WINAPI StartSurfaceQueueTrace(LPCWSTR pPath);
+
+// Writes out the buffered records and closes the trace.
+HRESULT WINAPI StopSurfaceQueueTrace();
+
+//
+// Replays the trace at pPath.  Dequeues are issued with a timeout of 0 since
+// the replay runs on a single thread; the order of the trace already puts each
+// one after the Enqueue and Flush that made its surface available.  The
+// timings and mismatches are returned in pStats.
+//
+HRESULT WINAPI ReplaySurfaceQueueTrace(
+                    LPCWSTR                         pPath,
+                    DWORD                           Flags,
+                    SURFACE_QUEUE_REPLAY_STATS*     pStats);
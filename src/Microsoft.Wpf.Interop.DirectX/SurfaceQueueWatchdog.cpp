@@ -0,0 +1,560 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#include <new>
+#include <stdarg.h>
+#include <stdio.h>
+#include "SurfaceQueueImpl.h"
+
+volatile LONG           g_SurfaceQueueWatchdogEnabled   = 0;
+
+//
+// Every initialized queue is on this list.  Queues take themselves off it
+// before they are destroyed, so while the lock is held the queues on the list
+// stay alive.
+//
+static SRWLOCK          g_QueueListLock                 = SRWLOCK_INIT;
+static CSurfaceQueue*   g_pFirstQueue                   = NULL;
+
+// The watchdog thread; start and stop are serialized by g_WatchdogLock
+static SRWLOCK                          g_WatchdogLock  = SRWLOCK_INIT;
+static HANDLE                           g_hWatchdog     = NULL;
+static HANDLE                           g_hWatchdogStop = NULL;
+static DWORD                            g_ThresholdMs   = 0;
+static PFN_SURFACE_QUEUE_STALL_CALLBACK g_pfnStall      = NULL;
+static void*                            g_pStallContext = NULL;
+
+//-----------------------------------------------------------------------------
+// CStallDumpWriter
+//
+// Collects the dump text.  Running out of memory is remembered and the dump is
+// dropped rather than handed out truncated.
+//-----------------------------------------------------------------------------
+class CStallDumpWriter
+{
+    public:
+        CStallDumpWriter() :
+            m_pText(NULL),
+            m_Length(0),
+            m_Capacity(0),
+            m_Failed(FALSE)
+        {
+        }
+
+        ~CStallDumpWriter()
+        {
+            if (m_pText)
+            {
+                delete[] m_pText;
+            }
+        }
+
+        void Append(const char* pFormat, ...)
+        {
+            va_list Args;
+            int     Length;
+
+            if (m_Failed)
+            {
+                return;
+            }
+
+            va_start(Args, pFormat);
+            Length = vsnprintf(NULL, 0, pFormat, Args);
+            va_end(Args);
+
+            if (Length < 0 || !Reserve(m_Length + Length + 1))
+            {
+                m_Failed = TRUE;
+                return;
+            }
+
+            va_start(Args, pFormat);
+            vsnprintf(m_pText + m_Length, m_Capacity - m_Length, pFormat, Args);
+            va_end(Args);
+
+            m_Length += Length;
+        }
+
+        // Appends a comma before every element of a list but the first
+        void Separator(BOOL* pFirst)
+        {
+            if (!*pFirst)
+            {
+                Append(",");
+            }
+            *pFirst = FALSE;
+        }
+
+        const char* GetText() const { return m_Failed ? NULL : m_pText; }
+        UINT GetLength() const { return m_Length; }
+
+    private:
+        BOOL Reserve(UINT Capacity)
+        {
+            if (Capacity <= m_Capacity)
+            {
+                return TRUE;
+            }
+
+            UINT    NewCapacity = max(Capacity, m_Capacity ? m_Capacity * 2 : 4096);
+            char*   pText       = new QUEUE_NOTHROW_SPECIFIER char[NewCapacity];
+
+            if (!pText)
+            {
+                return FALSE;
+            }
+            if (m_pText)
+            {
+                memcpy(pText, m_pText, m_Length + 1);
+                delete[] m_pText;
+            }
+            m_pText     = pText;
+            m_Capacity  = NewCapacity;
+            return TRUE;
+        }
+
+    private:
+        char*       m_pText;
+        UINT        m_Length;
+        UINT        m_Capacity;
+        BOOL        m_Failed;
+};
+
+//-----------------------------------------------------------------------------
+static const char* GetSurfaceStateName(SharedSurfaceState State)
+{
+    switch (State)
+    {
+        case SHARED_SURFACE_STATE_UNINITIALIZED:    return "uninitialized";
+        case SHARED_SURFACE_STATE_DEQUEUED:         return "dequeued";
+        case SHARED_SURFACE_STATE_ENQUEUED:         return "enqueued";
+        case SHARED_SURFACE_STATE_FLUSHED:          return "flushed";
+        default:                                    return "unknown";
+    }
+}
+
+//-----------------------------------------------------------------------------
+static const char* GetWaitKindName(LONG Kind)
+{
+    switch (Kind)
+    {
+        case QUEUE_WAIT_DEQUEUE:    return "dequeue";
+        case QUEUE_WAIT_FLUSH:      return "flush";
+        default:                    return "none";
+    }
+}
+
+//-----------------------------------------------------------------------------
+static const char* GetSideName(UINT Side)
+{
+    return Side == QUEUE_EPOCH_PRODUCER ? "producer" : "consumer";
+}
+
+//-----------------------------------------------------------------------------
+static LONGLONG GetElapsedMs(LONGLONG Start)
+{
+    LARGE_INTEGER Now;
+    LARGE_INTEGER Frequency;
+
+    QueryPerformanceCounter(&Now);
+    QueryPerformanceFrequency(&Frequency);
+    return (Now.QuadPart - Start) * 1000 / Frequency.QuadPart;
+}
+
+//-----------------------------------------------------------------------------
+// CSurfaceQueue watchdog functions
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+void CSurfaceQueue::RegisterForWatchdog()
+{
+    AcquireSRWLockExclusive(&g_QueueListLock);
+
+    ASSERT(!m_Registered);
+
+    m_pPrevRegistered = NULL;
+    m_pNextRegistered = g_pFirstQueue;
+    if (g_pFirstQueue)
+    {
+        g_pFirstQueue->m_pPrevRegistered = this;
+    }
+    g_pFirstQueue   = this;
+    m_Registered    = TRUE;
+
+    ReleaseSRWLockExclusive(&g_QueueListLock);
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceQueue::UnregisterForWatchdog()
+{
+    // Queues whose initialization failed were never added
+    if (!m_Registered)
+    {
+        return;
+    }
+
+    AcquireSRWLockExclusive(&g_QueueListLock);
+
+    if (m_pPrevRegistered)
+    {
+        m_pPrevRegistered->m_pNextRegistered = m_pNextRegistered;
+    }
+    else
+    {
+        g_pFirstQueue = m_pNextRegistered;
+    }
+    if (m_pNextRegistered)
+    {
+        m_pNextRegistered->m_pPrevRegistered = m_pPrevRegistered;
+    }
+    m_pNextRegistered   = NULL;
+    m_pPrevRegistered   = NULL;
+    m_Registered        = FALSE;
+
+    ReleaseSRWLockExclusive(&g_QueueListLock);
+}
+
+//-----------------------------------------------------------------------------
+BOOL CSurfaceQueue::CheckStall(LONGLONG Deadline, QueueEpochSide* pSide)
+{
+    for (UINT i = 0; i < QUEUE_EPOCH_NUM_SIDES; i++)
+    {
+        LONGLONG Start = InterlockedCompareExchange64(&m_WaitStart[i], 0, 0);
+
+        if (Start && Start < Deadline && Start != m_StallReported[i])
+        {
+            m_StallReported[i]  = Start;
+            *pSide              = (QueueEpochSide)i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceQueue::DumpSurfaces(CStallDumpWriter* pWriter)
+{
+    ASSERT(m_pRootQueue == this);
+
+    BOOL First = TRUE;
+
+    pWriter->Append("\"width\":%u,\"height\":%u,\"format\":%u,\"surfaces\":[",
+                    m_Desc.Width, m_Desc.Height, (UINT)m_Desc.Format);
+
+    for (UINT i = 0; i < m_Desc.NumSurfaces; i++)
+    {
+        SharedSurfaceObject* pObject = m_CreatedSurfaces ? m_CreatedSurfaces[i] : NULL;
+        if (!pObject)
+        {
+            continue;
+        }
+
+        pWriter->Separator(&First);
+        pWriter->Append("{\"index\":%u,\"state\":\"%s\",\"handle\":\"%p\"",
+                        i, GetSurfaceStateName(pObject->state), pObject->hSharedHandle);
+
+        if (pObject->state == SHARED_SURFACE_STATE_ENQUEUED || pObject->state == SHARED_SURFACE_STATE_FLUSHED)
+        {
+            // The surface is in the FIFO of one of the queues of the network
+            UINT Queue = 0;
+            for (CSurfaceQueue* pQueue = g_pFirstQueue; pQueue; pQueue = pQueue->m_pNextRegistered)
+            {
+                if (static_cast<ISurfaceQueue*>(pQueue) == pObject->queue)
+                {
+                    Queue = pQueue->m_TraceId;
+                    break;
+                }
+            }
+            pWriter->Append(",\"queue\":%u", Queue);
+        }
+        else if (pObject->state == SHARED_SURFACE_STATE_DEQUEUED)
+        {
+            pWriter->Append(",\"device\":\"%p\"", pObject->device);
+        }
+
+        pWriter->Append("}");
+    }
+
+    pWriter->Append("]");
+}
+
+//-----------------------------------------------------------------------------
+void CSurfaceQueue::DumpState(CStallDumpWriter* pWriter)
+{
+    BOOL First = TRUE;
+
+    pWriter->Append("{\"id\":%u,\"multithreaded\":%s,\"producer\":%s,\"consumer\":%s,"
+                    "\"metaDataSize\":%u,\"head\":%u,\"size\":%u,\"enqueuedHead\":%u,\"enqueued\":%u,",
+                    m_TraceId,
+                    m_IsMultithreaded ? "true" : "false",
+                    m_pProducer ? "true" : "false",
+                    m_pConsumer ? "true" : "false",
+                    m_Desc.MetaDataSize,
+                    m_QueueHead, m_QueueSize, m_iEnqueuedHead, m_nEnqueuedSurfaces);
+
+    //
+    // The FIFO.  Surfaces still enqueued hold the staging resource their flush
+    // is waiting on.  The lock is only ever held for a few instructions, so it
+    // is safe to take even while the queue is stalled.
+    //
+    pWriter->Append("\"fifo\":[");
+
+    if (m_IsMultithreaded)
+    {
+        EnterCriticalSection(&m_QueueLock);
+    }
+
+    for (UINT i = 0; i < m_QueueSize && m_SurfaceQueue; i++)
+    {
+        const SharedSurfaceQueueEntry& Entry = m_SurfaceQueue[(m_QueueHead + i) % m_Desc.NumSurfaces];
+
+        pWriter->Separator(&First);
+        pWriter->Append("{\"surface\":%d,\"state\":\"%s\",\"staging\":\"%p\",\"dirtyRects\":%u}",
+                        Entry.surface ? (int)GetSurfaceIndex(Entry.surface) : -1,
+                        Entry.surface ? GetSurfaceStateName(Entry.surface->state) : "none",
+                        Entry.pStagingResource,
+                        Entry.nDirtyRects);
+    }
+
+    if (m_IsMultithreaded)
+    {
+        LeaveCriticalSection(&m_QueueLock);
+    }
+
+    pWriter->Append("],\"waits\":[");
+
+    First = TRUE;
+    for (UINT i = 0; i < QUEUE_EPOCH_NUM_SIDES; i++)
+    {
+        LONGLONG Start = InterlockedCompareExchange64(&m_WaitStart[i], 0, 0);
+        if (Start)
+        {
+            pWriter->Separator(&First);
+            pWriter->Append("{\"side\":\"%s\",\"kind\":\"%s\",\"ms\":%lld}",
+                            GetSideName(i), GetWaitKindName(m_WaitKind[i]), GetElapsedMs(Start));
+        }
+    }
+
+    pWriter->Append("]}");
+}
+
+//-----------------------------------------------------------------------------
+// Appends every queue network.  The caller holds g_QueueListLock.
+//-----------------------------------------------------------------------------
+static void DumpNetworks(CStallDumpWriter* pWriter)
+{
+    BOOL FirstNetwork = TRUE;
+
+    pWriter->Append("\"networks\":[");
+
+    for (CSurfaceQueue* pRoot = g_pFirstQueue; pRoot; pRoot = pRoot->GetNextRegistered())
+    {
+        if (pRoot->GetRootQueue() != pRoot)
+        {
+            continue;
+        }
+
+        BOOL FirstQueue = TRUE;
+
+        pWriter->Separator(&FirstNetwork);
+        pWriter->Append("{\"root\":%u,", pRoot->GetTraceId());
+        pRoot->DumpSurfaces(pWriter);
+        pWriter->Append(",\"queues\":[");
+
+        for (CSurfaceQueue* pQueue = g_pFirstQueue; pQueue; pQueue = pQueue->GetNextRegistered())
+        {
+            if (pQueue->GetRootQueue() == pRoot)
+            {
+                pWriter->Separator(&FirstQueue);
+                pQueue->DumpState(pWriter);
+            }
+        }
+
+        pWriter->Append("]}");
+    }
+
+    pWriter->Append("]");
+}
+
+//-----------------------------------------------------------------------------
+static DWORD WINAPI WatchdogThread(void* pParameter)
+{
+    UNREFERENCED_PARAMETER(pParameter);
+
+    LARGE_INTEGER   Frequency;
+    DWORD           Interval = max(g_ThresholdMs / 4, (DWORD)10);
+
+    QueryPerformanceFrequency(&Frequency);
+
+    while (WaitForSingleObject(g_hWatchdogStop, Interval) == WAIT_TIMEOUT)
+    {
+        CStallDumpWriter    Writer;
+        LARGE_INTEGER       Now;
+        LONGLONG            Deadline;
+        BOOL                First = TRUE;
+
+        QueryPerformanceCounter(&Now);
+        Deadline = Now.QuadPart - (LONGLONG)g_ThresholdMs * Frequency.QuadPart / 1000;
+
+        AcquireSRWLockShared(&g_QueueListLock);
+
+        for (CSurfaceQueue* pQueue = g_pFirstQueue; pQueue; pQueue = pQueue->GetNextRegistered())
+        {
+            QueueEpochSide Side;
+
+            if (pQueue->CheckStall(Deadline, &Side))
+            {
+                if (First)
+                {
+                    Writer.Append("{\"stalls\":[");
+                }
+                Writer.Separator(&First);
+                Writer.Append("{\"queue\":%u,\"side\":\"%s\"}", pQueue->GetTraceId(), GetSideName(Side));
+            }
+        }
+
+        if (!First)
+        {
+            Writer.Append("],");
+            DumpNetworks(&Writer);
+            Writer.Append("}\n");
+        }
+
+        ReleaseSRWLockShared(&g_QueueListLock);
+
+        // The callback runs outside the lock so it can use queues freely
+        if (!First && Writer.GetText())
+        {
+            if (g_pfnStall)
+            {
+                g_pfnStall(Writer.GetText(), g_pStallContext);
+            }
+            else
+            {
+                OutputDebugStringA(Writer.GetText());
+            }
+        }
+    }
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI StartSurfaceQueueWatchdog(
+                    DWORD                               ThresholdMs,
+                    PFN_SURFACE_QUEUE_STALL_CALLBACK    pfnCallback,
+                    void*                               pContext)
+{
+    if (ThresholdMs == 0 || ThresholdMs == INFINITE)
+    {
+        return E_INVALIDARG;
+    }
+
+    HRESULT hr = S_OK;
+
+    AcquireSRWLockExclusive(&g_WatchdogLock);
+
+    if (g_hWatchdog)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_BUSY);
+        goto end;
+    }
+
+    g_hWatchdogStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!g_hWatchdogStop)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto end;
+    }
+
+    g_ThresholdMs   = ThresholdMs;
+    g_pfnStall      = pfnCallback;
+    g_pStallContext = pContext;
+
+    InterlockedExchange(&g_SurfaceQueueWatchdogEnabled, 1);
+
+    g_hWatchdog = CreateThread(NULL, 0, WatchdogThread, NULL, 0, NULL);
+    if (!g_hWatchdog)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        InterlockedExchange(&g_SurfaceQueueWatchdogEnabled, 0);
+        CloseHandle(g_hWatchdogStop);
+        g_hWatchdogStop = NULL;
+        goto end;
+    }
+
+end:
+    ReleaseSRWLockExclusive(&g_WatchdogLock);
+    return hr;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI StopSurfaceQueueWatchdog()
+{
+    AcquireSRWLockExclusive(&g_WatchdogLock);
+
+    if (!g_hWatchdog)
+    {
+        ReleaseSRWLockExclusive(&g_WatchdogLock);
+        return E_INVALIDARG;
+    }
+
+    // Waits already marked are cleared by the queues as they end
+    InterlockedExchange(&g_SurfaceQueueWatchdogEnabled, 0);
+
+    SetEvent(g_hWatchdogStop);
+    WaitForSingleObject(g_hWatchdog, INFINITE);
+
+    CloseHandle(g_hWatchdog);
+    CloseHandle(g_hWatchdogStop);
+    g_hWatchdog     = NULL;
+    g_hWatchdogStop = NULL;
+
+    ReleaseSRWLockExclusive(&g_WatchdogLock);
+    return S_OK;
+}
+
+//-----------------------------------------------------------------------------
+HRESULT WINAPI DumpSurfaceQueueState(
+                    char*       pBuffer,
+                    UINT        BufferSize,
+                    UINT*       pRequiredSize)
+{
+    if (pRequiredSize == NULL || (pBuffer == NULL && BufferSize))
+    {
+        return E_INVALIDARG;
+    }
+
+    CStallDumpWriter Writer;
+
+    AcquireSRWLockShared(&g_QueueListLock);
+    Writer.Append("{");
+    DumpNetworks(&Writer);
+    Writer.Append("}\n");
+    ReleaseSRWLockShared(&g_QueueListLock);
+
+    if (!Writer.GetText())
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    *pRequiredSize = Writer.GetLength() + 1;
+
+    if (BufferSize < *pRequiredSize)
+    {
+        if (BufferSize)
+        {
+            memcpy(pBuffer, Writer.GetText(), BufferSize - 1);
+            pBuffer[BufferSize - 1] = 0;
+        }
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    memcpy(pBuffer, Writer.GetText(), *pRequiredSize);
+    return S_OK;
+}
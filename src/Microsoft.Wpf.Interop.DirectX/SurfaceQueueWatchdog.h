@@ -0,0 +1,57 @@
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//
+// Copyright (c) Microsoft Corporation. All rights reserved
+
+#pragma once
+
+#include "surfacequeue.h"
+
+//
+// Stall watchdog.
+//
+// A Dequeue waiting for a surface that never gets flushed, or an Enqueue or
+// Flush waiting for rendering that never completes, hangs the calling thread
+// without any hint of why.  While the watchdog runs, the queues mark the
+// start of those waits, and a thread checks them periodically.  When a wait
+// has gone on for longer than the threshold, the watchdog snapshots every
+// queue network in the process and hands the dump to the callback:
+//
+//  - for each surface, its state, the queue it is in or the device that
+//    dequeued it
+//  - for each queue, the FIFO ring indices, the surfaces in the FIFO with
+//    their pending staging resources, and the waits in progress
+//
+// The dump is JSON text.  Each stalled wait is reported once.
+//
+
+// Called on the watchdog thread with the dump.  pDump is only valid during
+// the call.
+typedef void (CALLBACK *PFN_SURFACE_QUEUE_STALL_CALLBACK)(
+                                const char*     pDump,
+                                void*           pContext);
+
+//
+// Starts the watchdog thread.  Waits longer than ThresholdMs are reported to
+// pfnCallback, or written with OutputDebugString when it is NULL.  Only waits
+// that start after this call are watched.
+//
+HRESULT WINAPI StartSurfaceQueueWatchdog(
+                    DWORD                               ThresholdMs,
+                    PFN_SURFACE_QUEUE_STALL_CALLBACK    pfnCallback,
+                    void*                               pContext);
+
+HRESULT WINAPI StopSurfaceQueueWatchdog();
+
+//
+// Writes the same dump on demand.  pBuffer receives up to BufferSize bytes
+// including the terminating zero, and *pRequiredSize the size the whole dump
+// needs.  Fails with HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER) when it is
+// truncated.
+//
+HRESULT WINAPI DumpSurfaceQueueState(
+                    char*       pBuffer,
+                    UINT        BufferSize,
+                    UINT*       pRequiredSize);